@@ -0,0 +1,226 @@
+#include "arena.hpp"
+
+#include <array>
+#include <cstdlib>
+#include <iomanip>
+#include <mutex>
+
+#include <sys/mman.h>
+
+#include "magic_enum.hpp"
+#include "source.hpp"
+
+using namespace std;
+
+namespace {
+
+// ノードは 32 ビットのインデックスで指すので、1 つの連続領域に置く。
+// 領域を kNodeSlices 等分し、スレッドごとのノードのプールに 1 つずつ割り当てる。
+constexpr size_t kNodeReserve = size_t{1} << 36;
+constexpr size_t kNodeSlices = kMaxPoolThreads;
+constexpr size_t kNoNodeSlice = kNodeSlices; // 空きが無く、割り当てられなかった
+constexpr size_t kNodeSliceSize =
+  kNodeReserve / kNodeSlices / kNodeSliceAlign * kNodeSliceAlign;
+
+struct NodeRegion {
+  Arena reserve{kNodeReserve}; // 予約するだけで、ここからは確保しない
+  mutex mtx;
+  vector<size_t> free_slices;
+
+  NodeRegion() {
+    for (size_t i = kNodeSlices; i > 0; --i) {
+      free_slices.push_back(i - 1);
+    }
+  }
+};
+
+NodeRegion& GetNodeRegion() {
+  static NodeRegion region;
+  return region;
+}
+
+// thread_local の初期化から呼ぶので例外を投げない。空きが無ければ kNoNodeSlice を返す
+size_t AcquireNodeSlice() {
+  auto& region = GetNodeRegion();
+  lock_guard lock{region.mtx};
+  if (region.free_slices.empty()) {
+    return kNoNodeSlice;
+  }
+  auto slice = region.free_slices.back();
+  region.free_slices.pop_back();
+  return slice;
+}
+
+Arena NewNodeArena(size_t slice) {
+  if (slice == kNoNodeSlice) {
+    return Arena{}; // GetPool() がエラーにするので、ここからは確保しない
+  }
+  return Arena{NodeRegionBase() + slice * kNodeSliceSize, kNodeSliceSize};
+}
+
+struct Pools {
+  size_t node_slice = AcquireNodeSlice();
+  array<Arena, static_cast<size_t>(Pool::kNum)> arenas{
+    Arena{},
+    NewNodeArena(node_slice),
+    Arena{},
+    Arena{},
+  };
+  static_assert(static_cast<int>(Pool::kNode) == 1);
+
+  ~Pools() {
+    for (auto& arena : arenas) {
+      arena.Release();
+    }
+    if (node_slice != kNoNodeSlice) {
+      auto& region = GetNodeRegion();
+      lock_guard lock{region.mtx};
+      region.free_slices.push_back(node_slice);
+    }
+  }
+};
+
+Pools& GetThreadPools() {
+  thread_local Pools pools;
+  return pools;
+}
+
+auto& GetPools() {
+  return GetThreadPools().arenas;
+}
+
+} // namespace
+
+Arena::Arena(std::size_t contiguous_reserve)
+    : base_size_{contiguous_reserve}, owns_base_{true} {
+  void* p = mmap(nullptr, base_size_, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    throw bad_alloc{};
+  }
+  base_ = cur_ = end_ = static_cast<char*>(p);
+}
+
+Arena::Arena(char* base, std::size_t size)
+    : base_{base}, base_size_{size}, cur_{base}, end_{base} {
+}
+
+Arena::~Arena() {
+  Release();
+  if (owns_base_) {
+    munmap(base_, base_size_);
+  }
+}
+
+void* Arena::Allocate(std::size_t size, std::size_t align) {
+  auto p = reinterpret_cast<char*>(
+      (reinterpret_cast<uintptr_t>(cur_) + align - 1) & ~(align - 1));
+  if (base_ && p + size > end_) {
+    // 予約済みの領域を kChunkSize 単位で使えるようにする
+    const size_t grow =
+      (p + size - end_ + kChunkSize - 1) / kChunkSize * kChunkSize;
+    if (end_ + grow > base_ + base_size_ ||
+        mprotect(end_, grow, PROT_READ | PROT_WRITE) != 0) {
+      throw bad_alloc{};
+    }
+    end_ += grow;
+    bytes_reserved_ += grow;
+  } else if (cur_ == nullptr || p + size > end_) {
+    // 大きな要求はそれ専用のチャンクを割り当てる
+    const size_t chunk_size = max(kChunkSize, size + align);
+    auto chunk = static_cast<char*>(malloc(chunk_size));
+    if (chunk == nullptr) {
+      throw bad_alloc{};
+    }
+    chunks_.push_back(chunk);
+    bytes_reserved_ += chunk_size;
+    cur_ = chunk;
+    end_ = chunk + chunk_size;
+    p = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(cur_) + align - 1) & ~(align - 1));
+  }
+  cur_ = p + size;
+  bytes_allocated_ += size;
+  return p;
+}
+
+void Arena::Release() {
+  for (auto it = dtors_.rbegin(); it != dtors_.rend(); ++it) {
+    it->destroy(it->obj);
+  }
+  dtors_.clear();
+  for (auto chunk : chunks_) {
+    free(chunk);
+  }
+  chunks_.clear();
+  if (base_) {
+    // 予約は残したまま、使っていたページを返す
+    mmap(base_, end_ - base_, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    cur_ = end_ = base_;
+  } else {
+    cur_ = end_ = nullptr;
+  }
+  num_objects_ = bytes_allocated_ = bytes_reserved_ = 0;
+}
+
+void Arena::ReleaseTo(const Mark& mark) {
+  for (auto i = dtors_.size(); i > mark.num_dtors; --i) {
+    dtors_[i - 1].destroy(dtors_[i - 1].obj);
+  }
+  dtors_.resize(mark.num_dtors);
+  for (auto i = mark.num_chunks; i < chunks_.size(); ++i) {
+    free(chunks_[i]);
+  }
+  chunks_.resize(mark.num_chunks);
+  cur_ = mark.cur;
+  if (!base_) {
+    end_ = mark.end;
+    bytes_reserved_ = mark.bytes_reserved;
+  }
+  num_objects_ = mark.num_objects;
+  bytes_allocated_ = mark.bytes_allocated;
+}
+
+Arena& GetPool(Pool pool) {
+  auto& pools = GetThreadPools();
+  if (pool == Pool::kNode && pools.node_slice == kNoNodeSlice) [[unlikely]] {
+    ErrorOut() << "too many threads are compiling at once (at most "
+               << kMaxPoolThreads << ")" << endl;
+    throw CompileError{};
+  }
+  return pools.arenas[static_cast<size_t>(pool)];
+}
+
+char* NodeRegionBase() {
+  return GetNodeRegion().reserve.Base();
+}
+
+void ReleasePools() {
+  for (auto& arena : GetPools()) {
+    arena.Release();
+  }
+}
+
+void PrintPoolStats(std::ostream& os) {
+  os << left << setw(8) << "pool" << right
+     << setw(12) << "objects" << setw(14) << "bytes"
+     << setw(14) << "reserved" << '\n';
+
+  auto& pools = GetPools();
+  size_t total_objects = 0, total_bytes = 0, total_reserved = 0;
+  for (size_t i = 0; i < pools.size(); ++i) {
+    auto& arena = pools[i];
+    auto name = magic_enum::enum_name(static_cast<Pool>(i)).substr(1);
+    os << left << setw(8) << name << right
+       << setw(12) << arena.NumObjects()
+       << setw(14) << arena.BytesAllocated()
+       << setw(14) << arena.BytesReserved() << '\n';
+    total_objects += arena.NumObjects();
+    total_bytes += arena.BytesAllocated();
+    total_reserved += arena.BytesReserved();
+  }
+  os << left << setw(8) << "total" << right
+     << setw(12) << total_objects << setw(14) << total_bytes
+     << setw(14) << total_reserved << '\n';
+}
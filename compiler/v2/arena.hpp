@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// コンパイル単位の寿命を持つバンプアロケータ
+//
+// 確保したメモリは個別には解放せず、Release() でまとめて解放する。
+// デストラクタが自明でない型はデストラクタを記録しておき、Release() 時に呼ぶ。
+class Arena {
+ public:
+  Arena() = default;
+  // contiguous_reserve バイトの仮想アドレス空間を予約し、先頭から詰めて確保する。
+  // 確保したメモリは 1 つの連続した領域に並ぶので、Base() からの位置で指せる。
+  explicit Arena(std::size_t contiguous_reserve);
+  // 予約済みの領域 [base, base + size) を先頭から詰めて使う（予約の解放は呼び出し側が行う）
+  Arena(char* base, std::size_t size);
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena();
+
+  void* Allocate(std::size_t size, std::size_t align);
+
+  template <class T, class... Args>
+  T* New(Args&&... args) {
+    auto obj = new (Allocate(sizeof(T), alignof(T)))
+      T{std::forward<Args>(args)...};
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      dtors_.push_back({obj, [](void* p){ static_cast<T*>(p)->~T(); }});
+    }
+    ++num_objects_;
+    return obj;
+  }
+
+  // 確保したすべてのメモリを解放する
+  void Release();
+
+  // ある時点までの確保の状態（ReleaseTo() でその時点へ戻す）
+  struct Mark {
+    std::size_t num_chunks, num_dtors;
+    char* cur;
+    char* end;
+    std::size_t num_objects, bytes_allocated, bytes_reserved;
+  };
+  Mark GetMark() const {
+    return {chunks_.size(), dtors_.size(), cur_, end_,
+            num_objects_, bytes_allocated_, bytes_reserved_};
+  }
+  // mark より後に確保したメモリを解放する（連続モードのページは次の確保に使うので返さない）
+  void ReleaseTo(const Mark& mark);
+
+  std::size_t NumObjects() const { return num_objects_; }
+  std::size_t BytesAllocated() const { return bytes_allocated_; }
+  std::size_t BytesReserved() const { return bytes_reserved_; }
+  char* Base() const { return base_; } // 連続領域の先頭（連続モードでなければ nullptr）
+
+ private:
+  static constexpr std::size_t kChunkSize = 64 * 1024;
+
+  struct Dtor {
+    void* obj;
+    void (*destroy)(void*);
+  };
+
+  std::vector<char*> chunks_;
+  char* base_ = nullptr;        // 連続モードで使う領域
+  std::size_t base_size_ = 0;
+  bool owns_base_ = false;      // base_ を自分で予約したか
+  char* cur_ = nullptr;
+  char* end_ = nullptr;
+  std::vector<Dtor> dtors_;
+
+  std::size_t num_objects_ = 0;
+  std::size_t bytes_allocated_ = 0;
+  std::size_t bytes_reserved_ = 0;
+};
+
+// 種類別のメモリプール
+enum class Pool {
+  kToken,
+  kNode,
+  kType,
+  kObject,
+  kNum, // 列挙子の数
+};
+
+/* プールはスレッドごとに持つ
+ *
+ * 1 つの翻訳単位は 1 つのスレッドで構文解析・型付けするので、
+ * 複数の翻訳単位を別々のスレッドで並行してコンパイルできる（-c）。
+ * ノードはすべてのスレッドで共通の連続領域（NodeRegionBase()）に置き、
+ * スレッドごとのノードのプールはその一部を使う。
+ */
+Arena& GetPool(Pool pool);
+char* NodeRegionBase();
+
+// ノードのプールを同時に持てるスレッドの数（ノードの領域をこの数に等分する）
+// これを超えたスレッドがノードを確保しようとすると、エラーを表示して CompileError を投げる。
+constexpr std::size_t kMaxPoolThreads = 32;
+
+// スレッドごとのノードの領域は NodeRegionBase() からこの倍数の位置に置く。
+// ノードを共通の先頭からの番号で指せるよう、sizeof(Node) で割り切れる値にしてある。
+constexpr std::size_t kNodeSliceAlign = 3 * 64 * 1024;
+
+// 現在のスレッドのすべてのプールを一括で解放する（コンパイル終了時に呼ぶ）
+void ReleasePools();
+
+// プールごとの確保オブジェクト数とバイト数を表形式で出力する
+void PrintPoolStats(std::ostream& os);
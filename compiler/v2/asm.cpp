@@ -1,11 +1,14 @@
 #include "asm.hpp"
 
 #include <array>
-#include <cstdarg>
+#include <charconv>
+#include <deque>
 #include <iostream>
 #include <limits>
 #include <string>
 
+#include "source.hpp"
+
 #define NOT_IMPLEMENTED \
   do { \
     this->Output() << "// not implemented: " << __PRETTY_FUNCTION__ << std::endl; \
@@ -13,6 +16,25 @@
 
 using namespace std;
 
+namespace {
+
+// 各レジスタ・データ型の名前を make_name(stem, dt) で一度だけ作り、表にする
+template <class MakeName>
+Asm::RegNameTable BuildRegNameTable(
+    const array<const char*, Asm::kRegNum>& stems, MakeName make_name) {
+  static deque<string> storage; // 表から参照するので要素を移動させない
+  Asm::RegNameTable table;
+  for (size_t r = 0; r < table.size(); ++r) {
+    for (size_t dt = 0; dt < table[r].size(); ++dt) {
+      table[r][dt] = storage.emplace_back(
+          make_name(stems[r], static_cast<Asm::DataType>(dt)));
+    }
+  }
+  return table;
+}
+
+} // namespace
+
 class AsmX86_64 : public Asm {
  public:
   static constexpr std::array<const char*, kRegNum> kRegNames{
@@ -20,7 +42,7 @@ class AsmX86_64 : public Asm {
     "rbx", "r12", "r13", "r14", "r15",                   // 計算用（不揮発）
     "bp", "sp", "zero", "", ""
   };
-  static std::string RegName(std::string stem, DataType dt) {
+  static std::string MakeRegName(std::string stem, DataType dt) {
     if (stem == "zero") {
       return "0";
     }
@@ -58,15 +80,10 @@ class AsmX86_64 : public Asm {
     "", "byte", "word", "dword", "qword"
   };
 
-  using Asm::Asm; // コンストラクタ
-
-  std::string RegName(Register reg, DataType dt = kQWord) override {
-    return RegName(kRegNames[reg], dt);
-  }
+  static inline const RegNameTable kRegNameTable =
+    BuildRegNameTable(kRegNames, MakeRegName);
 
-  bool SameReg(Register a, Register b) override {
-    return RegName(a) == RegName(b);
-  }
+  AsmX86_64(std::ostream& out) : Asm{out, kRegNameTable} {}
 
   void Mov64(Register dest, std::uint64_t v) override {
     if (v <= numeric_limits<uint32_t>::max()) {
@@ -156,7 +173,7 @@ class AsmX86_64 : public Asm {
 
   void LoadN(Register dest, std::string_view label, DataType dt) override {
     PrintAsm(this, "    mov %rm, %s ptr [rip+%S]\n",
-             dest, dt, kDataTypeName[dt], label.data(), label.length());
+             dest, dt, kDataTypeName[dt], label);
   }
 
   void StoreN(Register addr, int disp, Register v, DataType dt) override {
@@ -166,7 +183,7 @@ class AsmX86_64 : public Asm {
 
   void StoreN(std::string_view label, Register v, DataType dt) override {
     PrintAsm(this, "    mov %s ptr [rip+%S], %rm\n",
-             kDataTypeName[dt], label.data(), label.length(), v, dt);
+             kDataTypeName[dt], label, v, dt);
   }
 
   void CmpSet(Compare c, Register dest, Register lhs, Register rhs) override {
@@ -193,17 +210,17 @@ class AsmX86_64 : public Asm {
   }
 
   void Jmp(std::string_view label) override {
-    PrintAsm(this, "    jmp %S\n", label.data(), label.length());
+    PrintAsm(this, "    jmp %S\n", label);
   }
 
   void JmpIfZero(Register v, std::string_view label) override {
     PrintAsm(this, "    test %r64, %r64\n", v, v);
-    PrintAsm(this, "    jz %S\n", label.data(), label.length());
+    PrintAsm(this, "    jz %S\n", label);
   }
 
   void JmpIfNotZero(Register v, std::string_view label) override {
     PrintAsm(this, "    test %r64, %r64\n", v, v);
-    PrintAsm(this, "    jnz %S\n", label.data(), label.length());
+    PrintAsm(this, "    jnz %S\n", label);
   }
 
   void LEA(Register dest, Register base, int disp) override {
@@ -216,7 +233,7 @@ class AsmX86_64 : public Asm {
 
   void LoadLabelAddr(Register dest, std::string_view label) override {
     PrintAsm(this, "    movabs %r64, offset %S\n",
-             dest, label.data(), label.length());
+             dest, label);
   }
 
   void Set1IfNonZero64(Register dest, Register v) override {
@@ -265,10 +282,13 @@ class AsmX86_64 : public Asm {
     return std::string{sym_name};
   }
 
-  void FuncPrologue(std::string_view sym_name) override {
-    string sym_label{sym_name};
-    PrintAsm(this, ".global %s\n", sym_label.c_str());
-    PrintAsm(this, "%s:\n", sym_label.c_str());
+  void FuncPrologue(std::string_view sym_name, SymBind bind) override {
+    if (bind == kBindGlobal) {
+      Global(sym_name);
+    } else if (bind == kBindWeak) {
+      Weak(sym_name);
+    }
+    PrintAsm(this, "%S:\n", sym_name);
     PrintAsm(this, "    push rbp\n");
     PrintAsm(this, "    mov rbp, rsp\n");
   }
@@ -292,7 +312,7 @@ class AsmAArch64 : public Asm {
     "19", "20", "21", "22", "23",
     "29", "sp", "zr", "16", "17",
   };
-  static std::string RegName(std::string stem, DataType dt) {
+  static std::string MakeRegName(std::string stem, DataType dt) {
     if (stem == "sp") {
       return stem;
     }
@@ -304,15 +324,10 @@ class AsmAArch64 : public Asm {
     return "failed to get register name for " + stem;
   }
 
-  using Asm::Asm; // コンストラクタ
+  static inline const RegNameTable kRegNameTable =
+    BuildRegNameTable(kRegNames, MakeRegName);
 
-  std::string RegName(Register reg, DataType dt = kQWord) override {
-    return RegName(kRegNames[reg], dt);
-  }
-
-  bool SameReg(Register a, Register b) override {
-    return RegName(a) == RegName(b);
-  }
+  AsmAArch64(std::ostream& out) : Asm{out, kRegNameTable} {}
 
   void Mov64(Register dest, std::uint64_t v) override {
     if (v <= 0xffffu) {
@@ -322,7 +337,7 @@ class AsmAArch64 : public Asm {
 
     for (int shift = 0; shift < 64; shift += 16) {
       if (uint16_t v16 = v >> shift; v16 != 0) {
-        PrintAsm(this, "    %s %r64, #%u16, lsl #%u0\n",
+        PrintAsm(this, "    %s %r64, #%u16, lsl #%u\n",
                  shift == 0 ? "movz" : "movk", dest, v16, shift);
       }
     }
@@ -421,15 +436,15 @@ class AsmAArch64 : public Asm {
   }
 
   void Jmp(std::string_view label) override {
-    PrintAsm(this, "    b %S\n", label.data(), label.length());
+    PrintAsm(this, "    b %S\n", label);
   }
 
   void JmpIfZero(Register v, std::string_view label) override {
-    PrintAsm(this, "    cbz %r64, %S\n", v, label.data(), label.length());
+    PrintAsm(this, "    cbz %r64, %S\n", v, label);
   }
 
   void JmpIfNotZero(Register v, std::string_view label) override {
-    PrintAsm(this, "    cbnz %r64, %S\n", v, label.data(), label.length());
+    PrintAsm(this, "    cbnz %r64, %S\n", v, label);
   }
 
   void LEA(Register dest, Register base, int disp) override {
@@ -442,9 +457,9 @@ class AsmAArch64 : public Asm {
 
   void LoadLabelAddr(Register dest, std::string_view label) override {
     PrintAsm(this, "    adrp %r64, %S@GOTPAGE\n",
-             dest, label.data(), label.length());
+             dest, label);
     PrintAsm(this, "    ldr %r64, [%r64, %S@GOTPAGEOFF]\n",
-             dest, dest, label.data(), label.length());
+             dest, dest, label);
   }
 
   void Set1IfNonZero64(Register dest, Register v) override {
@@ -466,13 +481,13 @@ class AsmAArch64 : public Asm {
 
   void IncN(Register addr, DataType dt) override {
     LoadN(Asm::kRegScr0, addr, 0, dt);
-    PrintAsm(this, "    add x16, x16, #1\n", addr);
+    PrintAsm(this, "    add x16, x16, #1\n");
     StoreN(addr, 0, Asm::kRegScr0, dt);
   }
 
   void DecN(Register addr, DataType dt) override {
     LoadN(Asm::kRegScr0, addr, 0, dt);
-    PrintAsm(this, "    sub x16, x16, #1\n", addr);
+    PrintAsm(this, "    sub x16, x16, #1\n");
     StoreN(addr, 0, Asm::kRegScr0, dt);
   }
 
@@ -496,11 +511,16 @@ class AsmAArch64 : public Asm {
     return std::string{"_"}.append(sym_name);
   }
 
-  void FuncPrologue(std::string_view sym_name) override {
+  void FuncPrologue(std::string_view sym_name, SymBind bind) override {
     auto sym_label = SymLabel(sym_name);
-    PrintAsm(this, ".global %s\n", sym_label.c_str());
+    if (bind != kBindLocal) {
+      PrintAsm(this, ".global %S\n", sym_label);
+    }
+    if (bind == kBindWeak) {
+      PrintAsm(this, ".weak_definition %S\n", sym_label);
+    }
     PrintAsm(this, ".p2align 2\n");
-    PrintAsm(this, "%s:\n", sym_label.c_str());
+    PrintAsm(this, "%S:\n", sym_label);
     PrintAsm(this, "    stp x29, x30, [sp, #-16]!\n");
     PrintAsm(this, "    mov x29, sp\n");
   }
@@ -516,34 +536,94 @@ class AsmAArch64 : public Asm {
   }
 
  private:
+  // ロード・ストア命令の接尾辞とレジスタ幅を決める
+  static bool LoadStoreSuffix(DataType dt,
+                              const char*& suffix, DataType& reg_dt) {
+    switch (dt) {
+      case kByte:  suffix = "b"; reg_dt = kDWord; return true;
+      case kWord:  suffix = "h"; reg_dt = kDWord; return true;
+      case kDWord: suffix = "";  reg_dt = kDWord; return true;
+      case kQWord: suffix = "";  reg_dt = kQWord; return true;
+      default:     return false;
+    }
+  }
+
   void LoadStoreN(const char* inst,
                   Register v, Register addr, int disp, DataType dt) {
-    const char* fmt;
-    switch (dt) {
-      case kByte:  fmt = "    %sb %r32, [%r64, #%i]\n"; break;
-      case kWord:  fmt = "    %sh %r32, [%r64, #%i]\n"; break;
-      case kDWord: fmt = "    %s %r32, [%r64, #%i]\n"; break;
-      case kQWord: fmt = "    %s %r64, [%r64, #%i]\n"; break;
-      default:     fmt = "non-standard size is not supported\n";
+    const char* suffix;
+    DataType reg_dt;
+    if (!LoadStoreSuffix(dt, suffix, reg_dt)) {
+      PrintAsm(this, "non-standard size is not supported\n");
+      return;
     }
-    PrintAsm(this, fmt, inst, v, addr, disp);
+    PrintAsm(this, "    %s%s %rm, [%r64, #%i]\n",
+             inst, suffix, v, reg_dt, addr, disp);
   }
 
   void LoadStoreN(const char* inst,
                   Register v, std::string_view label, DataType dt) {
-    PrintAsm(this, "    adrp x16, _%S@PAGE\n", label.data(), label.length());
-    const char* fmt;
-    switch (dt) {
-      case kByte:  fmt = "    %sb %r32, [x16, _%S@PAGEOFF]\n"; break;
-      case kWord:  fmt = "    %sh %r32, [x16, _%S@PAGEOFF]\n"; break;
-      case kDWord: fmt = "    %s %r32, [x16, _%S@PAGEOFF]\n"; break;
-      case kQWord: fmt = "    %s %r64, [x16, _%S@PAGEOFF]\n"; break;
-      default:     fmt = "non-standard size is not supported\n";
+    PrintAsm(this, "    adrp x16, _%S@PAGE\n", label);
+    const char* suffix;
+    DataType reg_dt;
+    if (!LoadStoreSuffix(dt, suffix, reg_dt)) {
+      PrintAsm(this, "non-standard size is not supported\n");
+      return;
     }
-    PrintAsm(this, fmt, inst, v, label.data(), label.length());
+    PrintAsm(this, "    %s%s %rm, [x16, _%S@PAGEOFF]\n",
+             inst, suffix, v, reg_dt, label);
   }
 };
 
+void Asm::Label(std::string_view label, std::string_view comment) {
+  if (comment.empty()) {
+    PrintAsm(this, "%S:\n", label);
+  } else {
+    PrintAsm(this, "%S: // %S\n", label, comment);
+  }
+}
+
+void Asm::Global(std::string_view sym_name) {
+  PrintAsm(this, ".global %S\n", sym_name);
+}
+
+void Asm::Weak(std::string_view sym_name) {
+  PrintAsm(this, ".weak %S\n", sym_name);
+}
+
+void Asm::Align(int p2) {
+  PrintAsm(this, "    .p2align %u\n", p2);
+}
+
+void Asm::DataZero(std::size_t size) {
+  PrintAsm(this, "    .zero %u\n", size);
+}
+
+void Asm::DataN(std::size_t size, std::int64_t v) {
+  const char* directive;
+  switch (size) {
+  case 1: directive = ".byte"; break;
+  case 2: directive = ".2byte"; break;
+  case 4: directive = ".4byte"; break;
+  case 8: directive = ".8byte"; break;
+  default:
+    PrintAsm(this, "non-standard size is not supported\n");
+    return;
+  }
+  out_ << "    " << directive << ' ' << v << '\n';
+}
+
+void Asm::DataCStr(const std::uint8_t* s, std::size_t len) {
+  out_ << "    .byte ";
+  for (size_t i = 0; i < len; ++i) {
+    out_ << static_cast<int>(s[i]) << ',';
+  }
+  out_ << "0\n";
+}
+
+void Asm::DataAddr(std::string_view label) {
+  PrintAsm(this, "    .dc.a %S\n", label);
+}
+
 Asm* NewAsm(AsmArch arch, std::ostream& out) {
   switch (arch) {
   case AsmArch::kX86_64:
@@ -554,82 +634,131 @@ Asm* NewAsm(AsmArch arch, std::ostream& out) {
   return nullptr;
 }
 
-void PrintAsm(Asm* asmgen, const char* format, ...) {
-  va_list args;
-  va_start(args, format);
-
-  const char* p = format;
-  auto& out = asmgen->Output();
-
-  auto read_bits = [&]{
-    long bits = strtol(p, NULL, 10);
-    if (bits == 0) {
-      // pass
-    } else if (bits < 10) {
-      p++;
-    } else if (bits < 100) {
-      p += 2;
-    } else if (bits < 1000) {
-      p += 3;
+const Asm::RegNameTable& RegNameTableOf(AsmArch arch) {
+  switch (arch) {
+  case AsmArch::kX86_64:
+    return AsmX86_64::kRegNameTable;
+  case AsmArch::kAArch64:
+    break;
+  }
+  return AsmAArch64::kRegNameTable;
+}
+
+void AsmFormatError(const char* msg) {
+  ErrorOut() << "PrintAsm: " << msg << endl;
+}
+
+void FormatAsm(Asm* asmgen, std::string_view format,
+               const AsmArg* args, std::size_t num_args) {
+  // 1 行分を line に組み立ててから、まとめてストリームバッファに書く
+  array<char, 256> line;
+  size_t len = 0;
+  auto sb = asmgen->Output().rdbuf();
+  auto put = [&](string_view s) {
+    if (len + s.size() > line.size()) {
+      sb->sputn(line.data(), len);
+      len = 0;
+      if (s.size() > line.size()) {
+        sb->sputn(s.data(), s.size());
+        return;
+      }
+    }
+    copy(s.begin(), s.end(), line.begin() + len);
+    len += s.size();
+  };
+  auto put_int = [&](auto v, bool showpos) {
+    array<char, 24> buf;
+    char* p = buf.data();
+    if (showpos && v >= 0) {
+      *p++ = '+';
+    }
+    p = to_chars(p, buf.data() + buf.size(), v).ptr;
+    put({buf.data(), static_cast<size_t>(p - buf.data())});
+  };
+  auto skip_bits = [&](size_t& i) {
+    while (i + 1 < format.size() && isdigit(format[i + 1])) {
+      ++i;
     }
-    return bits;
   };
 
-  while (*p) {
-    if (*p != '%') {
-      out << *p;
-      p++;
-      continue;
+  size_t arg_i = 0;
+  for (size_t i = 0; i < format.size(); ++i) {
+    auto lit_end = format.find('%', i);
+    if (lit_end != i) {
+      put(format.substr(i, lit_end - i));
+      if (lit_end == string_view::npos) {
+        break;
+      }
+      i = lit_end;
     }
 
-    p++;
-    const char c = *p;
+    const char c = format[++i];
+    if (arg_i >= num_args) {
+      break;
+    }
+    auto& arg = args[arg_i++];
     if (c == 'r') { // register
-      auto r = static_cast<Asm::Register>(va_arg(args, int));
-      p++;
-      if (*p == 'm') {
-        auto dt = static_cast<Asm::DataType>(va_arg(args, int));
-        out << asmgen->RegName(r, dt);
-        p++;
-      } else if (isdigit(*p)) {
-        long bits = read_bits();
-        out << asmgen->RegName(r, BitsToDataType(bits));
+      if (format[i + 1] == 'm') {
+        put(asmgen->RegName(arg.reg, args[arg_i++].dt));
+        ++i;
+      } else {
+        int bits = 0;
+        for (; i + 1 < format.size() && isdigit(format[i + 1]); ++i) {
+          bits = 10 * bits + format[i + 1] - '0';
+        }
+        put(asmgen->RegName(arg.reg, BitsToDataType(bits)));
       }
     } else if (c == 'i') { // signed value
-      p++;
-      long bits = read_bits();
-      int64_t v = 0;
-      if (bits <= 16) {
-        v = va_arg(args, int);
-      } else if (bits == 32) {
-        v = va_arg(args, int32_t);
-      } else if (bits == 64) {
-        v = va_arg(args, int64_t);
-      }
-      out << showpos << v << noshowpos;
+      skip_bits(i);
+      put_int(arg.i, true);
     } else if (c == 'u') { // unsigned value
-      p++;
-      long bits = read_bits();
-      uint64_t v = 0;
-      if (bits <= 16) {
-        v = va_arg(args, int);
-      } else if (bits == 32) {
-        v = va_arg(args, uint32_t);
-      } else if (bits == 64) {
-        v = va_arg(args, uint64_t);
-      }
-      out << v;
+      skip_bits(i);
+      put_int(static_cast<uint64_t>(arg.i), false);
     } else if (c == 's') {
-      p++;
-      auto s = va_arg(args, const char*);
-      out << s;
+      put(arg.s);
     } else if (c == 'S') {
-      p++;
-      auto s = va_arg(args, const char*);
-      auto l = va_arg(args, size_t);
-      out << string_view(s, l);
+      put({arg.s, arg.len});
+    }
+  }
+
+  sb->sputn(line.data(), len);
+}
+
+OutputBuffer::OutputBuffer(std::streambuf* dest, std::size_t size)
+    : dest_{dest}, buf_(size) {
+  setp(buf_.data(), buf_.data() + buf_.size());
+}
+
+OutputBuffer::int_type OutputBuffer::overflow(int_type c) {
+  if (sync() != 0) {
+    return traits_type::eof();
+  }
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+std::streamsize OutputBuffer::xsputn(const char* s, std::streamsize n) {
+  if (n > epptr() - pptr()) {
+    if (sync() != 0) {
+      return 0;
+    }
+    if (n > epptr() - pptr()) { // バッファより大きければ直接書き出す
+      return dest_->sputn(s, n);
     }
   }
+  copy(s, s + n, pptr());
+  pbump(n);
+  return n;
+}
 
-  va_end(args);
+int OutputBuffer::sync() {
+  const auto n = pptr() - pbase();
+  if (n > 0 && dest_->sputn(pbase(), n) != n) {
+    return -1;
+  }
+  setp(buf_.data(), buf_.data() + buf_.size());
+  return dest_->pubsync();
 }
@@ -1,9 +1,14 @@
 #pragma once
 
+#include <array>
 #include <bitset>
+#include <concepts>
 #include <cstdint>
 #include <ostream>
+#include <streambuf>
 #include <string_view>
+#include <type_traits>
+#include <vector>
 
 class Asm {
  public:
@@ -52,11 +57,26 @@ class Asm {
     kNonStandardDataType, kByte, kWord, kDWord, kQWord
   };
 
-  Asm(std::ostream& out) : out_{out} {}
+  // 関数のシンボルの結合
+  enum SymBind {
+    kBindLocal,  // 翻訳単位の中だけで見える
+    kBindGlobal,
+    kBindWeak,   // 他の翻訳単位の同名の定義と重複してよい（ジェネリック関数の具体化）
+  };
+
+  // レジスタ名の表（[reg][dt]）
+  using RegNameTable = std::array<std::array<std::string_view, 5>, kRegNum>;
+
+  Asm(std::ostream& out, const RegNameTable& reg_names)
+    : out_{out}, reg_names_{reg_names} {}
   virtual ~Asm() = default;
 
-  virtual std::string RegName(Register reg, DataType dt = kQWord) = 0;
-  virtual bool SameReg(Register a, Register b) = 0;
+  std::string_view RegName(Register reg, DataType dt = kQWord) const {
+    return reg_names_[reg][dt];
+  }
+  bool SameReg(Register a, Register b) const {
+    return RegName(a) == RegName(b);
+  }
 
   virtual void Mov64(Register dest, std::uint64_t v) = 0;
   virtual void Mov64(Register dest, Register v) = 0;
@@ -97,15 +117,46 @@ class Asm {
   virtual void SectionInit() = 0;
   virtual void SectionData(bool readonly) = 0;
   virtual std::string SymLabel(std::string_view sym_name) = 0;
-  virtual void FuncPrologue(std::string_view sym_name) = 0;
+  virtual void FuncPrologue(std::string_view sym_name, SymBind bind) = 0;
   virtual void FuncEpilogue() = 0;
   virtual bool VParamOnStack() = 0;
 
+  // ラベル・シンボル・データの定義（既定の実装は GNU as 向けの疑似命令を出力する）
+  virtual void Label(std::string_view label, std::string_view comment = {});
+  virtual void Global(std::string_view sym_name);
+  virtual void Weak(std::string_view sym_name);
+  virtual void Align(int p2);
+  virtual void DataZero(std::size_t size);
+  virtual void DataN(std::size_t size, std::int64_t v);
+  virtual void DataCStr(const std::uint8_t* s, std::size_t len); // 末尾に 0 を付ける
+  virtual void DataAddr(std::string_view label);
+
   // アーキテクチャ非依存な行を出力したいときに使う汎用出力メソッド
   std::ostream& Output() { return out_; }
 
  protected:
   std::ostream& out_;
+  const RegNameTable& reg_names_;
+};
+
+/* 出力を大きなバッファに溜め、まとめて書き出すストリームバッファ
+ *
+ * std::cout.rdbuf() と差し替えて使う。
+ * 1 文字ずつの書き込みも、溢れるまではバッファへのコピーだけで済む。
+ */
+class OutputBuffer : public std::streambuf {
+ public:
+  OutputBuffer(std::streambuf* dest, std::size_t size = 1 << 20);
+  ~OutputBuffer() { sync(); }
+
+ protected:
+  int_type overflow(int_type c) override;
+  std::streamsize xsputn(const char* s, std::streamsize n) override;
+  int sync() override;
+
+ private:
+  std::streambuf* dest_;
+  std::vector<char> buf_;
 };
 
 enum class AsmArch {
@@ -114,6 +165,7 @@ enum class AsmArch {
 };
 
 Asm* NewAsm(AsmArch arch, std::ostream& out);
+const Asm::RegNameTable& RegNameTableOf(AsmArch arch);
 
 constexpr Asm::DataType BitsToDataType(int bits) {
   switch (bits) {
@@ -125,4 +177,128 @@ constexpr Asm::DataType BitsToDataType(int bits) {
   return Asm::kNonStandardDataType;
 }
 
-void PrintAsm(Asm* asmgen, const char* format, ...);
+/* PrintAsm の書式
+ *
+ * %r8, %r16, %r32, %r64: レジスタ（Asm::Register）をそのビット幅の名前で出力
+ * %rm: レジスタ（Asm::Register）をデータ型（Asm::DataType）の幅の名前で出力
+ * %i:  符号付き整数を符号付きで出力（%i32 のようにビット幅を書いてもよい）
+ * %u:  符号なし整数を出力（%u64 のようにビット幅を書いてもよい）
+ * %s:  const char*
+ * %S:  std::string_view
+ *
+ * 書式と引数の型の対応はコンパイル時に検査する。
+ */
+struct AsmArg {
+  enum Kind { kReg, kDataType, kInt, kCStr, kStr } kind;
+  union {
+    Asm::Register reg;
+    Asm::DataType dt;
+    std::int64_t i;
+    const char* s;
+  };
+  std::size_t len; // kStr の長さ
+
+  AsmArg(Asm::Register v) : kind{kReg}, reg{v} {}
+  AsmArg(Asm::DataType v) : kind{kDataType}, dt{v} {}
+  AsmArg(std::integral auto v) : kind{kInt}, i(v) {}
+  AsmArg(const char* v) : kind{kCStr}, s{v} {}
+  AsmArg(std::string_view v) : kind{kStr}, s{v.data()}, len{v.size()} {}
+
+  template <class T>
+  static consteval Kind KindOf() {
+    if constexpr (std::is_same_v<T, Asm::Register>) {
+      return kReg;
+    } else if constexpr (std::is_same_v<T, Asm::DataType>) {
+      return kDataType;
+    } else if constexpr (std::is_integral_v<T>) {
+      return kInt;
+    } else if constexpr (std::is_convertible_v<T, const char*>) {
+      return kCStr;
+    } else {
+      static_assert(std::is_convertible_v<T, std::string_view>,
+                    "unsupported argument type for PrintAsm");
+      return kStr;
+    }
+  }
+};
+
+// コンパイル時に呼ばれるとコンパイルエラーになる（書式の誤りを報告する）
+void AsmFormatError(const char* msg);
+
+template <class... Args>
+class AsmFormat {
+ public:
+  template <class S>
+    requires std::is_convertible_v<const S&, std::string_view>
+  consteval AsmFormat(const S& s) : fmt_{s} {
+    constexpr std::array<AsmArg::Kind, sizeof...(Args)> kinds{
+      AsmArg::KindOf<std::decay_t<Args>>()...
+    };
+    std::size_t n = 0;
+    auto expect = [&](AsmArg::Kind k) {
+      if (n >= kinds.size()) {
+        AsmFormatError("too few arguments for the format");
+      } else if (kinds[n++] != k) {
+        AsmFormatError("argument type doesn't match the format");
+      }
+    };
+    for (std::size_t i = 0; i < fmt_.size(); ++i) {
+      if (fmt_[i] != '%') {
+        continue;
+      }
+      switch (++i < fmt_.size() ? fmt_[i] : '\0') {
+      case 'r':
+        expect(AsmArg::kReg);
+        if (i + 1 < fmt_.size() && fmt_[i + 1] == 'm') {
+          expect(AsmArg::kDataType);
+          ++i;
+        } else if (!ReadBits(i)) {
+          AsmFormatError("%r needs 'm' or a bit width");
+        }
+        break;
+      case 'i':
+      case 'u':
+        expect(AsmArg::kInt);
+        ReadBits(i);
+        break;
+      case 's': expect(AsmArg::kCStr); break;
+      case 'S': expect(AsmArg::kStr); break;
+      default:
+        AsmFormatError("unknown conversion specifier");
+      }
+    }
+    if (n != kinds.size()) {
+      AsmFormatError("too many arguments for the format");
+    }
+  }
+
+  std::string_view Get() const { return fmt_; }
+
+ private:
+  // fmt_[i] の直後のビット幅（8, 16, 32, 64）を読み飛ばす
+  consteval bool ReadBits(std::size_t& i) const {
+    for (std::string_view bits : {"8", "16", "32", "64"}) {
+      if (fmt_.substr(i + 1, bits.size()) == bits) {
+        i += bits.size();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::string_view fmt_;
+};
+
+void FormatAsm(Asm* asmgen, std::string_view format,
+               const AsmArg* args, std::size_t num_args);
+
+template <class... Args>
+void PrintAsm(Asm* asmgen, AsmFormat<std::type_identity_t<Args>...> format,
+              Args... args) {
+  if constexpr (sizeof...(Args) == 0) {
+    FormatAsm(asmgen, format.Get(), nullptr, 0);
+  } else {
+    const AsmArg arg_array[]{AsmArg(args)...};
+    FormatAsm(asmgen, format.Get(), arg_array, sizeof...(Args));
+  }
+}
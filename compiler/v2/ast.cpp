@@ -7,69 +7,87 @@
 #include <iterator>
 #include <list>
 #include <map>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 
+#include "arena.hpp"
 #include "magic_enum.hpp"
 #include "mangle.hpp"
+#include "module.hpp"
 #include "object.hpp"
+#include "trace.hpp"
 
 using namespace std;
 using std::filesystem::path, std::filesystem::create_directory;
 
-namespace {
-
 template <class T>
-class Numbering {
- public:
-  size_t Number(T value) {
-    if (auto it = number_.find(value); it != number_.end()) {
-      return it->second;
-    }
-    auto n = number_.size();
-    number_.insert({value, n});
-    return n;
+size_t DebugNames::Number(map<T, size_t>& number, T value) {
+  lock_guard lock{mutex_};
+  if (auto it = number.find(value); it != number.end()) {
+    return it->second;
   }
+  auto n = number.size();
+  number.insert({value, n});
+  return n;
+}
 
-  const auto& GetMapping() const {
-    return number_;
+template <class T>
+vector<T> DebugNames::Numbered(const map<T, size_t>& number) {
+  lock_guard lock{mutex_};
+  vector<T> values;
+  for (auto [ value, n ] : number) {
+    values.push_back(value);
   }
+  return values;
+}
 
- private:
-  map<T, size_t> number_;
-};
-
-Numbering<Node*> node_number;
-std::string NodeName(Node* node) {
+std::string DebugNames::Name(Node* node) {
   if (node == nullptr) {
     return "null";
   }
   ostringstream oss;
-  oss << "Node_" << node_number.Number(node);
+  oss << "Node_" << Number(node_number_, node);
   return oss.str();
 }
 
-Numbering<Type*> type_number;
-std::string TypeName(Type* type) {
+std::string DebugNames::Name(Type* type) {
   if (type == nullptr) {
     return "null";
   }
   ostringstream oss;
-  oss << "Type_" << type_number.Number(type);
+  oss << "Type_" << Number(type_number_, type);
   return oss.str();
 }
 
-Numbering<Object*> object_number;
-std::string ObjectName(Object* object) {
+std::string DebugNames::Name(Object* object) {
   if (object == nullptr) {
     return "null";
   }
   ostringstream oss;
-  oss << "Object_" << object_number.Number(object);
+  oss << "Object_" << Number(object_number_, object);
   return oss.str();
 }
 
+std::vector<Type*> DebugNames::NumberedTypes() {
+  return Numbered(type_number_);
+}
+
+std::vector<Object*> DebugNames::NumberedObjects() {
+  return Numbered(object_number_);
+}
+
+void DebugNames::Clear() {
+  lock_guard lock{mutex_};
+  node_number_.clear();
+  type_number_.clear();
+  object_number_.clear();
+}
+
+namespace {
+
 struct NodeValuePrinter {
   std::ostream& os;
 
@@ -101,68 +119,84 @@ struct NodeValuePrinter {
   }
 };
 
-void PrintAST(std::ostream& os, Node* ast, int indent, bool recursive) {
+void PrintASTValue(std::ostream& os, Node* ast, int indent) {
+  if (!get_if<VariantDummyType>(&ast->value)) {
+    os << '\n' << string(indent + 2, ' ') << "value=";
+    visit(NodeValuePrinter{os}, ast->value);
+  }
+  os << '\n' << string(indent, ' ') << '}';
+}
+
+void PrintAST(std::ostream& os, DebugNames& names, Node* ast,
+              int indent, bool recursive) {
   if (ast == nullptr) {
     os << "null";
     return;
   }
 
-  os << NodeName(ast) << ' ' << reinterpret_cast<void*>(ast)
-     << '{' << magic_enum::enum_name(ast->kind) << ' ';
-  if (ast->token) {
-    os << "'" << ast->token->raw << "'";
-  } else {
-    os << "null-token";
-  }
+  // 長い文の列で再帰が深くならないよう、next の連鎖はループでたどる。
+  // next を出力したノードの value と閉じ括弧は、連鎖の末尾から順に出力する。
+  vector<pair<Node*, int>> pending_tails;
+  for (;;) {
+    os << names.Name(ast) << ' ' << reinterpret_cast<void*>(ast)
+       << '{' << magic_enum::enum_name(ast->kind) << ' ';
+    if (ast->token) {
+      os << "'" << ast->token->raw << "'";
+    } else {
+      os << "null-token";
+    }
+
+    const bool multiline = recursive && (
+        ast->type || ast->lhs || ast->rhs || ast->cond || ast->next);
+    if (!multiline) {
+      ast->type && os << " type=" << ast->type;
+      ast->lhs && os << " lhs=" << names.Name(ast->lhs);
+      ast->rhs && os << " rhs=" << names.Name(ast->rhs);
+      ast->cond && os << " cond=" << names.Name(ast->cond);
+      ast->next && os << " next=" << names.Name(ast->next);
+      if (!get_if<VariantDummyType>(&ast->value)) {
+        os << " value=";
+        visit(NodeValuePrinter{os}, ast->value);
+      }
+      os << '}';
+      break;
+    }
 
-  const bool multiline = recursive && (
-      ast->type || ast->lhs || ast->rhs || ast->cond || ast->next);
-  if (multiline) {
     if (ast->type) {
       os << '\n' << string(indent + 2, ' ') << "type=" << ast->type;
     }
     if (ast->lhs) {
       os << '\n' << string(indent + 2, ' ') << "lhs=";
-      PrintAST(os, ast->lhs, indent + 2, recursive);
+      PrintAST(os, names, ast->lhs, indent + 2, recursive);
     }
     if (ast->rhs) {
       os << '\n' << string(indent + 2, ' ') << "rhs=";
-      PrintAST(os, ast->rhs, indent + 2, recursive);
+      PrintAST(os, names, ast->rhs, indent + 2, recursive);
     }
     if (ast->cond) {
       os << '\n' << string(indent + 2, ' ') << "cond=";
-      PrintAST(os, ast->cond, indent + 2, recursive);
-    }
-    if (ast->next) {
-      os << '\n' << string(indent + 2, ' ') << "next=";
-      PrintAST(os, ast->next, indent + 2, recursive);
+      PrintAST(os, names, ast->cond, indent + 2, recursive);
     }
-    if (!get_if<VariantDummyType>(&ast->value)) {
-      os << '\n' << string(indent + 2, ' ') << "value=";
-      visit(NodeValuePrinter{os}, ast->value);
-    }
-  } else {
-    ast->type && os << " type=" << ast->type;
-    ast->lhs && os << " lhs=" << NodeName(ast->lhs);
-    ast->rhs && os << " rhs=" << NodeName(ast->rhs);
-    ast->cond && os << " cond=" << NodeName(ast->cond);
-    ast->next && os << " next=" << NodeName(ast->next);
-    if (!get_if<VariantDummyType>(&ast->value)) {
-      os << " value=";
-      visit(NodeValuePrinter{os}, ast->value);
+    if (ast->next == nullptr) {
+      PrintASTValue(os, ast, indent);
+      break;
     }
+    os << '\n' << string(indent + 2, ' ') << "next=";
+    pending_tails.push_back({ast, indent});
+    ast = ast->next;
+    indent += 2;
   }
 
-  if (multiline) {
-    os << '\n' << string(indent, ' ') << '}';
-  } else {
-    os << '}';
+  while (!pending_tails.empty()) {
+    auto [ node, node_indent ] = pending_tails.back();
+    pending_tails.pop_back();
+    PrintASTValue(os, node, node_indent);
   }
 }
 
 Object* AllocateLVar(ASTContext& ctx, Token* name, Node* def) {
   if (ctx.sc.FindCurrentBlock(*name)) {
-    cerr << "local variable is redefined" << endl;
+    ErrorOut() << "local variable is redefined" << endl;
     ErrorAt(ctx.src, *name);
   }
   auto lvar = NewVar(name, def, Object::kLocal);
@@ -171,11 +205,74 @@ Object* AllocateLVar(ASTContext& ctx, Token* name, Node* def) {
   return lvar;
 }
 
-const map<char, Node::Kind> kUnaryOps{
-  {'&', Node::kAddr},
-  {'*', Node::kDeref},
+// グローバルな名前表に登録し、基本名の索引にも加える
+void PutGlobal(ASTContext& ctx, Symbol name, Object* obj) {
+  if (ctx.sc.Put(name, obj)) {
+    return;
+  }
+  auto& pool = GetPool(Pool::kObject);
+  auto base_name = GetSymbol(*obj->id);
+  auto overloads = ctx.overloads.Find(base_name);
+  if (overloads == nullptr) {
+    overloads = pool.New<OverloadSet>();
+    ctx.overloads.Insert(base_name, overloads);
+  }
+  overloads->objs.push_back(obj);
+  int arity = CountListItems(obj->def->rhs);
+  if (obj->def->kind == Node::kExtern) { // extern 宣言は関数型から数える
+    arity = 0;
+    for (auto param = obj->def->lhs->type->next; param; param = param->next) {
+      ++arity;
+    }
+  }
+  overloads->arity.push_back(arity);
+}
+
+// 2 項演算子の優先順位（大きいほど強く結合する）
+enum BinOpPrec {
+  kPrecNone,           // 2 項演算子ではない
+  kPrecLOr,            // ||
+  kPrecLAnd,           // &&
+  kPrecEquality,       // == !=
+  kPrecRelational,     // < <= > >=
+  kPrecAdditive,       // + -
+  kPrecMultiplicative, // * /
+  kPrecMax = kPrecMultiplicative,
+};
+
+// -gen-parse-anime で表示する、各優先順位を解析する関数の名前
+const char* const kPrecNames[]{
+  nullptr, "LogicalOr", "LogicalAnd", "Equality",
+  "Relational", "Additive", "Multiplicative",
 };
 
+struct BinOp {
+  int prec;
+  Node::Kind kind;
+  bool swap; // 被演算子を入れ替える（a < b は b > a のノードにする）
+};
+
+// 演算子・区切り記号の種類から 2 項演算子の情報を引く表
+constexpr auto kBinOps = []{
+  array<BinOp, static_cast<size_t>(Punct::kNum)> t{};
+  auto set = [&t](Punct p, int prec, Node::Kind kind, bool swap = false) {
+    t[static_cast<size_t>(p)] = {prec, kind, swap};
+  };
+  set(Punct::kLOr,  kPrecLOr,            Node::kLOr);
+  set(Punct::kLAnd, kPrecLAnd,           Node::kLAnd);
+  set(Punct::kEqu,  kPrecEquality,       Node::kEqu);
+  set(Punct::kNEqu, kPrecEquality,       Node::kNEqu);
+  set(Punct::kLT,   kPrecRelational,     Node::kGT, true);
+  set(Punct::kLE,   kPrecRelational,     Node::kLE);
+  set(Punct::kGT,   kPrecRelational,     Node::kGT);
+  set(Punct::kGE,   kPrecRelational,     Node::kLE, true);
+  set(Punct::kPlus, kPrecAdditive,       Node::kAdd);
+  set(Punct::kMinus, kPrecAdditive,      Node::kSub);
+  set(Punct::kStar, kPrecMultiplicative, Node::kMul);
+  set(Punct::kSlash, kPrecMultiplicative, Node::kDiv);
+  return t;
+}();
+
 struct Edge {
   std::string label, from, to;
 };
@@ -191,7 +288,9 @@ class DotEdgePrinter {
   std::ostream& os_;
 
  public:
-  DotEdgePrinter(std::ostream& os) : os_{os} {}
+  DotEdgePrinter(std::ostream& os, DebugNames& names)
+      : os_{os}, names{names} {}
+  DebugNames& names;
   bool Print(const Edge& e) {
     auto [ it, inserted ] = printed_edges_.insert(e);
     if (inserted) {
@@ -204,8 +303,8 @@ class DotEdgePrinter {
 void PrintASTDotEdge(DotEdgePrinter& dep, Type* type);
 void PrintASTDotEdge(DotEdgePrinter& dep, Object* object);
 void PrintASTDotEdge(DotEdgePrinter& dep, Node* ast, bool recursive);
-void PrintASTDot(std::ostream& os, Type* type);
-void PrintASTDot(std::ostream& os, Object* object);
+void PrintASTDot(std::ostream& os, DebugNames& names, Type* type);
+void PrintASTDot(std::ostream& os, DebugNames& names, Object* object);
 
 void EscapeDotLabel(std::ostream& os, char c) {
   if (c == '\"') {
@@ -227,6 +326,7 @@ void PrintTokenEscape(std::ostream& os, Token* token) {
 
 struct NodeValueDotPrinter {
   std::ostream& os;
+  DebugNames& names;
 
   void operator()(VariantDummyType) {
     os << "none";
@@ -238,7 +338,7 @@ struct NodeValueDotPrinter {
     os << "STR" << v.i;
   }
   void operator()(Object* v) {
-    os << ObjectName(v);
+    os << names.Name(v);
   }
   void operator()(TypedFunc* v) {
     os << Mangle(*v) << "()";
@@ -250,58 +350,58 @@ struct NodeValueDotPrinter {
 
 void PrintASTDotEdge(DotEdgePrinter& dep, Type* type) {
   if (type->base) {
-    if (dep.Print({"base", TypeName(type), TypeName(type->base)})) {
+    if (dep.Print({"base", dep.names.Name(type), dep.names.Name(type->base)})) {
       PrintASTDotEdge(dep, type->base);
     }
   }
   if (type->next) {
-    if (dep.Print({"next", TypeName(type), TypeName(type->next)})) {
+    if (dep.Print({"next", dep.names.Name(type), dep.names.Name(type->next)})) {
       PrintASTDotEdge(dep, type->next);
     }
   }
 }
 
 void PrintASTDotEdge(DotEdgePrinter& dep, Object* object) {
-  dep.Print({"def", ObjectName(object), NodeName(object->def)});
+  dep.Print({"def", dep.names.Name(object), dep.names.Name(object->def)});
   if (object->type) {
-    dep.Print({"type", ObjectName(object), TypeName(object->type)});
+    dep.Print({"type", dep.names.Name(object), dep.names.Name(object->type)});
     PrintASTDotEdge(dep, object->type);
   }
 }
 
 void PrintASTDotEdge(DotEdgePrinter& dep, Node* ast, bool recursive) {
   if (ast->type) {
-    dep.Print({"type", NodeName(ast), TypeName(ast->type)});
+    dep.Print({"type", dep.names.Name(ast), dep.names.Name(ast->type)});
     PrintASTDotEdge(dep, ast->type);
   }
   if (ast->lhs) {
-    dep.Print({"lhs", NodeName(ast), NodeName(ast->lhs)});
+    dep.Print({"lhs", dep.names.Name(ast), dep.names.Name(ast->lhs)});
     if (recursive) {
       PrintASTDotEdge(dep, ast->lhs, recursive);
     }
   }
   if (ast->rhs) {
-    dep.Print({"rhs", NodeName(ast), NodeName(ast->rhs)});
+    dep.Print({"rhs", dep.names.Name(ast), dep.names.Name(ast->rhs)});
     if (recursive) {
       PrintASTDotEdge(dep, ast->rhs, recursive);
     }
   }
   if (ast->cond) {
-    dep.Print({"cond", NodeName(ast), NodeName(ast->cond)});
+    dep.Print({"cond", dep.names.Name(ast), dep.names.Name(ast->cond)});
     if (recursive) {
       PrintASTDotEdge(dep, ast->cond, recursive);
     }
   }
   if (ast->next) {
-    dep.Print({"next", NodeName(ast), NodeName(ast->next)});
+    dep.Print({"next", dep.names.Name(ast), dep.names.Name(ast->next)});
     if (recursive) {
       PrintASTDotEdge(dep, ast->next, recursive);
     }
   }
   if (!get_if<VariantDummyType>(&ast->value)) {
     ostringstream oss;
-    visit(NodeValueDotPrinter{oss}, ast->value);
-    dep.Print({"value", NodeName(ast), oss.str()});
+    visit(NodeValueDotPrinter{oss, dep.names}, ast->value);
+    dep.Print({"value", dep.names.Name(ast), oss.str()});
 
     if (auto p = get_if<Object*>(&ast->value)) {
       Object* obj = *p;
@@ -310,21 +410,21 @@ void PrintASTDotEdge(DotEdgePrinter& dep, Node* ast, bool recursive) {
   }
 }
 
-void PrintASTDot(std::ostream& os, Type* type) {
+void PrintASTDot(std::ostream& os, DebugNames& names, Type* type) {
   if (type == nullptr) {
     os << "null";
     return;
   }
-  os << TypeName(type) << " [label=\"" << type << "\"];\n";
+  os << names.Name(type) << " [label=\"" << type << "\"];\n";
   return;
 }
 
-void PrintASTDot(std::ostream& os, Object* object) {
+void PrintASTDot(std::ostream& os, DebugNames& names, Object* object) {
   if (object == nullptr) {
     os << "null";
     return;
   }
-  os << ObjectName(object) << " [label=\""
+  os << names.Name(object) << " [label=\""
      << magic_enum::enum_name(object->kind)
      << ' ' << object->id->raw
      << "\\n" << magic_enum::enum_name(object->linkage)
@@ -333,7 +433,7 @@ void PrintASTDot(std::ostream& os, Object* object) {
   return;
 }
 
-std::vector<const char*> parse_stack;
+thread_local std::vector<const char*> parse_stack;
 void PrintParseStack(std::ostream& os, ASTContext& ctx) {
   const char* loc = &ctx.t.Peek()->raw[0];
   auto line = ctx.src.GetLine(loc);
@@ -346,9 +446,8 @@ void PrintParseStack(std::ostream& os, ASTContext& ctx) {
   }
 }
 
-std::set<Node*> generated_nodes;
-
-std::filesystem::path AnimeFilePath(size_t timestamp, const char* filename) {
+std::filesystem::path AnimeFilePath(string_view parse_anime_dir,
+                                    size_t timestamp, const char* filename) {
   create_directory(parse_anime_dir);
   ostringstream oss;
   oss << timestamp;
@@ -358,17 +457,19 @@ std::filesystem::path AnimeFilePath(size_t timestamp, const char* filename) {
 }
 
 void GenerateAnimePage(ASTContext& ctx) {
-  static size_t timestamp = 0;
+  thread_local size_t timestamp = 0;
 
-  if (parse_anime_dir.empty()) {
+  if (ctx.parse_anime_dir.empty()) {
     return;
   }
 
-  ofstream stack_file{AnimeFilePath(timestamp, "stack.txt").native()};
+  ofstream stack_file{
+    AnimeFilePath(ctx.parse_anime_dir, timestamp, "stack.txt").native()};
   PrintParseStack(stack_file, ctx);
 
-  ofstream ast_file{AnimeFilePath(timestamp, "ast.dot").native()};
-  PrintGeneratedNodes(ast_file);
+  ofstream ast_file{
+    AnimeFilePath(ctx.parse_anime_dir, timestamp, "ast.dot").native()};
+  PrintGeneratedNodes(ast_file, ctx.debug_names);
 
   ++timestamp;
 }
@@ -393,9 +494,8 @@ struct ParseStackAnimator {
 
 // ノードコンストラクタ
 Node* NewNode(Node::Kind kind, Token* token) {
-  Node* n = new Node{kind, token, nullptr, nullptr, nullptr, nullptr};
-  generated_nodes.insert(n);
-  return n;
+  return GetPool(Pool::kNode).New<Node>(
+      token, nullptr, decltype(Node::value){}, kind);
 }
 
 Node* NewNodeInt(Token* token, opela_type::Int value) {
@@ -434,7 +534,7 @@ Node* NewNodeType(ASTContext& ctx, Token* token) {
   auto t = ctx.tm.Find(*token);
   if (t == nullptr) {
     t = NewTypeUnresolved(token);
-    cerr << "not implemented: unresolved type handling" << endl;
+    ErrorOut() << "not implemented: unresolved type handling" << endl;
     ErrorAt(ctx.src, *token);
   }
   return NewNodeType(token, t);
@@ -453,11 +553,27 @@ Node* NewNodeChar(Token* ch) {
   return node;
 }
 
+namespace {
+
+// 最後まで宣言されなかった型名があれば、最初に使われたものを報告する
+void CheckUnresolvedTypes(ASTContext& ctx) {
+  if (!ctx.unresolved_types.empty()) {
+    auto first = min_element(
+        ctx.unresolved_types.begin(), ctx.unresolved_types.end(),
+        [](auto& a, auto& b) { return a.first.data() < b.first.data(); });
+    ErrorOut() << "undeclared type" << endl;
+    ErrorAt(ctx.src, *get<Token*>(first->second->value));
+  }
+}
+
+} // namespace
+
 // パーサー
 Node* Program(ASTContext& ctx) {
   PS(ctx);
   auto node = DeclarationSequence(ctx);
   ctx.t.Expect(Token::kEOF);
+  CheckUnresolvedTypes(ctx);
   return node;
 }
 
@@ -474,6 +590,8 @@ Node* DeclarationSequence(ASTContext& ctx) {
       cur->next = TypeDeclaration(ctx);
     } else if (ctx.t.Peek(Token::kVar)) {
       cur->next = VariableDefinition(ctx);
+    } else if (ctx.t.Peek(Token::kImport)) {
+      cur->next = ImportDeclaration(ctx);
     } else {
       return head.next;
     }
@@ -520,24 +638,49 @@ Node* FunctionDefinition(ASTContext& ctx) {
     func_obj->mangled_name = MangleByDefNode(node);
   }
 
-  ctx.sc.Put(func_obj->mangled_name, func_obj);
+  PutGlobal(ctx, Intern(func_obj->mangled_name), func_obj);
 
   ctx.sc.Enter();
   ASTContext func_ctx{ctx.src, ctx.t, ctx.tm, ctx.sc, ctx.strings,
-                      ctx.unresolved_types, ctx.undeclared_ids,
-                      ctx.typed_funcs, func_obj};
+                      ctx.unresolved_types, ctx.typing_defs, ctx.overloads,
+                      ctx.typed_funcs, func_obj, ctx.modules,
+                      ctx.parse_anime_dir, ctx.debug_names,
+                      ctx.deferred_bodies};
 
   for (auto param = node->rhs; param; param = param->next) {
     auto var = AllocateLVar(func_ctx, param->token, param);
     param->value = var;
   }
 
-  node->lhs = CompoundStatement(func_ctx);
+  // ジェネリック関数の本体は具体化するときに使うので、後回しにしない
+  if (ctx.deferred_bodies && generic_func_node == node) {
+    ctx.deferred_bodies->push_back({node, ctx.t.SkipBlock()});
+  } else {
+    node->lhs = CompoundStatement(func_ctx);
+  }
   ctx.sc.Leave();
   ctx.tm.Leave();
   return generic_func_node;
 }
 
+void ParseDeferredBody(ASTContext& ctx, const DeferredBody& body) {
+  auto func_obj = get<Object*>(body.def->value);
+  Tokenizer t{ctx.src, body.begin};
+  ASTContext func_ctx{ctx.src, t, ctx.tm, ctx.sc, ctx.strings,
+                      ctx.unresolved_types, ctx.typing_defs, ctx.overloads,
+                      ctx.typed_funcs, func_obj, ctx.modules,
+                      ctx.parse_anime_dir, ctx.debug_names, nullptr};
+
+  ctx.sc.Enter();
+  for (auto param = body.def->rhs; param; param = param->next) {
+    auto var = get<Object*>(param->value);
+    ctx.sc.Put(*var->id, var);
+  }
+  body.def->lhs = CompoundStatement(func_ctx);
+  ctx.sc.Leave();
+  CheckUnresolvedTypes(ctx);
+}
+
 Node* ExternDeclaration(ASTContext& ctx) {
   PS(ctx);
   ctx.t.Expect(Token::kExtern);
@@ -546,7 +689,7 @@ Node* ExternDeclaration(ASTContext& ctx) {
   if (attr && attr->raw == R"("C")") {
     mangle = false;
   } else if (attr) {
-    cerr << "unknown attribute" << endl;
+    ErrorOut() << "unknown attribute" << endl;
     ErrorAt(ctx.src, *attr);
   }
 
@@ -554,7 +697,7 @@ Node* ExternDeclaration(ASTContext& ctx) {
   auto tspec = TypeSpecifier(ctx);
   auto colon_token = ctx.t.Expect(";");
   if (tspec == nullptr) {
-    cerr << "type must be specified" << endl;
+    ErrorOut() << "type must be specified" << endl;
     ErrorAt(ctx.src, *colon_token);
   }
 
@@ -567,10 +710,36 @@ Node* ExternDeclaration(ASTContext& ctx) {
   } else {
     obj->mangled_name = id->raw;
   }
-  ctx.sc.Put(*obj->id, obj);
+  PutGlobal(ctx, Intern(obj->mangled_name), obj);
   return node;
 }
 
+// モジュールのインターフェースを構文解析し、その宣言の列を返す
+Node* ImportDeclaration(ASTContext& ctx) {
+  PS(ctx);
+  ctx.t.Expect(Token::kImport);
+  auto name = ctx.t.Expect(Token::kStr);
+  ctx.t.Expect(";");
+  if (ctx.modules == nullptr) {
+    ErrorOut() << "import is not supported here" << endl;
+    ErrorAt(ctx.src, *name);
+  }
+
+  auto iface = ctx.modules->Load(ctx.src, *name);
+  if (iface == nullptr) { // 既に読み込んだモジュール
+    return nullptr;
+  }
+  Tokenizer iface_t{*iface};
+  ASTContext iface_ctx{*iface, iface_t, ctx.tm, ctx.sc, ctx.strings,
+                       ctx.unresolved_types, ctx.typing_defs, ctx.overloads,
+                       ctx.typed_funcs, ctx.cur_func, ctx.modules,
+                       ctx.parse_anime_dir, ctx.debug_names,
+                       ctx.deferred_bodies};
+  auto decls = DeclarationSequence(iface_ctx);
+  iface_t.Expect(Token::kEOF);
+  return decls;
+}
+
 Node* TypeDeclaration(ASTContext& ctx) {
   PS(ctx);
   ctx.t.Expect(Token::kType);
@@ -598,12 +767,29 @@ Node* TypeDeclaration(ASTContext& ctx) {
 
   ctx.t.Expect(";");
 
-  auto type = NewTypeUser(tspec->type, name_token);
+  Type* type;
+  if (auto it = ctx.unresolved_types.find(name_token->raw);
+      it != ctx.unresolved_types.end()) {
+    // 先に使われていた仮の型をそのまま定義にすれば、参照元を書き換えずに済む
+    type = it->second;
+    type->kind = Type::kUser;
+    type->base = tspec->type;
+    type->value = name_token;
+    ctx.unresolved_types.erase(it);
+  } else {
+    type = NewTypeUser(tspec->type, name_token);
+  }
   if (auto prev = ctx.tm.Register(type)) {
-    cerr << "type is re-defined: name=" << name_token->raw
+    ErrorOut() << "type is re-defined: name=" << name_token->raw
          << ", prev=" << prev << endl;
     ErrorAt(ctx.src, *name_token);
   }
+  for (auto t = type->base; t && t->kind == Type::kUser; t = t->base) {
+    if (t == type) {
+      ErrorOut() << "circular type definition: " << name_token->raw << endl;
+      ErrorAt(ctx.src, *name_token);
+    }
+  }
 
   return NewNodeOneChild(Node::kTypedef, name_token, tspec);
 }
@@ -620,7 +806,7 @@ Node* VariableDefinition(ASTContext& ctx) {
       init = Expression(ctx);
     }
     if (init == nullptr && tspec == nullptr) {
-      cerr << "initial value or type specifier must be specified" << endl;
+      ErrorOut() << "initial value or type specifier must be specified" << endl;
       ErrorAt(ctx.src, *id);
     }
 
@@ -633,7 +819,7 @@ Node* VariableDefinition(ASTContext& ctx) {
       var = AllocateLVar(ctx, id, def_node);
     } else { // グローバル
       var = NewVar(id, def_node, Object::kGlobal);
-      ctx.sc.Put(*var->id, var);
+      PutGlobal(ctx, GetSymbol(*var->id), var);
     }
     id_node->value = var;
 
@@ -764,135 +950,116 @@ Node* Expression(ASTContext& ctx) {
   return Assignment(ctx);
 }
 
-Node* Assignment(ASTContext& ctx) {
-  PS(ctx);
-  const map<string_view, Node::Kind> opmap{
-    {"+=", Node::kAdd},
-    {"-=", Node::kSub},
-    {"*=", Node::kMul},
-    {"/=", Node::kDiv},
-  };
+namespace {
 
-  auto node = LogicalOr(ctx);
+// 優先順位が min_prec 以上の 2 項演算子からなる式を解析する（優先順位上昇法）
+Node* BinaryExpr(ASTContext& ctx, int min_prec) {
+  auto node = Unary(ctx);
 
-  if (auto op = ctx.t.Consume("=")) {
-    node = NewNodeBinOp(Node::kAssign, op, node, Assignment(ctx));
-  } else if (auto it = opmap.find(ctx.t.Peek()->raw); it != opmap.end()) {
-    auto op = ctx.t.Consume();
-    auto rhs = NewNodeBinOp(it->second, op, node, Assignment(ctx));
-    node = NewNodeBinOp(Node::kAssign, op, node, rhs);
-  } else if (auto op = ctx.t.Consume(":=")) {
-    if (node->kind != Node::kId) {
-      cerr << "lhs of ':=' must be an identifier" << endl;
-      ctx.t.Unexpected(*node->token);
+  for (;;) {
+    auto& binop = kBinOps[static_cast<size_t>(ctx.t.Peek()->punct)];
+    if (binop.prec < min_prec) {
+      return node;
     }
-    ctx.undeclared_ids.erase(node);
-    auto def_node = NewNodeBinOp(Node::kDefVar, op, node, Assignment(ctx));
-
-    auto lvar = AllocateLVar(ctx, node->token, def_node);
-    node->value = lvar;
-
-    node = def_node;
+    auto op = ctx.t.Consume();
+    auto rhs = BinaryExpr(ctx, binop.prec + 1); // 左結合
+    node = binop.swap ? NewNodeBinOp(binop.kind, op, rhs, node)
+                      : NewNodeBinOp(binop.kind, op, node, rhs);
   }
-
-  return node;
 }
 
-Node* LogicalOr(ASTContext& ctx) {
-  PS(ctx);
-  auto node = LogicalAnd(ctx);
+// 優先順位 prec の演算子だけを扱う 1 段分の再帰下降（-gen-parse-anime 用）
+Node* BinaryLevel(ASTContext& ctx, int prec) {
+  ParseStackAnimator psanimator(ctx, kPrecNames[prec]);
+  auto operand = [&ctx, prec]{
+    return prec == kPrecMax ? Unary(ctx) : BinaryLevel(ctx, prec + 1);
+  };
+  auto node = operand();
 
   for (;;) {
-    if (auto op = ctx.t.Consume("||")) {
-      node = NewNodeBinOp(Node::kLOr, op, node, LogicalAnd(ctx));
-    } else {
+    auto& binop = kBinOps[static_cast<size_t>(ctx.t.Peek()->punct)];
+    if (binop.prec != prec) {
       return node;
     }
+    auto op = ctx.t.Consume();
+    if (binop.swap) {
+      node = NewNodeBinOp(binop.kind, op, operand(), node);
+    } else {
+      node = NewNodeBinOp(binop.kind, op, node, operand());
+    }
   }
 }
 
-Node* LogicalAnd(ASTContext& ctx) {
+} // namespace
+
+Node* Assignment(ASTContext& ctx) {
   PS(ctx);
-  auto node = Equality(ctx);
+  // -gen-parse-anime では 1 段ずつ再帰する解析器を使い、解析の過程を再現する
+  auto node = ctx.parse_anime_dir.empty() ? BinaryExpr(ctx, kPrecLOr)
+                                          : LogicalOr(ctx);
 
-  for (;;) {
-    if (auto op = ctx.t.Consume("&&")) {
-      node = NewNodeBinOp(Node::kLAnd, op, node, Equality(ctx));
-    } else {
-      return node;
+  Node::Kind compound_kind;
+  switch (ctx.t.Peek()->punct) {
+  case Punct::kAssign:
+    {
+      auto op = ctx.t.Consume();
+      return NewNodeBinOp(Node::kAssign, op, node, Assignment(ctx));
     }
+  case Punct::kPlusAssign:  compound_kind = Node::kAdd; break;
+  case Punct::kMinusAssign: compound_kind = Node::kSub; break;
+  case Punct::kStarAssign:  compound_kind = Node::kMul; break;
+  case Punct::kSlashAssign: compound_kind = Node::kDiv; break;
+  case Punct::kDefine:
+    {
+      auto op = ctx.t.Consume();
+      if (node->kind != Node::kId) {
+        ErrorOut() << "lhs of ':=' must be an identifier" << endl;
+        ctx.t.Unexpected(*node->token);
+      }
+      auto def_node = NewNodeBinOp(Node::kDefVar, op, node, Assignment(ctx));
+
+      auto lvar = AllocateLVar(ctx, node->token, def_node);
+      node->value = lvar;
+      return def_node;
+    }
+  default:
+    return node;
   }
+
+  auto op = ctx.t.Consume();
+  auto rhs = NewNodeBinOp(compound_kind, op, node, Assignment(ctx));
+  return NewNodeBinOp(Node::kAssign, op, node, rhs);
 }
 
-Node* Equality(ASTContext& ctx) {
-  PS(ctx);
-  auto node = Relational(ctx);
+Node* LogicalOr(ASTContext& ctx) {
+  return BinaryLevel(ctx, kPrecLOr);
+}
 
-  for (;;) {
-    if (auto op = ctx.t.Consume("==")) {
-      node = NewNodeBinOp(Node::kEqu, op, node, Relational(ctx));
-    } else if (auto op = ctx.t.Consume("!=")) {
-      node = NewNodeBinOp(Node::kNEqu, op, node, Relational(ctx));
-    } else {
-      return node;
-    }
-  }
+Node* LogicalAnd(ASTContext& ctx) {
+  return BinaryLevel(ctx, kPrecLAnd);
 }
 
-Node* Relational(ASTContext& ctx) {
-  PS(ctx);
-  auto node = Additive(ctx);
+Node* Equality(ASTContext& ctx) {
+  return BinaryLevel(ctx, kPrecEquality);
+}
 
-  for (;;) {
-    if (auto op = ctx.t.Consume("<")) {
-      node = NewNodeBinOp(Node::kGT, op, Additive(ctx), node);
-    } else if (auto op = ctx.t.Consume("<=")) {
-      node = NewNodeBinOp(Node::kLE, op, node, Additive(ctx));
-    } else if (auto op = ctx.t.Consume(">")) {
-      node = NewNodeBinOp(Node::kGT, op, node, Additive(ctx));
-    } else if (auto op = ctx.t.Consume(">=")) {
-      node = NewNodeBinOp(Node::kLE, op, Additive(ctx), node);
-    } else {
-      return node;
-    }
-  }
+Node* Relational(ASTContext& ctx) {
+  return BinaryLevel(ctx, kPrecRelational);
 }
 
 Node* Additive(ASTContext& ctx) {
-  PS(ctx);
-  auto node = Multiplicative(ctx);
-
-  for (;;) {
-    if (auto op = ctx.t.Consume("+")) {
-      node = NewNodeBinOp(Node::kAdd, op, node, Multiplicative(ctx));
-    } else if (auto op = ctx.t.Consume("-")) {
-      node = NewNodeBinOp(Node::kSub, op, node, Multiplicative(ctx));
-    } else {
-      return node;
-    }
-  }
+  return BinaryLevel(ctx, kPrecAdditive);
 }
 
 Node* Multiplicative(ASTContext& ctx) {
-  PS(ctx);
-  auto node = Unary(ctx);
-
-  for (;;) {
-    if (auto op = ctx.t.Consume("*")) {
-      node = NewNodeBinOp(Node::kMul, op, node, Unary(ctx));
-    } else if (auto op = ctx.t.Consume("/")) {
-      node = NewNodeBinOp(Node::kDiv, op, node, Unary(ctx));
-    } else {
-      return node;
-    }
-  }
+  return BinaryLevel(ctx, kPrecMultiplicative);
 }
 
 Node* Unary(ASTContext& ctx) {
   PS(ctx);
-  if (ctx.t.Consume("+")) {
+  if (ctx.t.Consume(Punct::kPlus)) {
     return Unary(ctx);
-  } else if (auto op = ctx.t.Consume("-")) {
+  } else if (auto op = ctx.t.Consume(Punct::kMinus)) {
     auto zero = NewNodeInt(nullptr, 0);
     auto node = Unary(ctx);
     return NewNodeBinOp(Node::kSub, op, zero, node);
@@ -906,13 +1073,10 @@ Node* Unary(ASTContext& ctx) {
     return NewNodeOneChild(Node::kSizeof, op, arg);
   }
 
-  auto cur_token = ctx.t.Peek();
-  if (cur_token->raw.size() == 1) {
-    if (auto it = kUnaryOps.find(cur_token->raw[0]);
-        it != kUnaryOps.end() && cur_token->kind == Token::kReserved) {
-      auto op = ctx.t.Consume();
-      return NewNodeOneChild(it->second, op, Unary(ctx));
-    }
+  if (auto op = ctx.t.Consume(Punct::kAmp)) {
+    return NewNodeOneChild(Node::kAddr, op, Unary(ctx));
+  } else if (auto op = ctx.t.Consume(Punct::kStar)) {
+    return NewNodeOneChild(Node::kDeref, op, Unary(ctx));
   }
 
   return Postfix(ctx);
@@ -923,33 +1087,30 @@ Node* Postfix(ASTContext& ctx) {
   auto node = Primary(ctx);
 
   for (;;) {
-    if (auto op = ctx.t.Consume("(")) {
+    if (auto op = ctx.t.Consume(Punct::kLParen)) {
       node = NewNodeOneChild(Node::kCall, op, node);
-      if (!ctx.t.Consume(")")) {
+      if (!ctx.t.Consume(Punct::kRParen)) {
         node->rhs = Expression(ctx);
-        for (auto cur = node->rhs; ctx.t.Consume(","); cur = cur->next) {
+        for (auto cur = node->rhs; ctx.t.Consume(Punct::kComma); cur = cur->next) {
           cur->next = Expression(ctx);
         }
         ctx.t.Expect(")");
       }
-      if (ctx.undeclared_ids.count(node->lhs) > 0) {
-        ctx.undeclared_ids[node->lhs] = node;
-      }
-    } else if (auto op = ctx.t.Consume("@")) {
-      Node* rhs = ctx.t.Peek("<") ? TypeList(ctx) : TypeSpecifier(ctx);
+    } else if (auto op = ctx.t.Consume(Punct::kAt)) {
+      Node* rhs = ctx.t.Peek(Punct::kLT) ? TypeList(ctx) : TypeSpecifier(ctx);
       node = NewNodeBinOp(Node::kCast, op, node, rhs);
       if (node->rhs == nullptr) {
-        cerr << "type spec must be specified" << endl;
+        ErrorOut() << "type spec must be specified" << endl;
         ErrorAt(ctx.src, *op);
       }
-    } else if (auto op = ctx.t.Consume("[")) {
+    } else if (auto op = ctx.t.Consume(Punct::kLBracket)) {
       auto subscr = Expression(ctx);
       ctx.t.Expect("]");
       node = NewNodeBinOp(Node::kSubscr, op, node, subscr);
-    } else if (auto op = ctx.t.Consume(".")) {
+    } else if (auto op = ctx.t.Consume(Punct::kDot)) {
       auto id = ctx.t.Expect(Token::kId);
       node = NewNodeBinOp(Node::kDot, op, node, NewNode(Node::kId, id));
-    } else if (auto op = ctx.t.Consume("->")) {
+    } else if (auto op = ctx.t.Consume(Punct::kArrow)) {
       auto id = ctx.t.Expect(Token::kId);
       node = NewNodeBinOp(Node::kArrow, op, node, NewNode(Node::kId, id));
     } else {
@@ -960,7 +1121,7 @@ Node* Postfix(ASTContext& ctx) {
 
 Node* Primary(ASTContext& ctx) {
   PS(ctx);
-  if (ctx.t.Consume("(")) {
+  if (ctx.t.Consume(Punct::kLParen)) {
     auto node = Expression(ctx);
     ctx.t.Expect(")");
     return node;
@@ -968,17 +1129,15 @@ Node* Primary(ASTContext& ctx) {
     auto node = NewNode(Node::kId, id);
     if (auto obj = ctx.sc.Find(*id)) {
       node->value = obj;
-    } else {
-      ctx.undeclared_ids.insert({node, nullptr});
-    }
+    } // 見つからなければ SetType() でグローバルオブジェクトから探す
     return node;
   } else if (auto token = ctx.t.Consume(Token::kStr)) {
     return NewNodeStr(ctx, token);
   } else if (auto token = ctx.t.Consume(Token::kChar)) {
     return NewNodeChar(token);
-  } else if (auto op = ctx.t.Consume("{")) {
+  } else if (auto op = ctx.t.Consume(Punct::kLBrace)) {
     auto node = NewNode(Node::kInitList, op);
-    if (ctx.t.Consume("}")) {
+    if (ctx.t.Consume(Punct::kRBrace)) {
       return node;
     }
     Node head; // dummy
@@ -986,7 +1145,7 @@ Node* Primary(ASTContext& ctx) {
     for (;;) {
       cur->next = Expression(ctx);
       cur = cur->next;
-      if (!ctx.t.Consume(",")) {
+      if (!ctx.t.Consume(Punct::kComma)) {
         ctx.t.Expect("}");
         node->lhs = head.next;
         return node;
@@ -1002,7 +1161,7 @@ Node* TypeSpecifier(ASTContext& ctx) {
   if (auto ptr_token = ctx.t.Consume("*")) {
     auto base_tspec = TypeSpecifier(ctx);
     if (!base_tspec) {
-      cerr << "pointer base type must be specified" << endl;
+      ErrorOut() << "pointer base type must be specified" << endl;
       ErrorAt(ctx.src, *ptr_token);
     }
     auto node = NewNodeType(
@@ -1029,13 +1188,13 @@ Node* TypeSpecifier(ASTContext& ctx) {
     auto arr_size = Expression(ctx);
     ctx.t.Expect("]");
     if (arr_size->kind != Node::kInt) {
-      cerr << "array size must be an integer literal" << endl;
+      ErrorOut() << "array size must be an integer literal" << endl;
       ErrorAt(ctx.src, *arr_size->token);
     }
 
     auto elem_type = TypeSpecifier(ctx);
     if (elem_type == nullptr) {
-      cerr << "element type must be specified" << endl;
+      ErrorOut() << "element type must be specified" << endl;
       ErrorAt(ctx.src, *ctx.t.Peek());
     }
 
@@ -1052,7 +1211,7 @@ Node* TypeSpecifier(ASTContext& ctx) {
       auto name = ctx.t.Expect(Token::kId);
       auto tspec = TypeSpecifier(ctx);
       if (tspec == nullptr) {
-        cerr << "type must be specified" << endl;
+        ErrorOut() << "type must be specified" << endl;
         ErrorAt(ctx.src, *ctx.t.Peek());
       }
       cur->next = NewTypeParam(tspec->type, name);
@@ -1065,8 +1224,12 @@ Node* TypeSpecifier(ASTContext& ctx) {
   if (auto name_token = ctx.t.Consume(Token::kId)) {
     auto t = ctx.tm.Find(*name_token);
     if (t == nullptr) {
-      t = NewTypeUnresolved(name_token);
-      ctx.unresolved_types.push_back(t);
+      // 同じ名前の前方参照は 1 つの仮の型を共有し、型の宣言時にまとめて解決する
+      auto& unresolved_t = ctx.unresolved_types[name_token->raw];
+      if (unresolved_t == nullptr) {
+        unresolved_t = NewTypeUnresolved(name_token);
+      }
+      t = unresolved_t;
     }
     Node* type_list = nullptr;
     if (ctx.t.Peek("<")) {
@@ -1143,13 +1306,13 @@ Node* TypeList(ASTContext& ctx) {
     return type_list;
   }
   if ((type_list->lhs = TypeSpecifier(ctx)) == nullptr) {
-    cerr << "type must be specified" << endl;
+    ErrorOut() << "type must be specified" << endl;
     ErrorAt(ctx.src, *ctx.t.Peek());
   }
   for (auto cur = type_list->lhs; !ctx.t.ConsumeOrSub(">"); cur = cur->next) {
     ctx.t.Expect(",");
     if ((cur->next = TypeSpecifier(ctx)) == nullptr) {
-      cerr << "type must be specified" << endl;
+      ErrorOut() << "type must be specified" << endl;
       ErrorAt(ctx.src, *ctx.t.Peek());
     }
   }
@@ -1169,21 +1332,25 @@ Node* GParamList(ASTContext& ctx) {
   return param_list;
 }
 
-void PrintAST(std::ostream& os, Node* ast) {
-  PrintAST(os, ast, 0, false);
+void PrintAST(std::ostream& os, DebugNames& names, Node* ast) {
+  PrintAST(os, names, ast, 0, false);
 }
 
-void PrintASTRec(std::ostream& os, Node* ast) {
-  PrintAST(os, ast, 0, true);
+void PrintASTRec(std::ostream& os, DebugNames& names, Node* ast) {
+  PrintAST(os, names, ast, 0, true);
 }
 
-void PrintGeneratedNodes(std::ostream& os) {
+void PrintGeneratedNodes(std::ostream& os, DebugNames& names) {
   os << "digraph AST {\n";
 
-  DotEdgePrinter dep{os};
+  DotEdgePrinter dep{os, names};
 
-  for (auto node : generated_nodes) {
-    os << NodeName(node) << " [label=\"" << NodeName(node) << "\\n"
+  // このスレッドのノードは、プールの連続領域（スレッドごとの区画）に生成順で並んでいる。
+  // 区画は node_base から始まるとは限らないので、プール自身の先頭からたどる
+  auto& pool = GetPool(Pool::kNode);
+  const auto first = reinterpret_cast<Node*>(pool.Base());
+  for (Node* node = first; node != first + pool.NumObjects(); ++node) {
+    os << names.Name(node) << " [label=\"" << names.Name(node) << "\\n"
        << magic_enum::enum_name(node->kind) << ' ';
     if (node->token) {
       PrintTokenEscape(os, node->token);
@@ -1194,11 +1361,11 @@ void PrintGeneratedNodes(std::ostream& os) {
     cerr << "printing node edges " << node->lhs << "," << node->rhs << endl;
     PrintASTDotEdge(dep, node, false);
   }
-  for (auto [ type, index ] : type_number.GetMapping()) {
-    PrintASTDot(os, type);
+  for (auto type : names.NumberedTypes()) {
+    PrintASTDot(os, names, type);
   }
-  for (auto [ obj, index ] : object_number.GetMapping()) {
-    PrintASTDot(os, obj);
+  for (auto obj : names.NumberedObjects()) {
+    PrintASTDot(os, names, obj);
   }
   os << "}\n";
 }
@@ -1213,7 +1380,7 @@ int CountListItems(Node* head) {
 
 opela_type::String DecodeEscapeSequence(Source& src, Token& token) {
   if (token.kind != Token::kStr || token.raw[0] != '"') {
-    cerr << "invalid string literal" << endl;
+    ErrorOut() << "invalid string literal" << endl;
     ErrorAt(src, token);
   }
 
@@ -1221,7 +1388,7 @@ opela_type::String DecodeEscapeSequence(Source& src, Token& token) {
 
   for (size_t i = 1;;) {
     if (i >= token.raw.length()) {
-      cerr << "incomplete string literal" << endl;
+      ErrorOut() << "incomplete string literal" << endl;
       ErrorAt(src, token);
     }
     if (token.raw[i] == '"') {
@@ -1236,71 +1403,85 @@ opela_type::String DecodeEscapeSequence(Source& src, Token& token) {
   }
 }
 
-void ResolveIDs(ASTContext& ctx) {
-  while (!ctx.undeclared_ids.empty()) {
-    auto it = ctx.undeclared_ids.begin();
-    auto target = it->first;
-    auto target_ctx = it->second;
-    ctx.undeclared_ids.erase(it);
-
-    // 基本名（Object::id）が一致するグローバルオブジェクトを候補とする
-    auto globals = ctx.sc.GetGlobals();
-    list<Object*> candidates;
-    copy_if(globals.begin(), globals.end(), back_inserter(candidates),
-            [target](auto o){
-              return o->id->raw == target->token->raw;
-            });
-    switch (candidates.size()) {
-    case 0:
-      cerr << "undeclared id" << endl;
-      ErrorAt(ctx.src, *target->token);
-    case 1:
-      target->value = candidates.front();
-      break;
-    default:
-      if (target_ctx && target_ctx->kind == Node::kCall) {
-        size_t num_args = 0;
-        for (auto arg = target_ctx->rhs; arg; arg = arg->next) {
-          ++num_args;
-        }
+namespace {
 
-        // 実引数の数（num_args）と仮引数の数が等しいものに候補を絞る
-        candidates.remove_if(
-          [num_args](auto o){
-            size_t num_params = 0;
-            for (auto param = o->def->rhs; param; param = param->next) {
-              ++num_params;
-            }
-            return num_args != num_params;
-          });
-
-        if (candidates.size() == 1) {
-          target->value = candidates.front();
-          break;
+/* スコープで見つからなかった識別子をグローバルオブジェクトに解決する
+ *
+ * 解決結果は id->value に残すので、2 回目以降は探さない。
+ * call は id を呼び出す kCall ノード（呼び出しでなければ nullptr）で、
+ * オーバーロードを実引数の数で絞り込むのに使う。
+ */
+Object* ResolveID(ASTContext& ctx, Node* id, Node* call) {
+  if (auto p = get_if<Object*>(&id->value)) {
+    return *p;
+  }
+
+  // 基本名（Object::id）が一致するグローバルオブジェクトを候補とする
+  auto overloads = ctx.overloads.Find(GetSymbol(*id->token));
+  switch (overloads ? overloads->objs.size() : 0) {
+  case 0:
+    ErrorOut() << "undeclared id" << endl;
+    ErrorAt(ctx.src, *id->token);
+  case 1:
+    id->value = overloads->objs.front();
+    break;
+  default:
+    if (call) {
+      const int num_args = CountListItems(call->rhs);
+
+      // 実引数の数（num_args）と仮引数の数が等しいものに候補を絞る
+      Object* found = nullptr;
+      int num_found = 0;
+      for (size_t i = 0; i < overloads->objs.size(); ++i) {
+        if (overloads->arity[i] == num_args) {
+          found = overloads->objs[i];
+          ++num_found;
         }
       }
 
-      cerr << "ambiguous id" << endl;
-      ErrorAt(ctx.src, *target->token);
+      if (num_found == 1) {
+        id->value = found;
+        break;
+      }
     }
+
+    ErrorOut() << "ambiguous id" << endl;
+    ErrorAt(ctx.src, *id->token);
   }
+  return get<Object*>(id->value);
 }
 
-void ResolveType(ASTContext& ctx) {
-  while (!ctx.unresolved_types.empty()) {
-    auto target = ctx.unresolved_types.front();
-    ctx.unresolved_types.pop_front();
+/* フィールドへのアクセス node（kDot、kArrow）に、フィールドの型とオフセットを設定する
+ *
+ * struct_t は kStruct か kConcrete。オフセットは node->value に残し、コード生成ではフィールドを探さない。
+ * ジェネリック関数の中ではフィールドの大きさが型変数で決まることがあるので型だけを設定し、
+ * オフセットは具体化するときに求める。
+ */
+// ジェネリック関数の本体を型付けしているなら true（型変数の型はまだ決まっていない）
+bool InGenericFunc(ASTContext& ctx) {
+  return ctx.cur_func && ctx.cur_func->def->kind == Node::kDefGFunc;
+}
 
-    auto target_name = get<Token*>(target->value);
-    auto t = ctx.tm.Find(*target_name);
-    if (t == nullptr) {
-      cerr << "undeclared type" << endl;
-      ErrorAt(ctx.src, *target_name);
+void SetTypeField(ASTContext& ctx, Node* node, Type* struct_t) {
+  auto& name = *node->rhs->token;
+  if (InGenericFunc(ctx)) {
+    for (auto ft = GetPrimaryType(struct_t)->next; ft; ft = ft->next) {
+      if (get<Token*>(ft->value)->raw == name.raw) {
+        node->type = ft->base;
+        return;
+      }
     }
-    *target = *t;
+  } else if (auto field = GetTypeLayout(ctx.src, struct_t).Find(name)) {
+    node->type = field->type;
+    node->value = static_cast<opela_type::Int>(field->offset);
+    return;
   }
+  ErrorOut() << "no such member" << endl;
+  ErrorAt(ctx.src, name);
 }
 
+} // namespace
+
 Type* MergeTypeBinOp(Type* l, Type* r) {
   l = GetUserBaseType(l);
   r = GetUserBaseType(r);
@@ -1342,8 +1523,13 @@ void SetType(ASTContext& ctx, Node* node) {
       auto r = GetUserBaseType(node->rhs->type);
       if (l->kind == Type::kPointer && IsIntegral(r)) {
         node->type = node->lhs->type;
-      } else {
+      } else if (IsIntegral(l) && (IsIntegral(r) || r->kind == Type::kPointer)) {
         node->type = MergeTypeBinOp(node->lhs->type, node->rhs->type);
+      } else if (InGenericFunc(ctx)) { // 型変数の演算は具体化してから確かめる
+        node->type = MergeTypeBinOp(node->lhs->type, node->rhs->type);
+      } else {
+        ErrorOut() << "not supported " << l << " + " << r << endl;
+        ErrorAt(ctx.src, *node->token);
       }
     }
     break;
@@ -1357,8 +1543,13 @@ void SetType(ASTContext& ctx, Node* node) {
         node->type = ctx.tm.Find("int");
       } else if (l->kind == Type::kPointer && IsIntegral(r)) {
         node->type = node->lhs->type;
-      } else {
+      } else if (IsIntegral(l) && (IsIntegral(r) || r->kind == Type::kPointer)) {
         node->type = MergeTypeBinOp(node->lhs->type, node->rhs->type);
+      } else if (InGenericFunc(ctx) || IsEqual(l, r)) {
+        node->type = MergeTypeBinOp(node->lhs->type, node->rhs->type);
+      } else {
+        ErrorOut() << "not supported " << l << " - " << r << endl;
+        ErrorAt(ctx.src, *node->token);
       }
     }
     break;
@@ -1383,8 +1574,18 @@ void SetType(ASTContext& ctx, Node* node) {
     break;
   case Node::kId:
     {
-      auto obj = get<Object*>(node->value);
-      SetType(ctx, obj->def);
+      auto obj = ResolveID(ctx, node, nullptr);
+      if (auto def = obj->def; def->kind == Node::kDefVar && !def->type) {
+        // 初期化式をたどって自分自身に戻ってきたら、型を決められない
+        if (!ctx.typing_defs.insert(def).second) {
+          ErrorOut() << "circular reference: " << node->token->raw << endl;
+          ErrorAt(ctx.src, *node->token);
+        }
+        SetType(ctx, def);
+        ctx.typing_defs.erase(def);
+      } else {
+        SetType(ctx, def);
+      }
       node->type = obj->type;
     }
     break;
@@ -1398,8 +1599,7 @@ void SetType(ASTContext& ctx, Node* node) {
     get<Object*>(node->lhs->value)->type = node->lhs->type = node->type;
     break;
   case Node::kDefFunc:
-    {
-      auto f = get<Object*>(node->value);
+    if (auto f = get<Object*>(node->value); f->type == nullptr) {
       f->type = NewTypeFunc(node->cond->type, ParamTypeFromDeclList(node->rhs));
     }
     break;
@@ -1433,6 +1633,9 @@ void SetType(ASTContext& ctx, Node* node) {
     SetType(ctx, node->lhs);
     break;
   case Node::kCall:
+    if (node->lhs->kind == Node::kId) {
+      ResolveID(ctx, node->lhs, node);
+    }
     SetType(ctx, node->lhs);
     for (auto arg = node->rhs; arg; arg = arg->next) {
       SetType(ctx, arg);
@@ -1447,21 +1650,21 @@ void SetType(ASTContext& ctx, Node* node) {
         node->type = t->base->base;
         param_t = t->base->next;
       } else {
-        cerr << "not implemented call for " << t << endl;
+        ErrorOut() << "not implemented call for " << t << endl;
         ErrorAt(ctx.src, *node->token);
       }
 
       auto arg = node->rhs;
       while (param_t && param_t->kind != Type::kVParam) {
         if (arg == nullptr) {
-          cerr << "too few arguments" << endl;
+          ErrorOut() << "too few arguments" << endl;
           ErrorAt(ctx.src, *node->token);
         }
         arg = arg->next;
         param_t = param_t->next;
       }
       if (arg && param_t == nullptr) {
-        cerr << "too many arguments" << endl;
+        ErrorOut() << "too many arguments" << endl;
         ErrorAt(ctx.src, *arg->token);
       }
     }
@@ -1525,7 +1728,7 @@ void SetType(ASTContext& ctx, Node* node) {
     SetType(ctx, node->lhs);
     if (auto t = GetUserBaseType(node->lhs->type);
         t->kind != Type::kArray && t->kind != Type::kPointer) {
-      cerr << "cannot deref non-pointer type: " << t << endl;
+      ErrorOut() << "cannot deref non-pointer type: " << t << endl;
       ErrorAt(ctx.src, *node->token);
     } else {
       node->type = t->base;
@@ -1536,7 +1739,7 @@ void SetType(ASTContext& ctx, Node* node) {
     SetType(ctx, node->rhs);
     if (auto t = GetUserBaseType(node->lhs->type);
         t->kind != Type::kArray && t->kind != Type::kPointer) {
-      cerr << "cannot deref non-pointer type: " << t << endl;
+      ErrorOut() << "cannot deref non-pointer type: " << t << endl;
       ErrorAt(ctx.src, *node->token);
     } else {
       node->type = t->base;
@@ -1577,34 +1780,24 @@ void SetType(ASTContext& ctx, Node* node) {
     SetType(ctx, node->lhs);
     if (auto t = GetUserBaseType(node->lhs->type);
         t->kind != Type::kGParam && t->kind != Type::kStruct) {
-      cerr << "lhs must be a struct: " << t << endl;
+      ErrorOut() << "lhs must be a struct: " << t << endl;
       ErrorAt(ctx.src, *node->token);
-    } else {
-      for (auto ft = t->next; ft; ft = ft->next) {
-        if (get<Token*>(ft->value)->raw == node->rhs->token->raw) {
-          node->type = ft->base;
-          break;
-        }
-      }
+    } else if (t->kind == Type::kStruct) {
+      SetTypeField(ctx, node, t);
     }
     break;
   case Node::kArrow:
     SetType(ctx, node->lhs);
     if (auto p = GetPrimaryType(node->lhs->type);
         p->kind != Type::kGParam && p->kind != Type::kPointer) {
-      cerr << "lhs must be a pointer to a struct: " << p << endl;
+      ErrorOut() << "lhs must be a pointer to a struct: " << p << endl;
       ErrorAt(ctx.src, *node->token);
     } else if (auto t = GetPrimaryType(p->base);
                t->kind != Type::kGParam && t->kind != Type::kStruct) {
-      cerr << "lhs must be a pointer to a struct: " << t << endl;
+      ErrorOut() << "lhs must be a pointer to a struct: " << t << endl;
       ErrorAt(ctx.src, *node->token);
-    } else {
-      for (auto ft = t->next; ft; ft = ft->next) {
-        if (get<Token*>(ft->value)->raw == node->rhs->token->raw) {
-          node->type = ft->base;
-          break;
-        }
-      }
+    } else if (t->kind == Type::kStruct) {
+      SetTypeField(ctx, node, GetUserBaseType(p->base));
     }
     break;
   case Node::kDefGFunc:
@@ -1622,42 +1815,180 @@ void SetType(ASTContext& ctx, Node* node) {
   }
 }
 
-void SetTypeProgram(ASTContext& ctx, Node* ast) {
-  if (ast == nullptr) {
+void SetTypeFunc(ASTContext& ctx, Node* def) {
+  TraceSpan span{"TypeCheckFunc", def->token->raw};
+  ctx.cur_func = get<Object*>(def->value);
+  SetType(ctx, def);
+  for (auto param = def->rhs; param; param = param->next) {
+    SetType(ctx, param);
+  }
+  if (def->lhs == nullptr) { // 本体はまだ構文解析していない
     return;
   }
+  for (auto stmt = def->lhs->next; stmt; stmt = stmt->next) {
+    SetType(ctx, stmt);
+  }
+}
 
-  switch (ast->kind) {
-  case Node::kDefVar:
-    SetType(ctx, ast);
-    SetTypeProgram(ctx, ast->next);
-    break;
-  case Node::kDefFunc:
-    ctx.cur_func = get<Object*>(ast->value);
-    for (auto param = ast->rhs; param; param = param->next) {
-      SetType(ctx, param);
+namespace {
+
+// 部分木 node のノード（next の先も含む）をすべて visit に渡す。深い木でも再帰しない
+template <class Visitor>
+void VisitNodes(Node* node, Visitor&& visit) {
+  vector<Node*> stack{node};
+  while (!stack.empty()) {
+    Node* n = stack.back();
+    stack.pop_back();
+    if (n == nullptr) {
+      continue;
     }
-    for (auto stmt = ast->lhs->next; stmt; stmt = stmt->next) {
-      SetType(ctx, stmt);
+    visit(n);
+    stack.push_back(n->next);
+    stack.push_back(n->cond);
+    stack.push_back(n->rhs);
+    stack.push_back(n->lhs);
+  }
+}
+
+} // namespace
+
+void SetTypeProgram(ASTContext& ctx, Node* ast) {
+  // 宣言の数だけ再帰しないよう、next の連鎖はループでたどる
+  for (; ast; ast = ast->next) {
+    switch (ast->kind) {
+    case Node::kDefVar:
+      SetType(ctx, ast);
+      break;
+    case Node::kDefFunc:
+      SetTypeFunc(ctx, ast);
+      break;
+    case Node::kExtern:
+      SetType(ctx, ast);
+      break;
+    case Node::kTypedef:
+      break;
+    case Node::kDefGFunc:
+      SetTypeProgram(ctx, ast->lhs);
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+vector<Object*> SetTypeReachable(ASTContext& ctx, Node* ast,
+                                 PruneStats& stats) {
+  vector<Node*> func_defs, gfunc_defs; // 宣言の順
+  bool has_main = false;
+  for (auto decl = ast; decl; decl = decl->next) {
+    if (decl->kind == Node::kDefFunc) {
+      func_defs.push_back(decl);
+      has_main |= get<Object*>(decl->value)->mangled_name == "main";
+    } else if (decl->kind == Node::kDefGFunc) {
+      gfunc_defs.push_back(decl);
     }
-    get<Object*>(ast->value)->type =
-      NewTypeFunc(ast->cond->type, ParamTypeFromDeclList(ast->rhs));
-    SetTypeProgram(ctx, ast->next);
-    break;
-  case Node::kExtern:
-    SetType(ctx, ast);
-    SetTypeProgram(ctx, ast->next);
-    break;
-  case Node::kTypedef:
-    SetTypeProgram(ctx, ast->next);
-    break;
-  case Node::kDefGFunc:
-    SetTypeProgram(ctx, ast->lhs);
-    SetTypeProgram(ctx, ast->next);
-    break;
-  default:
-    break;
   }
+
+  set<Object*> reached;
+  vector<Object*> worklist;
+  auto reach = [&](Object* func) {
+    if (reached.insert(func).second) {
+      worklist.push_back(func);
+    }
+  };
+  // 型付けした部分木から参照している関数をたどる
+  auto reach_refs = [&](Node* node) {
+    VisitNodes(node, [&](Node* n) {
+      if (n->kind != Node::kId) {
+        return;
+      }
+      if (auto p = get_if<Object*>(&n->value);
+          p && (*p)->kind == Object::kFunc && (*p)->linkage == Object::kGlobal) {
+        reach(*p);
+      }
+    });
+  };
+
+  for (auto decl = ast; decl; decl = decl->next) {
+    switch (decl->kind) {
+    case Node::kDefVar:
+      SetType(ctx, decl);
+      reach_refs(decl->rhs);
+      break;
+    case Node::kExtern:
+      SetType(ctx, decl);
+      break;
+    case Node::kDefFunc:
+      if (!has_main || get<Object*>(decl->value)->mangled_name == "main") {
+        reach(get<Object*>(decl->value));
+      }
+      break;
+    case Node::kDefGFunc:
+      if (!has_main) {
+        reach(get<Object*>(decl->lhs->value));
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  while (!worklist.empty()) {
+    auto func = worklist.back();
+    worklist.pop_back();
+    Node* def = func->def;
+    if (def->kind == Node::kDefGFunc) {
+      def = def->lhs;
+    }
+    SetTypeFunc(ctx, def);
+    reach_refs(def->lhs);
+  }
+
+  // 到達できない非ジェネリック関数も型付けしてエラーを報告する。
+  // ただし具体化の指定は捨てる表に登録し、具体化もコード生成もしない
+  TypedFuncMap unreached_typed_funcs;
+  ASTContext unreached_ctx{ctx.src, ctx.t, ctx.tm, ctx.sc, ctx.strings,
+                           ctx.unresolved_types, ctx.typing_defs, ctx.overloads,
+                           unreached_typed_funcs, nullptr, ctx.modules,
+                           ctx.parse_anime_dir, ctx.debug_names,
+                           ctx.deferred_bodies};
+  for (auto def : func_defs) {
+    if (!reached.contains(get<Object*>(def->value))) {
+      SetTypeFunc(unreached_ctx, def);
+    }
+  }
+
+  // 省いた関数の中で具体化を指定していた箇所を数える
+  size_t pruned_instances = 0;
+  auto count_instances = [&](Node* def) {
+    VisitNodes(def->lhs, [&](Node* n) {
+      pruned_instances += n->kind == Node::kCast && n->rhs &&
+                          n->rhs->kind == Node::kTList;
+    });
+  };
+
+  vector<Object*> funcs;
+  for (auto def : func_defs) {
+    if (auto func = get<Object*>(def->value); reached.contains(func)) {
+      funcs.push_back(func);
+    } else {
+      count_instances(def);
+    }
+  }
+  size_t pruned_gfuncs = 0;
+  for (auto def : gfunc_defs) {
+    if (!reached.contains(get<Object*>(def->lhs->value))) {
+      ++pruned_gfuncs;
+      count_instances(def->lhs);
+    }
+  }
+
+  stats.funcs += func_defs.size();
+  stats.pruned_funcs += func_defs.size() - funcs.size();
+  stats.gfuncs += gfunc_defs.size();
+  stats.pruned_gfuncs += pruned_gfuncs;
+  stats.pruned_instances += pruned_instances;
+  return funcs;
 }
 
 bool IsLiteral(Node* node) {
@@ -1700,6 +2031,9 @@ std::string MangleByDefNode(Node* func_def) {
   if (func_def->type) {
     return Mangle(func_def->token->raw, func_def->type);
   }
+  if (func_def->kind == Node::kExtern) {
+    return Mangle(func_def->token->raw, func_def->lhs->type);
+  }
   Type* param_type = ParamTypeFromDeclList(func_def->rhs);
   Type* func_type = NewTypeFunc(func_def->cond->type, param_type);
   return Mangle(func_def->token->raw, func_type);
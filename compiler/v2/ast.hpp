@@ -1,10 +1,19 @@
 #pragma once
 
-#include <list>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
 #include <ostream>
+#include <set>
+#include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
+#include "arena.hpp"
+#include "compact_variant.hpp"
 #include "generics.hpp"
 #include "object.hpp"
 #include "scope.hpp"
@@ -18,8 +27,25 @@ struct StringIndex {
 
 struct VariantDummyType {};
 
+struct Node;
+
+/* ノードを指す 32 ビットの参照
+ *
+ * ノードはすべてノード用プールの連続領域に置かれるので、その中の位置で指す
+ * （1 始まり。0 は nullptr を表す）。Node* と相互に暗黙変換でき、ポインタと同様に使える。
+ */
+class NodeRef {
+ public:
+  NodeRef(Node* node = nullptr);
+  operator Node*() const;
+  Node* operator->() const { return *this; }
+
+ private:
+  std::uint32_t i_;
+};
+
 struct Node {
-  enum Kind {
+  enum Kind : std::uint8_t {
     kInt,     // 整数リテラル
     kAdd,     // 2項演算子 +
     kSub,     // 2項演算子 -
@@ -62,7 +88,7 @@ struct Node {
     kArrow,   // 構造体ポインタアクセス演算子
     kDefGFunc,// ジェネリック関数の定義
     kTList,  // 型パラメタ <T1, T2, ...>
-  } kind;
+  };
 
   Token* token; // このノードを代表するトークン
 
@@ -75,11 +101,19 @@ struct Node {
    *   kParam: 仮引数の型は lhs が保持
    */
 
+  // 値の末尾の隙間に kind 以降のメンバを詰める（Node 全体で 48 バイト）
+  [[no_unique_address]]
+  CompactVariant<VariantDummyType, opela_type::Int, StringIndex, Object*,
+                 opela_type::Byte, TypedFunc*, TypedFuncMap*> value = {};
+
+  Kind kind;
+  std::int16_t ershov = 0;
+
   // 子ノード
-  Node* lhs = nullptr;
-  Node* rhs = nullptr;
-  Node* cond = nullptr; // 条件式
-  Node* next = nullptr;
+  NodeRef lhs = nullptr;
+  NodeRef rhs = nullptr;
+  NodeRef cond = nullptr; // 条件式
+  NodeRef next = nullptr;
 
   /* 2項演算以外での lhs と rhs、cond の用途
    *
@@ -134,11 +168,18 @@ struct Node {
    * kDefFunc, kExtern: 次の宣言
    * kParam: 次の仮引数
    */
-
-  std::variant<VariantDummyType, opela_type::Int, StringIndex, Object*,
-               opela_type::Byte, TypedFunc*, TypedFuncMap*> value = {};
-  int ershov = 0;
 };
+static_assert(sizeof(Node) == 48);
+static_assert(kNodeSliceAlign % sizeof(Node) == 0);
+
+inline Node* const node_base = reinterpret_cast<Node*>(NodeRegionBase());
+
+inline NodeRef::NodeRef(Node* node)
+  : i_(node ? static_cast<std::uint32_t>(node - node_base + 1) : 0) {}
+
+inline NodeRef::operator Node*() const {
+  return i_ ? node_base + (i_ - 1) : nullptr;
+}
 
 Node* NewNode(Node::Kind kind, Token* token);
 Node* NewNodeInt(Token* token, opela_type::Int value);
@@ -151,22 +192,80 @@ Node* NewNodeType(ASTContext& ctx, Token* token);
 Node* NewNodeStr(ASTContext& ctx, Token* str);
 Node* NewNodeChar(Token* ch);
 
+/* AST のダンプで使うノード・型・オブジェクトの名前（Node_0 など）
+ *
+ * 番号は出てきた順に 0 から振る。翻訳単位（コンパイル）ごとに 1 つ持つので、
+ * 同時に別の翻訳単位をコンパイルしても番号は互いに影響しない。
+ * -j ではコード生成のコメントを複数のスレッドから出力するので、排他して番号を振る。
+ */
+class DebugNames {
+ public:
+  std::string Name(Node* node);
+  std::string Name(Type* type);
+  std::string Name(Object* object);
+
+  // 番号を振った型・オブジェクトを返す（アドレスの順）
+  std::vector<Type*> NumberedTypes();
+  std::vector<Object*> NumberedObjects();
+
+  // 振った番号を忘れる（-stream で解放したノードを指さないようにする）
+  void Clear();
+
+ private:
+  template <class T>
+  std::size_t Number(std::map<T, std::size_t>& number, T value);
+  template <class T>
+  std::vector<T> Numbered(const std::map<T, std::size_t>& number);
+
+  std::mutex mutex_;
+  std::map<Node*, std::size_t> node_number_;
+  std::map<Type*, std::size_t> type_number_;
+  std::map<Object*, std::size_t> object_number_;
+};
+
+// 基本名（Object::id）が同じグローバルオブジェクトの集合
+struct OverloadSet {
+  std::vector<Object*> objs; // 登録順
+  std::vector<int> arity;    // objs[i]->def->rhs の要素数
+};
+
+// 基本名からオーバーロード集合を引く索引
+using OverloadIndex = SymbolMap<OverloadSet>;
+
+class ModuleLoader;
+
+// -stream で構文解析を後回しにした関数本体
+struct DeferredBody {
+  Node* def;         // 本体（lhs）がまだ無い kDefFunc ノード
+  const char* begin; // 本体の '{' の位置
+};
+
 struct ASTContext {
   Source& src;
   Tokenizer& t;
   TypeManager& tm;
   Scope<Object>& sc;
   std::vector<opela_type::String>& strings;
-  std::list<Type*>& unresolved_types;
-  std::map<Node*, Node*>& undeclared_ids; // key=kId  value=context
+  // 宣言より前に使われた型名と、その仮の型（kUnresolved）
+  std::map<std::string_view, Type*>& unresolved_types;
+  std::set<Node*>& typing_defs; // 型付け中の変数定義（循環参照の検出用）
+  OverloadIndex& overloads;
   TypedFuncMap& typed_funcs;
   Object* cur_func;
+  ModuleLoader* modules; // import を読み込む（nullptr なら import できない）
+  std::string_view parse_anime_dir; // -gen-parse-anime の出力先（空なら出力しない）
+  DebugNames& debug_names; // AST のダンプと -gen-parse-anime で使う名前
+  // nullptr でなければ非ジェネリック関数の本体を読み飛ばし、ここへ積む（-stream）
+  std::vector<DeferredBody>* deferred_bodies;
 };
 
 Node* Program(ASTContext& ctx);
+// 読み飛ばした関数本体を構文解析し、body.def->lhs に付ける
+void ParseDeferredBody(ASTContext& ctx, const DeferredBody& body);
 Node* DeclarationSequence(ASTContext& ctx);
 Node* FunctionDefinition(ASTContext& ctx);
 Node* ExternDeclaration(ASTContext& ctx);
+Node* ImportDeclaration(ASTContext& ctx);
 Node* TypeDeclaration(ASTContext& ctx);
 Node* VariableDefinition(ASTContext& ctx);
 Node* Statement(ASTContext& ctx);
@@ -190,10 +289,10 @@ Node* ParameterDeclList(ASTContext& ctx);
 Node* TypeList(ASTContext& ctx);
 Node* GParamList(ASTContext& ctx);
 
-void PrintAST(std::ostream& os, Node* ast);
-void PrintASTRec(std::ostream& os, Node* ast);
+void PrintAST(std::ostream& os, DebugNames& names, Node* ast);
+void PrintASTRec(std::ostream& os, DebugNames& names, Node* ast);
 
-void PrintGeneratedNodes(std::ostream& os);
+void PrintGeneratedNodes(std::ostream& os, DebugNames& names);
 
 // 線形リスト（next によるリスト）の要素数を返す。
 // nullptr -> 0
@@ -203,13 +302,38 @@ int CountListItems(Node* head);
 
 opela_type::String DecodeEscapeSequence(Source& src, Token& token);
 
-void ResolveIDs(ASTContext& ctx);
-void ResolveType(ASTContext& ctx);
 Type* MergeTypeBinOp(Type* l, Type* r);
+
+/* 式や宣言に型を付ける
+ *
+ * 識別子は初めて型が必要になった時点でグローバルオブジェクトに解決し、
+ * 参照先の定義にも必要に応じて型を付ける（結果は Node::type に残して再利用する）。
+ */
 void SetType(ASTContext& ctx, Node* node);
+// 宣言の列 ast に型を付ける。本体の無い（-stream で後回しにした）関数はシグネチャだけ型付けする
 void SetTypeProgram(ASTContext& ctx, Node* ast);
+// 関数定義 def（kDefFunc）のシグネチャと本体に型を付ける
+void SetTypeFunc(ASTContext& ctx, Node* def);
+
+// 到達可能性解析で省いた関数の数（翻訳単位をまたいで数える）
+struct PruneStats {
+  std::atomic<std::size_t> funcs = 0, pruned_funcs = 0;   // 非ジェネリック関数
+  std::atomic<std::size_t> gfuncs = 0, pruned_gfuncs = 0; // ジェネリック関数
+  std::atomic<std::size_t> pruned_instances = 0; // 省いた関数の中の具体化の指定（F@<T>）
+};
+
+/* 根から到達できる関数を求め、コードを生成すべき非ジェネリック関数を宣言の順に返す
+ *
+ * 根は main とグローバル変数の初期化式。main の無い翻訳単位（-c でコンパイルするモジュールなど）は
+ * すべての関数を公開するので、すべての関数を根とする。
+ * 型付けした本体から呼び出し・アドレスの参照をたどり、見つかった関数を順に型付けする。
+ * アドレスを取られた関数も参照として見つかるので、関数ポインタ経由の呼び出しも漏れない。
+ * ジェネリック関数は到達したときに本体を型付けし、そこで具体化の指定を typed_funcs へ登録する。
+ * 到達できない非ジェネリック関数も最後に型付けしてエラーを報告するが、
+ * 具体化の指定は typed_funcs へ登録しないので、到達できない関数からの具体化は作られない。
+ */
+std::vector<Object*> SetTypeReachable(ASTContext& ctx, Node* ast,
+                                      PruneStats& stats);
 bool IsLiteral(Node* node);
 Type* ParamTypeFromDeclList(Node* plist);
 std::string MangleByDefNode(Node* func_def);
-
-inline std::string parse_anime_dir;
@@ -0,0 +1,92 @@
+#!/bin/bash
+# コンパイラ全体のベンチマーク
+#
+# 使い方: compilebench.sh [opelagen の引数...]
+# bench/opelagen で大きさの異なるプログラムを生成し、-ftime-report で段階ごとの時間を測る。
+# 大きさを 10 倍にしたときの時間の伸びを指数 k（時間 ∝ 行数^k）で表示し、
+# k が SLOPE_LIMIT を超えた段階に '!' を付ける（線形でない処理の検出用）。
+#
+# 環境変数:
+#   OPELAC       測る opelac（既定: bench/opelac。最適化ビルド）
+#   SIZES        生成する行数の一覧（既定: "1000 10000 100000 1000000"）
+#   REPEAT       各大きさで測る回数。合計時間が最短の回を採る（既定: 3）
+#   SLOPE_LIMIT  非線形とみなす指数（既定: 1.25）
+
+cd "$(dirname "$0")/.."
+
+opelac=${OPELAC:-./bench/opelac}
+opelagen=./bench/opelagen
+sizes=${SIZES:-"1000 10000 100000 1000000"}
+repeat=${REPEAT:-3}
+slope_limit=${SLOPE_LIMIT:-1.25}
+phases="parse sema codegen generics globals emit total"
+
+# 関数呼び出しの深い入力でもスタックが尽きないようにする（変えられなければそのまま測る）
+ulimit -s unlimited 2>/dev/null
+
+tmp_dir=$(mktemp -d)
+trap 'rm -rf $tmp_dir' EXIT
+
+# 行数と段階ごとの時間（ms）を 1 行ずつ results に溜める
+results=$tmp_dir/results
+for size in $sizes
+do
+  src=$tmp_dir/bench_$size.opl
+  $opelagen -lines $size "$@" > $src || exit 1
+  lines=$(wc -l < $src)
+
+  best=""
+  for ((i = 0; i < repeat; i++))
+  do
+    report=$tmp_dir/report
+    if ! $opelac -emit-obj -o /dev/null -ftime-report < $src 2> $report
+    then
+      echo "failed to compile $size lines:"
+      head -5 $report
+      exit 1
+    fi
+    row=$(awk -v phases="$phases" '
+      { wall[$1] = $2; rss = $NF }
+      END {
+        n = split(phases, p, " ")
+        for (i = 1; i <= n; i++) printf "%s ", (p[i] in wall ? wall[p[i]] : 0)
+        printf "%s\n", rss
+      }' $report)
+    total=$(echo $row | awk '{ print $7 }')
+    if [ -z "$best" ] || awk -v a=$total -v b=$best_total 'BEGIN { exit !(a < b) }'
+    then
+      best=$row
+      best_total=$total
+    fi
+  done
+  echo "$lines $best" >> $results
+done
+
+# 表の出力: 段階ごとの時間と 1000 行あたりの時間、前の大きさからの指数
+awk -v phases="$phases" -v limit=$slope_limit '
+  BEGIN {
+    n = split(phases, p, " ")
+    printf "%10s", "lines"
+    for (i = 1; i <= n; i++) printf "%13s", p[i] "(ms)"
+    printf "%12s%14s\n", "ms/KLOC", "peak RSS(MiB)"
+  }
+  {
+    printf "%10d", $1
+    for (i = 1; i <= n; i++) printf "%13.1f", $(i + 1)
+    printf "%12.2f%14.1f\n", $(n + 1) / ($1 / 1000), $(n + 2) / 1024
+
+    if (NR > 1) {
+      printf "%10s", "k="
+      for (i = 1; i <= n; i++) {
+        k = "-"
+        if (prev[i] > 0.5 && $(i + 1) > 0) {
+          k = sprintf("%.2f", log($(i + 1) / prev[i]) / log($1 / prev_lines))
+          if (k + 0 > limit) k = k "!"
+        }
+        printf "%13s", k
+      }
+      printf "\n"
+    }
+    for (i = 1; i <= n; i++) prev[i] = $(i + 1)
+    prev_lines = $1
+  }' $results
@@ -0,0 +1,79 @@
+// 字句解析器のマイクロベンチマーク
+//
+// 使い方: lexbench [-size MiB] [-repeat N] file...
+// 与えられたファイルを連結し、指定サイズに達するまで繰り返した入力を
+// TokenStream::LexAll() で字句解析して、最良のスループット（MB/s）を表示する。
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../source.hpp"
+#include "../token.hpp"
+
+using namespace std;
+
+int main(int argc, char** argv) {
+  size_t size_mib = 16;
+  int repeat = 5;
+  vector<string> files;
+
+  for (int i = 1; i < argc; ++i) {
+    if (string_view arg{argv[i]}; arg == "-size" && i + 1 < argc) {
+      size_mib = strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-repeat" && i + 1 < argc) {
+      repeat = atoi(argv[++i]);
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+  if (files.empty()) {
+    cerr << "usage: " << argv[0] << " [-size MiB] [-repeat N] file..." << endl;
+    return 1;
+  }
+
+  string sample;
+  for (auto& file : files) {
+    ifstream ifs{file};
+    if (!ifs) {
+      cerr << "failed to open " << file << endl;
+      return 1;
+    }
+    sample.append(istreambuf_iterator<char>{ifs}, {});
+    sample += '\n';
+  }
+
+  string input;
+  while (input.size() < size_mib << 20) {
+    input += sample;
+  }
+  istringstream iss{input};
+  Source src;
+  src.ReadAll(iss);
+
+  double best_sec = 0;
+  size_t num_tokens = 0;
+  for (int i = 0; i < repeat; ++i) {
+    TokenStream stream{src};
+    auto start = chrono::steady_clock::now();
+    stream.LexAll();
+    chrono::duration<double> sec = chrono::steady_clock::now() - start;
+    if (i == 0 || sec.count() < best_sec) {
+      best_sec = sec.count();
+    }
+
+    num_tokens = 0;
+    while (stream.At(num_tokens)->kind != Token::kEOF) {
+      ++num_tokens;
+    }
+  }
+
+  cout << input.size() << " bytes, " << num_tokens << " tokens: "
+       << input.size() / best_sec / 1e6 << " MB/s, "
+       << num_tokens / best_sec / 1e6 << " Mtokens/s" << endl;
+}
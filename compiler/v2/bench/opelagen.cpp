@@ -0,0 +1,238 @@
+// ベンチマーク用の OpeLa プログラム生成器
+//
+// 使い方: opelagen [-seed N] [-lines N] [-funcs N] [-stmts N] [-depth N]
+//                  [-structs N] [-generics N] [-globals N] [-fwd PERCENT]
+// 乱数の種を固定すれば同じプログラムを生成する。-lines を指定すると、
+// おおよその行数がその値になるよう関数の数を決める（-funcs より優先）。
+//
+// 生成するプログラムはコンパイルでき、実行すると必ず終了する。
+// 関数は残り呼び出し回数 n を受け取り、n > 0 のときだけ他の関数を呼ぶ。main は 0 を返す。
+// -fwd で指定した割合の関数呼び出し・構造体・グローバル変数は、使う位置より後ろで宣言する。
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct Config {
+  unsigned seed = 1;
+  long lines = 0;
+  int funcs = 100;
+  int stmts = 12;    // 関数 1 つあたりの文の数
+  int depth = 3;     // 式の木の深さの上限
+  int structs = 8;
+  int generics = 4;  // ジェネリック関数の数（それぞれ複数の型で具体化する）
+  int globals = 16;
+  int fwd = 30;      // 前方参照の割合（%）
+};
+
+const char* const kGenericTypeArgs[] = {"int", "int32", "int16", "int64"};
+
+class Generator {
+ public:
+  Generator(const Config& conf) : conf_{conf}, seed_{conf.seed} {}
+
+  void Generate(ostream& os) {
+    // 前方参照になる構造体とグローバル変数はファイルの末尾で宣言する
+    ostringstream tail;
+    for (int i = 0; i < conf_.structs; ++i) {
+      // 関数の引数の型（S0）は、マングリングのために先に宣言しておく必要がある
+      (i > 0 && Percent(conf_.fwd) ? tail : os) << StructDecl(i);
+    }
+    for (int i = 0; i < conf_.globals; ++i) {
+      (Percent(conf_.fwd) ? tail : os)
+        << "var g" << i << " int = " << Rand(100) << ";\n";
+    }
+    for (int i = 0; i < conf_.generics; ++i) {
+      os << "func G" << i << "<T>(a, b T) T { return a * " << i + 2
+         << " + b; }\n";
+    }
+    for (int i = 0; i < conf_.funcs; ++i) {
+      Function(os, i);
+    }
+    os << "func main() int {\n"
+       << "  var s S0;\n"
+       << "  s.a = 1;\n"
+       << "  f0(3, 1, 2, &s);\n"
+       << "  return 0;\n"
+       << "}\n";
+    os << tail.str();
+  }
+
+ private:
+  unsigned Rand(unsigned n) {
+    seed_ = seed_ * 1103515245 + 12345;
+    return (seed_ >> 16) % n;
+  }
+
+  bool Percent(int p) {
+    return static_cast<int>(Rand(100)) < p;
+  }
+
+  string StructDecl(int i) {
+    ostringstream oss;
+    oss << "type S" << i << " struct { a int; b int; c int; };\n";
+    return oss.str();
+  }
+
+  // 呼び出し先の関数番号。fwd % は自分より後ろ、残りは自分より前（先頭なら後ろ）
+  int Callee(int self) {
+    if (conf_.funcs <= 1) {
+      return self;
+    }
+    if (self == 0 || (self + 1 < conf_.funcs && Percent(conf_.fwd))) {
+      return self + 1 + Rand(conf_.funcs - self - 1);
+    }
+    return Rand(self);
+  }
+
+  string Leaf() {
+    switch (Rand(6)) {
+    case 0: return to_string(Rand(1000));
+    case 1: return "a";
+    case 2: return "b";
+    case 3: return conf_.globals > 0 ? "g" + to_string(Rand(conf_.globals))
+                                     : "a";
+    case 4: return "p->" + string(1, "abc"[Rand(3)]);
+    default:
+      return num_locals_ > 0 ? "v" + to_string(Rand(num_locals_)) : "b";
+    }
+  }
+
+  string Expr(int depth) {
+    if (depth <= 0 || Rand(4) == 0) {
+      return Leaf();
+    }
+    if (conf_.generics > 0 && Rand(8) == 0) {
+      const char* t = kGenericTypeArgs[Rand(size(kGenericTypeArgs))];
+      return "G" + to_string(Rand(conf_.generics)) + "@<" + t + ">(" +
+        "(" + Expr(depth - 1) + ")@" + t + ", " + Leaf() + "@" + t + ")";
+    }
+    const char* const ops[] = {" + ", " - ", " * "};
+    return "(" + Expr(depth - 1) + ops[Rand(size(ops))] +
+      Expr(depth - 1) + ")";
+  }
+
+  string Cond() {
+    const char* const ops[] = {" < ", " > ", " <= ", " == ", " != "};
+    return Expr(conf_.depth / 2) + ops[Rand(size(ops))] +
+      Expr(conf_.depth / 2);
+  }
+
+  string Local() {
+    return "v" + to_string(Rand(num_locals_));
+  }
+
+  void Statement(ostream& os, int self) {
+    const unsigned kind = num_locals_ == 0 ? 0 : Rand(8);
+    os << "  ";
+    switch (kind) {
+    case 0:
+      os << 'v' << num_locals_ << " := " << Expr(conf_.depth) << ";\n";
+      ++num_locals_;
+      break;
+    case 1:
+      os << Local() << " = " << Expr(conf_.depth) << ";\n";
+      break;
+    case 2:
+      os << "if " << Cond() << " { " << Local() << " = " << Expr(conf_.depth)
+         << "; } else { " << Local() << " = " << Expr(conf_.depth) << "; }\n";
+      break;
+    case 3:
+      {
+        const string i = "i" + to_string(num_loops_);
+        os << "for " << i << " := 0; " << i << " < 3; " << i << " = " << i
+           << " + 1 { " << Local() << " = " << Local() << " + " << i << "; }\n";
+      }
+      ++num_loops_;
+      break;
+    case 4:
+      os << "p->" << "abc"[Rand(3)] << " = " << Expr(conf_.depth) << ";\n";
+      break;
+    case 5:
+      {
+        auto v = Local();
+        os << "var t" << num_structs_ << " S" << Rand(conf_.structs) << "; t"
+           << num_structs_ << ".b = " << Expr(conf_.depth) << "; " << v
+           << " = " << v << " + t" << num_structs_ << ".b;\n";
+        ++num_structs_;
+      }
+      break;
+    default:
+      {
+        auto v = Local();
+        os << "if n > 0 { " << v << " = " << v << " + f" << Callee(self)
+           << "(n - 1, " << Expr(conf_.depth / 2) << ", " << Leaf()
+           << ", p); }\n";
+      }
+      break;
+    }
+  }
+
+  void Function(ostream& os, int self) {
+    num_locals_ = num_loops_ = num_structs_ = 0;
+    os << "func f" << self << "(n, a, b int, p *S0) int {\n";
+    for (int i = 0; i < conf_.stmts; ++i) {
+      Statement(os, self);
+    }
+    os << "  return " << (num_locals_ > 0 ? Local() : "a") << " + b;\n"
+       << "}\n";
+  }
+
+  const Config& conf_;
+  unsigned seed_;
+  int num_locals_ = 0, num_loops_ = 0, num_structs_ = 0;
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+  Config conf;
+  for (int i = 1; i < argc; ++i) {
+    string_view arg{argv[i]};
+    if (i + 1 >= argc) {
+      cerr << "unknown or incomplete argument: " << arg << endl;
+      return 1;
+    }
+    const long v = atol(argv[++i]);
+    if (arg == "-seed") {
+      conf.seed = v;
+    } else if (arg == "-lines") {
+      conf.lines = v;
+    } else if (arg == "-funcs") {
+      conf.funcs = v;
+    } else if (arg == "-stmts") {
+      conf.stmts = v;
+    } else if (arg == "-depth") {
+      conf.depth = v;
+    } else if (arg == "-structs") {
+      conf.structs = v;
+    } else if (arg == "-generics") {
+      conf.generics = v;
+    } else if (arg == "-globals") {
+      conf.globals = v;
+    } else if (arg == "-fwd") {
+      conf.fwd = v;
+    } else {
+      cerr << "unknown argument: " << arg << endl;
+      return 1;
+    }
+  }
+  if (conf.structs < 1) {
+    conf.structs = 1; // main と関数の引数で S0 を使う
+  }
+  if (conf.lines > 0) {
+    // 関数 1 つは stmts + 3 行。それ以外の宣言の行数を差し引く
+    const long other = conf.structs + conf.globals + conf.generics + 5;
+    conf.funcs = max(1L, (conf.lines - other) / (conf.stmts + 3));
+  }
+
+  Generator gen{conf};
+  gen.Generate(cout);
+}
@@ -0,0 +1,117 @@
+// 構文解析器のマイクロベンチマーク
+//
+// 使い方: parsebench [-funcs N] [-terms N] [-repeat N] [file...]
+// 式を多く含むソースを生成し（ファイルを与えた場合はその内容を使う）、
+// Program() で構文解析して、最良の時間とスループット（MB/s）を表示する。
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../arena.hpp"
+#include "../ast.hpp"
+#include "../source.hpp"
+#include "../token.hpp"
+
+using namespace std;
+
+namespace {
+
+// 2 項演算子を terms 個ほど含む式を 1 つの関数に 4 つずつ並べたソースを作る
+string GenerateSource(int funcs, int terms) {
+  const char* const ops[] = {
+    " + ", " - ", " * ", " / ", " < ", " <= ", " == ", " != ", " && ", " || ",
+  };
+  const char* const operands[] = {"a", "b", "c", "(a + 1)", "(b * c)", "3"};
+  unsigned seed = 1;
+  auto rand = [&seed]{ return (seed = seed * 1103515245 + 12345) >> 16; };
+
+  ostringstream oss;
+  for (int f = 0; f < funcs; ++f) {
+    oss << "func f" << f << "(a, b, c int) int {\n";
+    for (int s = 0; s < 4; ++s) {
+      oss << "  " << (s == 3 ? "return " : "a = ");
+      for (int t = 0; t < terms; ++t) {
+        if (t > 0) {
+          oss << ops[rand() % size(ops)];
+        }
+        oss << operands[rand() % size(operands)];
+      }
+      oss << ";\n";
+    }
+    oss << "}\n";
+  }
+  return oss.str();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  int funcs = 2000, terms = 16, repeat = 5;
+  vector<string> files;
+
+  for (int i = 1; i < argc; ++i) {
+    if (string_view arg{argv[i]}; arg == "-funcs" && i + 1 < argc) {
+      funcs = atoi(argv[++i]);
+    } else if (arg == "-terms" && i + 1 < argc) {
+      terms = atoi(argv[++i]);
+    } else if (arg == "-repeat" && i + 1 < argc) {
+      repeat = atoi(argv[++i]);
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+
+  string input;
+  for (auto& file : files) {
+    ifstream ifs{file};
+    if (!ifs) {
+      cerr << "failed to open " << file << endl;
+      return 1;
+    }
+    input.append(istreambuf_iterator<char>{ifs}, {});
+    input += '\n';
+  }
+  if (files.empty()) {
+    input = GenerateSource(funcs, terms);
+  }
+  istringstream iss{input};
+  Source src;
+  src.ReadAll(iss);
+
+  double best_sec = 0;
+  size_t num_nodes = 0;
+  for (int i = 0; i < repeat; ++i) {
+    const size_t nodes_before = GetPool(Pool::kNode).NumObjects();
+    Tokenizer tokenizer{src};
+    TypeManager type_manager{src};
+    Scope<Object> scope;
+    vector<opela_type::String> strings;
+    map<string_view, Type*> unresolved_types;
+    set<Node*> typing_defs;
+    OverloadIndex overloads;
+    TypedFuncMap typed_funcs;
+    DebugNames debug_names;
+    ASTContext ctx{src, tokenizer, type_manager, scope, strings,
+                   unresolved_types, typing_defs, overloads,
+                   typed_funcs, nullptr, nullptr, {}, debug_names, nullptr};
+
+    auto start = chrono::steady_clock::now();
+    Program(ctx);
+    chrono::duration<double> sec = chrono::steady_clock::now() - start;
+    if (i == 0 || sec.count() < best_sec) {
+      best_sec = sec.count();
+    }
+    num_nodes = GetPool(Pool::kNode).NumObjects() - nodes_before;
+  }
+
+  cout << input.size() << " bytes, " << num_nodes << " nodes: "
+       << best_sec * 1e3 << " ms, "
+       << input.size() / best_sec / 1e6 << " MB/s, "
+       << num_nodes / best_sec / 1e6 << " Mnodes/s" << endl;
+}
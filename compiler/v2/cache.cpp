@@ -0,0 +1,287 @@
+#include "cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <set>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "ast.hpp"
+#include "generics.hpp"
+#include "object.hpp"
+#include "typespec.hpp"
+
+using namespace std;
+
+namespace {
+
+// コード生成やキーの求め方を変えたら増やす（古いキャッシュを使わないように）
+constexpr uint64_t kCacheVersion = 1;
+constexpr char kPackMagic[] = "OPLC";
+
+string LabelPrefix(size_t func_index) {
+  return "LABEL" + to_string(func_index) + '_';
+}
+
+// FNV-1a を 8 バイト単位にしたもの
+class Mixer {
+ public:
+  uint64_t Value() const { return h_; }
+
+  void Add(uint64_t v) {
+    h_ = (h_ ^ v) * 0x100000001b3;
+    h_ ^= h_ >> 32; // 上位ビットの違いも下位ビットへ伝える
+  }
+
+  void Add(string_view s) {
+    Add(s.size());
+    for (; s.size() >= 8; s.remove_prefix(8)) {
+      uint64_t v;
+      memcpy(&v, s.data(), 8);
+      Add(v);
+    }
+    uint64_t v = 0;
+    memcpy(&v, s.data(), s.size());
+    Add(v);
+  }
+
+ private:
+  uint64_t h_ = 0xcbf29ce484222325;
+};
+
+// 関数定義の部分木と、そこから辿れる型・オブジェクトを混ぜ合わせる
+class FuncHasher {
+ public:
+  // 関数ごとに作り直すと表の確保が目立つので、スレッドごとに使い回す
+  void Reset(uint64_t salt) {
+    h_ = {};
+    h_.Add(salt);
+    type_hashes_.clear();
+    local_index_.clear();
+  }
+
+  uint64_t Value() const { return h_.Value(); }
+
+  void Add(uint64_t v) { h_.Add(v); }
+  void Add(string_view s) { h_.Add(s); }
+
+  void AddNode(Node* node) {
+    for (; node; node = node->next) {
+      Add(node->kind);
+      Add(node->token ? node->token->raw : string_view{});
+      Add(TypeHash(node->type));
+      AddValue(node);
+      AddNode(node->lhs);
+      AddNode(node->rhs);
+      AddNode(node->cond);
+    }
+  }
+
+  // 関数定義（kDefFunc）自身。next は次の宣言なので辿らない
+  void AddFuncDef(Node* def) {
+    auto func = get<Object*>(def->value);
+    Add(func->mangled_name);
+    Add(TypeHash(func->type));
+    // ローカル変数の位置（スタック上の順番）は locals の順で決まる
+    Add(func->locals.size());
+    for (size_t i = 0; i < func->locals.size(); ++i) {
+      local_index_[func->locals[i]] = i;
+      Add(TypeHash(func->locals[i]->type));
+    }
+    Add(def->token->raw);
+    AddNode(def->lhs);
+    AddNode(def->rhs);
+    AddNode(def->cond);
+  }
+
+ private:
+  void AddValue(Node* node) {
+    Add(node->value.index());
+    if (auto v = get_if<opela_type::Int>(&node->value)) {
+      Add(*v);
+    } else if (auto v = get_if<opela_type::Byte>(&node->value)) {
+      Add(*v);
+    } else if (auto v = get_if<StringIndex>(&node->value)) {
+      Add(v->i); // ラベル名（STR<番号>）しか参照しない
+    } else if (auto v = get_if<Object*>(&node->value)) {
+      AddObject(*v);
+    } else if (auto v = get_if<TypedFunc*>(&node->value)) {
+      Add(Mangle(**v));
+    }
+  }
+
+  void AddObject(Object* obj) {
+    Add(obj->kind);
+    Add(obj->linkage);
+    if (obj->linkage == Object::kLocal) {
+      auto it = local_index_.find(obj);
+      Add(it == local_index_.end() ? ~uint64_t(0) : it->second);
+      return;
+    }
+    Add(obj->id->raw);
+    Add(obj->mangled_name);
+    Add(TypeHash(obj->type));
+    if (obj->def && obj->def->kind == Node::kExtern && obj->def->cond) {
+      Add(obj->def->cond->token->raw); // extern "C"
+    }
+  }
+
+  // 型の内容（base と next の先まで）のハッシュ。同じ型は関数の中で 1 度だけ求める
+  uint64_t TypeHash(Type* t) {
+    if (t == nullptr) {
+      return 0xff;
+    }
+    // 計算中の型は 0 とみなして、再帰的な型の循環を断つ
+    if (auto [it, inserted] = type_hashes_.try_emplace(t, 0); !inserted) {
+      return it->second;
+    }
+    Mixer m;
+    m.Add(t->kind);
+    if (auto bits = get_if<long>(&t->value)) {
+      m.Add(*bits);
+    } else if (auto name = get<Token*>(t->value)) {
+      m.Add(name->raw);
+    }
+    m.Add(TypeHash(t->base));
+    m.Add(TypeHash(t->next));
+    return type_hashes_[t] = m.Value();
+  }
+
+  Mixer h_;
+  unordered_map<Type*, uint64_t> type_hashes_;
+  unordered_map<Object*, size_t> local_index_;
+};
+
+} // namespace
+
+CodeCache::CodeCache(filesystem::path dir, string_view unit_name,
+                     CodeCacheStats& stats)
+    : stats_{stats} {
+  Mixer name_hash;
+  name_hash.Add(kCacheVersion);
+  name_hash.Add(unit_name);
+  char file_name[32];
+  snprintf(file_name, sizeof(file_name), "%016llx.pack",
+           static_cast<unsigned long long>(name_hash.Value()));
+  path_ = dir / file_name;
+
+  ifstream in{path_, ios::binary | ios::ate};
+  if (!in) {
+    return;
+  }
+  pack_.resize(in.tellg());
+  in.seekg(0);
+  if (!in.read(pack_.data(), pack_.size())) {
+    pack_.clear();
+    return;
+  }
+
+  // ヘッダ：マジック "OPLC"、版数
+  // 各エントリ：キー、関数番号、コードの長さ（すべて 8 バイト）、コード
+  auto read_u64 = [this](size_t& pos, uint64_t& v) {
+    if (pack_.size() - pos < 8) {
+      return false;
+    }
+    memcpy(&v, pack_.data() + pos, 8);
+    pos += 8;
+    return true;
+  };
+  size_t pos = 4;
+  uint64_t version;
+  if (pack_.size() < 4 || pack_.compare(0, 4, kPackMagic) != 0 ||
+      !read_u64(pos, version) || version != kCacheVersion) {
+    pack_.clear();
+    return;
+  }
+  uint64_t key, func_index, size;
+  while (read_u64(pos, key) && read_u64(pos, func_index) &&
+         read_u64(pos, size) && pack_.size() - pos >= size) {
+    entries_[key] = {key, func_index, string_view{pack_}.substr(pos, size)};
+    pos += size;
+  }
+}
+
+bool CodeCache::Load(uint64_t key, size_t func_index, string& text) {
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    ++stats_.misses;
+    return false;
+  }
+  ++stats_.hits;
+  const auto& e = it->second;
+  {
+    lock_guard lock{mtx_};
+    used_.push_back(e);
+  }
+
+  if (e.func_index == func_index) {
+    text.assign(e.text);
+    return true;
+  }
+  const auto from = LabelPrefix(e.func_index), to = LabelPrefix(func_index);
+  text.clear();
+  size_t pos = 0;
+  for (size_t found; (found = e.text.find(from, pos)) != string::npos;
+       pos = found + from.size()) {
+    text.append(e.text, pos, found - pos).append(to);
+  }
+  text.append(e.text, pos);
+  return true;
+}
+
+void CodeCache::Store(uint64_t key, size_t func_index, string_view text) {
+  auto copy = make_unique<string>(text);
+  lock_guard lock{mtx_};
+  used_.push_back({key, func_index, *copy});
+  new_texts_.push_back(move(copy));
+}
+
+void CodeCache::Save() {
+  if (new_texts_.empty() && used_.size() == entries_.size()) {
+    return; // すべて読み込んだものを使った
+  }
+
+  // 別名で書いてから置き換えるので、並行して同じ翻訳単位を書いても壊れない
+  auto tmp_path = path_;
+  tmp_path += ".tmp" + to_string(getpid()) + "-" +
+              to_string(hash<thread::id>{}(this_thread::get_id()));
+  {
+    ofstream out{tmp_path, ios::binary};
+    auto write_u64 = [&out](uint64_t v) {
+      out.write(reinterpret_cast<const char*>(&v), 8);
+    };
+    out << kPackMagic;
+    write_u64(kCacheVersion);
+    set<uint64_t> written; // 同じ関数が複数回現れても 1 つだけ書く
+    for (auto& e : used_) {
+      if (written.insert(e.key).second) {
+        write_u64(e.key);
+        write_u64(e.func_index);
+        write_u64(e.text.size());
+        out << e.text;
+      }
+    }
+    if (!out) {
+      out.close();
+      error_code ec;
+      filesystem::remove(tmp_path, ec);
+      return; // 書けなくてもコンパイルは続けられる
+    }
+  }
+  error_code ec;
+  filesystem::rename(tmp_path, path_, ec);
+  if (ec) {
+    filesystem::remove(tmp_path, ec);
+  }
+}
+
+uint64_t HashFuncDef(Node* def, uint64_t salt) {
+  thread_local FuncHasher h;
+  h.Reset(salt);
+  h.Add(kCacheVersion);
+  h.AddFuncDef(def);
+  return h.Value();
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct Node;
+
+// -cache-dir の利用状況（翻訳単位をまたいで数える）
+struct CodeCacheStats {
+  std::atomic<std::size_t> hits = 0, misses = 0;
+};
+
+/* -cache-dir: 関数ごとのコード生成結果をディスクにキャッシュする
+ *
+ * キーは型付けを終えた関数定義（kDefFunc）の部分木と、そこから参照する型（構造体はフィールドまで）、
+ * 呼び出す関数・参照するグローバル変数の名前と型から求めたハッシュ（HashFuncDef）。
+ * 関数の本体や、依存する構造体のレイアウト、呼び出す関数のシグネチャが変わればキーも変わる。
+ * 値はその関数のアセンブリ言語コード。ラベル名は関数番号を含む（LABEL<関数番号>_<通し番号>）ので、
+ * 読み込むときに付け替える。
+ *
+ * 関数ごとにファイルを開くと生成するより遅くなるので、翻訳単位ごとに 1 つのファイル
+ * （<dir>/<翻訳単位の名前のハッシュ>.pack）にまとめ、最初に丸ごと読み込む。
+ * Save() は今回のコンパイルで使ったコードだけを書き出すので、使われなくなったコードは消える。
+ */
+class CodeCache {
+ public:
+  // dir から unit_name（入力ファイル名など）のキャッシュを読み込む
+  CodeCache(std::filesystem::path dir, std::string_view unit_name,
+            CodeCacheStats& stats);
+
+  // key のコードがあれば、ラベルの関数番号を func_index に付け替えて text に入れ、true を返す
+  bool Load(std::uint64_t key, std::size_t func_index, std::string& text);
+  // ラベルの関数番号が func_index であるコード text を key で登録する
+  void Store(std::uint64_t key, std::size_t func_index, std::string_view text);
+  // 今回使ったコードをキャッシュのファイルへ書き出す
+  void Save();
+
+ private:
+  struct Entry {
+    std::uint64_t key;
+    std::size_t func_index;
+    std::string_view text; // pack_ か new_texts_ の中を指す
+  };
+
+  std::filesystem::path path_;
+  CodeCacheStats& stats_;
+  std::string pack_; // 読み込んだファイルの中身
+  std::unordered_map<std::uint64_t, Entry> entries_;
+
+  std::mutex mtx_; // 以下は関数を並列に生成するスレッドから更新する
+  std::vector<Entry> used_;
+  std::vector<std::unique_ptr<std::string>> new_texts_;
+};
+
+// 型付け済みの関数定義 def のキャッシュのキーを求める。salt にはコード生成の設定を混ぜる
+std::uint64_t HashFuncDef(Node* def, std::uint64_t salt);
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <variant>
+
+/* 8 バイト以下の自明にコピー可能な型だけを持てる std::variant の代用品
+ *
+ * 値 8 バイトとタグ 1 バイトからなる。[[no_unique_address]] を付けたメンバにすると、
+ * 後続のメンバを末尾のパディングに詰められる（std::variant ではできない）。
+ * get, get_if, holds_alternative, visit は std::variant と同じように使える。
+ */
+template <class... Ts>
+class CompactVariant {
+  static_assert(((sizeof(Ts) <= 8 &&
+                  std::is_trivially_copyable_v<Ts>) && ...),
+                "CompactVariant supports only small trivially copyable types");
+
+ public:
+  template <class T>
+  static constexpr std::size_t kIndexOf = [] {
+    constexpr bool same[]{std::is_same_v<T, Ts>...};
+    for (std::size_t i = 0; i < sizeof...(Ts); ++i) {
+      if (same[i]) {
+        return i;
+      }
+    }
+    return sizeof...(Ts);
+  }();
+
+  template <class T>
+  static constexpr bool kHolds = kIndexOf<std::decay_t<T>> < sizeof...(Ts);
+
+  CompactVariant() : index_{0} {
+    using First = std::tuple_element_t<0, std::tuple<Ts...>>;
+    new (storage_) First{};
+  }
+
+  template <class T>
+    requires kHolds<T>
+  CompactVariant(T v) {
+    Set(v);
+  }
+
+  template <class T>
+    requires kHolds<T>
+  CompactVariant& operator=(T v) {
+    Set(v);
+    return *this;
+  }
+
+  std::size_t index() const { return index_; }
+
+  template <class T>
+  T* GetIf() {
+    return index_ == kIndexOf<T> ?
+      std::launder(reinterpret_cast<T*>(storage_)) : nullptr;
+  }
+
+  template <class T>
+  const T* GetIf() const {
+    return index_ == kIndexOf<T> ?
+      std::launder(reinterpret_cast<const T*>(storage_)) : nullptr;
+  }
+
+  template <class F>
+  decltype(auto) Visit(F&& f) const {
+    return VisitImpl<0, Ts...>(f);
+  }
+
+ private:
+  template <class T>
+  void Set(T v) {
+    using U = std::decay_t<T>;
+    new (storage_) U{v};
+    index_ = kIndexOf<U>;
+  }
+
+  template <std::size_t I, class T, class... Rest, class F>
+  decltype(auto) VisitImpl(F& f) const {
+    if constexpr (sizeof...(Rest) == 0) {
+      return f(*GetIf<T>());
+    } else {
+      if (index_ == I) {
+        return f(*GetIf<T>());
+      }
+      return VisitImpl<I + 1, Rest...>(f);
+    }
+  }
+
+  alignas(8) unsigned char storage_[8];
+  std::uint8_t index_;
+};
+
+template <class T, class... Ts>
+T* get_if(CompactVariant<Ts...>* v) {
+  return v ? v->template GetIf<T>() : nullptr;
+}
+
+template <class T, class... Ts>
+const T* get_if(const CompactVariant<Ts...>* v) {
+  return v ? v->template GetIf<T>() : nullptr;
+}
+
+template <class T, class... Ts>
+T& get(CompactVariant<Ts...>& v) {
+  if (auto p = v.template GetIf<T>()) {
+    return *p;
+  }
+  throw std::bad_variant_access{};
+}
+
+template <class T, class... Ts>
+const T& get(const CompactVariant<Ts...>& v) {
+  if (auto p = v.template GetIf<T>()) {
+    return *p;
+  }
+  throw std::bad_variant_access{};
+}
+
+template <class T, class... Ts>
+bool holds_alternative(const CompactVariant<Ts...>& v) {
+  return v.index() == CompactVariant<Ts...>::template kIndexOf<T>;
+}
+
+template <class F, class... Ts>
+decltype(auto) visit(F&& f, const CompactVariant<Ts...>& v) {
+  return v.Visit(f);
+}
@@ -0,0 +1,1250 @@
+#include "compile.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <bitset>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "arena.hpp"
+#include "asm.hpp"
+#include "ast.hpp"
+#include "cache.hpp"
+#include "generics.hpp"
+#include "jobs.hpp"
+#include "magic_enum.hpp"
+#include "mangle.hpp"
+#include "module.hpp"
+#include "object.hpp"
+#include "objasm.hpp"
+#include "source.hpp"
+#include "token.hpp"
+#include "trace.hpp"
+
+using namespace std;
+
+namespace {
+
+void ExtractBits(Asm& asmgen, Asm::Register v, int offset, int width) {
+  /* v:      0001'0010'0011'0100
+   * offset: 8    ^^^^
+   * width:  4
+   *
+   * result: 0000'0000'0000'0010
+   */
+  asmgen.ShiftL64(v, 64 - offset - width);
+  asmgen.ShiftR64(v, 64 - width);
+}
+
+Asm::Register UseAnyCalcReg(Asm::RegSet& free_calc_regs) {
+  auto reg_index = countr_zero(free_calc_regs.to_ulong());
+  if (reg_index >= Asm::kRegNum) {
+    return Asm::kRegNum;
+  }
+  free_calc_regs.reset(reg_index);
+  return static_cast<Asm::Register>(reg_index);
+}
+
+int SetErshovNumber(Source& src, Node* expr) {
+  if (expr->ershov > 0) {
+    return expr->ershov;
+  } else if (expr->kind == Node::kCall) {
+    for (auto arg = expr->rhs; arg; arg = arg->next) {
+      SetErshovNumber(src, arg);
+    }
+    return expr->ershov = 9;
+  } else if (expr->lhs == nullptr && expr->rhs == nullptr) {
+    return expr->ershov = 1;
+  } else if (expr->lhs != nullptr && expr->rhs != nullptr) {
+    int l = SetErshovNumber(src, expr->lhs);
+    int r = SetErshovNumber(src, expr->rhs);
+    return expr->ershov = l == r ? l + 1 : max(l, r);
+  } else if (expr->lhs != nullptr && expr->rhs == nullptr) {
+    return expr->ershov = SetErshovNumber(src, expr->lhs);
+  }
+  ErrorOut() << "unexpected node" << endl;
+  ErrorAt(src, *expr->token);
+}
+
+// 関数ごとのラベルの名前空間（ラベル名は LABEL<関数番号>_<通し番号>）
+// 関数を別々のスレッドで生成しても、ラベル名は生成する順序によらず決まる。
+struct LabelSpace {
+  size_t func_index;
+  size_t counter = 0;
+};
+
+struct GenContext {
+  Source& src;
+  const opela::CompileOptions& opts;
+  DebugNames& names; // コメントに出力する AST の名前
+  Asm& asmgen;
+  Object* func;
+  LabelSpace& label_space;
+};
+
+struct LabelSet {
+  string cont, brk;
+};
+
+string GenerateLabel(GenContext& ctx) {
+  ostringstream oss;
+  oss << "LABEL" << ctx.label_space.func_index << '_'
+      << ctx.label_space.counter++;
+  return oss.str();
+}
+
+string StringLabel(size_t index) {
+  ostringstream oss;
+  oss << "STR" << index;
+  return oss.str();
+}
+
+bool GenCast(GenContext& ctx, Asm::Register dest,
+             Type* from_type, Type* to_type, bool explicit_cast = false) {
+  auto f = GetUserBaseType(from_type);
+  auto t = GetUserBaseType(to_type);
+  if (IsEqual(f, t)) {
+    return false;
+  }
+
+  if (IsIntegral(f)) {
+    if (IsIntegral(t)) {
+      auto f_bits = get<long>(f->value);
+      auto t_bits = get<long>(t->value);
+      if (t_bits < f_bits) {
+        ctx.asmgen.ShiftL64(dest, 64 - t_bits);
+        ctx.asmgen.ShiftR64(dest, 64 - t_bits);
+      } else if (f_bits < t_bits) {
+        ctx.asmgen.ShiftL64(dest, 64 - f_bits);
+        if (f->kind == Type::kInt) { // sign extend
+          ctx.asmgen.ShiftAR64(dest, 64 - f_bits);
+        } else { // zero extend
+          ctx.asmgen.ShiftR64(dest, 64 - f_bits);
+        }
+      }
+    } else if (t->kind == Type::kBool) {
+      ctx.asmgen.Set1IfNonZero64(dest, dest);
+    } else if (explicit_cast && t->kind == Type::kPointer) {
+      // pass
+    } else {
+      return true;
+    }
+  } else if (f->kind == Type::kBool) {
+    if (!IsIntegral(t) && t->kind != Type::kBool) {
+      return true;
+    }
+  } else if (explicit_cast && f->kind == Type::kPointer) {
+    if (t->kind == Type::kPointer) {
+      // pass
+    } else if (IsIntegral(t)) {
+      if (auto bits = get<long>(t->value); bits < 64) {
+
+        ctx.asmgen.And64(dest, (1 << get<long>(t->value)) - 1);
+      }
+    } else {
+      return true;
+    }
+  } else {
+    return true;
+  }
+  return false;
+}
+
+Asm::DataType BytesToDataType(int bytes) {
+  if (bytes == 1) {
+    return Asm::kByte;
+  } else if (bytes == 2) {
+    return Asm::kWord;
+  } else if (bytes <= 4) {
+    return Asm::kDWord;
+  } else if (bytes <= 8) {
+    return Asm::kQWord;
+  }
+  return Asm::kNonStandardDataType;
+}
+
+Asm::DataType DataTypeOf(GenContext& ctx, Type* type) {
+  return BytesToDataType(SizeofType(ctx.src, type));
+}
+
+Asm::DataType DataTypeOf(GenContext& ctx, Node* node) {
+  auto dt = DataTypeOf(ctx, node->type);
+  if (dt == Asm::kNonStandardDataType) {
+    ErrorOut() << "non-standard data type: " << node->type << endl;
+    ErrorAt(ctx.src, *node->token);
+  }
+  return dt;
+}
+
+struct EvalBinOp {
+  Node* node;
+  Asm::Register dest_reg, calc_reg;
+  Asm::Register lhs_reg, rhs_reg;
+  bool lhs_in_dest;
+};
+
+void GenerateAsm(GenContext& ctx, Node* node,
+                 Asm::Register dest, Asm::RegSet free_calc_regs,
+                 const LabelSet& labels, bool lval = false);
+
+void GenerateAssign(GenContext& ctx, const EvalBinOp& e,
+                    Asm::RegSet free_calc_regs, bool lval) {
+  const auto lhs_t = GetUserBaseType(e.node->lhs->type);
+  const auto rhs_t = GetUserBaseType(e.node->rhs->type);
+  if (rhs_t->kind == Type::kInitList) {
+    if (lhs_t->kind == Type::kArray) {
+      const auto reg = UseAnyCalcReg(free_calc_regs);
+      const auto elem_size = SizeofType(ctx.src, lhs_t->base);
+      const auto elem_dt = BytesToDataType(elem_size);
+      int elem_offset = 0;
+      int sp_offset = 0;
+      auto init_elem = e.node->rhs->lhs;
+      for (int i = 0; i < get<long>(lhs_t->value); ++i) {
+        if (init_elem) {
+          ctx.asmgen.LoadN(reg, e.rhs_reg, sp_offset,
+                           DataTypeOf(ctx, init_elem));
+          ctx.asmgen.StoreN(e.lhs_reg, elem_offset, reg, elem_dt);
+          init_elem = init_elem->next;
+        } else {
+          ctx.asmgen.StoreN(e.lhs_reg, elem_offset, Asm::kRegZero, elem_dt);
+        }
+        sp_offset += 8;
+        elem_offset += elem_size;
+      }
+    } else if (lhs_t->kind == Type::kStruct) {
+      const auto reg = UseAnyCalcReg(free_calc_regs);
+      int sp_offset = 0;
+      auto init_elem = e.node->rhs->lhs;
+      for (auto& field : GetTypeLayout(ctx.src, lhs_t).fields) {
+        const auto field_dt = DataTypeOf(ctx, field.type);
+        if (init_elem) {
+          ctx.asmgen.LoadN(reg, e.rhs_reg, sp_offset,
+                           DataTypeOf(ctx, init_elem));
+          ctx.asmgen.StoreN(e.lhs_reg, field.offset, reg, field_dt);
+          init_elem = init_elem->next;
+        } else {
+          ctx.asmgen.StoreN(e.lhs_reg, field.offset, Asm::kRegZero, field_dt);
+        }
+        sp_offset += 8;
+      }
+    }
+  } else {
+    if (auto lhs_size = SizeofType(ctx.src, e.node->lhs->type); lhs_size > 8) {
+      // 8バイトより大きなデータ構造はレジスタにアドレスが格納されているはず
+      const auto reg = UseAnyCalcReg(free_calc_regs);
+      for (size_t i = 0; 8 * i < lhs_size; ++i) {
+        auto copy_dt = BytesToDataType(min(size_t(8), lhs_size - 8 * i));
+        ctx.asmgen.LoadN(reg, e.rhs_reg, 8 * i, copy_dt);
+        ctx.asmgen.StoreN(e.lhs_reg, 8 * i, reg, copy_dt);
+      }
+    } else {
+      // 8バイト以下のデータ構造はレジスタに値自体が乗っている
+      ctx.asmgen.StoreN(e.lhs_reg, 0, e.rhs_reg, BytesToDataType(lhs_size));
+    }
+  }
+  if (lval && !e.lhs_in_dest) {
+    ctx.asmgen.Mov64(e.dest_reg, e.calc_reg);
+  } else if (!lval && e.lhs_in_dest) {
+    ctx.asmgen.Mov64(e.dest_reg, e.calc_reg);
+  }
+}
+
+void GenerateGVarData(GenContext& ctx, Type* obj_t, Node* init) {
+  obj_t = GetUserBaseType(obj_t);
+  const auto obj_size = SizeofType(ctx.src, obj_t);
+
+  if (init == nullptr || IsLiteral(init) == false) {
+    ctx.asmgen.DataZero(obj_size);
+  } else if (init->kind == Node::kInt) {
+    ctx.asmgen.DataN(obj_size, get<opela_type::Int>(init->value));
+  } else if (init->kind == Node::kInitList && obj_t->kind == Type::kArray) {
+    auto init_elem = init->lhs;
+    for (int i = 0; i < get<long>(obj_t->value); ++i) {
+      GenerateGVarData(ctx, obj_t->base, init_elem);
+      init_elem = init_elem ? init_elem->next : nullptr;
+    }
+  } else if (init->kind == Node::kInitList && obj_t->kind == Type::kStruct) {
+    auto init_elem = init->lhs;
+    for (auto& field : GetTypeLayout(ctx.src, obj_t).fields) {
+      GenerateGVarData(ctx, field.type, init_elem);
+      init_elem = init_elem ? init_elem->next : nullptr;
+    }
+  } else {
+    ErrorOut() << "unknown initial data type" << endl;
+    ErrorAt(ctx.src, *init->token);
+  }
+}
+
+void GenerateAsm(GenContext& ctx, Node* node,
+                 Asm::Register dest, Asm::RegSet free_calc_regs,
+                 const LabelSet& labels, bool lval) {
+  auto comment_node = [&ctx, node]{
+    if (ctx.opts.lean_asm) {
+      return;
+    }
+    ctx.asmgen.Output() << "    // ";
+    PrintAST(ctx.asmgen.Output(), ctx.names, node);
+    ctx.asmgen.Output() << '\n';
+  };
+
+  switch (node->kind) {
+  case Node::kInt:
+    comment_node();
+    ctx.asmgen.Mov64(dest, get<opela_type::Int>(node->value));
+    return;
+  case Node::kBlock:
+    for (auto stmt = node->next; stmt; stmt = stmt->next) {
+      GenerateAsm(ctx, stmt, dest, free_calc_regs, labels);
+    }
+    return;
+  case Node::kId:
+    comment_node();
+    if (auto p = get_if<Object*>(&node->value)) {
+      Object* obj = *p;
+      switch (obj->linkage) {
+      case Object::kLocal:
+        if (lval || SizeofType(ctx.src, obj->type) > 8) {
+          ctx.asmgen.LEA(dest, Asm::kRegBP, obj->bp_offset);
+        } else {
+          ctx.asmgen.LoadN(dest, Asm::kRegBP, obj->bp_offset,
+                           DataTypeOf(ctx, obj->type));
+        }
+        break;
+      case Object::kGlobal:
+      case Object::kExternal:
+        if (obj->kind == Object::kFunc) {
+          if (obj->linkage == Object::kExternal &&
+              obj->def->cond && obj->def->cond->token->raw == R"("C")") {
+            ctx.asmgen.LoadLabelAddr(dest, ctx.asmgen.SymLabel(obj->id->raw));
+          } else {
+            ctx.asmgen.LoadLabelAddr(
+                dest, ctx.asmgen.SymLabel(obj->mangled_name));
+          }
+        } else if (lval) {
+          ctx.asmgen.LoadLabelAddr(dest, ctx.asmgen.SymLabel(obj->id->raw));
+        } else {
+          ctx.asmgen.LoadN(dest, obj->id->raw, DataTypeOf(ctx, obj->type));
+        }
+        break;
+      }
+    }
+    return;
+  case Node::kDefVar:
+    if (node->rhs) {
+      break;
+    }
+    return;
+  case Node::kDefFunc:
+    {
+      auto func = get<Object*>(node->value);
+      GenContext func_ctx{ctx.src, ctx.opts, ctx.names, ctx.asmgen, func,
+                          ctx.label_space};
+
+      int stack_size = 0;
+      for (Object* obj : func->locals) {
+        stack_size += (SizeofType(ctx.src, obj->type) + 7) & ~7;
+        obj->bp_offset = -stack_size;
+      }
+      stack_size = (stack_size + 0xf) & ~static_cast<size_t>(0xf);
+
+      // ジェネリック関数の具体化（ctx.func は元のジェネリック関数）は、
+      // 同じものを import した他の翻訳単位も生成しうるので弱いシンボルにする
+      ctx.asmgen.FuncPrologue(func->mangled_name, ctx.func ?
+                              Asm::kBindWeak : Asm::kBindGlobal);
+
+      ctx.asmgen.Sub64(Asm::kRegSP, stack_size);
+      int arg_index = 0;
+      for (auto param = node->rhs; param; param = param->next) {
+        auto arg_reg = static_cast<Asm::Register>(Asm::kRegV0 + arg_index);
+        ctx.asmgen.StoreN(Asm::kRegBP, -8 * (1 + arg_index),
+                          arg_reg, Asm::kQWord);
+        ++arg_index;
+      }
+      GenerateAsm(func_ctx, node->lhs, dest, free_calc_regs, labels);
+      ctx.asmgen.Xor64(Asm::kRegA, Asm::kRegA);
+      ctx.asmgen.Label(func->mangled_name + ".exit");
+      ctx.asmgen.FuncEpilogue();
+      return;
+    }
+  case Node::kRet:
+    comment_node();
+    if (node->lhs) {
+      GenerateAsm(ctx, node->lhs, Asm::kRegA, free_calc_regs, labels);
+      if (GenCast(ctx, Asm::kRegA, node->lhs->type, ctx.func->type->base)) {
+        ErrorOut() << "not implemented cast from " << node->lhs->type
+             << " to " << ctx.func->type->base << endl;
+        ErrorAt(ctx.src, *node->token);
+      }
+    }
+    ctx.asmgen.Jmp(ctx.func->mangled_name + ".exit");
+    return;
+  case Node::kIf:
+    comment_node();
+    {
+      auto label_exit = GenerateLabel(ctx);
+      auto label_else = node->rhs ? GenerateLabel(ctx) : label_exit;
+      GenerateAsm(ctx, node->cond, dest, free_calc_regs, labels);
+      ctx.asmgen.JmpIfZero(dest, label_else);
+      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels);
+      if (node->rhs) {
+        ctx.asmgen.Jmp(label_exit);
+        ctx.asmgen.Label(label_else, "else clause");
+        GenerateAsm(ctx, node->rhs, dest, free_calc_regs, labels);
+      }
+      ctx.asmgen.Label(label_exit, "if stmt exit");
+    }
+    return;
+  case Node::kLoop:
+    comment_node();
+    {
+      LabelSet ls{GenerateLabel(ctx), GenerateLabel(ctx)};
+      ctx.asmgen.Label(ls.cont, "loop body");
+      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, ls);
+      ctx.asmgen.Jmp(ls.cont);
+      ctx.asmgen.Label(ls.brk, "loop end");
+    }
+    return;
+  case Node::kFor:
+    comment_node();
+    {
+      auto label_loop = GenerateLabel(ctx);
+      auto label_cond = GenerateLabel(ctx);
+      LabelSet ls{node->rhs ? GenerateLabel(ctx) : label_cond, GenerateLabel(ctx)};
+      if (node->rhs) {
+        GenerateAsm(ctx, node->rhs, dest, free_calc_regs, ls);
+      }
+      ctx.asmgen.Jmp(label_cond);
+      ctx.asmgen.Label(label_loop, "loop body");
+      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, ls);
+      if (node->rhs) {
+        ctx.asmgen.Label(ls.cont, "update");
+        GenerateAsm(ctx, node->rhs->next, dest, free_calc_regs, ls);
+      }
+      ctx.asmgen.Label(label_cond, "condition");
+      GenerateAsm(ctx, node->cond, dest, free_calc_regs, ls);
+      ctx.asmgen.JmpIfNotZero(dest, label_loop);
+      ctx.asmgen.Label(ls.brk, "loop end");
+    }
+    return;
+  case Node::kCall:
+    {
+      SetErshovNumber(ctx.src, node);
+      const int num_arg = CountListItems(node->rhs);
+
+      int num_normal_param = 0;
+
+      auto func_t = node->lhs->type;
+      if (func_t->kind == Type::kPointer) {
+        func_t = func_t->base;
+      }
+      Node* varg_start = node->rhs;
+      for (auto param_t = func_t->next;
+           param_t && param_t->kind == Type::kParam;
+           param_t = param_t->next) {
+        ++num_normal_param;
+        varg_start = varg_start->next;
+      }
+
+      vector<Asm::Register> saved_regs;
+      auto save_reg = [&](Asm::Register reg) {
+        ctx.asmgen.Push64(reg);
+        saved_regs.push_back(reg);
+      };
+
+      // 戻り値、引数レジスタを退避
+      if (dest != Asm::kRegA) {
+        save_reg(Asm::kRegA);
+      }
+      for (int i = -1; i < num_arg; ++i) {
+        auto reg = static_cast<Asm::Register>(Asm::kRegV0 + i);
+        if (!ctx.asmgen.SameReg(reg, dest) && !free_calc_regs.test(reg)) {
+          save_reg(reg);
+          free_calc_regs.set(reg);
+        }
+      }
+
+      // 関数名の評価結果を格納するレジスタを探す
+      Asm::Register lhs_reg = Asm::kRegNV0;
+      for (int i = Asm::kRegV0 + num_arg; i <= Asm::kRegY; ++i) {
+        if (free_calc_regs.test(i)) {
+          lhs_reg = static_cast<Asm::Register>(i);
+          break;
+        }
+      }
+      if (lhs_reg > Asm::kRegY) {
+        lhs_reg = Asm::kRegY;
+        save_reg(lhs_reg);
+        free_calc_regs.set(lhs_reg);
+      }
+
+      // 可変長引数をスタックに積む（特定のアーキテクチャだけ）
+      if (ctx.asmgen.VParamOnStack()) {
+        unsigned int bytes = 8 * (num_arg - num_normal_param);
+        bytes = (bytes + 0xf) & ~0xf;
+        ctx.asmgen.Sub64(Asm::kRegSP, bytes);
+
+        unsigned int offset = 0;
+        for (auto varg = varg_start; varg; varg = varg->next) {
+          GenerateAsm(ctx, varg, dest, free_calc_regs, labels);
+          if (!ctx.opts.lean_asm) {
+            ctx.asmgen.Output() << "    // store varg into stack\n";
+          }
+          ctx.asmgen.StoreN(Asm::kRegSP, offset, dest, Asm::kQWord);
+          offset += 8;
+        }
+      }
+
+      // Ershov 数が 2 以上の引数を事前に評価し、スタックに保存しておく
+      vector<Node*> reg_args;
+      Node* arg_on_reg_end = ctx.asmgen.VParamOnStack() ? varg_start : nullptr;
+      for (auto arg = node->rhs; arg != arg_on_reg_end; arg = arg->next) {
+        reg_args.push_back(arg);
+        if (arg->ershov >= 2) {
+          GenerateAsm(ctx, arg, dest, free_calc_regs, labels);
+          ctx.asmgen.Push64(dest);
+        }
+      }
+
+      GenerateAsm(ctx, node->lhs, lhs_reg, free_calc_regs, labels);
+      free_calc_regs.reset(lhs_reg);
+
+      // 引数レジスタに実引数を設定する
+      while (!reg_args.empty()) {
+        auto arg = reg_args.back();
+        reg_args.pop_back();
+        auto reg = static_cast<Asm::Register>(Asm::kRegV0 + reg_args.size());
+        if (arg->ershov == 1) {
+          GenerateAsm(ctx, arg, reg, free_calc_regs, labels);
+        } else {
+          ctx.asmgen.Pop64(reg);
+        }
+      }
+
+      // 関数を呼び、結果を dest レジスタにコピーする
+      if (!ctx.opts.lean_asm) {
+        ctx.asmgen.Output() << "    // calling " << node->lhs->token->raw << '\n';
+      }
+      ctx.asmgen.Call(lhs_reg);
+      if (Asm::kRegA != dest) {
+        ctx.asmgen.Mov64(dest, Asm::kRegA);
+      }
+
+      // 可変長引数を積んだスタックの領域を開放する
+      if (ctx.asmgen.VParamOnStack()) {
+        unsigned int bytes = 8 * (num_arg - num_normal_param);
+        bytes = (bytes + 0xf) & ~0xf;
+        ctx.asmgen.Add64(Asm::kRegSP, bytes);
+      }
+
+      // 退避したレジスタの復帰
+      while (!saved_regs.empty()) {
+        ctx.asmgen.Pop64(saved_regs.back());
+        saved_regs.pop_back();
+      }
+    }
+    return;
+  case Node::kStr:
+    comment_node();
+    ctx.asmgen.LoadLabelAddr(
+        dest, StringLabel(get<StringIndex>(node->value).i));
+    return;
+  case Node::kExtern:
+  case Node::kTypedef:
+    return;
+  case Node::kSizeof:
+    comment_node();
+    ctx.asmgen.Mov64(dest, SizeofType(ctx.src, node->lhs->type));
+    return;
+  case Node::kCast:
+    if (node->rhs->kind == Node::kTList) {
+      auto tf = get<TypedFunc*>(node->value);
+      ctx.asmgen.LoadLabelAddr(dest, ctx.asmgen.SymLabel(Mangle(*tf)));
+      return;
+    }
+    GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, lval);
+    if (GenCast(ctx, dest, node->lhs->type, node->rhs->type, true)) {
+      ErrorOut() << "not implemented cast from " << node->lhs->type
+           << " to " << node->rhs->type << endl;
+      ErrorAt(ctx.src, *node->token);
+    }
+    return;
+  case Node::kChar:
+    comment_node();
+    ctx.asmgen.Mov64(dest, get<opela_type::Byte>(node->value));
+    return;
+  case Node::kLAnd:
+    comment_node();
+    {
+      auto label_end = GenerateLabel(ctx);
+      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels);
+      ctx.asmgen.JmpIfZero(dest, label_end);
+      GenerateAsm(ctx, node->rhs, dest, free_calc_regs, labels);
+      ctx.asmgen.Set1IfNonZero64(dest, dest);
+      ctx.asmgen.Label(label_end, "end of '&&'");
+    }
+    return;
+  case Node::kLOr:
+    comment_node();
+    {
+      auto label_end = GenerateLabel(ctx);
+      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels);
+      ctx.asmgen.JmpIfNotZero(dest, label_end);
+      GenerateAsm(ctx, node->rhs, dest, free_calc_regs, labels);
+      ctx.asmgen.Label(label_end, "end of '||'");
+      ctx.asmgen.Set1IfNonZero64(dest, dest);
+    }
+    return;
+  case Node::kBreak:
+    comment_node();
+    ctx.asmgen.Jmp(labels.brk);
+    return;
+  case Node::kCont:
+    comment_node();
+    ctx.asmgen.Jmp(labels.cont);
+    return;
+  case Node::kInc:
+    comment_node();
+    GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, true);
+    ctx.asmgen.IncN(dest, DataTypeOf(ctx, node));
+    return;
+  case Node::kDec:
+    comment_node();
+    GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, true);
+    ctx.asmgen.DecN(dest, DataTypeOf(ctx, node));
+    return;
+  case Node::kInitList:
+    comment_node();
+    {
+      int sp_offset = 0;
+      for (auto elem = node->lhs; elem; elem = elem->next) {
+        auto esize = SizeofType(ctx.src, elem->type);
+        sp_offset += (esize + 7) & ~7;
+      }
+      ctx.asmgen.Sub64(Asm::kRegSP, (sp_offset + 0xf) & ~0xf);
+      sp_offset = 0;
+      for (auto elem = node->lhs; elem; elem = elem->next) {
+        GenerateAsm(ctx, elem, dest, free_calc_regs, labels);
+        ctx.asmgen.StoreN(Asm::kRegSP, sp_offset, dest, DataTypeOf(ctx, elem));
+        auto esize = SizeofType(ctx.src, elem->type);
+        sp_offset += (esize + 7) & ~7;
+      }
+      ctx.asmgen.Mov64(dest, Asm::kRegSP);
+    }
+    return;
+  case Node::kDot:
+    {
+      // フィールドのオフセットは型付けで求めてある
+      const size_t field_offset = get<opela_type::Int>(node->value);
+      if (SizeofType(ctx.src, node->lhs->type) > 8 || lval) {
+        GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, true);
+        if (lval) {
+          ctx.asmgen.Add64(dest, field_offset);
+        } else {
+          ctx.asmgen.LoadN(dest, dest, field_offset, DataTypeOf(ctx, node->type));
+        }
+      } else { // SizeofType <= 8 && lval == false
+        GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, false);
+        if (auto field_size = SizeofType(ctx.src, node->type); field_size < 8) {
+          ExtractBits(ctx.asmgen, dest, field_offset * 8, field_size * 8);
+        }
+      }
+    }
+    return;
+  case Node::kArrow:
+    {
+      const size_t field_offset = get<opela_type::Int>(node->value);
+      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, false);
+      if (lval) {
+        ctx.asmgen.Add64(dest, field_offset);
+      } else {
+        ctx.asmgen.LoadN(dest, dest, field_offset, DataTypeOf(ctx, node->type));
+      }
+    }
+    return;
+  default:
+    ; // pass
+  }
+
+  // ここから Expression に対する処理
+  SetErshovNumber(ctx.src, node);
+
+  const bool request_lval =
+    node->kind == Node::kAssign ||
+    node->kind == Node::kDefVar ||
+    node->kind == Node::kAddr ||
+    (node->kind == Node::kSubscr && node->lhs->type->kind != Type::kPointer)
+    ;
+
+  Asm::Register reg;
+  const bool lhs_in_dest = node->rhs == nullptr ||
+                           node->lhs->ershov >= node->rhs->ershov;
+  if (lhs_in_dest) {
+    GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, request_lval);
+    if (node->rhs) {
+      reg = UseAnyCalcReg(free_calc_regs);
+      GenerateAsm(ctx, node->rhs, reg, free_calc_regs, labels);
+    }
+  } else {
+    GenerateAsm(ctx, node->rhs, dest, free_calc_regs, labels);
+    reg = UseAnyCalcReg(free_calc_regs);
+    GenerateAsm(ctx, node->lhs, reg, free_calc_regs, labels, request_lval);
+  }
+  auto lhs_reg = lhs_in_dest ? dest : reg;
+  auto rhs_reg = lhs_in_dest ? reg : dest;
+
+  auto lhs_t = GetUserBaseType(node->lhs->type);
+  auto rhs_t = node->rhs ? GetUserBaseType(node->rhs->type) : nullptr;
+
+  comment_node();
+
+  switch (node->kind) {
+  case Node::kAdd:
+    if (IsIntegral(lhs_t) && IsIntegral(rhs_t)) {
+      ctx.asmgen.Add64(dest, reg);
+    } else if (lhs_t->kind == Type::kPointer && IsIntegral(rhs_t)) {
+      ctx.asmgen.Mul64(rhs_reg, rhs_reg, SizeofType(ctx.src, lhs_t->base));
+      ctx.asmgen.Add64(dest, reg);
+    } else if (IsIntegral(lhs_t) && rhs_t->kind == Type::kPointer) {
+      ctx.asmgen.Mul64(lhs_reg, lhs_reg, SizeofType(ctx.src, rhs_t->base));
+      ctx.asmgen.Add64(dest, reg);
+    } else {
+      ErrorOut() << "not supported " << lhs_t << " + " << rhs_t << endl;
+      ErrorAt(ctx.src, *node->token);
+    }
+    break;
+  case Node::kSub:
+    if (IsIntegral(lhs_t) && IsIntegral(rhs_t)) {
+      ctx.asmgen.Sub64(lhs_reg, rhs_reg);
+    } else if (lhs_t->kind == Type::kPointer && IsIntegral(rhs_t)) {
+      ctx.asmgen.Mul64(rhs_reg, rhs_reg, SizeofType(ctx.src, lhs_t->base));
+      ctx.asmgen.Sub64(lhs_reg, rhs_reg);
+    } else if (IsIntegral(lhs_t) && rhs_t->kind == Type::kPointer) {
+      ctx.asmgen.Mul64(lhs_reg, lhs_reg, SizeofType(ctx.src, rhs_t->base));
+      ctx.asmgen.Sub64(lhs_reg, rhs_reg);
+    } else if (IsEqual(lhs_t, rhs_t)) {
+      ctx.asmgen.Sub64(lhs_reg, rhs_reg);
+      auto tmp_reg = UseAnyCalcReg(free_calc_regs);
+      ctx.asmgen.Mov64(tmp_reg, SizeofType(ctx.src, lhs_t->base));
+      ctx.asmgen.Div64(lhs_reg, tmp_reg);
+    } else {
+      ErrorOut() << "not supported " << lhs_t << " - " << rhs_t << endl;
+      ErrorAt(ctx.src, *node->token);
+    }
+    if (!lhs_in_dest) {
+      ctx.asmgen.Mov64(dest, reg);
+    }
+    break;
+  case Node::kMul:
+    ctx.asmgen.Mul64(dest, reg);
+    break;
+  case Node::kDiv:
+    if (lhs_in_dest) {
+      ctx.asmgen.Div64(dest, reg);
+    } else {
+      ctx.asmgen.Div64(reg, dest);
+      ctx.asmgen.Mov64(dest, reg);
+    }
+    break;
+  case Node::kEqu:
+    ctx.asmgen.CmpSet(Asm::kCmpE, dest, dest, reg);
+    break;
+  case Node::kNEqu:
+    ctx.asmgen.CmpSet(Asm::kCmpNE, dest, dest, reg);
+    break;
+  case Node::kGT:
+    if (auto t = MergeTypeBinOp(node->lhs->type, node->rhs->type);
+        t->kind == Type::kInt) {
+      ctx.asmgen.CmpSet(Asm::kCmpG, dest, lhs_reg, rhs_reg);
+    } else {
+      ctx.asmgen.CmpSet(Asm::kCmpA, dest, lhs_reg, rhs_reg);
+    }
+    break;
+  case Node::kLE:
+    if (auto t = MergeTypeBinOp(node->lhs->type, node->rhs->type);
+        t->kind == Type::kInt) {
+      ctx.asmgen.CmpSet(Asm::kCmpLE, dest, lhs_reg, rhs_reg);
+    } else {
+      ctx.asmgen.CmpSet(Asm::kCmpBE, dest, lhs_reg, rhs_reg);
+    }
+    break;
+  case Node::kDefVar:
+  case Node::kAssign:
+    GenerateAssign(ctx, {node, dest, reg, lhs_reg, rhs_reg, lhs_in_dest},
+                   free_calc_regs, lval);
+    break;
+  case Node::kAddr:
+    break;
+  case Node::kDeref:
+    if (!lval) {
+      ctx.asmgen.LoadN(dest, dest, 0, DataTypeOf(ctx, lhs_t));
+    }
+    break;
+  case Node::kSubscr:
+    ctx.asmgen.Mul64(rhs_reg, rhs_reg, SizeofType(ctx.src, lhs_t->base));
+    ctx.asmgen.Add64(dest, reg);
+    if (!lval) {
+      ctx.asmgen.LoadN(dest, dest, 0, DataTypeOf(ctx, lhs_t->base));
+    }
+    break;
+  default:
+    ErrorOut() << "GenerateAsm: should not come here" << endl;
+    ErrorAt(ctx.src, *node->token);
+  }
+
+  if (auto t = GetUserBaseType(node->type); !lval && IsIntegral(t)) {
+    if (auto bits = get<long>(t->value); bits < 64) {
+      ExtractBits(ctx.asmgen, dest, 0, bits);
+    }
+  }
+  /* node->type が bool の場合はあえて無視する。
+   * なぜなら、bool になるのは各種比較演算子のときのみで、
+   * 各種比較演算子は必ず 0/1 の値を返すから。
+   * int -> bool のキャスト（0 なら 0、非 0 なら 1）をせずとも、
+   * 希望する結果は既に得られている。
+   */
+}
+
+void PrintDebugInfo(ostream& out, DebugNames& names, Node* ast,
+                    vector<opela_type::String>& strings) {
+  PrintASTRec(out, names, ast);
+  out << '\n';
+  for (size_t i = 0; i < strings.size(); ++i) {
+    out << StringLabel(i) << ": \"";
+    for (auto ch : strings[i]) {
+      out << static_cast<char>(ch);
+    }
+    out << "\"\n";
+  }
+}
+
+// 生存期間中にトークン・ノード・オブジェクトのプールへ確保したメモリを、終わるときに解放する（-stream）
+class ScratchPools {
+ public:
+  ScratchPools() {
+    for (size_t i = 0; i < size(kPools); ++i) {
+      marks_[i] = GetPool(kPools[i]).GetMark();
+    }
+  }
+  ScratchPools(const ScratchPools&) = delete;
+  ScratchPools& operator=(const ScratchPools&) = delete;
+  ~ScratchPools() {
+    for (size_t i = 0; i < size(kPools); ++i) {
+      GetPool(kPools[i]).ReleaseTo(marks_[i]);
+    }
+  }
+
+ private:
+  // 型は正準型の表などから指されるので解放しない
+  static constexpr Pool kPools[] = {Pool::kToken, Pool::kNode, Pool::kObject};
+  Arena::Mark marks_[size(kPools)];
+};
+
+/* 関数定義 def のコードを out へ生成する
+ *
+ * cache があれば、内容の同じ関数のコードをキャッシュから出力する。
+ * キャッシュに無ければ別のバッファへ生成し、それを保存してから出力する。
+ * gfunc はジェネリック関数の具体化なら元のジェネリック関数、そうでなければ nullptr。
+ */
+void GenerateFuncCode(Source& src, const opela::CompileOptions& opts,
+                      DebugNames& names, Asm& out, CodeCache* cache, Object* gfunc,
+                      LabelSpace& label_space, Node* def,
+                      Asm::RegSet free_calc_regs) {
+  if (!cache) {
+    GenContext ctx{src, opts, names, out, gfunc, label_space};
+    GenerateAsm(ctx, def, Asm::kRegA, free_calc_regs, {});
+    return;
+  }
+
+  // コードの書き方を変える設定もキーに混ぜる
+  const uint64_t salt = static_cast<uint64_t>(opts.arch) << 2 |
+                        uint64_t{opts.lean_asm} << 1 |
+                        uint64_t{gfunc != nullptr};
+  const uint64_t key = HashFuncDef(def, salt);
+  string text;
+  if (cache->Load(key, label_space.func_index, text)) {
+    out.Output() << text;
+    return;
+  }
+
+  ostringstream buf;
+  unique_ptr<Asm> func_asm{NewAsm(opts.arch, buf)};
+  GenContext ctx{src, opts, names, *func_asm, gfunc, label_space};
+  GenerateAsm(ctx, def, Asm::kRegA, free_calc_regs, {});
+  cache->Store(key, label_space.func_index, buf.view());
+  out.Output() << buf.view();
+}
+
+void GenerateTypedFunc(Source& src, const opela::CompileOptions& opts,
+                       DebugNames& names, Asm* asmgen, CodeCache* cache,
+                       Asm::RegSet free_calc_regs, size_t& func_index,
+                       const TypeMap& gtype, TypedFunc* tf) {
+  TypeMap tf_gtype{gtype};
+  tf_gtype.merge(tf->gtype);
+
+  if (!RegisterInstance(tf->func, tf_gtype)) {
+    return;
+  }
+  {
+    TraceSpan span{"InstantiateFunc", tf->func->id->raw};
+    optional<ScratchPools> scratch; // -stream なら具体化した AST は生成し終えたら捨てる
+    if (opts.streaming) {
+      scratch.emplace();
+    }
+    Node* conc_def_node = ConcretizeDefFunc(src, tf_gtype, tf->func->def->lhs);
+
+    LabelSpace label_space{func_index++};
+    GenerateFuncCode(src, opts, names, *asmgen, cache, tf->func, label_space,
+                     conc_def_node, free_calc_regs);
+  }
+
+  auto inner_tfs = get<TypedFuncMap*>(tf->func->def->value);
+  for (auto [ generic_name, inner_tf ] : *inner_tfs) {
+    GenerateTypedFunc(src, opts, names, asmgen, cache, free_calc_regs,
+                      func_index, tf_gtype, inner_tf);
+  }
+}
+
+void GenerateTypedFuncs(Source& src, const opela::CompileOptions& opts,
+                        DebugNames& names, Asm* asmgen, CodeCache* cache,
+                        Asm::RegSet free_calc_regs, size_t& func_index,
+                        const TypedFuncMap& tfs) {
+  for (auto [ mangled_name, tf ] : tfs) {
+    GenerateTypedFunc(src, opts, names, asmgen, cache, free_calc_regs,
+                      func_index, tf->gtype, tf);
+  }
+}
+
+/* グローバル関数のコードを生成する
+ *
+ * pool にワーカーがいれば関数を連続した組に分け、組ごとに別の Asm とバッファへ並列に生成する。
+ * 生成し終えたらバッファをソースコードの順に連結するので、出力はスレッドの数によらない。
+ * 並列に生成できるのは、型付けを終えた AST を読むだけの非ジェネリック関数に限る。
+ */
+void GenerateFuncs(Source& src, const opela::CompileOptions& opts,
+                   DebugNames& names, Asm* asmgen, ObjectAsm* obj_asm,
+                   CodeCache* cache, Asm::RegSet free_calc_regs,
+                   const vector<Object*>& funcs, JobPool& pool) {
+  auto gen_func = [&](Asm& out, size_t i) {
+    TraceSpan span{"GenerateFunc", funcs[i]->mangled_name};
+    LabelSpace label_space{i};
+    GenerateFuncCode(src, opts, names, out, cache, nullptr, label_space,
+                     funcs[i]->def, free_calc_regs);
+  };
+
+  if (pool.NumWorkers() == 0 || funcs.size() <= 1) {
+    for (size_t i = 0; i < funcs.size(); ++i) {
+      gen_func(*asmgen, i);
+    }
+    return;
+  }
+
+  // 関数の大きさの偏りを均すため、組の数はスレッドの数より十分多くする
+  const size_t num_threads = pool.NumWorkers() + 1;
+  const size_t batch_size = max<size_t>(1, funcs.size() / (num_threads * 8));
+  const size_t num_batches = (funcs.size() + batch_size - 1) / batch_size;
+  struct Batch {
+    ostringstream text;
+    unique_ptr<Asm> asmgen;
+  };
+  vector<Batch> batches(num_batches);
+  for (auto& batch : batches) {
+    batch.asmgen.reset(obj_asm ? NewObjectAsm(opts.arch)
+                               : NewAsm(opts.arch, batch.text));
+  }
+
+  // ワーカーで見つけたエラーも呼び出し元のスレッドと同じ出力先へ表示する
+  ostream& error_out = ErrorOut();
+  JobGroup group{pool};
+  for (size_t b = 0; b < num_batches; ++b) {
+    group.Run([&, b]{
+      ErrorOutScope error_scope{error_out};
+      const size_t end = min(funcs.size(), (b + 1) * batch_size);
+      for (size_t i = b * batch_size; i < end; ++i) {
+        gen_func(*batches[b].asmgen, i);
+      }
+    });
+  }
+  group.Wait();
+
+  for (auto& batch : batches) {
+    if (obj_asm) {
+      obj_asm->Append(static_cast<ObjectAsm&>(*batch.asmgen));
+    } else {
+      asmgen->Output() << batch.text.view();
+    }
+  }
+}
+
+/* -stream: 後回しにした関数本体を 1 つずつ構文解析・型付けしてコードを生成し、すぐに解放する
+ *
+ * 本体のトークン・ノード・ローカル変数は ScratchPools で確保し、生成を終えたら捨てる。
+ * 本体の文字列リテラルもその場で読み出し専用データとして出力し、中身を捨てる。
+ * next_string は次に出力する文字列リテラルの番号。
+ */
+void GenerateDeferredFuncs(ASTContext& ctx, const opela::CompileOptions& opts,
+                           Asm* asmgen, CodeCache* cache,
+                           Asm::RegSet free_calc_regs,
+                           const vector<DeferredBody>& bodies,
+                           size_t& next_string) {
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    auto& body = bodies[i];
+    auto func = get<Object*>(body.def->value);
+    TraceSpan span{"GenerateFunc", func->mangled_name};
+    const size_t num_params = func->locals.size();
+    {
+      ScratchPools scratch;
+      ParseDeferredBody(ctx, body);
+      SetTypeFunc(ctx, body.def);
+      LabelSpace label_space{i};
+      GenerateFuncCode(ctx.src, opts, ctx.debug_names, *asmgen, cache,
+                       nullptr, label_space, body.def, free_calc_regs);
+      body.def->lhs = nullptr;
+      func->locals.resize(num_params); // 仮引数だけを残す
+      func->locals.shrink_to_fit();
+      ctx.debug_names.Clear(); // コメントの番号は解放したノードを指している
+    }
+
+    if (next_string < ctx.strings.size()) {
+      asmgen->SectionData(true);
+      for (; next_string < ctx.strings.size(); ++next_string) {
+        auto& str = ctx.strings[next_string];
+        asmgen->Label(StringLabel(next_string));
+        asmgen->DataCStr(str.data(), str.size());
+        opela_type::String{}.swap(str);
+      }
+      asmgen->SectionText();
+    }
+  }
+}
+
+} // namespace
+
+namespace opela {
+
+unique_ptr<Asm> NewOutputAsm(AsmArch arch, ostream& out, bool object) {
+  if (object) {
+    return unique_ptr<Asm>{NewObjectAsm(arch)};
+  }
+  return unique_ptr<Asm>{NewAsm(arch, out)};
+}
+
+void CompileUnit(const CompileOptions& opts, Source& src, ostream& out,
+                 Asm* asmgen, ObjectAsm* obj_asm, JobPool& pool,
+                 PhaseRecorder& phases) {
+  TokenStream token_stream(src);
+  jthread lexer_thread; // 構文解析がエラーで中断しても、字句解析の終了を待ってから破棄する
+  if (opts.lex_mode == LexMode::kPreLex) {
+    phases.Begin("lex");
+    token_stream.LexAll();
+  } else if (opts.lex_mode == LexMode::kLexThread) {
+    lexer_thread = jthread([&token_stream, &error_out = ErrorOut()]{
+      ErrorOutScope error_scope{error_out};
+      try {
+        token_stream.LexAll();
+      } catch (const CompileError&) {
+        // 構文解析の側でも、このエラーの位置のトークンを読もうとして CompileError になる
+      }
+    });
+  }
+  Tokenizer tokenizer = opts.lex_mode == LexMode::kLazy ?
+    Tokenizer(src) : Tokenizer(src, token_stream);
+  TypeManager type_manager(src);
+  Scope<Object> scope;
+  std::vector<opela_type::String> strings;
+  map<string_view, Type*> unresolved_types;
+  set<Node*> typing_defs;
+  OverloadIndex overloads;
+  TypedFuncMap typed_funcs;
+  ModuleLoader modules{opts.import_dirs};
+  vector<DeferredBody> deferred_bodies;
+  DebugNames debug_names; // 翻訳単位ごとに Node_0 などの番号を 0 から振る
+  ASTContext ast_ctx{src, tokenizer, type_manager, scope, strings,
+                     unresolved_types, typing_defs, overloads,
+                     typed_funcs, nullptr, &modules, opts.parse_anime_dir,
+                     debug_names, opts.streaming ? &deferred_bodies : nullptr};
+  phases.Begin("parse"); // 字句解析は -pre-tokenize を付けない限り構文解析に含まれる
+  auto ast = Program(ast_ctx);
+  if (lexer_thread.joinable()) {
+    lexer_thread.join();
+  }
+
+  // -stream では関数本体がまだ無いので、AST は表示しない
+  if (opts.verbosity >= 1 && !obj_asm && !opts.streaming) {
+    phases.Begin("dump-ast");
+    out << "/* AST before resolving types\n";
+    PrintDebugInfo(out, debug_names, ast, strings);
+    out << "*/\n\n";
+  }
+  phases.Begin("sema");
+  vector<Object*> funcs; // コードを生成する非ジェネリック関数
+  if (opts.prune_unused && !opts.streaming) {
+    PruneStats unused_prune_stats;
+    funcs = SetTypeReachable(
+        ast_ctx, ast, opts.prune_stats ? *opts.prune_stats : unused_prune_stats);
+  } else {
+    // -stream なら関数本体はコード生成のときに型付けする
+    SetTypeProgram(ast_ctx, ast); // ここでジェネリック関数の内部まで型を付けてはいけないかも
+    for (auto obj : scope.GetGlobals()) {
+      if (obj->linkage == Object::kGlobal && obj->kind == Object::kFunc &&
+          obj->def->kind == Node::kDefFunc) {
+        funcs.push_back(obj);
+      }
+    }
+  }
+  if (!opts.lean_asm && !opts.streaming) {
+    phases.Begin("dump-ast");
+    out << "/* AST\n";
+    PrintDebugInfo(out, debug_names, ast, strings);
+    out << "*/\n\n";
+  }
+
+  if (!opts.ast_graph.empty()) {
+    ofstream graph_file(opts.ast_graph);
+    PrintGeneratedNodes(graph_file, debug_names);
+  }
+
+  Asm::RegSet free_calc_regs;
+  if (!asmgen->SameReg(Asm::kRegA, Asm::kRegV0)) {
+    free_calc_regs.set(Asm::kRegV0);
+  }
+  free_calc_regs.set(Asm::kRegV1);
+  free_calc_regs.set(Asm::kRegV2);
+  free_calc_regs.set(Asm::kRegV3);
+  free_calc_regs.set(Asm::kRegV4);
+  free_calc_regs.set(Asm::kRegV5);
+  free_calc_regs.set(Asm::kRegX);
+  free_calc_regs.set(Asm::kRegY);
+
+  phases.Begin("codegen");
+  // キャッシュはアセンブリ言語のテキストなので、機械語を直接作るときは使わない
+  unique_ptr<CodeCache> cache;
+  CodeCacheStats unused_stats;
+  if (!opts.cache_dir.empty() && !obj_asm) {
+    auto unit_name = !opts.cache_unit_name.empty() ? opts.cache_unit_name :
+                     !src.Name().empty() ? src.Name() : string{"-"};
+    cache = make_unique<CodeCache>(
+        opts.cache_dir, unit_name,
+        opts.cache_stats ? *opts.cache_stats : unused_stats);
+  }
+  asmgen->FilePrologue();
+  asmgen->SectionText();
+  size_t next_string = 0; // 次に出力する文字列リテラル（-stream は関数ごとに出力する）
+  if (opts.streaming) {
+    GenerateDeferredFuncs(ast_ctx, opts, asmgen, cache.get(), free_calc_regs,
+                          deferred_bodies, next_string);
+  } else {
+    GenerateFuncs(src, opts, debug_names, asmgen, obj_asm, cache.get(),
+                  free_calc_regs, funcs, pool);
+  }
+
+  phases.Begin("generics");
+  size_t func_index = funcs.size(); // ラベルの名前空間の番号
+  GenerateTypedFuncs(src, opts, debug_names, asmgen, cache.get(),
+                     free_calc_regs, func_index, typed_funcs);
+  if (cache) {
+    cache->Save();
+  }
+
+  phases.Begin("globals");
+  // -stream で関数本体を構文解析すると名前表の層が再確保されるので、ここで取り出す
+  auto& globals = scope.GetGlobals();
+  // 翻訳単位ごとに .init_array から呼ぶので、他の翻訳単位からは見えなくてよい
+  asmgen->Label("_init_opela");
+  asmgen->FuncPrologue("_init_opela", Asm::kBindLocal);
+  LabelSpace init_label_space{func_index++};
+  for (auto obj : globals) {
+    if (obj->linkage == Object::kGlobal && obj->kind == Object::kVar) {
+      auto var_def = obj->def;
+      if (var_def->rhs && IsLiteral(var_def->rhs) == false) {
+        GenContext ctx{src, opts, debug_names, *asmgen, nullptr,
+                       init_label_space};
+        GenerateAsm(ctx, var_def->rhs, Asm::kRegA, free_calc_regs, {});
+        auto lhs_reg = UseAnyCalcReg(free_calc_regs);
+        GenerateAsm(ctx, var_def->lhs, lhs_reg, free_calc_regs, {}, true);
+        GenerateAssign(
+            ctx,
+            {var_def, lhs_reg, Asm::kRegA, lhs_reg, Asm::kRegA, true},
+            free_calc_regs, false);
+      }
+    }
+  }
+  asmgen->Label("_init_opela.exit");
+  asmgen->FuncEpilogue();
+
+  asmgen->SectionInit();
+  asmgen->DataAddr("_init_opela");
+
+  asmgen->SectionData(true);
+  for (size_t i = next_string; i < strings.size(); ++i) {
+    asmgen->Label(StringLabel(i));
+    asmgen->DataCStr(strings[i].data(), strings[i].size());
+  }
+
+  asmgen->SectionData(false);
+  GenContext ctx{src, opts, debug_names, *asmgen, nullptr, init_label_space};
+  for (auto obj : globals) {
+    if (obj->linkage == Object::kGlobal && obj->kind == Object::kVar) {
+      asmgen->Align(4);
+      asmgen->Label(asmgen->SymLabel(obj->id->raw));
+      GenerateGVarData(ctx, obj->type, obj->def->rhs);
+    }
+  }
+
+  phases.Begin("emit");
+  if (obj_asm && opts.emit_obj) {
+    WriteELF(out, obj_asm->Finish());
+  }
+  out.flush();
+  phases.End();
+}
+
+void ReleaseUnit() {
+  ClearInternedTypes();
+  ClearGenericsCache();
+  ReleasePools();
+}
+
+CompileResult Compile(const CompileOptions& opts, string_view name,
+                      string_view source) {
+  CompileResult result;
+  if (opts.emit_obj && opts.arch != AsmArch::kX86_64) {
+    result.diagnostics = "-emit-obj supports only x86_64\n";
+    return result;
+  }
+
+  string text{source};
+  text.push_back('\0'); // Source はヌル文字で終わるテキストを指す
+  Source src{string{name}, text};
+  ostringstream out, diagnostics;
+  ErrorOutScope error_scope{diagnostics};
+  // 呼び出し元のスレッドも仕事をする。ノードのプールを持てるスレッドの数を超えないようにする
+  JobPool pool{min(opts.num_jobs, static_cast<int>(kMaxPoolThreads)) - 1};
+  auto asmgen = NewOutputAsm(opts.arch, out, opts.emit_obj);
+  auto obj_asm = opts.emit_obj ?
+    static_cast<ObjectAsm*>(asmgen.get()) : nullptr;
+
+  PhaseRecorder phases;
+  try {
+    CompileUnit(opts, src, out, asmgen.get(), obj_asm, pool, phases);
+    result.ok = true;
+  } catch (const CompileError&) {
+  }
+  ReleaseUnit();
+
+  if (result.ok) {
+    result.output = std::move(out).str();
+  }
+  result.diagnostics = std::move(diagnostics).str();
+  return result;
+}
+
+} // namespace opela
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "asm.hpp"
+
+class JobPool;
+class ObjectAsm;
+class PhaseRecorder;
+class Source;
+struct CodeCacheStats;
+struct PruneStats;
+
+/* コンパイラをライブラリとして使うための入口
+ *
+ * コンパイルの設定はすべて CompileOptions で渡し、大域変数には持たない。
+ * 1 つのスレッドで同時に進められるコンパイルは 1 つだけだが、
+ * 別々のスレッドからなら並行して Compile() を呼べる。
+ */
+namespace opela {
+
+enum class LexMode {
+  kLazy,      // 構文解析器が要求するたびに 1 トークンずつ字句解析する
+  kPreLex,    // 構文解析の前にソース全体を字句解析する
+  kLexThread, // 構文解析と並行して別スレッドで字句解析する
+};
+
+// 1 つの翻訳単位のコンパイルの設定（opelac のオプションに対応する）
+struct CompileOptions {
+  AsmArch arch = AsmArch::kX86_64;       // -target-arch
+  int verbosity = 0;                     // -v
+  bool lean_asm = false;                 // -lean: AST のコメントを出力しない
+  bool emit_obj = false;                 // -emit-obj: ELF を出力する
+  LexMode lex_mode = LexMode::kLazy;     // -pre-tokenize, -lex-thread
+  int num_jobs = 1;                      // -j（Compile() で使うスレッドの数）
+  std::string ast_graph;                 // -gen-ast-graph
+  std::string parse_anime_dir;           // -gen-parse-anime
+  std::vector<std::string> import_dirs;  // -I
+  std::string cache_dir;                 // -cache-dir（空ならキャッシュしない）
+  // キャッシュで翻訳単位を区別する名前（空ならソースの名前）
+  std::string cache_unit_name;
+  CodeCacheStats* cache_stats = nullptr; // キャッシュの利用状況を数える先
+  // 到達できない関数のコードと、そこからの具体化を生成しない（-prune-unused）。
+  // 外部から名前で呼ばれる関数も省いてしまうので、既定では無効
+  bool prune_unused = false;
+  PruneStats* prune_stats = nullptr;     // 省いた関数の数を数える先
+  // -stream: 関数本体を 1 つずつ構文解析・型付け・生成して解放する
+  bool streaming = false;
+};
+
+struct CompileResult {
+  bool ok = false;
+  std::string output;      // アセンブリ言語（emit_obj なら ELF）
+  std::string diagnostics; // エラーメッセージ
+};
+
+// name（エラー表示に使うファイル名）の source をコンパイルする。エラーは結果として返す
+CompileResult Compile(const CompileOptions& opts, std::string_view name,
+                      std::string_view source);
+
+// 出力先 out へ書き出す Asm を作る（機械語を直接作るなら ObjectAsm）
+std::unique_ptr<Asm> NewOutputAsm(AsmArch arch, std::ostream& out,
+                                  bool object);
+
+/* 1 つの翻訳単位をコンパイルし、asmgen へ出力する
+ *
+ * out は asmgen の出力先で、AST のダンプと ELF（opts.emit_obj のとき）もここへ書き出す。
+ * エラーがあれば ErrorOut() へ表示して CompileError を投げる。
+ * 確保したプールはそのまま残すので、呼び出し側で ReleaseUnit() する。
+ */
+void CompileUnit(const CompileOptions& opts, Source& src, std::ostream& out,
+                 Asm* asmgen, ObjectAsm* obj_asm, JobPool& pool,
+                 PhaseRecorder& phases);
+
+// 翻訳単位のコンパイルで確保したメモリと、それを指す表を解放する
+void ReleaseUnit();
+
+} // namespace opela
@@ -0,0 +1,159 @@
+#include <elf.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "objasm.hpp"
+
+using namespace std;
+
+namespace {
+
+// 文字列表（.strtab, .shstrtab）
+struct StrTab {
+  string data{'\0'};
+
+  uint32_t Add(string_view s) {
+    const uint32_t i = data.size();
+    data.append(s);
+    data.push_back('\0');
+    return i;
+  }
+};
+
+template <class T>
+void Append(vector<uint8_t>& buf, const T& v) {
+  auto p = reinterpret_cast<const uint8_t*>(&v);
+  buf.insert(buf.end(), p, p + sizeof(v));
+}
+
+} // namespace
+
+void WriteELF(std::ostream& out, const ObjFile& obj) {
+  // セクションの並び：
+  // null, obj.sections..., .rela.*..., .symtab, .strtab, .shstrtab, .note.GNU-stack
+  vector<Elf64_Shdr> shdrs(1);
+  vector<vector<uint8_t>> contents(1);
+  StrTab shstrtab, strtab;
+
+  auto add_section = [&](string_view name, uint32_t type, uint64_t flags,
+                         uint64_t align, vector<uint8_t> data) {
+    Elf64_Shdr sh{};
+    sh.sh_name = shstrtab.Add(name);
+    sh.sh_type = type;
+    sh.sh_flags = flags;
+    sh.sh_addralign = align;
+    sh.sh_size = data.size();
+    shdrs.push_back(sh);
+    contents.push_back(move(data));
+    return shdrs.size() - 1;
+  };
+
+  for (auto& sec : obj.sections) {
+    add_section(sec.name, sec.type, sec.flags, sec.align, sec.data);
+  }
+
+  // ELF ではローカルシンボルをグローバルシンボルより前に置く
+  vector<uint32_t> sym_elf_index(obj.symbols.size());
+  vector<uint8_t> symtab;
+  Append(symtab, Elf64_Sym{});
+  uint32_t num_syms = 1, first_global = 0;
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1) {
+      first_global = num_syms;
+    }
+    for (size_t i = 0; i < obj.symbols.size(); ++i) {
+      auto& s = obj.symbols[i];
+      const bool global = s.global || s.section < 0;
+      if (global != (pass == 1)) {
+        continue;
+      }
+      Elf64_Sym sym{};
+      sym.st_name = strtab.Add(s.name);
+      const int bind = s.weak ? STB_WEAK : global ? STB_GLOBAL : STB_LOCAL;
+      sym.st_info = ELF64_ST_INFO(bind, s.section < 0 ? STT_NOTYPE : s.type);
+      sym.st_shndx = s.section < 0 ? SHN_UNDEF : s.section + 1;
+      sym.st_value = s.section < 0 ? 0 : s.value;
+      sym.st_size = s.section < 0 ? 0 : s.size;
+      Append(symtab, sym);
+      sym_elf_index[i] = num_syms++;
+    }
+  }
+
+  const uint32_t symtab_index = shdrs.size() + [&]{
+    uint32_t n = 0;
+    for (auto& sec : obj.sections) {
+      n += !sec.relocs.empty();
+    }
+    return n;
+  }();
+
+  for (size_t i = 0; i < obj.sections.size(); ++i) {
+    auto& sec = obj.sections[i];
+    if (sec.relocs.empty()) {
+      continue;
+    }
+    vector<uint8_t> rela;
+    for (auto& r : sec.relocs) {
+      Elf64_Rela ent{};
+      ent.r_offset = r.offset;
+      ent.r_info = ELF64_R_INFO(sym_elf_index[r.sym], r.type);
+      ent.r_addend = r.addend;
+      Append(rela, ent);
+    }
+    auto idx = add_section(".rela" + sec.name, SHT_RELA, SHF_INFO_LINK, 8,
+                           move(rela));
+    shdrs[idx].sh_entsize = sizeof(Elf64_Rela);
+    shdrs[idx].sh_link = symtab_index;
+    shdrs[idx].sh_info = i + 1;
+  }
+
+  add_section(".symtab", SHT_SYMTAB, 0, 8, move(symtab));
+  shdrs[symtab_index].sh_entsize = sizeof(Elf64_Sym);
+  shdrs[symtab_index].sh_link = symtab_index + 1;
+  shdrs[symtab_index].sh_info = first_global;
+  add_section(".strtab", SHT_STRTAB, 0, 1,
+              {strtab.data.begin(), strtab.data.end()});
+  const auto shstrtab_index = shdrs.size();
+  shdrs.push_back({});
+  contents.push_back({});
+  // スタックを実行可能にしないことを示す
+  add_section(".note.GNU-stack", SHT_PROGBITS, 0, 1, {});
+  shdrs[shstrtab_index].sh_name = shstrtab.Add(".shstrtab");
+  shdrs[shstrtab_index].sh_type = SHT_STRTAB;
+  shdrs[shstrtab_index].sh_addralign = 1;
+  contents[shstrtab_index].assign(shstrtab.data.begin(), shstrtab.data.end());
+  shdrs[shstrtab_index].sh_size = contents[shstrtab_index].size();
+
+  // ファイル上の配置を決める
+  vector<uint8_t> file(sizeof(Elf64_Ehdr));
+  for (size_t i = 1; i < shdrs.size(); ++i) {
+    const auto align = max<uint64_t>(shdrs[i].sh_addralign, 1);
+    file.resize((file.size() + align - 1) / align * align);
+    shdrs[i].sh_offset = file.size();
+    file.insert(file.end(), contents[i].begin(), contents[i].end());
+  }
+  file.resize((file.size() + 7) / 8 * 8);
+
+  Elf64_Ehdr eh{};
+  memcpy(eh.e_ident, ELFMAG, SELFMAG);
+  eh.e_ident[EI_CLASS] = ELFCLASS64;
+  eh.e_ident[EI_DATA] = ELFDATA2LSB;
+  eh.e_ident[EI_VERSION] = EV_CURRENT;
+  eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  eh.e_type = ET_REL;
+  eh.e_machine = EM_X86_64;
+  eh.e_version = EV_CURRENT;
+  eh.e_shoff = file.size();
+  eh.e_ehsize = sizeof(Elf64_Ehdr);
+  eh.e_shentsize = sizeof(Elf64_Shdr);
+  eh.e_shnum = shdrs.size();
+  eh.e_shstrndx = shstrtab_index;
+  memcpy(file.data(), &eh, sizeof(eh));
+  for (auto& sh : shdrs) {
+    Append(file, sh);
+  }
+
+  out.write(reinterpret_cast<const char*>(file.data()), file.size());
+}
@@ -5,53 +5,69 @@
 #include <functional>
 #include <iostream>
 #include <map>
+#include <optional>
+#include <set>
+#include <vector>
 
+#include "arena.hpp"
 #include "ast.hpp"
 #include "magic_enum.hpp"
 #include "mangle.hpp"
 
 using namespace std;
 
+namespace {
+
+struct ConcItem {
+  Node* node;
+  Node* lhs; // 具体化後の子
+  Node* rhs;
+  Node* cond;
+};
+
+} // namespace
+
 struct ConcContext {
   Source& src;
-  TypeMap& gtype;
+  const TypeMap* gtype; // InternTypeMap() で正準化した型変数の対応表
   Object* func; // 具体化を実行中の関数オブジェクト
   std::map<Object*, Object*>& new_lvars;
+  std::vector<ConcItem> items; // ConcretizeNode() の作業用スタック
 };
 
 namespace {
 
-Node* ConcretizeNode(ConcContext& ctx, Node* node) {
-  if (node == nullptr) {
-    return nullptr;
-  }
-
+// kType と kId のノードを具体化する（これらの next は複製しない）
+Node* ConcretizeLeaf(ConcContext& ctx, Node* node) {
   if (node->kind == Node::kType) {
     return NewNodeType(node->token, ConcretizeType(ctx.gtype, node->type));
-  } else if (node->kind == Node::kId) {
-    auto dup = NewNode(Node::kId, node->token);
-    if (auto p = get_if<Object*>(&node->value)) {
-      Object* obj = *p;
-      if (auto it = ctx.new_lvars.find(obj); it != ctx.new_lvars.end()) {
-        dup->value = it->second;
-        dup->type = it->second->type;
-      } else {
-        auto obj_dup = new Object{*obj};
-        dup->value = obj_dup;
-        dup->type = obj_dup->type = ConcretizeType(ctx.gtype, obj->type);
-      }
+  }
+
+  auto dup = NewNode(Node::kId, node->token);
+  if (auto p = get_if<Object*>(&node->value)) {
+    Object* obj = *p;
+    if (auto it = ctx.new_lvars.find(obj); it != ctx.new_lvars.end()) {
+      dup->value = it->second;
+      dup->type = it->second->type;
     } else {
-      dup->type = ConcretizeType(ctx.gtype, node->type);
+      auto obj_dup = GetPool(Pool::kObject).New<Object>(*obj);
+      dup->value = obj_dup;
+      dup->type = obj_dup->type = ConcretizeType(ctx.gtype, obj->type);
     }
-    return dup;
+  } else {
+    dup->type = ConcretizeType(ctx.gtype, node->type);
   }
+  return dup;
+}
 
-  auto lhs = ConcretizeNode(ctx, node->lhs);
-  auto rhs = ConcretizeNode(ctx, node->rhs);
-  auto cond = ConcretizeNode(ctx, node->cond);
-  auto next = ConcretizeNode(ctx, node->next);
+// 子を具体化し終えたノードを、必要なら複製して型を付け直す
+Node* ConcretizeItem(ConcContext& ctx, const ConcItem& item, Node* next) {
+  auto [ node, lhs, rhs, cond ] = item;
+  // ジェネリック関数の中のフィールドへのアクセスには、オフセットがまだ無い
+  const bool field_access =
+    node->kind == Node::kDot || node->kind == Node::kArrow;
   if (lhs == node->lhs && rhs == node->rhs &&
-      cond == node->cond && next == node->next) {
+      cond == node->cond && next == node->next && !field_access) {
     return node;
   }
 
@@ -63,7 +79,11 @@ Node* ConcretizeNode(ConcContext& ctx, Node* node) {
   dup->value = node->value;
   if (auto p = get_if<Object*>(&node->value)) {
     Object* obj = *p;
-    get<Object*>(dup->value)->type = ConcretizeType(ctx.gtype, obj->type);
+    if (auto it = ctx.new_lvars.find(obj); it != ctx.new_lvars.end()) {
+      dup->value = it->second;
+    } else {
+      obj->type = ConcretizeType(ctx.gtype, obj->type);
+    }
   } else if (auto p = get_if<TypedFunc*>(&node->value)) {
     TypedFunc* tf = *p;
     get<TypedFunc*>(dup->value)->func->type =
@@ -113,63 +133,107 @@ Node* ConcretizeNode(ConcContext& ctx, Node* node) {
   case Node::kDec:
     dup->type = lhs->type;
     break;
+  case Node::kDot:
+    if (auto t = GetUserBaseType(lhs->type);
+        t->kind != Type::kStruct && t->kind != Type::kConcrete) {
+      ErrorOut() << "lhs must be a struct: " << t << endl;
+      ErrorAt(ctx.src, *node->token);
+    } else if (auto field = GetTypeLayout(ctx.src, t).Find(*node->rhs->token)) {
+      dup->type = field->type;
+      dup->value = static_cast<opela_type::Int>(field->offset);
+    } else {
+      ErrorOut() << "no such member" << endl;
+      ErrorAt(ctx.src, *node->rhs->token);
+    }
+    break;
   case Node::kArrow:
     if (auto p = GetPrimaryType(lhs->type); p->kind != Type::kPointer) {
-      cerr << "lhs must be a pointer to a struct: " << p << endl;
+      ErrorOut() << "lhs must be a pointer to a struct: " << p << endl;
       ErrorAt(ctx.src, *node->token);
     } else if (auto t = GetPrimaryType(p->base); t->kind != Type::kStruct) {
-      cerr << "lhs must be a pointer to a struct: " << t << endl;
+      ErrorOut() << "lhs must be a pointer to a struct: " << t << endl;
       ErrorAt(ctx.src, *node->token);
+    } else if (auto field = GetTypeLayout(ctx.src, GetUserBaseType(p->base))
+                              .Find(*node->rhs->token)) {
+      dup->type = field->type;
+      dup->value = static_cast<opela_type::Int>(field->offset);
     } else {
-      for (auto ft = t->next; ft; ft = ft->next) {
-        if (get<Token*>(ft->value)->raw == node->rhs->token->raw) {
-          dup->type = ft->base;
-          break;
-        }
-      }
-      if (dup->type == nullptr) {
-        cerr << "no such member" << endl;
-        ErrorAt(ctx.src, *node->rhs->token);
-      }
+      ErrorOut() << "no such member" << endl;
+      ErrorAt(ctx.src, *node->rhs->token);
     }
     break;
   case Node::kTList:
     break;
   default:
-    cerr << "ConcretizeNode: not implemented" << endl;
+    ErrorOut() << "ConcretizeNode: not implemented" << endl;
     ErrorAt(ctx.src, *node->token);
   }
 
   return dup;
 }
 
+/* next でつながったノード列を具体化する
+ *
+ * 文の数だけ再帰しないよう、next の連鎖はループでたどる。
+ * 各ノードの子を先頭から順に具体化した後、末尾から順に複製する（再帰版と同じ順序）。
+ */
+Node* ConcretizeNode(ConcContext& ctx, Node* node) {
+  const size_t base = ctx.items.size();
+  Node* next = nullptr;
+  for (; node; node = node->next) {
+    if (node->kind == Node::kType || node->kind == Node::kId) {
+      next = ConcretizeLeaf(ctx, node);
+      break;
+    }
+    auto lhs = ConcretizeNode(ctx, node->lhs);
+    auto rhs = ConcretizeNode(ctx, node->rhs);
+    auto cond = ConcretizeNode(ctx, node->cond);
+    ctx.items.push_back({node, lhs, rhs, cond});
+  }
+
+  while (ctx.items.size() > base) {
+    next = ConcretizeItem(ctx, ctx.items.back(), next);
+    ctx.items.pop_back();
+  }
+  return next;
+}
+
 } // namespace
 
-using DoneKey = std::pair<Type*, TypeMap*>;
+namespace {
 
-struct LessDoneKey {
-  bool operator()(const DoneKey& a, const DoneKey& b) const {
-    if (a.first < b.first) {
-      return true;
-    } else if (a.first > b.first) {
-      return false;
-    }
-    // a.first == b.first
-    if (b.second == nullptr) {
-      return false;
-    } else if (a.second == nullptr) {
-      return true;
-    }
-    // a.second != nullptr && b.second != nullptr
-    return *a.second < *b.second;
-  }
-};
+// 内容が同じ TypeMap を 1 つにまとめる表
+thread_local std::set<TypeMap> interned_type_maps;
+
+// 具体化の結果の表（翻訳単位の中で共有する）
+// キーの TypeMap は InternTypeMap() で正準化されているので、ポインタで比較できる
+using DoneKey = std::pair<Type*, const TypeMap*>;
+thread_local std::map<DoneKey, Type*> concretized_types;
+
+// 生成済みのジェネリック関数のインスタンス
+thread_local std::set<std::pair<Object*, std::string>> generated_instances;
 
-using DoneMap = std::map<DoneKey, Type*, LessDoneKey>;
+} // namespace
+
+void ClearGenericsCache() {
+  interned_type_maps.clear();
+  concretized_types.clear();
+  generated_instances.clear();
+}
+
+const TypeMap* InternTypeMap(const TypeMap& gtype) {
+  return &*interned_type_maps.insert(gtype).first;
+}
+
+namespace {
 
-Type* ConcretizeType(TypeMap* gtype, Type* type, DoneMap& done) {
+// 複製せずに具体化できる型なら、その結果を返す
+std::optional<Type*> ConcretizeTypeNoDup(const TypeMap* gtype, Type* type) {
+  auto& done = concretized_types;
   if (type == nullptr) {
     return nullptr;
+  } else if (type->id != 0) { // 正準型は型変数を含まない
+    return type;
   } else if (auto it = done.find({type, gtype}); it != done.end()) {
     return it->second;
   }
@@ -178,41 +242,83 @@ Type* ConcretizeType(TypeMap* gtype, Type* type, DoneMap& done) {
     auto generic_t = GetUserBaseType(type->base);
     auto type_list = type->next;
 
-    auto gtype_ = new TypeMap;
+    TypeMap gtype_;
     auto gparam = generic_t->next;
     for (auto param = type_list; param; param = param->next) {
       string gname{get<Token*>(gparam->value)->raw};
-      gtype_->insert({gname, ConcretizeType(gtype, param->base, done)});
+      gtype_.insert({gname, ConcretizeType(gtype, param->base)});
       gparam = gparam->next;
     }
 
-    return done[{type, gtype_}] = ConcretizeType(gtype_, generic_t->base, done);
+    auto conc_t = ConcretizeType(InternTypeMap(gtype_), generic_t->base);
+    return done[{type, gtype}] = conc_t;
   }
 
   if (type->kind == Type::kGParam) {
     if (gtype) {
-      return done[{type, gtype}] = (*gtype)[string(get<Token*>(type->value)->raw)];
+      auto it = gtype->find(string(get<Token*>(type->value)->raw));
+      return done[{type, gtype}] = it == gtype->end() ? nullptr : it->second;
     }
     return done[{type, gtype}] = type;
   }
 
-  auto dup = NewType(type->kind);
-  done[{type, gtype}] = dup;
+  return std::nullopt;
+}
 
-  dup->base = ConcretizeType(gtype, type->base, done);
-  dup->next = ConcretizeType(gtype, type->next, done);
-  dup->value = type->value;
-  return dup;
+} // namespace
+
+Type* ConcretizeType(const TypeMap* gtype, Type* type) {
+  auto& done = concretized_types;
+
+  /* 引数やフィールドの並び（next の連鎖）は再帰せずループでたどる
+   *
+   * 先頭から順に複製して base を具体化した後、末尾から順に next をつないで正準化する。
+   * 複製は正準化の前に done に登録するので、自己参照する型も具体化できる。
+   */
+  vector<pair<Type*, Type*>> chain; // 元の型と複製
+  optional<Type*> next;
+  while (!(next = ConcretizeTypeNoDup(gtype, type))) {
+    auto dup = GetPool(Pool::kType).New<Type>(*type);
+    dup->layout = nullptr; // フィールドの型が変わるので配置は求め直す
+    done[{type, gtype}] = dup;
+    dup->base = ConcretizeType(gtype, type->base);
+    chain.push_back({type, dup});
+    type = type->next;
+  }
+
+  Type* conc_t = *next;
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    auto [ orig, dup ] = *it;
+    dup->next = conc_t;
+    if (dup->base == orig->base && dup->next == orig->next) {
+      // 具体化すべき型変数を含まないなら複製しない
+      conc_t = done[{orig, gtype}] = orig;
+    } else {
+      conc_t = done[{orig, gtype}] = InternType(dup);
+    }
+  }
+  return conc_t;
 }
 
 Type* ConcretizeType(TypeMap& gtype, Type* type) {
-  DoneMap done;
-  return ConcretizeType(&gtype, type, done);
+  return ConcretizeType(InternTypeMap(gtype), type);
 }
 
 Type* ConcretizeType(Type* type) {
-  DoneMap done;
-  return ConcretizeType(nullptr, type, done);
+  return ConcretizeType(nullptr, type);
+}
+
+bool RegisterInstance(Object* gfunc, TypeMap& gtype) {
+  auto gtype_id = InternTypeMap(gtype);
+  string type_args;
+  for (auto gname = gfunc->def->rhs; gname; gname = gname->next) {
+    auto it = gtype.find(string(gname->token->raw));
+    if (it != gtype.end()) {
+      type_args += Mangle(ConcretizeType(gtype_id, it->second));
+    }
+    type_args += ',';
+  }
+  return generated_instances.insert({gfunc, type_args}).second;
 }
 
 TypedFunc* NewTypedFunc(Object* gfunc, Node* type_list) {
@@ -245,25 +351,24 @@ Node* ConcretizeDefFunc(Source& src, TypeMap& gtype, Node* def) {
     gtype[gname] = ConcretizeType(gtype, conc_t);
   }
 
+  auto gtype_id = InternTypeMap(gtype);
   auto func = get<Object*>(def->value);
-  Type* conc_func_t = ConcretizeType(gtype, func->type);
+  Type* conc_func_t = ConcretizeType(gtype_id, func->type);
 
   auto obj_dup = NewFunc(func->id, def, func->linkage);
   obj_dup->locals = func->locals;
   map<Object*, Object*> new_lvars;
   for (size_t i = 0; i < func->locals.size(); ++i) {
     Object* lvar = func->locals[i];
-    auto t = ConcretizeType(gtype, lvar->type);
-    if (t != lvar->type) {
-      auto new_lvar = new Object{*lvar};
-      new_lvar->type = t;
-      obj_dup->locals[i] = new_lvar;
-      new_lvars[lvar] = new_lvar;
-    }
+    // インスタンスごとに別のローカル変数を用意する
+    auto new_lvar = GetPool(Pool::kObject).New<Object>(*lvar);
+    new_lvar->type = ConcretizeType(gtype_id, lvar->type);
+    obj_dup->locals[i] = new_lvar;
+    new_lvars[lvar] = new_lvar;
   }
 
   obj_dup->type = conc_func_t;
-  ConcContext ctx{src, gtype, obj_dup, new_lvars};
+  ConcContext ctx{src, gtype_id, obj_dup, new_lvars, {}};
 
   def_dup->lhs = ConcretizeNode(ctx, def->lhs);
   def_dup->rhs = ConcretizeNode(ctx, def->rhs);
@@ -8,6 +8,12 @@
 #include "typespec.hpp"
 
 using TypeMap = std::map<std::string, Type*>;
+
+// 内容が同じ TypeMap に対して同じポインタを返す
+const TypeMap* InternTypeMap(const TypeMap& gtype);
+
+// 型を具体化する。結果は翻訳単位の中でキャッシュされる。
+Type* ConcretizeType(const TypeMap* gtype, Type* type);
 Type* ConcretizeType(TypeMap& gtype, Type* type);
 Type* ConcretizeType(Type* type);
 
@@ -24,6 +30,16 @@ TypedFunc* NewTypedFunc(Object* gfunc, Node* type_list);
 Type* ConcretizeType(TypedFunc& f);
 std::string Mangle(TypedFunc& f);
 
+/* ジェネリック関数のインスタンス（関数と具体化後の型引数の組）を登録する
+ *
+ * 既に登録されていれば false を返す。
+ * 同じインスタンスを 2 度具体化・生成しないよう、ConcretizeDefFunc() の前に呼ぶ。
+ */
+bool RegisterInstance(Object* gfunc, TypeMap& gtype);
+
 // 与えられた kDefFunc ノードを複製しつつ型を具体化する
 // 戻り値は型が具体化されたノード
 Node* ConcretizeDefFunc(Source& src, TypeMap& gtype, Node* def);
+
+// 具体化の結果とインスタンスの表を空にする（翻訳単位のコンパイルを終えたら呼ぶ）
+void ClearGenericsCache();
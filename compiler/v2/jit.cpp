@@ -0,0 +1,180 @@
+#include "jit.hpp"
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+using namespace std;
+
+namespace {
+
+// 各セクションをページ境界から配置する（セクションごとに保護属性を変えるため）
+struct Image {
+  uint8_t* base = nullptr;
+  size_t size = 0;
+  vector<uint8_t*> sec_addr;
+};
+
+bool Map(const ObjFile& obj, Image& img) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  vector<size_t> offsets;
+  for (auto& sec : obj.sections) {
+    offsets.push_back(img.size);
+    img.size += (sec.data.size() + page - 1) / page * page;
+  }
+  if (img.size == 0) {
+    img.size = page;
+  }
+  void* p = mmap(nullptr, img.size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    cerr << "failed to map memory for the code" << endl;
+    return false;
+  }
+  img.base = static_cast<uint8_t*>(p);
+  for (size_t i = 0; i < obj.sections.size(); ++i) {
+    auto& data = obj.sections[i].data;
+    img.sec_addr.push_back(img.base + offsets[i]);
+    copy(data.begin(), data.end(), img.sec_addr.back());
+  }
+  return true;
+}
+
+bool Relocate(const ObjFile& obj, Image& img) {
+  vector<uint8_t*> sym_addr(obj.symbols.size());
+  for (size_t i = 0; i < obj.symbols.size(); ++i) {
+    auto& s = obj.symbols[i];
+    if (s.section >= 0) {
+      sym_addr[i] = img.sec_addr[s.section] + s.value;
+    } else if (auto p = dlsym(RTLD_DEFAULT, s.name.c_str())) {
+      sym_addr[i] = static_cast<uint8_t*>(p);
+    } else {
+      cerr << "undefined symbol: " << s.name << endl;
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < obj.sections.size(); ++i) {
+    for (auto& r : obj.sections[i].relocs) {
+      uint8_t* place = img.sec_addr[i] + r.offset;
+      const auto s = reinterpret_cast<intptr_t>(sym_addr[r.sym]);
+      if (r.type == R_X86_64_64) {
+        const uint64_t v = s + r.addend;
+        memcpy(place, &v, sizeof(v));
+      } else if (r.type == R_X86_64_PC32) {
+        const int64_t v = s + r.addend - reinterpret_cast<intptr_t>(place);
+        if (v < numeric_limits<int32_t>::min() ||
+            numeric_limits<int32_t>::max() < v) {
+          cerr << "relocation overflow: " << obj.symbols[r.sym].name << endl;
+          return false;
+        }
+        const int32_t v32 = v;
+        memcpy(place, &v32, sizeof(v32));
+      } else {
+        cerr << "unsupported relocation type: " << r.type << endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool Protect(const ObjFile& obj, Image& img) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < obj.sections.size(); ++i) {
+    auto& sec = obj.sections[i];
+    if (sec.data.empty()) {
+      continue;
+    }
+    int prot = PROT_READ;
+    if (sec.flags & SHF_WRITE) prot |= PROT_WRITE;
+    if (sec.flags & SHF_EXECINSTR) prot |= PROT_EXEC;
+    const size_t len = (sec.data.size() + page - 1) / page * page;
+    if (mprotect(img.sec_addr[i], len, prot) != 0) {
+      cerr << "failed to change protection of " << sec.name << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// perf が JIT コードのシンボルを表示できるよう /tmp/perf-<pid>.map を書く
+void WritePerfMap(const ObjFile& obj, const Image& img) {
+  vector<const ObjSymbol*> funcs;
+  for (auto& s : obj.symbols) {
+    if (s.section >= 0 && s.global &&
+        (obj.sections[s.section].flags & SHF_EXECINSTR)) {
+      funcs.push_back(&s);
+    }
+  }
+  sort(funcs.begin(), funcs.end(), [](auto a, auto b) {
+    return a->value < b->value;
+  });
+
+  ofstream map_file("/tmp/perf-" + to_string(getpid()) + ".map");
+  for (size_t i = 0; i < funcs.size(); ++i) {
+    auto& text = obj.sections[funcs[i]->section];
+    const uint64_t end =
+      i + 1 < funcs.size() ? funcs[i + 1]->value : text.data.size();
+    if (end == funcs[i]->value) {
+      continue; // 同じ位置に複数の名前がある
+    }
+    map_file << hex
+             << reinterpret_cast<uintptr_t>(img.sec_addr[funcs[i]->section] +
+                                            funcs[i]->value)
+             << ' ' << end - funcs[i]->value << ' ' << funcs[i]->name << '\n';
+  }
+}
+
+} // namespace
+
+bool LoadLibrary(const std::string& path) {
+  if (dlopen(path.c_str(), RTLD_NOW | RTLD_GLOBAL) == nullptr) {
+    cerr << "failed to load " << path << ": " << dlerror() << endl;
+    return false;
+  }
+  return true;
+}
+
+int RunObject(const ObjFile& obj, const std::vector<std::string>& args) {
+  Image img;
+  if (!Map(obj, img) || !Relocate(obj, img) || !Protect(obj, img)) {
+    return 1;
+  }
+  WritePerfMap(obj, img);
+
+  auto main_it = obj.sym_index.find("main");
+  if (main_it == obj.sym_index.end() ||
+      obj.symbols[main_it->second].section < 0) {
+    cerr << "main is not defined" << endl;
+    return 1;
+  }
+
+  for (size_t i = 0; i < obj.sections.size(); ++i) {
+    if (obj.sections[i].type != SHT_INIT_ARRAY) {
+      continue;
+    }
+    auto init = reinterpret_cast<void (**)()>(img.sec_addr[i]);
+    for (size_t j = 0; j < obj.sections[i].data.size() / 8; ++j) {
+      init[j]();
+    }
+  }
+
+  vector<char*> argv;
+  for (auto& arg : args) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  auto& main_sym = obj.symbols[main_it->second];
+  auto main_func = reinterpret_cast<int64_t (*)(int64_t, char**)>(
+      img.sec_addr[main_sym.section] + main_sym.value);
+  return main_func(args.size(), argv.data());
+}
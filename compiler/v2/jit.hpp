@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "objasm.hpp"
+
+/* オブジェクトを実行可能メモリに配置し、その場で実行する
+ *
+ * 未定義シンボルは dlsym で解決する（-load で読み込んだ共有ライブラリも対象）。
+ * .init_array の初期化関数を呼んだ後、main(argc, argv) を呼んでその戻り値を返す。
+ * perf がシンボルを解決できるよう /tmp/perf-<pid>.map を書き出す。
+ */
+int RunObject(const ObjFile& obj, const std::vector<std::string>& args);
+
+// シンボル解決に使う共有ライブラリを読み込む。失敗したら false
+bool LoadLibrary(const std::string& path);
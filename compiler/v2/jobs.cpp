@@ -0,0 +1,140 @@
+#include "jobs.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <utility>
+
+using namespace std;
+
+namespace {
+
+// 現在のスレッドがワーカーとして属するプールと、そのワーカーのキューの番号
+thread_local const JobPool* current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+} // namespace
+
+JobPool::JobPool(int num_workers) {
+  for (int i = 0; i <= num_workers; ++i) {
+    queues_.push_back(make_unique<Queue>());
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    workers_.emplace_back([this, i]{ WorkerMain(i); });
+  }
+}
+
+JobPool::~JobPool() {
+  {
+    lock_guard lock{wake_mtx_};
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void JobPool::Submit(JobGroup& group, std::function<void()> fn) {
+  ++group.num_running_;
+  auto& q = current_pool == this ? *queues_[current_queue] : *queues_.back();
+  {
+    lock_guard lock{q.mtx};
+    q.jobs.push_back({&group, move(fn)});
+  }
+  {
+    lock_guard lock{wake_mtx_};
+    ++num_queued_;
+  }
+  wake_.notify_one();
+}
+
+bool JobPool::RunOne(JobGroup* group) {
+  const size_t self = current_pool == this ? current_queue : queues_.size() - 1;
+  auto match = [group](const Job& job) {
+    return group == nullptr || job.group == group;
+  };
+
+  // ワーカーは自分のキューから最後に投入した仕事を取る。
+  // 他のキューと共有のキューからは、最初に投入した仕事から順に取る。
+  optional<Job> job;
+  for (size_t k = 0; k < queues_.size() && !job; ++k) {
+    const size_t i = (self + k) % queues_.size();
+    auto& q = *queues_[i];
+    lock_guard lock{q.mtx};
+    if (i == self && current_pool == this) {
+      if (auto it = find_if(q.jobs.rbegin(), q.jobs.rend(), match);
+          it != q.jobs.rend()) {
+        job = move(*it);
+        q.jobs.erase(next(it).base());
+      }
+    } else if (auto it = find_if(q.jobs.begin(), q.jobs.end(), match);
+               it != q.jobs.end()) {
+      job = move(*it);
+      q.jobs.erase(it);
+    }
+  }
+  if (!job) {
+    return false;
+  }
+  --num_queued_;
+
+  try {
+    job->fn();
+  } catch (...) {
+    lock_guard lock{job->group->error_mtx_};
+    if (!job->group->error_) {
+      job->group->error_ = current_exception();
+    }
+  }
+
+  // num_running_ が 0 になった時点でグループは破棄されうるので、以降は触らない
+  bool last;
+  {
+    lock_guard lock{wake_mtx_};
+    last = --job->group->num_running_ == 0;
+  }
+  if (last) {
+    wake_.notify_all();
+  }
+  return true;
+}
+
+void JobPool::WorkerMain(std::size_t index) {
+  current_pool = this;
+  current_queue = index;
+  for (;;) {
+    if (RunOne(nullptr)) {
+      continue;
+    }
+    unique_lock lock{wake_mtx_};
+    wake_.wait(lock, [this]{ return stop_ || num_queued_ > 0; });
+    if (stop_) {
+      return;
+    }
+  }
+}
+
+void JobGroup::Drain() {
+  while (num_running_ > 0) {
+    if (pool_.RunOne(this)) {
+      continue;
+    }
+    // 残りの仕事は他のスレッドが実行中。終わるまで眠る
+    unique_lock lock{pool_.wake_mtx_};
+    pool_.wake_.wait_for(lock, chrono::milliseconds{1},
+                         [this]{ return num_running_ == 0; });
+  }
+}
+
+void JobGroup::Wait() {
+  Drain();
+  lock_guard lock{error_mtx_};
+  if (auto error = exchange(error_, nullptr)) {
+    rethrow_exception(error);
+  }
+}
+
+JobGroup::~JobGroup() {
+  Drain();
+}
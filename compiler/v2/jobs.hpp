@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class JobGroup;
+
+/* ワークスティーリング方式のスレッドプール（-j）
+ *
+ * ワーカーはそれぞれ自分のキューを持ち、自分が投入した仕事を末尾から取って実行する。
+ * 自分のキューが空になったら、他のキューの先頭から仕事を盗む。
+ * ワーカー以外のスレッドが投入した仕事は共有のキューに入る。
+ *
+ * 仕事は JobGroup を通して投入し、JobGroup::Wait() で終わるのを待つ。
+ * 待っているスレッドも、そのグループの仕事を手伝って実行する。
+ * ワーカーの数が 0 なら、すべての仕事を Wait() したスレッドが実行する。
+ */
+class JobPool {
+ public:
+  explicit JobPool(int num_workers);
+  JobPool(const JobPool&) = delete;
+  JobPool& operator=(const JobPool&) = delete;
+  ~JobPool();
+
+  int NumWorkers() const { return workers_.size(); }
+
+ private:
+  friend class JobGroup;
+
+  struct Job {
+    JobGroup* group;
+    std::function<void()> fn;
+  };
+
+  struct Queue {
+    std::mutex mtx;
+    std::deque<Job> jobs;
+  };
+
+  void Submit(JobGroup& group, std::function<void()> fn);
+  // 仕事を 1 つ探して実行する。group が nullptr でなければ、そのグループの仕事だけを探す
+  bool RunOne(JobGroup* group);
+  void WorkerMain(std::size_t index);
+
+  std::vector<std::unique_ptr<Queue>> queues_; // 末尾は共有のキュー
+  std::vector<std::thread> workers_;
+  std::mutex wake_mtx_;
+  std::condition_variable wake_;
+  std::atomic<std::size_t> num_queued_ = 0;
+  bool stop_ = false;
+};
+
+// 同時に投入し、まとめて待つ仕事の集まり
+class JobGroup {
+ public:
+  explicit JobGroup(JobPool& pool) : pool_{pool} {}
+  JobGroup(const JobGroup&) = delete;
+  JobGroup& operator=(const JobGroup&) = delete;
+  ~JobGroup(); // 仕事が終わるまで待つ（例外は投げ直さない）
+
+  void Run(std::function<void()> fn) { pool_.Submit(*this, std::move(fn)); }
+
+  // すべての仕事が終わるまで待つ。仕事が例外を投げていたら、最初の例外を投げ直す
+  void Wait();
+
+ private:
+  friend class JobPool;
+
+  void Drain();
+
+  JobPool& pool_;
+  std::atomic<std::size_t> num_running_ = 0;
+  std::mutex error_mtx_;
+  std::exception_ptr error_;
+};
@@ -1,31 +1,48 @@
-#include <algorithm>
-#include <array>
-#include <bit>
-#include <bitset>
-#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
-#include <set>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <unistd.h>
+#include <vector>
 
+#include "arena.hpp"
 #include "asm.hpp"
 #include "ast.hpp"
-#include "generics.hpp"
-#include "magic_enum.hpp"
-#include "mangle.hpp"
-#include "object.hpp"
+#include "cache.hpp"
+#include "compile.hpp"
+#include "jit.hpp"
+#include "jobs.hpp"
+#include "objasm.hpp"
+#include "server.hpp"
 #include "source.hpp"
-#include "token.hpp"
+#include "trace.hpp"
 
 using namespace std;
 
 namespace {
 
-int verbosity = 0;
+opela::CompileOptions opts; // 翻訳単位ごとのコンパイルの設定
 string target_arch = "x86_64";
-string ast_graph;
+bool pool_stats = false;
+string output_path;    // 空なら標準出力へ出力する
+bool run_jit = false;  // 生成した機械語をその場で実行する
+vector<string> run_args{"-"}; // -run 以降の引数（プログラムの argv）
+vector<string> load_libs;     // -run でシンボル解決に使う共有ライブラリ
+bool time_report = false; // 段階ごとの時間を標準エラー出力へ表示する
+bool mem_report = false;  // 段階ごとのオブジェクト数とメモリ使用量を表示する
+string time_trace_path;   // 空でなければ Chrome トレース形式の JSON を書き出す
+bool compile_only = false;  // -c: 入力ファイルごとに出力ファイルを作る
+vector<string> input_paths; // -c でコンパイルするファイル
+bool server_mode = false;   // -server: コンパイル要求を繰り返し受け付ける
+string server_socket;       // 空でなければ標準入出力の代わりにこの Unix ソケットで受け付ける
+CodeCacheStats cache_stats;
+bool prune_report = false; // 到達できずに省いた関数の数を表示する
+PruneStats prune_stats;
 
 int ParseArgs(int argc, char** argv) {
   int i = 1;
@@ -39,22 +56,119 @@ int ParseArgs(int argc, char** argv) {
       target_arch = argv[i + 1];
       i += 2;
     } else if (opt == "-v") {
-      ++verbosity;
+      ++opts.verbosity;
       ++i;
     } else if (opt == "-gen-ast-graph") {
       if (i == argc - 1) {
         cerr << "-gen-ast-graph needs one argument" << endl;
         return 1;
       }
-      ast_graph = argv[i + 1];
+      opts.ast_graph = argv[i + 1];
       i += 2;
     } else if (opt == "-gen-parse-anime") {
       if (i == argc - 1) {
         cerr << "-gen-parse-anime needs one argument" << endl;
         return 1;
       }
-      parse_anime_dir = argv[i + 1];
+      opts.parse_anime_dir = argv[i + 1];
       i += 2;
+    } else if (opt == "-pre-tokenize") {
+      opts.lex_mode = opela::LexMode::kPreLex;
+      ++i;
+    } else if (opt == "-lex-thread") {
+      opts.lex_mode = opela::LexMode::kLexThread;
+      ++i;
+    } else if (opt == "-pool-stats") {
+      pool_stats = true;
+      ++i;
+    } else if (opt == "-lean") {
+      opts.lean_asm = true;
+      ++i;
+    } else if (opt == "-emit-obj") {
+      opts.emit_obj = true;
+      ++i;
+    } else if (opt == "-run") {
+      run_jit = true;
+      run_args.insert(run_args.end(), argv + i + 1, argv + argc);
+      i = argc;
+    } else if (opt == "-load") {
+      if (i == argc - 1) {
+        cerr << "-load needs one argument" << endl;
+        return 1;
+      }
+      load_libs.push_back(argv[i + 1]);
+      i += 2;
+    } else if (opt == "-ftime-report") {
+      time_report = true;
+      ++i;
+    } else if (opt == "-fmem-report") {
+      mem_report = true;
+      ++i;
+    } else if (opt == "-ftime-trace") {
+      if (i == argc - 1) {
+        cerr << "-ftime-trace needs one argument" << endl;
+        return 1;
+      }
+      time_trace_path = argv[i + 1];
+      i += 2;
+    } else if (opt == "-j") {
+      if (i == argc - 1) {
+        cerr << "-j needs one argument" << endl;
+        return 1;
+      }
+      opts.num_jobs = atoi(argv[i + 1]);
+      if (opts.num_jobs < 1) {
+        cerr << "-j needs a positive number: " << argv[i + 1] << endl;
+        return 1;
+      }
+      i += 2;
+    } else if (opt == "-I") {
+      if (i == argc - 1) {
+        cerr << "-I needs one argument" << endl;
+        return 1;
+      }
+      opts.import_dirs.push_back(argv[i + 1]);
+      i += 2;
+    } else if (opt == "-cache-dir") {
+      if (i == argc - 1) {
+        cerr << "-cache-dir needs one argument" << endl;
+        return 1;
+      }
+      opts.cache_dir = argv[i + 1];
+      i += 2;
+    } else if (opt == "-prune-unused") {
+      opts.prune_unused = true;
+      ++i;
+    } else if (opt == "-prune-report") {
+      prune_report = true;
+      ++i;
+    } else if (opt == "-stream") {
+      opts.streaming = true;
+      ++i;
+    } else if (opt == "-server") {
+      server_mode = true;
+      ++i;
+    } else if (opt == "-server-socket") {
+      if (i == argc - 1) {
+        cerr << "-server-socket needs one argument" << endl;
+        return 1;
+      }
+      server_mode = true;
+      server_socket = argv[i + 1];
+      i += 2;
+    } else if (opt == "-c") {
+      compile_only = true;
+      ++i;
+    } else if (opt == "-o") {
+      if (i == argc - 1) {
+        cerr << "-o needs one argument" << endl;
+        return 1;
+      }
+      output_path = argv[i + 1];
+      i += 2;
+    } else if (!opt.starts_with('-')) {
+      input_paths.push_back(argv[i]);
+      ++i;
     } else {
       cerr << "unknown argument: " << opt << endl;
       return 1;
@@ -63,966 +177,275 @@ int ParseArgs(int argc, char** argv) {
   return 0;
 }
 
-void ExtractBits(Asm& asmgen, Asm::Register v, int offset, int width) {
-  /* v:      0001'0010'0011'0100
-   * offset: 8    ^^^^
-   * width:  4
-   *
-   * result: 0000'0000'0000'0010
-   */
-  asmgen.ShiftL64(v, 64 - offset - width);
-  asmgen.ShiftR64(v, 64 - width);
-}
-
 } // namespace
 
-Asm::Register UseAnyCalcReg(Asm::RegSet& free_calc_regs) {
-  auto reg_index = countr_zero(free_calc_regs.to_ulong());
-  if (reg_index >= Asm::kRegNum) {
-    return Asm::kRegNum;
-  }
-  free_calc_regs.reset(reg_index);
-  return static_cast<Asm::Register>(reg_index);
-}
-
-bool HasChildren(Node* node) {
-  if (node == nullptr) {
-    return false;
-  } else if (node->kind == Node::kInt) {
-    return false;
-  }
-  return true;
-}
-
-int SetErshovNumber(Source& src, Node* expr) {
-  if (expr->ershov > 0) {
-    return expr->ershov;
-  } else if (expr->kind == Node::kCall) {
-    for (auto arg = expr->rhs; arg; arg = arg->next) {
-      SetErshovNumber(src, arg);
-    }
-    return expr->ershov = 9;
-  } else if (expr->lhs == nullptr && expr->rhs == nullptr) {
-    return expr->ershov = 1;
-  } else if (expr->lhs != nullptr && expr->rhs != nullptr) {
-    int l = SetErshovNumber(src, expr->lhs);
-    int r = SetErshovNumber(src, expr->rhs);
-    return expr->ershov = l == r ? l + 1 : max(l, r);
-  } else if (expr->lhs != nullptr && expr->rhs == nullptr) {
-    return expr->ershov = SetErshovNumber(src, expr->lhs);
-  }
-  cerr << "unexpected node" << endl;
-  ErrorAt(src, *expr->token);
-}
-
-struct GenContext {
-  Source& src;
-  Asm& asmgen;
-  Object* func;
-};
-
-struct LabelSet {
-  string cont, brk;
-};
-
-size_t label_counter = 0;
-string GenerateLabel() {
-  ostringstream oss;
-  oss << "LABEL" << label_counter++;
-  return oss.str();
+// -cache-dir のキャッシュから再利用した関数の割合を表示する
+void PrintCacheStats(ostream& os) {
+  const size_t hits = cache_stats.hits;
+  const size_t total = hits + cache_stats.misses;
+  ostringstream rate;
+  rate << fixed << setprecision(1) << (total ? 100.0 * hits / total : 0.0);
+  os << "code cache: " << hits << '/' << total << " functions reused ("
+     << rate.view() << "%)" << endl;
 }
 
-string StringLabel(size_t index) {
-  ostringstream oss;
-  oss << "STR" << index;
-  return oss.str();
+// 到達できずに型付け・コード生成を省いた関数の数を表示する
+void PrintPruneStats(ostream& os) {
+  os << "pruned " << prune_stats.pruned_funcs << '/' << prune_stats.funcs
+     << " functions, " << prune_stats.pruned_gfuncs << '/'
+     << prune_stats.gfuncs << " generic functions and "
+     << prune_stats.pruned_instances << " instantiations" << endl;
 }
 
-const std::array<const char*, 9> kSizeMap{
-  nullptr,
-  ".byte",
-  ".2byte",
-  nullptr,
-  ".4byte",
-  nullptr,
-  nullptr,
-  nullptr,
-  ".8byte",
-};
-
-uint64_t GenMaskBits(int bit_width) {
-  if (bit_width == 64) {
-    return 0xffffffffffffffff;
+// -c で 1 つの入力ファイルをコンパイルし、out_path へ書き出す。成功したら true を返す
+// エラーは diagnostics へ書き出す（並行してコンパイルする他のファイルのエラーと混ざらないように）
+bool CompileFile(const string& input_path, const filesystem::path& out_path,
+                 JobPool& pool, ostream& diagnostics) {
+  TraceSpan span{"CompileFile", input_path};
+  ErrorOutScope error_scope{diagnostics};
+  ifstream in{input_path, ios::binary};
+  if (!in) {
+    ErrorOut() << "failed to open " << input_path << endl;
+    return false;
   }
-  return (uint64_t(1) << bit_width) - 1;
-}
+  Source src{input_path};
+  src.ReadAll(in);
 
-int CeilBitsToRegSize(int bits) {
-  return ((bits + 7) >> 3) << 3;
-}
-
-bool GenCast(GenContext& ctx, Asm::Register dest,
-             Type* from_type, Type* to_type, bool explicit_cast = false) {
-  auto f = GetUserBaseType(from_type);
-  auto t = GetUserBaseType(to_type);
-  if (IsEqual(f, t)) {
+  ofstream out{out_path, ios::binary};
+  if (!out) {
+    ErrorOut() << "failed to open " << out_path.native() << endl;
     return false;
   }
+  auto asmgen = opela::NewOutputAsm(opts.arch, out, opts.emit_obj);
+  auto obj_asm = opts.emit_obj ?
+    static_cast<ObjectAsm*>(asmgen.get()) : nullptr;
+
+  bool ok = true;
+  try {
+    PhaseRecorder phases;
+    opela::CompileUnit(opts, src, out, asmgen.get(), obj_asm, pool, phases);
+  } catch (const CompileError&) {
+    ok = false;
+  }
+  opela::ReleaseUnit();
 
-  if (IsIntegral(f)) {
-    if (IsIntegral(t)) {
-      auto f_bits = get<long>(f->value);
-      auto t_bits = get<long>(t->value);
-      if (t_bits < f_bits) {
-        ctx.asmgen.ShiftL64(dest, 64 - t_bits);
-        ctx.asmgen.ShiftR64(dest, 64 - t_bits);
-      } else if (f_bits < t_bits) {
-        ctx.asmgen.ShiftL64(dest, 64 - f_bits);
-        if (f->kind == Type::kInt) { // sign extend
-          ctx.asmgen.ShiftAR64(dest, 64 - f_bits);
-        } else { // zero extend
-          ctx.asmgen.ShiftR64(dest, 64 - f_bits);
-        }
-      }
-    } else if (t->kind == Type::kBool) {
-      ctx.asmgen.Set1IfNonZero64(dest, dest);
-    } else if (explicit_cast && t->kind == Type::kPointer) {
-      // pass
-    } else {
-      return true;
-    }
-  } else if (f->kind == Type::kBool) {
-    if (!IsIntegral(t) && t->kind != Type::kBool) {
-      return true;
-    }
-  } else if (explicit_cast && f->kind == Type::kPointer) {
-    if (t->kind == Type::kPointer) {
-      // pass
-    } else if (IsIntegral(t)) {
-      if (auto bits = get<long>(t->value); bits < 64) {
-
-        ctx.asmgen.And64(dest, (1 << get<long>(t->value)) - 1);
-      }
-    } else {
-      return true;
-    }
-  } else {
-    return true;
+  if (!ok) {
+    out.close();
+    filesystem::remove(out_path);
   }
-  return false;
+  return ok;
 }
 
-Asm::DataType BytesToDataType(int bytes) {
-  if (bytes == 1) {
-    return Asm::kByte;
-  } else if (bytes == 2) {
-    return Asm::kWord;
-  } else if (bytes <= 4) {
-    return Asm::kDWord;
-  } else if (bytes <= 8) {
-    return Asm::kQWord;
+/* -c: 入力ファイルごとにコンパイルし、出力ディレクトリ（-o、省略時はカレントディレクトリ）に
+ * 拡張子を .s（-emit-obj なら .o）に替えたファイルを書き出す
+ *
+ * ファイルは 1 つずつ pool の仕事になり、並行して構文解析・型付け・コード生成する。
+ * 終わったファイルから順に進捗と結果を標準エラー出力へ表示する。
+ * ファイルのエラーは溜めておき、そのファイルの進捗の行に続けてまとめて表示する。
+ */
+int CompileFiles(JobPool& pool) {
+  const filesystem::path out_dir = output_path.empty() ? "." : output_path;
+  error_code ec;
+  filesystem::create_directories(out_dir, ec);
+  if (ec) {
+    cerr << "failed to create " << out_dir.native() << ": "
+         << ec.message() << endl;
+    return 1;
   }
-  return Asm::kNonStandardDataType;
-}
 
-Asm::DataType DataTypeOf(GenContext& ctx, Type* type) {
-  return BytesToDataType(SizeofType(ctx.src, type));
-}
+  mutex report_mtx;
+  size_t num_done = 0, num_failed = 0;
+  JobGroup group{pool};
+  for (auto& input_path : input_paths) {
+    group.Run([&]{
+      auto out_path = out_dir / filesystem::path{input_path}.filename();
+      out_path.replace_extension(opts.emit_obj ? ".o" : ".s");
+      ostringstream diagnostics;
+      const bool ok = CompileFile(input_path, out_path, pool, diagnostics);
+
+      lock_guard lock{report_mtx};
+      ++num_done;
+      num_failed += !ok;
+      cerr << '[' << num_done << '/' << input_paths.size() << "] "
+           << input_path << (ok ? " -> " + out_path.native() : ": failed")
+           << endl;
+      cerr << diagnostics.view() << flush;
+    });
+  }
+  group.Wait();
 
-Asm::DataType DataTypeOf(GenContext& ctx, Node* node) {
-  auto dt = DataTypeOf(ctx, node->type);
-  if (dt == Asm::kNonStandardDataType) {
-    cerr << "non-standard data type: " << node->type << endl;
-    ErrorAt(ctx.src, *node->token);
+  if (num_failed > 0) {
+    cerr << num_failed << " of " << input_paths.size()
+         << " files failed to compile" << endl;
+    return 1;
   }
-  return dt;
+  return 0;
 }
 
-struct EvalBinOp {
-  Node* node;
-  Asm::Register dest_reg, calc_reg;
-  Asm::Register lhs_reg, rhs_reg;
-  bool lhs_in_dest;
-};
-
-void GenerateAsm(GenContext& ctx, Node* node,
-                 Asm::Register dest, Asm::RegSet free_calc_regs,
-                 const LabelSet& labels, bool lval = false);
-
-void GenerateAssign(GenContext& ctx, const EvalBinOp& e,
-                    Asm::RegSet free_calc_regs, bool lval) {
-  const auto lhs_t = GetUserBaseType(e.node->lhs->type);
-  const auto rhs_t = GetUserBaseType(e.node->rhs->type);
-  if (rhs_t->kind == Type::kInitList) {
-    if (lhs_t->kind == Type::kArray) {
-      const auto reg = UseAnyCalcReg(free_calc_regs);
-      const auto elem_size = SizeofType(ctx.src, lhs_t->base);
-      const auto elem_dt = BytesToDataType(elem_size);
-      int elem_offset = 0;
-      int sp_offset = 0;
-      auto init_elem = e.node->rhs->lhs;
-      for (int i = 0; i < get<long>(lhs_t->value); ++i) {
-        if (init_elem) {
-          ctx.asmgen.LoadN(reg, e.rhs_reg, sp_offset,
-                           DataTypeOf(ctx, init_elem));
-          ctx.asmgen.StoreN(e.lhs_reg, elem_offset, reg, elem_dt);
-          init_elem = init_elem->next;
-        } else {
-          ctx.asmgen.StoreN(e.lhs_reg, elem_offset, Asm::kRegZero, elem_dt);
-        }
-        sp_offset += 8;
-        elem_offset += elem_size;
-      }
-    } else if (lhs_t->kind == Type::kStruct) {
-      const auto reg = UseAnyCalcReg(free_calc_regs);
-      int field_offset = 0;
-      int sp_offset = 0;
-      auto init_elem = e.node->rhs->lhs;
-      for (auto ft = lhs_t->next; ft; ft = ft->next) {
-        const auto field_size = SizeofType(ctx.src, ft);
-        const auto field_dt = BytesToDataType(field_size);
-        if (init_elem) {
-          ctx.asmgen.LoadN(reg, e.rhs_reg, sp_offset,
-                           DataTypeOf(ctx, init_elem));
-          ctx.asmgen.StoreN(e.lhs_reg, field_offset, reg, field_dt);
-          init_elem = init_elem->next;
-        } else {
-          ctx.asmgen.StoreN(e.lhs_reg, field_offset, Asm::kRegZero, field_dt);
-        }
-        sp_offset += 8;
-        field_offset += field_size;
-      }
-    }
-  } else {
-    if (auto lhs_size = SizeofType(ctx.src, e.node->lhs->type); lhs_size > 8) {
-      // 8バイトより大きなデータ構造はレジスタにアドレスが格納されているはず
-      const auto reg = UseAnyCalcReg(free_calc_regs);
-      for (size_t i = 0; 8 * i < lhs_size; ++i) {
-        auto copy_dt = BytesToDataType(min(size_t(8), lhs_size - 8 * i));
-        ctx.asmgen.LoadN(reg, e.rhs_reg, 8 * i, copy_dt);
-        ctx.asmgen.StoreN(e.lhs_reg, 8 * i, reg, copy_dt);
-      }
-    } else {
-      // 8バイト以下のデータ構造はレジスタに値自体が乗っている
-      ctx.asmgen.StoreN(e.lhs_reg, 0, e.rhs_reg, BytesToDataType(lhs_size));
-    }
+int main(int argc, char** argv) {
+  if (int err = ParseArgs(argc, argv)) {
+    return err;
   }
-  if (lval && !e.lhs_in_dest) {
-    ctx.asmgen.Mov64(e.dest_reg, e.calc_reg);
-  } else if (!lval && e.lhs_in_dest) {
-    ctx.asmgen.Mov64(e.dest_reg, e.calc_reg);
+  if (!time_trace_path.empty()) {
+    EnableTimeTrace();
   }
-}
-
-void GenerateGVarData(GenContext& ctx, Type* obj_t, Node* init) {
-  obj_t = GetUserBaseType(obj_t);
-  const auto obj_size = SizeofType(ctx.src, obj_t);
 
-  if (init == nullptr || IsLiteral(init) == false) {
-    ctx.asmgen.Output() << "    .zero " << obj_size << '\n';
-  } else if (init->kind == Node::kInt) {
-    ctx.asmgen.Output() << "    " << kSizeMap[obj_size] << ' '
-                        << get<opela_type::Int>(init->value) << '\n';
-  } else if (init->kind == Node::kInitList && obj_t->kind == Type::kArray) {
-    auto init_elem = init->lhs;
-    for (int i = 0; i < get<long>(obj_t->value); ++i) {
-      GenerateGVarData(ctx, obj_t->base, init_elem);
-      init_elem = init_elem ? init_elem->next : nullptr;
-    }
-  } else if (init->kind == Node::kInitList && obj_t->kind == Type::kStruct) {
-    auto init_elem = init->lhs;
-    for (auto ft = obj_t->next; ft; ft = ft->next) {
-      GenerateGVarData(ctx, ft->base, init_elem);
-      init_elem = init_elem ? init_elem->next : nullptr;
-    }
+  if (target_arch == "x86_64") {
+    opts.arch = AsmArch::kX86_64;
+  } else if (target_arch == "aarch64") {
+    opts.arch = AsmArch::kAArch64;
   } else {
-    cerr << "unknown initial data type" << endl;
-    ErrorAt(ctx.src, *init->token);
+    cerr << "current version doesn't support " << target_arch << endl;
+    return 1;
   }
-}
-
-void GenerateAsm(GenContext& ctx, Node* node,
-                 Asm::Register dest, Asm::RegSet free_calc_regs,
-                 const LabelSet& labels, bool lval) {
-  auto comment_node = [&ctx, node]{
-    ctx.asmgen.Output() << "    // ";
-    PrintAST(ctx.asmgen.Output(), node);
-    ctx.asmgen.Output() << '\n';
-  };
-
-  switch (node->kind) {
-  case Node::kInt:
-    comment_node();
-    ctx.asmgen.Mov64(dest, get<opela_type::Int>(node->value));
-    return;
-  case Node::kBlock:
-    for (auto stmt = node->next; stmt; stmt = stmt->next) {
-      GenerateAsm(ctx, stmt, dest, free_calc_regs, labels);
-    }
-    return;
-  case Node::kId:
-    comment_node();
-    if (auto p = get_if<Object*>(&node->value)) {
-      Object* obj = *p;
-      switch (obj->linkage) {
-      case Object::kLocal:
-        if (lval || SizeofType(ctx.src, obj->type) > 8) {
-          ctx.asmgen.LEA(dest, Asm::kRegBP, obj->bp_offset);
-        } else {
-          ctx.asmgen.LoadN(dest, Asm::kRegBP, obj->bp_offset,
-                           DataTypeOf(ctx, obj->type));
-        }
-        break;
-      case Object::kGlobal:
-      case Object::kExternal:
-        if (obj->kind == Object::kFunc) {
-          if (obj->linkage == Object::kExternal &&
-              obj->def->cond->token->raw == R"("C")") {
-            ctx.asmgen.LoadLabelAddr(dest, ctx.asmgen.SymLabel(obj->id->raw));
-          } else {
-            ctx.asmgen.LoadLabelAddr(
-                dest, ctx.asmgen.SymLabel(obj->mangled_name));
-          }
-        } else if (lval) {
-          ctx.asmgen.LoadLabelAddr(dest, ctx.asmgen.SymLabel(obj->id->raw));
-        } else {
-          ctx.asmgen.LoadN(dest, obj->id->raw, DataTypeOf(ctx, obj->type));
-        }
-        break;
-      }
-    }
-    return;
-  case Node::kDefVar:
-    if (node->rhs) {
-      break;
-    }
-    return;
-  case Node::kDefFunc:
-    {
-      auto func = get<Object*>(node->value);
-      GenContext func_ctx{ctx.src, ctx.asmgen, func};
-
-      int stack_size = 0;
-      for (Object* obj : func->locals) {
-        stack_size += (SizeofType(ctx.src, obj->type) + 7) & ~7;
-        obj->bp_offset = -stack_size;
-      }
-      stack_size = (stack_size + 0xf) & ~static_cast<size_t>(0xf);
-
-      ctx.asmgen.FuncPrologue(func->mangled_name);
-
-      ctx.asmgen.Sub64(Asm::kRegSP, stack_size);
-      int arg_index = 0;
-      for (auto param = node->rhs; param; param = param->next) {
-        auto arg_reg = static_cast<Asm::Register>(Asm::kRegV0 + arg_index);
-        ctx.asmgen.StoreN(Asm::kRegBP, -8 * (1 + arg_index),
-                          arg_reg, Asm::kQWord);
-        ++arg_index;
-      }
-      GenerateAsm(func_ctx, node->lhs, dest, free_calc_regs, labels);
-      ctx.asmgen.Xor64(Asm::kRegA, Asm::kRegA);
-      ctx.asmgen.Output() << func->mangled_name << ".exit:\n";
-      ctx.asmgen.FuncEpilogue();
-      return;
-    }
-  case Node::kRet:
-    comment_node();
-    if (node->lhs) {
-      GenerateAsm(ctx, node->lhs, Asm::kRegA, free_calc_regs, labels);
-      if (GenCast(ctx, Asm::kRegA, node->lhs->type, ctx.func->type->base)) {
-        cerr << "not implemented cast from " << node->lhs->type
-             << " to " << ctx.func->type->base << endl;
-        ErrorAt(ctx.src, *node->token);
-      }
-    }
-    ctx.asmgen.Jmp(ctx.func->mangled_name + ".exit");
-    return;
-  case Node::kIf:
-    comment_node();
-    {
-      auto label_exit = GenerateLabel();
-      auto label_else = node->rhs ? GenerateLabel() : label_exit;
-      GenerateAsm(ctx, node->cond, dest, free_calc_regs, labels);
-      ctx.asmgen.JmpIfZero(dest, label_else);
-      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels);
-      if (node->rhs) {
-        ctx.asmgen.Jmp(label_exit);
-        ctx.asmgen.Output() << label_else << ": // else clause\n";
-        GenerateAsm(ctx, node->rhs, dest, free_calc_regs, labels);
-      }
-      ctx.asmgen.Output() << label_exit << ": // if stmt exit\n";
-    }
-    return;
-  case Node::kLoop:
-    comment_node();
-    {
-      LabelSet ls{GenerateLabel(), GenerateLabel()};
-      ctx.asmgen.Output() << ls.cont << ": // loop body\n";
-      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, ls);
-      ctx.asmgen.Jmp(ls.cont);
-      ctx.asmgen.Output() << ls.brk << ": // loop end\n";
+  if (opts.emit_obj || run_jit) {
+    if (opts.arch != AsmArch::kX86_64) {
+      cerr << "-emit-obj and -run support only x86_64" << endl;
+      return 1;
     }
-    return;
-  case Node::kFor:
-    comment_node();
-    {
-      auto label_loop = GenerateLabel();
-      auto label_cond = GenerateLabel();
-      LabelSet ls{node->rhs ? GenerateLabel() : label_cond, GenerateLabel()};
-      if (node->rhs) {
-        GenerateAsm(ctx, node->rhs, dest, free_calc_regs, ls);
-      }
-      ctx.asmgen.Jmp(label_cond);
-      ctx.asmgen.Output() << label_loop << ": // loop body\n";
-      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, ls);
-      if (node->rhs) {
-        ctx.asmgen.Output() << ls.cont << ": // update\n";
-        GenerateAsm(ctx, node->rhs->next, dest, free_calc_regs, ls);
-      }
-      ctx.asmgen.Output() << label_cond << ": // condition\n";
-      GenerateAsm(ctx, node->cond, dest, free_calc_regs, ls);
-      ctx.asmgen.JmpIfNotZero(dest, label_loop);
-      ctx.asmgen.Output() << ls.brk << ": // loop end\n";
+#ifndef __x86_64__
+    if (run_jit) {
+      cerr << "-run supports only x86_64 hosts" << endl;
+      return 1;
     }
-    return;
-  case Node::kCall:
-    {
-      SetErshovNumber(ctx.src, node);
-      const int num_arg = CountListItems(node->rhs);
-
-      int num_normal_param = 0;
-
-      auto func_t = node->lhs->type;
-      if (func_t->kind == Type::kPointer) {
-        func_t = func_t->base;
-      }
-      Node* varg_start = node->rhs;
-      for (auto param_t = func_t->next;
-           param_t && param_t->kind == Type::kParam;
-           param_t = param_t->next) {
-        ++num_normal_param;
-        varg_start = varg_start->next;
-      }
-
-      vector<Asm::Register> saved_regs;
-      auto save_reg = [&](Asm::Register reg) {
-        ctx.asmgen.Push64(reg);
-        saved_regs.push_back(reg);
-      };
-
-      // 戻り値、引数レジスタを退避
-      if (dest != Asm::kRegA) {
-        save_reg(Asm::kRegA);
-      }
-      for (int i = -1; i < num_arg; ++i) {
-        auto reg = static_cast<Asm::Register>(Asm::kRegV0 + i);
-        if (!ctx.asmgen.SameReg(reg, dest) && !free_calc_regs.test(reg)) {
-          save_reg(reg);
-          free_calc_regs.set(reg);
-        }
-      }
-
-      // 関数名の評価結果を格納するレジスタを探す
-      Asm::Register lhs_reg = Asm::kRegNV0;
-      for (int i = Asm::kRegV0 + num_arg; i <= Asm::kRegY; ++i) {
-        if (free_calc_regs.test(i)) {
-          lhs_reg = static_cast<Asm::Register>(i);
-          break;
-        }
-      }
-      if (lhs_reg > Asm::kRegY) {
-        lhs_reg = Asm::kRegY;
-        save_reg(lhs_reg);
-        free_calc_regs.set(lhs_reg);
-      }
-
-      // 可変長引数をスタックに積む（特定のアーキテクチャだけ）
-      if (ctx.asmgen.VParamOnStack()) {
-        unsigned int bytes = 8 * (num_arg - num_normal_param);
-        bytes = (bytes + 0xf) & ~0xf;
-        ctx.asmgen.Sub64(Asm::kRegSP, bytes);
-
-        unsigned int offset = 0;
-        for (auto varg = varg_start; varg; varg = varg->next) {
-          GenerateAsm(ctx, varg, dest, free_calc_regs, labels);
-          ctx.asmgen.Output() << "    // store varg into stack\n";
-          ctx.asmgen.StoreN(Asm::kRegSP, offset, dest, Asm::kQWord);
-          offset += 8;
-        }
-      }
-
-      // Ershov 数が 2 以上の引数を事前に評価し、スタックに保存しておく
-      vector<Node*> reg_args;
-      Node* arg_on_reg_end = ctx.asmgen.VParamOnStack() ? varg_start : nullptr;
-      for (auto arg = node->rhs; arg != arg_on_reg_end; arg = arg->next) {
-        reg_args.push_back(arg);
-        if (arg->ershov >= 2) {
-          GenerateAsm(ctx, arg, dest, free_calc_regs, labels);
-          ctx.asmgen.Push64(dest);
-        }
-      }
-
-      GenerateAsm(ctx, node->lhs, lhs_reg, free_calc_regs, labels);
-      free_calc_regs.reset(lhs_reg);
-
-      // 引数レジスタに実引数を設定する
-      while (!reg_args.empty()) {
-        auto arg = reg_args.back();
-        reg_args.pop_back();
-        auto reg = static_cast<Asm::Register>(Asm::kRegV0 + reg_args.size());
-        if (arg->ershov == 1) {
-          GenerateAsm(ctx, arg, reg, free_calc_regs, labels);
-        } else {
-          ctx.asmgen.Pop64(reg);
-        }
-      }
-
-      // 関数を呼び、結果を dest レジスタにコピーする
-      ctx.asmgen.Output() << "    // calling " << node->lhs->token->raw << '\n';
-      ctx.asmgen.Call(lhs_reg);
-      if (Asm::kRegA != dest) {
-        ctx.asmgen.Mov64(dest, Asm::kRegA);
-      }
-
-      // 可変長引数を積んだスタックの領域を開放する
-      if (ctx.asmgen.VParamOnStack()) {
-        unsigned int bytes = 8 * (num_arg - num_normal_param);
-        bytes = (bytes + 0xf) & ~0xf;
-        ctx.asmgen.Add64(Asm::kRegSP, bytes);
-      }
+#endif
+    opts.lean_asm = true; // コメントや AST を出力先に混ぜない
+  }
+  if (run_jit) {
+    opts.emit_obj = false; // ELF は書き出さずに実行する
+  }
 
-      // 退避したレジスタの復帰
-      while (!saved_regs.empty()) {
-        ctx.asmgen.Pop64(saved_regs.back());
-        saved_regs.pop_back();
-      }
-    }
-    return;
-  case Node::kStr:
-    comment_node();
-    ctx.asmgen.LoadLabelAddr(
-        dest, StringLabel(get<StringIndex>(node->value).i));
-    return;
-  case Node::kExtern:
-  case Node::kTypedef:
-    return;
-  case Node::kSizeof:
-    comment_node();
-    ctx.asmgen.Mov64(dest, SizeofType(ctx.src, node->lhs->type));
-    return;
-  case Node::kCast:
-    if (node->rhs->kind == Node::kTList) {
-      auto tf = get<TypedFunc*>(node->value);
-      ctx.asmgen.LoadLabelAddr(dest, ctx.asmgen.SymLabel(Mangle(*tf)));
-      return;
-    }
-    GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, lval);
-    if (GenCast(ctx, dest, node->lhs->type, node->rhs->type, true)) {
-      cerr << "not implemented cast from " << node->lhs->type
-           << " to " << node->rhs->type << endl;
-      ErrorAt(ctx.src, *node->token);
-    }
-    return;
-  case Node::kChar:
-    comment_node();
-    ctx.asmgen.Mov64(dest, get<opela_type::Byte>(node->value));
-    return;
-  case Node::kLAnd:
-    comment_node();
-    {
-      auto label_end = GenerateLabel();
-      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels);
-      ctx.asmgen.JmpIfZero(dest, label_end);
-      GenerateAsm(ctx, node->rhs, dest, free_calc_regs, labels);
-      ctx.asmgen.Set1IfNonZero64(dest, dest);
-      ctx.asmgen.Output() << label_end << ": // end of '&&'\n";
-    }
-    return;
-  case Node::kLOr:
-    comment_node();
-    {
-      auto label_end = GenerateLabel();
-      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels);
-      ctx.asmgen.JmpIfNotZero(dest, label_end);
-      GenerateAsm(ctx, node->rhs, dest, free_calc_regs, labels);
-      ctx.asmgen.Output() << label_end << ": // end of '||'\n";
-      ctx.asmgen.Set1IfNonZero64(dest, dest);
-    }
-    return;
-  case Node::kBreak:
-    comment_node();
-    ctx.asmgen.Jmp(labels.brk);
-    return;
-  case Node::kCont:
-    comment_node();
-    ctx.asmgen.Jmp(labels.cont);
-    return;
-  case Node::kInc:
-    comment_node();
-    GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, true);
-    ctx.asmgen.IncN(dest, DataTypeOf(ctx, node));
-    return;
-  case Node::kDec:
-    comment_node();
-    GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, true);
-    ctx.asmgen.DecN(dest, DataTypeOf(ctx, node));
-    return;
-  case Node::kInitList:
-    comment_node();
-    {
-      int sp_offset = 0;
-      for (auto elem = node->lhs; elem; elem = elem->next) {
-        auto esize = SizeofType(ctx.src, elem->type);
-        sp_offset += (esize + 7) & ~7;
-      }
-      ctx.asmgen.Sub64(Asm::kRegSP, (sp_offset + 0xf) & ~0xf);
-      sp_offset = 0;
-      for (auto elem = node->lhs; elem; elem = elem->next) {
-        GenerateAsm(ctx, elem, dest, free_calc_regs, labels);
-        ctx.asmgen.StoreN(Asm::kRegSP, sp_offset, dest, DataTypeOf(ctx, elem));
-        auto esize = SizeofType(ctx.src, elem->type);
-        sp_offset += (esize + 7) & ~7;
-      }
-      ctx.asmgen.Mov64(dest, Asm::kRegSP);
-    }
-    return;
-  case Node::kDot:
-    {
-      size_t field_offset = 0;
-      auto ft = GetUserBaseType(node->lhs->type)->next;
-      for (; ft; ft = ft->next) {
-        if (get<Token*>(ft->value)->raw == node->rhs->token->raw) {
-          break;
-        }
-        field_offset += SizeofType(ctx.src, ft);
-      }
-      if (SizeofType(ctx.src, node->lhs->type) > 8 || lval) {
-        GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, true);
-        if (lval) {
-          ctx.asmgen.Add64(dest, field_offset);
-        } else {
-          ctx.asmgen.LoadN(dest, dest, field_offset, DataTypeOf(ctx, ft->base));
-        }
-      } else { // SizeofType <= 8 && lval == false
-        GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, false);
-        if (auto field_size = SizeofType(ctx.src, ft->base); field_size < 8) {
-          ExtractBits(ctx.asmgen, dest, field_offset * 8, field_size * 8);
-        }
-      }
-    }
-    return;
-  case Node::kArrow:
-    {
-      size_t field_offset = 0;
-      auto ptr_t = GetUserBaseType(node->lhs->type);
-      auto ft = GetUserBaseType(ptr_t->base)->next;
-      for (; ft; ft = ft->next) {
-        if (get<Token*>(ft->value)->raw == node->rhs->token->raw) {
-          break;
-        }
-        field_offset += SizeofType(ctx.src, ft);
-      }
-      GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, false);
-      if (lval) {
-        ctx.asmgen.Add64(dest, field_offset);
-      } else {
-        ctx.asmgen.LoadN(dest, dest, field_offset, DataTypeOf(ctx, ft->base));
-      }
+  if (!opts.cache_dir.empty() && (opts.emit_obj || run_jit)) {
+    cerr << "-cache-dir is ignored with -emit-obj and -run" << endl;
+    opts.cache_dir.clear();
+  } else if (!opts.cache_dir.empty()) {
+    error_code ec;
+    filesystem::create_directories(opts.cache_dir, ec);
+    if (ec) {
+      cerr << "failed to create " << opts.cache_dir << ": " << ec.message()
+           << endl;
+      return 1;
     }
-    return;
-  default:
-    ; // pass
+  }
+  if (opts.num_jobs > static_cast<int>(kMaxPoolThreads)) {
+    cerr << "-j is limited to " << kMaxPoolThreads << " jobs" << endl;
+    opts.num_jobs = kMaxPoolThreads;
+  }
+  opts.cache_stats = &cache_stats;
+  opts.prune_stats = &prune_stats;
+  if (prune_report && (!opts.prune_unused || opts.streaming)) {
+    cerr << "-prune-report is ignored without -prune-unused or with -stream"
+         << endl;
+    prune_report = false;
+  }
+  if (opts.streaming && opts.lex_mode != opela::LexMode::kLazy) {
+    // 読み飛ばした関数本体は後でその位置から字句解析し直すので、先に字句解析しても無駄になる
+    cerr << "-pre-tokenize and -lex-thread are ignored with -stream" << endl;
+    opts.lex_mode = opela::LexMode::kLazy;
   }
 
-  // ここから Expression に対する処理
-  SetErshovNumber(ctx.src, node);
-
-  const bool request_lval =
-    node->kind == Node::kAssign ||
-    node->kind == Node::kDefVar ||
-    node->kind == Node::kAddr ||
-    (node->kind == Node::kSubscr && node->lhs->type->kind != Type::kPointer)
-    ;
-
-  Asm::Register reg;
-  const bool lhs_in_dest = node->rhs == nullptr ||
-                           node->lhs->ershov >= node->rhs->ershov;
-  if (lhs_in_dest) {
-    GenerateAsm(ctx, node->lhs, dest, free_calc_regs, labels, request_lval);
-    if (node->rhs) {
-      reg = UseAnyCalcReg(free_calc_regs);
-      GenerateAsm(ctx, node->rhs, reg, free_calc_regs, labels);
+  if (server_mode) {
+    if (run_jit || compile_only || !input_paths.empty()) {
+      cerr << "-server cannot be used with -run, -c or input files" << endl;
+      return 1;
     }
-  } else {
-    GenerateAsm(ctx, node->rhs, dest, free_calc_regs, labels);
-    reg = UseAnyCalcReg(free_calc_regs);
-    GenerateAsm(ctx, node->lhs, reg, free_calc_regs, labels, request_lval);
+    return server_socket.empty() ?
+      ServeFd(STDIN_FILENO, STDOUT_FILENO, opts) :
+      ServeSocket(server_socket, opts);
   }
-  auto lhs_reg = lhs_in_dest ? dest : reg;
-  auto rhs_reg = lhs_in_dest ? reg : dest;
-
-  auto lhs_t = GetUserBaseType(node->lhs->type);
-  auto rhs_t = node->rhs ? GetUserBaseType(node->rhs->type) : nullptr;
 
-  comment_node();
+  JobPool pool{opts.num_jobs - 1}; // 呼び出し元のスレッドも仕事をするので 1 つ少なくする
 
-  switch (node->kind) {
-  case Node::kAdd:
-    if (IsIntegral(lhs_t) && IsIntegral(rhs_t)) {
-      ctx.asmgen.Add64(dest, reg);
-    } else if (lhs_t->kind == Type::kPointer && IsIntegral(rhs_t)) {
-      ctx.asmgen.Mul64(rhs_reg, rhs_reg, SizeofType(ctx.src, lhs_t->base));
-      ctx.asmgen.Add64(dest, reg);
-    } else if (IsIntegral(lhs_t) && rhs_t->kind == Type::kPointer) {
-      ctx.asmgen.Mul64(lhs_reg, lhs_reg, SizeofType(ctx.src, rhs_t->base));
-      ctx.asmgen.Add64(dest, reg);
-    } else {
-      cerr << "not supported " << lhs_t << " + " << rhs_t << endl;
-      ErrorAt(ctx.src, *node->token);
-    }
-    break;
-  case Node::kSub:
-    if (IsIntegral(lhs_t) && IsIntegral(rhs_t)) {
-      ctx.asmgen.Sub64(lhs_reg, rhs_reg);
-    } else if (lhs_t->kind == Type::kPointer && IsIntegral(rhs_t)) {
-      ctx.asmgen.Mul64(rhs_reg, rhs_reg, SizeofType(ctx.src, lhs_t->base));
-      ctx.asmgen.Sub64(lhs_reg, rhs_reg);
-    } else if (IsIntegral(lhs_t) && rhs_t->kind == Type::kPointer) {
-      ctx.asmgen.Mul64(lhs_reg, lhs_reg, SizeofType(ctx.src, rhs_t->base));
-      ctx.asmgen.Sub64(lhs_reg, rhs_reg);
-    } else if (IsEqual(lhs_t, rhs_t)) {
-      ctx.asmgen.Sub64(lhs_reg, rhs_reg);
-      auto tmp_reg = UseAnyCalcReg(free_calc_regs);
-      ctx.asmgen.Mov64(tmp_reg, SizeofType(ctx.src, lhs_t->base));
-      ctx.asmgen.Div64(lhs_reg, tmp_reg);
-    } else {
-      cerr << "not supported " << lhs_t << " - " << rhs_t << endl;
-      ErrorAt(ctx.src, *node->token);
-    }
-    if (!lhs_in_dest) {
-      ctx.asmgen.Mov64(dest, reg);
-    }
-    break;
-  case Node::kMul:
-    ctx.asmgen.Mul64(dest, reg);
-    break;
-  case Node::kDiv:
-    if (lhs_in_dest) {
-      ctx.asmgen.Div64(dest, reg);
-    } else {
-      ctx.asmgen.Div64(reg, dest);
-      ctx.asmgen.Mov64(dest, reg);
+  if (compile_only) {
+    if (run_jit) {
+      cerr << "-c cannot be used with -run" << endl;
+      return 1;
+    } else if (input_paths.empty()) {
+      cerr << "-c needs input files" << endl;
+      return 1;
     }
-    break;
-  case Node::kEqu:
-    ctx.asmgen.CmpSet(Asm::kCmpE, dest, dest, reg);
-    break;
-  case Node::kNEqu:
-    ctx.asmgen.CmpSet(Asm::kCmpNE, dest, dest, reg);
-    break;
-  case Node::kGT:
-    if (auto t = MergeTypeBinOp(node->lhs->type, node->rhs->type);
-        t->kind == Type::kInt) {
-      ctx.asmgen.CmpSet(Asm::kCmpG, dest, lhs_reg, rhs_reg);
-    } else {
-      ctx.asmgen.CmpSet(Asm::kCmpA, dest, lhs_reg, rhs_reg);
+    int exit_code = CompileFiles(pool);
+    if (!opts.cache_dir.empty()) {
+      PrintCacheStats(cerr);
     }
-    break;
-  case Node::kLE:
-    if (auto t = MergeTypeBinOp(node->lhs->type, node->rhs->type);
-        t->kind == Type::kInt) {
-      ctx.asmgen.CmpSet(Asm::kCmpLE, dest, lhs_reg, rhs_reg);
-    } else {
-      ctx.asmgen.CmpSet(Asm::kCmpBE, dest, lhs_reg, rhs_reg);
+    if (prune_report) {
+      PrintPruneStats(cerr);
     }
-    break;
-  case Node::kDefVar:
-  case Node::kAssign:
-    GenerateAssign(ctx, {node, dest, reg, lhs_reg, rhs_reg, lhs_in_dest},
-                   free_calc_regs, lval);
-    break;
-  case Node::kAddr:
-    break;
-  case Node::kDeref:
-    if (!lval) {
-      ctx.asmgen.LoadN(dest, dest, 0, DataTypeOf(ctx, lhs_t));
+    if (!time_trace_path.empty()) {
+      ofstream trace_file(time_trace_path);
+      WriteTimeTrace(trace_file);
     }
-    break;
-  case Node::kSubscr:
-    ctx.asmgen.Mul64(rhs_reg, rhs_reg, SizeofType(ctx.src, lhs_t->base));
-    ctx.asmgen.Add64(dest, reg);
-    if (!lval) {
-      ctx.asmgen.LoadN(dest, dest, 0, DataTypeOf(ctx, lhs_t->base));
-    }
-    break;
-  default:
-    cerr << "GenerateAsm: should not come here" << endl;
-    ErrorAt(ctx.src, *node->token);
+    return exit_code;
+  } else if (!input_paths.empty()) {
+    cerr << "input files need -c (without -c, source is read from stdin)"
+         << endl;
+    return 1;
   }
 
-  if (auto t = GetUserBaseType(node->type); !lval && IsIntegral(t)) {
-    if (auto bits = get<long>(t->value); bits < 64) {
-      ExtractBits(ctx.asmgen, dest, 0, bits);
-    }
-  }
-  /* node->type が bool の場合はあえて無視する。
-   * なぜなら、bool になるのは各種比較演算子のときのみで、
-   * 各種比較演算子は必ず 0/1 の値を返すから。
-   * int -> bool のキャスト（0 なら 0、非 0 なら 1）をせずとも、
-   * 希望する結果は既に得られている。
-   */
-}
+  PhaseRecorder phases;
 
-void PrintDebugInfo(Node* ast, vector<opela_type::String>& strings) {
-  PrintASTRec(cout, ast);
-  cout << '\n';
-  for (size_t i = 0; i < strings.size(); ++i) {
-    cout << StringLabel(i) << ": \"";
-    for (auto ch : strings[i]) {
-      cout << static_cast<char>(ch);
+  ofstream out_file;
+  if (!output_path.empty()) {
+    out_file.open(output_path, ios::binary);
+    if (!out_file) {
+      cerr << "failed to open " << output_path << endl;
+      return 1;
     }
-    cout << "\"\n";
-  }
-}
-
-void GenerateTypedFunc(Source& src, Asm* asmgen, Asm::RegSet free_calc_regs,
-                       set<string>& generated,
-                       const TypeMap& gtype, TypedFunc* tf) {
-  TypeMap tf_gtype{gtype};
-  tf_gtype.merge(tf->gtype);
-
-  Node* conc_def_node = ConcretizeDefFunc(src, tf_gtype, tf->func->def->lhs);
-  string conc_name{get<Object*>(conc_def_node->value)->id->raw};
-  if (auto [ it, inserted ] = generated.insert(conc_name); !inserted) {
-    return;
-  }
-
-  GenContext ctx{src, *asmgen, tf->func};
-  GenerateAsm(ctx, conc_def_node, Asm::kRegA, free_calc_regs, {});
-
-  auto inner_tfs = get<TypedFuncMap*>(tf->func->def->value);
-  for (auto [ generic_name, inner_tf ] : *inner_tfs) {
-    GenerateTypedFunc(src, asmgen, free_calc_regs, generated, tf_gtype, inner_tf);
   }
-}
-
-void GenerateTypedFuncs(Source& src, Asm* asmgen, Asm::RegSet free_calc_regs,
-                        const TypedFuncMap& tfs) {
-  set<string> generated;
-  for (auto [ mangled_name, tf ] : tfs) {
-    GenerateTypedFunc(src, asmgen, free_calc_regs, generated, tf->gtype, tf);
-  }
-}
 
-int main(int argc, char** argv) {
-  if (int err = ParseArgs(argc, argv)) {
-    return err;
-  }
-
-  Asm* asmgen;
-  if (target_arch == "x86_64") {
-    asmgen = NewAsm(AsmArch::kX86_64, cout);
-  } else if (target_arch == "aarch64") {
-    asmgen = NewAsm(AsmArch::kAArch64, cout);
-  } else {
-    cerr << "current version doesn't support " << target_arch << endl;
-    return 1;
-  }
+  // 標準出力（-o があればそのファイル）へまとめて書き出す
+  OutputBuffer out_buf{output_path.empty() ? cout.rdbuf() : out_file.rdbuf()};
+  ostream out{&out_buf};
+  auto asmgen = opela::NewOutputAsm(opts.arch, out, opts.emit_obj || run_jit);
+  auto obj_asm = opts.emit_obj || run_jit ?
+    static_cast<ObjectAsm*>(asmgen.get()) : nullptr;
 
+  // 標準入力から読むときは出力先の名前でキャッシュを区別する
+  opts.cache_unit_name = output_path.empty() ? "-" : output_path;
   Source src;
+  phases.Begin("read");
   src.ReadAll(cin);
-  Tokenizer tokenizer(src);
-  TypeManager type_manager(src);
-  Scope<Object> scope;
-  std::vector<opela_type::String> strings;
-  list<Type*> unresolved_types;
-  map<Node*, Node*> undeclared_ids;
-  TypedFuncMap typed_funcs;
-  ASTContext ast_ctx{src, tokenizer, type_manager, scope, strings,
-                     unresolved_types, undeclared_ids, typed_funcs, nullptr};
-  auto ast = Program(ast_ctx);
-
-  if (verbosity >= 1) {
-    cout << "/* AST before resolving types\n";
-    PrintDebugInfo(ast, strings);
-    cout << "*/\n\n";
+  try {
+    opela::CompileUnit(opts, src, out, asmgen.get(), obj_asm, pool, phases);
+  } catch (const CompileError&) {
+    return 1;
   }
-  ResolveIDs(ast_ctx);
-  ResolveType(ast_ctx);
-  SetTypeProgram(ast_ctx, ast); // ここでジェネリック関数の内部まで型を付けてはいけないかも
-  cout << "/* AST\n";
-  PrintDebugInfo(ast, strings);
-  cout << "*/\n\n";
 
-  if (!ast_graph.empty()) {
-    ofstream graph_file(ast_graph);
-    PrintGeneratedNodes(graph_file);
+  if (!opts.cache_dir.empty()) {
+    PrintCacheStats(cerr);
   }
-
-  Asm::RegSet free_calc_regs;
-  if (!asmgen->SameReg(Asm::kRegA, Asm::kRegV0)) {
-    free_calc_regs.set(Asm::kRegV0);
+  if (prune_report) {
+    PrintPruneStats(cerr);
   }
-  free_calc_regs.set(Asm::kRegV1);
-  free_calc_regs.set(Asm::kRegV2);
-  free_calc_regs.set(Asm::kRegV3);
-  free_calc_regs.set(Asm::kRegV4);
-  free_calc_regs.set(Asm::kRegV5);
-  free_calc_regs.set(Asm::kRegX);
-  free_calc_regs.set(Asm::kRegY);
-
-  auto globals = scope.GetGlobals();
-  asmgen->FilePrologue();
-  asmgen->SectionText();
-  for (auto obj : globals) {
-    if (obj->linkage == Object::kGlobal && obj->kind == Object::kFunc &&
-        obj->def->kind == Node::kDefFunc) {
-      GenContext ctx{src, *asmgen, nullptr};
-      GenerateAsm(ctx, obj->def, Asm::kRegA, free_calc_regs, {});
-    }
+  if (pool_stats) {
+    PrintPoolStats(cerr);
   }
+  if (mem_report) {
+    PrintPoolStats(cerr);
+    phases.PrintMemReport(cerr);
+  }
+  opela::ReleaseUnit();
 
-  GenerateTypedFuncs(src, asmgen, free_calc_regs, typed_funcs);
-
-  asmgen->Output() << ".global _init_opela\n_init_opela:\n";
-  asmgen->FuncPrologue("_init_opela");
-  for (auto obj : globals) {
-    if (obj->linkage == Object::kGlobal && obj->kind == Object::kVar) {
-      auto var_def = obj->def;
-      if (var_def->rhs && IsLiteral(var_def->rhs) == false) {
-        GenContext ctx{src, *asmgen, nullptr};
-        GenerateAsm(ctx, var_def->rhs, Asm::kRegA, free_calc_regs, {});
-        auto lhs_reg = UseAnyCalcReg(free_calc_regs);
-        GenerateAsm(ctx, var_def->lhs, lhs_reg, free_calc_regs, {}, true);
-        GenerateAssign(
-            ctx,
-            {var_def, lhs_reg, Asm::kRegA, lhs_reg, Asm::kRegA, true},
-            free_calc_regs, false);
+  int exit_code = 0;
+  if (run_jit) {
+    phases.Begin("load");
+    for (auto& lib : load_libs) {
+      if (!LoadLibrary(lib)) {
+        return 1;
       }
     }
+    auto& obj = obj_asm->Finish();
+    phases.Begin("run");
+    exit_code = RunObject(obj, run_args);
+    phases.End();
   }
-  asmgen->Output() << "_init_opela.exit:\n";
-  asmgen->FuncEpilogue();
-
-  asmgen->SectionInit();
-  asmgen->Output() << "    .dc.a _init_opela\n";
 
-  asmgen->SectionData(true);
-  for (size_t i = 0; i < strings.size(); ++i) {
-    cout << StringLabel(i) << ":\n    .byte ";
-    for (auto ch : strings[i]) {
-      cout << static_cast<int>(ch) << ',';
-    }
-    cout << "0\n";
+  if (time_report) {
+    phases.PrintTimeReport(cerr);
   }
-
-  asmgen->SectionData(false);
-  GenContext ctx{src, *asmgen, nullptr};
-  for (auto obj : globals) {
-    if (obj->linkage == Object::kGlobal && obj->kind == Object::kVar) {
-      asmgen->Output() << "    .p2align 4\n"
-                       << asmgen->SymLabel(obj->id->raw) << ":\n";
-      GenerateGVarData(ctx, obj->type, obj->def->rhs);
-    }
+  if (!time_trace_path.empty()) {
+    ofstream trace_file(time_trace_path);
+    WriteTimeTrace(trace_file);
   }
+  return exit_code;
 }
@@ -39,7 +39,7 @@ std::string Mangle(Type* t) {
     }
     break;
   default:
-    cerr << "Mangle logic is not implemented for " << t << endl;
+    ErrorOut() << "Mangle logic is not implemented for " << t << endl;
   }
   return oss.str();
 }
@@ -53,7 +53,7 @@ std::string Mangle(std::string_view base_name, Type* t) {
     }
     return oss.str();
   } else {
-    cerr << "Mangle logic is not implemented for " << t << endl;
+    ErrorOut() << "Mangle logic is not implemented for " << t << endl;
     assert(false);
   }
 }
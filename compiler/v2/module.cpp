@@ -0,0 +1,290 @@
+#include "module.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <set>
+#include <thread>
+
+using namespace std;
+
+namespace {
+
+// .opli ファイルの先頭。この後ろに InterfaceHeader::text_size バイトのテキストが続く
+struct InterfaceHeader {
+  char magic[4];         // "OPLI"
+  uint32_t version;      // kInterfaceVersion
+  uint64_t source_hash;  // モジュールのソースの FNV-1a ハッシュ
+  uint64_t text_size;    // テキストの長さ（末尾のヌル文字を含む）
+};
+
+constexpr char kInterfaceMagic[4]{'O', 'P', 'L', 'I'};
+constexpr uint32_t kInterfaceVersion = 2; // テキストの作り方を変えたら増やす
+
+uint64_t HashSource(string_view s) { // FNV-1a
+  uint64_t h = 0xcbf29ce484222325;
+  for (unsigned char c : s) {
+    h = (h ^ c) * 0x100000001b3;
+  }
+  return h;
+}
+
+const char* EndOf(Token* token) {
+  return token->raw.data() + token->raw.size();
+}
+
+// { } の対応を取りながら、同じ深さにある stop までトークンを読み飛ばし、stop のトークンを返す
+// skipped があれば、読み飛ばしたトークン（stop を含む）をそこへ積む
+Token* SkipUntil(Tokenizer& t, Punct stop, vector<Token*>* skipped = nullptr) {
+  int depth = 0;
+  for (;;) {
+    auto token = t.Consume();
+    if (token->kind == Token::kEOF) {
+      t.Unexpected(*token);
+    }
+    if (skipped) {
+      skipped->push_back(token);
+    }
+    if (depth == 0 && token->punct == stop) {
+      return token;
+    }
+    if (token->punct == Punct::kLBrace) {
+      ++depth;
+    } else if (token->punct == Punct::kRBrace) {
+      --depth;
+    }
+  }
+}
+
+// モジュールのトップレベルで定義したグローバル変数の名前を集める
+set<string_view> GlobalVarNames(Source& module) {
+  Tokenizer t{module};
+  set<string_view> names;
+  int depth = 0;
+  for (auto token = t.Consume(); token->kind != Token::kEOF;
+       token = t.Consume()) {
+    if (token->punct == Punct::kLBrace) {
+      ++depth;
+    } else if (token->punct == Punct::kRBrace) {
+      --depth;
+    } else if (depth == 0 && token->kind == Token::kVar) {
+      names.insert(t.Expect(Token::kId)->raw);
+    }
+  }
+  return names;
+}
+
+/* ジェネリック関数の定義 tokens がモジュールのグローバル変数を使っていれば、エラーを表示する
+ *
+ * グローバル変数はインターフェースに含めないので、import した側では具体化できない。
+ * 仮引数・ローカル変数と同名のものや、メンバ名（. と -> の後ろ）はグローバル変数とみなさない。
+ */
+void CheckGlobalUse(Source& module, const vector<Token*>& tokens,
+                    const set<string_view>& globals) {
+  set<string_view> locals;
+  bool in_body = false;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    auto token = tokens[i];
+    if (!in_body) { // シグネチャの名前は仮引数か型名
+      in_body = token->punct == Punct::kLBrace;
+      if (token->kind == Token::kId) {
+        locals.insert(token->raw);
+      }
+      continue;
+    }
+    if (token->kind == Token::kVar && i + 1 < tokens.size()) {
+      locals.insert(tokens[++i]->raw);
+      continue;
+    }
+    if (token->kind != Token::kId || !globals.contains(token->raw) ||
+        locals.contains(token->raw) ||
+        tokens[i - 1]->punct == Punct::kDot ||
+        tokens[i - 1]->punct == Punct::kArrow) {
+      continue;
+    }
+    ErrorOut() << "generic function cannot use a global variable of the module: "
+               << token->raw << endl;
+    ErrorAt(module, *token);
+  }
+}
+
+/* モジュールのソースからインターフェースのテキストを作る
+ *
+ * 構文解析はせず、トークンの並びからトップレベルの宣言の範囲を切り出す。
+ * main とグローバル変数（翻訳単位の外からは見えない）は公開しない。
+ * そのため、グローバル変数を使うジェネリック関数があればエラーにする。
+ */
+string ExtractInterface(Source& module) {
+  const auto globals = GlobalVarNames(module);
+  Tokenizer t{module};
+  string text;
+  auto append = [&](const char* begin, const char* end) {
+    text.append(begin, end);
+    text += '\n';
+  };
+
+  while (!t.Peek(Token::kEOF)) {
+    auto first = t.Consume();
+    switch (first->kind) {
+    case Token::kFunc:
+      {
+        auto name = t.Expect(Token::kId);
+        const bool generic = t.Peek("<");
+        vector<Token*> tokens; // ジェネリック関数の定義のトークン
+        auto skipped = generic ? &tokens : nullptr;
+        auto body = SkipUntil(t, Punct::kLBrace, skipped);
+        auto body_end = SkipUntil(t, Punct::kRBrace, skipped);
+        if (generic) {
+          CheckGlobalUse(module, tokens, globals);
+          append(first->raw.data(), EndOf(body_end));
+        } else if (name->raw != "main") {
+          auto sig_end = body->raw.data();
+          while (isspace(sig_end[-1])) {
+            --sig_end;
+          }
+          text += "extern ";
+          text += name->raw;
+          text += " func";
+          text.append(EndOf(name), sig_end);
+          text += ";\n";
+        }
+      }
+      break;
+    case Token::kExtern:
+    case Token::kType:
+    case Token::kImport:
+      append(first->raw.data(), EndOf(SkipUntil(t, Punct::kSemicolon)));
+      break;
+    case Token::kVar:
+      SkipUntil(t, Punct::kSemicolon);
+      break;
+    default:
+      t.Unexpected(*first);
+    }
+  }
+  return text;
+}
+
+// path を読み込めれば true を返す
+bool ReadFile(const filesystem::path& path, string& contents) {
+  ifstream in{path, ios::binary};
+  if (!in) {
+    return false;
+  }
+  contents.assign(istreambuf_iterator<char>{in}, istreambuf_iterator<char>{});
+  return true;
+}
+
+// 別名で書いてから置き換えるので、並行して同じ .opli を書いても壊れない
+void WriteInterface(const filesystem::path& path, uint64_t source_hash,
+                    const string& text) {
+  InterfaceHeader header{};
+  memcpy(header.magic, kInterfaceMagic, sizeof(header.magic));
+  header.version = kInterfaceVersion;
+  header.source_hash = source_hash;
+  header.text_size = text.size() + 1;
+
+  auto tmp_path = path;
+  tmp_path += ".tmp" + to_string(getpid()) + "-" +
+              to_string(hash<thread::id>{}(this_thread::get_id()));
+  {
+    ofstream out{tmp_path, ios::binary};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(text.c_str(), header.text_size);
+    if (!out) {
+      out.close();
+      filesystem::remove(tmp_path);
+      return; // キャッシュを書けなくてもコンパイルは続けられる
+    }
+  }
+  error_code ec;
+  filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    filesystem::remove(tmp_path, ec);
+  }
+}
+
+} // namespace
+
+ModuleLoader::~ModuleLoader() {
+  for (auto [ addr, size ] : mappings_) {
+    munmap(addr, size);
+  }
+}
+
+Source* ModuleLoader::Load(Source& importer, Token& name_token) {
+  auto name = name_token.raw.substr(1, name_token.raw.size() - 2);
+  filesystem::path file_name{string{name}};
+  file_name += ".opl";
+
+  // import する側のディレクトリ（標準入力ならカレントディレクトリ）、-I の順に探す
+  vector<filesystem::path> dirs{
+    filesystem::path{importer.Name()}.parent_path()};
+  dirs.insert(dirs.end(), search_dirs_.begin(), search_dirs_.end());
+  filesystem::path module_path;
+  string module_src;
+  for (auto& dir : dirs) {
+    if (ReadFile(dir / file_name, module_src)) {
+      module_path = dir / file_name;
+      break;
+    }
+  }
+  if (module_path.empty()) {
+    ErrorOut() << "module not found: " << name << endl;
+    ErrorAt(importer, name_token);
+  }
+  if (!loaded_.insert(filesystem::weakly_canonical(module_path)).second) {
+    return nullptr;
+  }
+
+  const uint64_t source_hash = HashSource(module_src);
+  auto iface_path = module_path;
+  iface_path.replace_extension(".opli");
+
+  // キャッシュが今のソースから作ったものなら、mmap してそのまま使う
+  if (int fd = open(iface_path.c_str(), O_RDONLY); fd >= 0) {
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) > sizeof(InterfaceHeader)) {
+      addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (addr != MAP_FAILED) {
+      auto header = static_cast<const InterfaceHeader*>(addr);
+      auto text = static_cast<const char*>(addr) + sizeof(InterfaceHeader);
+      if (memcmp(header->magic, kInterfaceMagic, sizeof(header->magic)) == 0 &&
+          header->version == kInterfaceVersion &&
+          header->source_hash == source_hash &&
+          sizeof(InterfaceHeader) + header->text_size == size_t(st.st_size) &&
+          text[header->text_size - 1] == '\0') {
+        mappings_.push_back({addr, size_t(st.st_size)});
+        auto iface = ifaces_.emplace_back(make_unique<Source>(
+            iface_path.native(), string_view{text, header->text_size})).get();
+        importer.AddImport(iface);
+        return iface;
+      }
+      munmap(addr, st.st_size);
+    }
+  }
+
+  Source module{module_path.native(),
+                string_view{module_src.c_str(), module_src.size() + 1}};
+  auto& text = *texts_.emplace_back(
+      make_unique<string>(ExtractInterface(module)));
+  WriteInterface(iface_path, source_hash, text);
+
+  auto iface = ifaces_.emplace_back(make_unique<Source>(
+      iface_path.native(), string_view{text.c_str(), text.size() + 1})).get();
+  importer.AddImport(iface);
+  return iface;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "source.hpp"
+#include "token.hpp"
+
+/* import "name" で読み込むモジュールのインターフェース
+ *
+ * モジュールは 1 つの .opl ファイルで、そのトップレベルの関数・型・ジェネリック関数を公開する。
+ * インターフェースは公開する宣言を OpeLa の構文で並べたテキストで、
+ * 非ジェネリック関数は本体を除いた extern 宣言に、型とジェネリック関数は定義そのままにする。
+ * ジェネリック関数の本体はモジュールのグローバル変数を使えない（インターフェースを作るときのエラーになる）。
+ * import する側はこれだけを構文解析するので、モジュールの関数本体を解析・型付けしなくて済む。
+ *
+ * インターフェースはモジュールと同じディレクトリの <name>.opli にキャッシュする。
+ * .opli はヘッダ（InterfaceHeader）とテキストからなり、読み込むときは mmap して
+ * ヘッダに記録したモジュールのソースのハッシュが今のソースと一致するかを確かめる。
+ * 一致しなければインターフェースを作り直して書き込む。
+ */
+class ModuleLoader {
+ public:
+  // search_dirs: import する側のディレクトリで見つからないときに探すディレクトリ（-I）
+  explicit ModuleLoader(std::vector<std::string> search_dirs = {})
+    : search_dirs_{std::move(search_dirs)} {}
+  ModuleLoader(const ModuleLoader&) = delete;
+  ModuleLoader& operator=(const ModuleLoader&) = delete;
+  ~ModuleLoader();
+
+  /* importer で import されたモジュール name_token（文字列リテラル）のインターフェースを返す
+   *
+   * 同じモジュールを既に読み込んでいたら nullptr を返す。
+   * モジュールが見つからなければエラーを表示して CompileError を投げる。
+   */
+  Source* Load(Source& importer, Token& name_token);
+
+ private:
+  struct Mapping {
+    void* addr;
+    std::size_t size;
+  };
+
+  std::vector<std::string> search_dirs_;
+  std::set<std::filesystem::path> loaded_;
+  std::vector<std::unique_ptr<Source>> ifaces_;
+  std::vector<std::unique_ptr<std::string>> texts_; // キャッシュを使えなかったときのテキスト
+  std::vector<Mapping> mappings_;
+};
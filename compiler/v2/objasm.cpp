@@ -0,0 +1,604 @@
+#include "objasm.hpp"
+
+#include <elf.h>
+
+#include <iostream>
+#include <limits>
+
+#include "source.hpp"
+
+using namespace std;
+
+namespace {
+
+std::ostream null_out{nullptr}; // Output() への書き込みを捨てる
+
+bool FitsInt8(int64_t v) {
+  return numeric_limits<int8_t>::min() <= v && v <= numeric_limits<int8_t>::max();
+}
+
+bool FitsInt32(int64_t v) {
+  return numeric_limits<int32_t>::min() <= v &&
+         v <= numeric_limits<int32_t>::max();
+}
+
+[[noreturn]] void EncodeError(string_view msg) {
+  ErrorOut() << "failed to encode: " << msg << endl;
+  throw CompileError{};
+}
+
+} // namespace
+
+uint32_t ObjFile::Sym(std::string_view name) {
+  if (auto it = sym_index.find(name); it != sym_index.end()) {
+    return it->second;
+  }
+  const uint32_t i = symbols.size();
+  symbols.push_back({string{name}, -1, 0, false, false, STT_NOTYPE, 0});
+  sym_index.emplace(name, i);
+  return i;
+}
+
+ObjectAsm::ObjectAsm(const RegNameTable& reg_names)
+    : Asm{null_out, reg_names} {
+  cur_ = UseSection(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16);
+}
+
+int ObjectAsm::UseSection(std::string_view name, std::uint32_t type,
+                          std::uint64_t flags, std::uint64_t align) {
+  for (size_t i = 0; i < obj_.sections.size(); ++i) {
+    if (obj_.sections[i].name == name) {
+      return i;
+    }
+  }
+  obj_.sections.push_back({string{name}, type, flags, align, {}, {}});
+  return obj_.sections.size() - 1;
+}
+
+void ObjectAsm::SwitchSection(int section) {
+  cur_ = section;
+  data_sym_ = kNoSym;
+}
+
+void ObjectAsm::SectionText() {
+  SwitchSection(
+      UseSection(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16));
+}
+
+void ObjectAsm::SectionInit() {
+  SwitchSection(
+      UseSection(".init_array", SHT_INIT_ARRAY, SHF_ALLOC | SHF_WRITE, 8));
+}
+
+void ObjectAsm::SectionData(bool readonly) {
+  if (readonly) {
+    SwitchSection(UseSection(".rodata", SHT_PROGBITS, SHF_ALLOC, 1));
+  } else {
+    SwitchSection(
+        UseSection(".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 1));
+  }
+}
+
+void ObjectAsm::Label(std::string_view label, std::string_view) {
+  const auto i = obj_.Sym(label);
+  auto& sym = obj_.symbols[i];
+  if (sym.section >= 0 &&
+      (sym.section != cur_ || sym.value != Code().size())) {
+    EncodeError("label is already defined: " + string{label});
+  }
+  sym.section = cur_;
+  sym.value = Code().size();
+
+  // データセクションのラベルは、次のラベルまでに置いたデータを指すオブジェクトとする
+  data_sym_ = kNoSym;
+  if ((obj_.sections[cur_].flags & SHF_EXECINSTR) == 0) {
+    sym.type = STT_OBJECT;
+    data_sym_ = i;
+  }
+}
+
+void ObjectAsm::BeginFunc(std::string_view sym_name) {
+  Label(sym_name);
+  func_sym_ = obj_.Sym(sym_name);
+  obj_.symbols[func_sym_].type = STT_FUNC;
+}
+
+void ObjectAsm::EndFunc() {
+  if (func_sym_ == kNoSym) {
+    return;
+  }
+  auto& sym = obj_.symbols[func_sym_];
+  sym.size = Code().size() - sym.value;
+  func_sym_ = kNoSym;
+}
+
+void ObjectAsm::GrowDataSym() {
+  if (data_sym_ != kNoSym) {
+    auto& sym = obj_.symbols[data_sym_];
+    sym.size = Code().size() - sym.value;
+  }
+}
+
+void ObjectAsm::Global(std::string_view sym_name) {
+  obj_.symbols[obj_.Sym(sym_name)].global = true;
+}
+
+void ObjectAsm::Weak(std::string_view sym_name) {
+  auto& sym = obj_.symbols[obj_.Sym(sym_name)];
+  sym.global = true;
+  sym.weak = true;
+}
+
+void ObjectAsm::Align(int p2) {
+  auto& sec = obj_.sections[cur_];
+  sec.align = max<uint64_t>(sec.align, 1u << p2);
+  while (sec.data.size() % (1u << p2)) {
+    sec.data.push_back(0);
+  }
+}
+
+void ObjectAsm::DataZero(std::size_t size) {
+  Code().resize(Code().size() + size);
+  GrowDataSym();
+}
+
+void ObjectAsm::DataN(std::size_t size, std::int64_t v) {
+  EmitN(size, v);
+  GrowDataSym();
+}
+
+void ObjectAsm::DataCStr(const std::uint8_t* s, std::size_t len) {
+  Code().insert(Code().end(), s, s + len);
+  Emit8(0);
+  GrowDataSym();
+}
+
+void ObjectAsm::DataAddr(std::string_view label) {
+  EmitRef(8, R_X86_64_64, label, 0);
+  GrowDataSym();
+}
+
+void ObjectAsm::EmitN(std::size_t size, std::uint64_t v) {
+  for (size_t i = 0; i < size; ++i) {
+    Emit8(v >> (8 * i));
+  }
+}
+
+void ObjectAsm::EmitRef(std::size_t size, std::uint32_t type,
+                        std::string_view label, std::int64_t addend) {
+  fixups_.push_back({cur_, Code().size(), size, type, obj_.Sym(label), addend});
+  EmitN(size, 0);
+}
+
+void ObjectAsm::Append(const ObjectAsm& part) {
+  vector<int> sec_map;
+  vector<uint64_t> sec_base;
+  for (auto& ps : part.obj_.sections) {
+    const int s = UseSection(ps.name, ps.type, ps.flags, ps.align);
+    auto& sec = obj_.sections[s];
+    sec.align = max(sec.align, ps.align);
+    sec_map.push_back(s);
+    sec_base.push_back(sec.data.size());
+    sec.data.insert(sec.data.end(), ps.data.begin(), ps.data.end());
+  }
+
+  // part での出現順に登録するので、シンボルの並びは 1 つの ObjectAsm で生成した場合と同じになる
+  vector<uint32_t> sym_map;
+  for (auto& psym : part.obj_.symbols) {
+    const auto i = obj_.Sym(psym.name);
+    sym_map.push_back(i);
+    auto& sym = obj_.symbols[i];
+    if (psym.section >= 0) {
+      if (sym.section >= 0) {
+        EncodeError("label is already defined: " + psym.name);
+      }
+      sym.section = sec_map[psym.section];
+      sym.value = sec_base[psym.section] + psym.value;
+      sym.type = psym.type;
+      sym.size = psym.size;
+    }
+    sym.global = sym.global || psym.global;
+    sym.weak = sym.weak || psym.weak;
+  }
+
+  for (auto& f : part.fixups_) {
+    fixups_.push_back({sec_map[f.section], sec_base[f.section] + f.offset,
+                       f.size, f.type, sym_map[f.sym], f.addend});
+  }
+}
+
+const ObjFile& ObjectAsm::Finish() {
+  for (auto& f : fixups_) {
+    auto& sym = obj_.symbols[f.sym];
+    auto& sec = obj_.sections[f.section];
+    if (f.type == PCRelType() && sym.section == f.section && !sym.global) {
+      const int64_t v = sym.value + f.addend - f.offset;
+      for (size_t i = 0; i < f.size; ++i) {
+        sec.data[f.offset + i] = v >> (8 * i);
+      }
+    } else {
+      sec.relocs.push_back({f.offset, f.sym, f.type, f.addend});
+    }
+  }
+  fixups_.clear();
+  return obj_;
+}
+
+namespace {
+
+class AsmX86_64Obj : public ObjectAsm {
+ public:
+  AsmX86_64Obj() : ObjectAsm{RegNameTableOf(AsmArch::kX86_64)} {}
+
+  void Mov64(Register dest, std::uint64_t v) override {
+    const int d = Num(dest);
+    if (v <= numeric_limits<uint32_t>::max()) {
+      Prefix(kDWord, 0, d, false);
+      Emit8(0xb8 | (d & 7));
+      EmitN(4, v);
+    } else if (FitsInt32(v)) {
+      OpRR(kQWord, {0xc7}, 0, d, false);
+      EmitN(4, v);
+    } else {
+      Prefix(kQWord, 0, d, false);
+      Emit8(0xb8 | (d & 7));
+      EmitN(8, v);
+    }
+  }
+
+  void Mov64(Register dest, Register v) override {
+    OpRR(kQWord, {0x89}, Num(v), Num(dest));
+  }
+
+  void Add64(Register dest, std::uint64_t v) override {
+    OpImm(0, dest, v);
+  }
+
+  void Add64(Register dest, Register v) override {
+    OpRR(kQWord, {0x01}, Num(v), Num(dest));
+  }
+
+  void Sub64(Register dest, std::uint64_t v) override {
+    OpImm(5, dest, v);
+  }
+
+  void Sub64(Register dest, Register v) override {
+    OpRR(kQWord, {0x29}, Num(v), Num(dest));
+  }
+
+  void Mul64(Register dest, Register v) override {
+    OpRR(kQWord, {0x0f, 0xaf}, Num(dest), Num(v));
+  }
+
+  void Mul64(Register dest, Register a, std::uint64_t b) override {
+    if (FitsInt8(b)) {
+      OpRR(kQWord, {0x6b}, Num(dest), Num(a));
+      Emit8(b);
+    } else if (FitsInt32(b)) {
+      OpRR(kQWord, {0x69}, Num(dest), Num(a));
+      EmitN(4, b);
+    } else {
+      EncodeError("imul immediate is too large");
+    }
+  }
+
+  void Div64(Register dest, Register v) override {
+    if (dest != kRegA) {
+      Push64(kRegA);
+    }
+    Push64(kRegV2); // rdx
+    if (dest != kRegA) {
+      Mov64(kRegA, dest);
+    }
+    OpRR(kDWord, {0x31}, 2, 2); // xor edx, edx
+    OpRR(kQWord, {0xf7}, 6, Num(v), false);
+    if (dest != kRegA) {
+      Mov64(dest, kRegA);
+    }
+    Pop64(kRegV2);
+    if (dest != kRegA) {
+      Pop64(kRegA);
+    }
+  }
+
+  void And64(Register dest, std::uint64_t v) override {
+    if (v <= 0x7fffffff) {
+      OpImm(4, dest, v);
+    } else {
+      Push64(Asm::kRegV0);
+      Mov64(Asm::kRegV0, v);
+      And64(dest, Asm::kRegV0);
+      Pop64(Asm::kRegV0);
+    }
+  }
+
+  void And64(Register dest, Register v) override {
+    OpRR(kQWord, {0x21}, Num(v), Num(dest));
+  }
+
+  void Or64(Register dest, Register v) override {
+    OpRR(kQWord, {0x09}, Num(v), Num(dest));
+  }
+
+  void Push64(Register reg) override {
+    Prefix(kDWord, 0, Num(reg), false);
+    Emit8(0x50 | (Num(reg) & 7));
+  }
+
+  void Pop64(Register reg) override {
+    Prefix(kDWord, 0, Num(reg), false);
+    Emit8(0x58 | (Num(reg) & 7));
+  }
+
+  void LoadN(Register dest, Register addr, int disp, DataType dt) override {
+    OpMem(dt, {dt == kByte ? uint8_t(0x8a) : uint8_t(0x8b)},
+          Num(dest), Num(addr), disp);
+  }
+
+  void LoadN(Register dest, std::string_view label, DataType dt) override {
+    OpRIP(dt, {dt == kByte ? uint8_t(0x8a) : uint8_t(0x8b)}, Num(dest), label);
+  }
+
+  void StoreN(Register addr, int disp, Register v, DataType dt) override {
+    if (v == kRegZero) { // mov [addr+disp], 0
+      OpMem(dt, {dt == kByte ? uint8_t(0xc6) : uint8_t(0xc7)},
+            0, Num(addr), disp, false);
+      EmitN(ImmSize(dt), 0);
+      return;
+    }
+    OpMem(dt, {dt == kByte ? uint8_t(0x88) : uint8_t(0x89)},
+          Num(v), Num(addr), disp);
+  }
+
+  void StoreN(std::string_view label, Register v, DataType dt) override {
+    if (v == kRegZero) {
+      OpRIP(dt, {dt == kByte ? uint8_t(0xc6) : uint8_t(0xc7)},
+            0, label, ImmSize(dt), false);
+      EmitN(ImmSize(dt), 0);
+      return;
+    }
+    OpRIP(dt, {dt == kByte ? uint8_t(0x88) : uint8_t(0x89)}, Num(v), label);
+  }
+
+  void CmpSet(Compare c, Register dest, Register lhs, Register rhs) override {
+    uint8_t cc;
+    switch (c) {
+      case kCmpE:  cc = 0x94; break;
+      case kCmpNE: cc = 0x95; break;
+      case kCmpG:  cc = 0x9f; break;
+      case kCmpLE: cc = 0x9e; break;
+      case kCmpA:  cc = 0x97; break;
+      case kCmpBE: cc = 0x96; break;
+      default: EncodeError("unknown comparison");
+    }
+    OpRR(kQWord, {0x39}, Num(rhs), Num(lhs));
+    SetAndZeroExtend(cc, dest);
+  }
+
+  void Xor64(Register dest, Register v) override {
+    OpRR(kQWord, {0x31}, Num(v), Num(dest));
+  }
+
+  void Ret() override {
+    Emit8(0xc3);
+  }
+
+  void Jmp(std::string_view label) override {
+    Emit8(0xe9);
+    EmitRef(4, R_X86_64_PC32, label, -4);
+  }
+
+  void JmpIfZero(Register v, std::string_view label) override {
+    OpRR(kQWord, {0x85}, Num(v), Num(v));
+    Emit8(0x0f);
+    Emit8(0x84);
+    EmitRef(4, R_X86_64_PC32, label, -4);
+  }
+
+  void JmpIfNotZero(Register v, std::string_view label) override {
+    OpRR(kQWord, {0x85}, Num(v), Num(v));
+    Emit8(0x0f);
+    Emit8(0x85);
+    EmitRef(4, R_X86_64_PC32, label, -4);
+  }
+
+  void LEA(Register dest, Register base, int disp) override {
+    OpMem(kQWord, {0x8d}, Num(dest), Num(base), disp);
+  }
+
+  void Call(Register addr) override {
+    OpRR(kDWord, {0xff}, 2, Num(addr), false);
+  }
+
+  void LoadLabelAddr(Register dest, std::string_view label) override {
+    Prefix(kQWord, 0, Num(dest), false);
+    Emit8(0xb8 | (Num(dest) & 7));
+    EmitRef(8, R_X86_64_64, label, 0);
+  }
+
+  void Set1IfNonZero64(Register dest, Register v) override {
+    OpRR(kQWord, {0x85}, Num(v), Num(v));
+    SetAndZeroExtend(0x95, dest);
+  }
+
+  void ShiftL64(Register dest, int bits) override {
+    OpRR(kQWord, {0xc1}, 4, Num(dest), false);
+    Emit8(bits);
+  }
+
+  void ShiftR64(Register dest, int bits) override {
+    OpRR(kQWord, {0xc1}, 5, Num(dest), false);
+    Emit8(bits);
+  }
+
+  void ShiftAR64(Register dest, int bits) override {
+    OpRR(kQWord, {0xc1}, 7, Num(dest), false);
+    Emit8(bits);
+  }
+
+  void IncN(Register addr, DataType dt) override {
+    OpMem(dt, {dt == kByte ? uint8_t(0xfe) : uint8_t(0xff)},
+          0, Num(addr), 0, false);
+  }
+
+  void DecN(Register addr, DataType dt) override {
+    OpMem(dt, {dt == kByte ? uint8_t(0xfe) : uint8_t(0xff)},
+          1, Num(addr), 0, false);
+  }
+
+  void FuncPrologue(std::string_view sym_name, SymBind bind) override {
+    if (bind == kBindGlobal) {
+      Global(sym_name);
+    } else if (bind == kBindWeak) {
+      Weak(sym_name);
+    }
+    BeginFunc(sym_name);
+    Push64(kRegBP);
+    Mov64(kRegBP, kRegSP);
+  }
+
+  void FuncEpilogue() override {
+    Emit8(0xc9); // leave
+    Emit8(0xc3); // ret
+    EndFunc();
+  }
+
+  bool VParamOnStack() override {
+    return false;
+  }
+
+ protected:
+  std::uint32_t PCRelType() const override {
+    return R_X86_64_PC32;
+  }
+
+ private:
+  // Asm::Register に対応する x86-64 のレジスタ番号
+  static int Num(Register reg) {
+    static constexpr array<int, kRegNum> kNums{
+      0, 7, 6, 2, 1, 8, 9, 10, 11, // rax, rdi, rsi, rdx, rcx, r8 - r11
+      3, 12, 13, 14, 15,           // rbx, r12 - r15
+      5, 4, -1, -1, -1             // rbp, rsp
+    };
+    if (kNums[reg] < 0) {
+      EncodeError("register is not available on x86-64");
+    }
+    return kNums[reg];
+  }
+
+  /* オペランドサイズ接頭辞と REX 接頭辞を出力する
+   *
+   * reg: ModRM.reg に入るレジスタ番号（reg_is_reg が偽なら /digit）
+   * rm:  ModRM.rm に入るレジスタ番号（メモリオペランドならベースレジスタ）
+   * rm_is_reg: rm がレジスタオペランドか
+   */
+  void Prefix(DataType dt, int reg, int rm, bool rm_is_reg,
+              bool reg_is_reg = true) {
+    if (dt == kNonStandardDataType) {
+      EncodeError("non-standard size is not supported");
+    }
+    if (dt == kWord) {
+      Emit8(0x66);
+    }
+    uint8_t rex = 0x40;
+    if (dt == kQWord) rex |= 8;
+    if (reg_is_reg && reg >= 8) rex |= 4;
+    if (rm >= 8) rex |= 1;
+    // spl, bpl, sil, dil は REX 接頭辞が無いと ah, ch, dh, bh になる
+    const bool byte_reg = dt == kByte &&
+      ((reg_is_reg && 4 <= reg && reg < 8) || (rm_is_reg && 4 <= rm && rm < 8));
+    if (rex != 0x40 || byte_reg) {
+      Emit8(rex);
+    }
+  }
+
+  void Opcode(initializer_list<uint8_t> opcode) {
+    for (auto b : opcode) {
+      Emit8(b);
+    }
+  }
+
+  // op r/m, r （r/m がレジスタ）
+  void OpRR(DataType dt, initializer_list<uint8_t> opcode, int reg, int rm,
+            bool reg_is_reg = true) {
+    Prefix(dt, reg, rm, true, reg_is_reg);
+    Opcode(opcode);
+    Emit8(0xc0 | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  // op [base+disp], r
+  void OpMem(DataType dt, initializer_list<uint8_t> opcode,
+             int reg, int base, int disp, bool reg_is_reg = true) {
+    Prefix(dt, reg, base, false, reg_is_reg);
+    Opcode(opcode);
+    uint8_t mod;
+    if (disp == 0 && (base & 7) != 5) { // rbp, r13 は disp 無しにできない
+      mod = 0x00;
+    } else if (FitsInt8(disp)) {
+      mod = 0x40;
+    } else {
+      mod = 0x80;
+    }
+    Emit8(mod | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4) { // rsp, r12 は SIB が必要
+      Emit8(0x24);
+    }
+    if (mod == 0x40) {
+      Emit8(disp);
+    } else if (mod == 0x80) {
+      EmitN(4, disp);
+    }
+  }
+
+  // op [rip+label], r （imm_size は命令末尾に続く即値のバイト数）
+  void OpRIP(DataType dt, initializer_list<uint8_t> opcode,
+             int reg, std::string_view label,
+             int imm_size = 0, bool reg_is_reg = true) {
+    Prefix(dt, reg, 0, false, reg_is_reg);
+    Opcode(opcode);
+    Emit8(0x05 | ((reg & 7) << 3));
+    EmitRef(4, R_X86_64_PC32, label, -4 - imm_size);
+  }
+
+  // mov r/m, imm の即値のバイト数（64 ビットでも 4 バイト）
+  static int ImmSize(DataType dt) {
+    switch (dt) {
+    case kByte: return 1;
+    case kWord: return 2;
+    default:    return 4;
+    }
+  }
+
+  // add/sub/and r64, imm （digit は ModRM.reg に入る拡張オペコード）
+  void OpImm(int digit, Register dest, std::uint64_t v) {
+    const int64_t sv = v;
+    if (FitsInt8(sv)) {
+      OpRR(kQWord, {0x83}, digit, Num(dest), false);
+      Emit8(sv);
+    } else if (FitsInt32(sv)) {
+      OpRR(kQWord, {0x81}, digit, Num(dest), false);
+      EmitN(4, sv);
+    } else {
+      EncodeError("immediate value is too large");
+    }
+  }
+
+  // setcc r8; movzx r32, r8
+  void SetAndZeroExtend(uint8_t cc, Register dest) {
+    const int d = Num(dest);
+    OpRR(kByte, {0x0f, cc}, 0, d, false);
+    OpRR(kByte, {0x0f, 0xb6}, d, d); // 接頭辞の都合上 kByte として扱う
+  }
+};
+
+} // namespace
+
+ObjectAsm* NewObjectAsm(AsmArch arch) {
+  switch (arch) {
+  case AsmArch::kX86_64:
+    return new AsmX86_64Obj;
+  case AsmArch::kAArch64:
+    break;
+  }
+  return nullptr;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "asm.hpp"
+
+// 再配置情報（型の値は ELF の R_X86_64_* と同じ）
+struct ObjReloc {
+  std::uint64_t offset;
+  std::uint32_t sym; // ObjFile::symbols のインデックス
+  std::uint32_t type;
+  std::int64_t addend;
+};
+
+struct ObjSection {
+  std::string name;
+  std::uint32_t type;  // SHT_PROGBITS など
+  std::uint64_t flags; // SHF_ALLOC など
+  std::uint64_t align;
+  std::vector<std::uint8_t> data;
+  std::vector<ObjReloc> relocs;
+};
+
+struct ObjSymbol {
+  std::string name;
+  int section; // ObjFile::sections のインデックス。未定義なら -1
+  std::uint64_t value;
+  bool global;
+  bool weak; // global のうち、他の翻訳単位の同名の定義と重複してよいもの
+  std::uint8_t type;  // STT_FUNC など
+  std::uint64_t size; // 関数やデータの大きさ（バイト）。不明なら 0
+};
+
+// 機械語・データ・シンボル・再配置情報からなるオブジェクトファイルの中身
+struct ObjFile {
+  std::vector<ObjSection> sections;
+  std::vector<ObjSymbol> symbols;
+  std::map<std::string, std::uint32_t, std::less<>> sym_index;
+
+  // 名前に対応するシンボルを返す。無ければ未定義シンボルとして作る
+  std::uint32_t Sym(std::string_view name);
+};
+
+/* 機械語を直接生成する Asm
+ *
+ * 命令とデータを ObjFile に書き込み、アセンブラを通さずにオブジェクトファイルを作る。
+ * コメントなどの文字列出力（Output()）は捨てられる。
+ */
+class ObjectAsm : public Asm {
+ public:
+  ObjectAsm(const RegNameTable& reg_names);
+
+  void FilePrologue() override {}
+  void SectionText() override;
+  void SectionInit() override;
+  void SectionData(bool readonly) override;
+  std::string SymLabel(std::string_view sym_name) override {
+    return std::string{sym_name};
+  }
+
+  void Label(std::string_view label, std::string_view comment = {}) override;
+  void Global(std::string_view sym_name) override;
+  void Weak(std::string_view sym_name) override;
+  void Align(int p2) override;
+  void DataZero(std::size_t size) override;
+  void DataN(std::size_t size, std::int64_t v) override;
+  void DataCStr(const std::uint8_t* s, std::size_t len) override;
+  void DataAddr(std::string_view label) override;
+
+  // 別の ObjectAsm で生成した機械語・シンボル・参照を各セクションの末尾に連結する。
+  // 関数ごとに並列に生成した結果を順にまとめるのに使う（part は Finish() 前であること）。
+  void Append(const ObjectAsm& part);
+
+  // 同じセクション内への相対参照を解決し、残りを再配置情報にする。
+  // 出力の直前に 1 度だけ呼ぶ。
+  const ObjFile& Finish();
+
+ protected:
+  std::vector<std::uint8_t>& Code() { return obj_.sections[cur_].data; }
+  void Emit8(std::uint8_t v) { Code().push_back(v); }
+  void EmitN(std::size_t size, std::uint64_t v);
+
+  // 現在位置に size バイトの参照を置く。値は Finish() で決まる
+  void EmitRef(std::size_t size, std::uint32_t type,
+               std::string_view label, std::int64_t addend);
+
+  // 関数の先頭と末尾で呼び、シンボルを関数として大きさを記録する
+  void BeginFunc(std::string_view sym_name);
+  void EndFunc();
+
+  // 相対参照として扱う再配置の型（同じセクション内なら Finish() で解決する）
+  virtual std::uint32_t PCRelType() const = 0;
+
+ private:
+  struct Fixup {
+    int section;
+    std::uint64_t offset;
+    std::size_t size;
+    std::uint32_t type;
+    std::uint32_t sym;
+    std::int64_t addend;
+  };
+
+  static constexpr std::uint32_t kNoSym = -1;
+
+  int UseSection(std::string_view name, std::uint32_t type,
+                 std::uint64_t flags, std::uint64_t align);
+  void SwitchSection(int section);
+  // 直前のラベルから現在位置までをデータシンボルの大きさとする
+  void GrowDataSym();
+
+  ObjFile obj_;
+  int cur_;
+  std::uint32_t func_sym_ = kNoSym; // 生成中の関数のシンボル
+  std::uint32_t data_sym_ = kNoSym; // 生成中のデータのシンボル
+  std::vector<Fixup> fixups_;
+};
+
+ObjectAsm* NewObjectAsm(AsmArch arch); // 今のところ x86-64 のみ
+
+// ELF64 のリロケータブルオブジェクトとして書き出す
+void WriteELF(std::ostream& out, const ObjFile& obj);
@@ -6,6 +6,7 @@
 #include <string_view>
 #include <vector>
 
+#include "arena.hpp"
 #include "token.hpp"
 #include "typespec.hpp"
 
@@ -39,11 +40,13 @@ struct Object {
 };
 
 inline Object* NewVar(Token* id, Node* def, Object::Linkage linkage) {
-  return new Object{Object::kVar, id, def, nullptr, linkage, -1, {}, {}};
+  return GetPool(Pool::kObject).New<Object>(
+      Object{Object::kVar, id, def, nullptr, linkage, -1, {}, {}});
 }
 
 inline Object* NewFunc(Token* id, Node* def, Object::Linkage linkage) {
-  return new Object{Object::kFunc, id, def, nullptr, linkage, -1, {}, {}};
+  return GetPool(Pool::kObject).New<Object>(
+      Object{Object::kFunc, id, def, nullptr, linkage, -1, {}, {}});
 }
 
 std::ostream& operator<<(std::ostream& os, Object* o);
@@ -1,10 +1,9 @@
 #pragma once
 
-#include <map>
-#include <string>
 #include <string_view>
 #include <vector>
 
+#include "symbol.hpp"
 #include "token.hpp"
 
 template <class T>
@@ -13,14 +12,16 @@ class Scope {
   void Enter();
   void Leave();
 
-  T* Find(const std::string& name) const;
-  T* Find(Token& name) const {
-    return Find(std::string{name.raw});
-  }
+  T* Find(Symbol name) const;
+  T* Find(std::string_view name) const { return Find(Intern(name)); }
+  T* Find(Token& name) const { return Find(GetSymbol(name)); }
 
-  T* FindCurrentBlock(const std::string& name) const;
+  T* FindCurrentBlock(Symbol name) const;
+  T* FindCurrentBlock(std::string_view name) const {
+    return FindCurrentBlock(Intern(name));
+  }
   T* FindCurrentBlock(Token& name) const {
-    return FindCurrentBlock(std::string{name.raw});
+    return FindCurrentBlock(GetSymbol(name));
   }
 
   /* 名前表に登録する。
@@ -28,62 +29,65 @@ class Scope {
    * 既に同じ名前で登録されていた場合は上書きをせず、
    * 既に登録されているオブジェクトを返す。
    */
-  T* Put(const std::string& name, T* v);
-  T* Put(Token& name, T* v) {
-    return Put(std::string{name.raw}, v);
-  }
+  T* Put(Symbol name, T* v);
+  T* Put(std::string_view name, T* v) { return Put(Intern(name), v); }
+  T* Put(Token& name, T* v) { return Put(GetSymbol(name), v); }
 
-  std::vector<T*> GetGlobals() const;
+  const std::vector<T*>& GetGlobals() const;
 
  private:
-  // 名前表（先頭がグローバル、末尾が現在のブロック）
-  std::vector<std::map<std::string, T*>> layers_{{}};
+  struct Layer {
+    SymbolMap<T> names;
+    std::vector<T*> put_order; // 登録順を記憶する配列
+  };
 
-  // 登録順を記憶する配列
-  std::vector<std::vector<T*>> put_order_{{}};
+  // 名前表（先頭がグローバル、末尾が現在のブロック）
+  // Leave() したブロックの領域は次の Enter() で再利用する。
+  std::vector<Layer> layers_{1};
+  std::size_t depth_ = 1;
 };
 
 template <class T>
 void Scope<T>::Enter() {
-  layers_.push_back({});
-  put_order_.push_back({});
+  if (depth_ == layers_.size()) {
+    layers_.emplace_back();
+  }
+  ++depth_;
 }
 
 template <class T>
 void Scope<T>::Leave() {
-  layers_.pop_back();
-  put_order_.pop_back();
+  auto& l = layers_[--depth_];
+  l.names.Clear();
+  l.put_order.clear();
 }
 
 template <class T>
-T* Scope<T>::Find(const std::string& name) const {
-  for (auto lay_it = layers_.rbegin(); lay_it != layers_.rend(); ++lay_it) {
-    if (auto it = lay_it->find(name); it != lay_it->end()) {
-      return it->second;
+T* Scope<T>::Find(Symbol name) const {
+  for (auto i = depth_; i-- > 0;) {
+    if (auto v = layers_[i].names.Find(name)) {
+      return v;
     }
   }
   return nullptr;
 }
 
 template <class T>
-T* Scope<T>::FindCurrentBlock(const std::string& name) const {
-  auto& bl = layers_.back();
-  auto it = bl.find(name);
-  return it == bl.end() ? nullptr : it->second;
+T* Scope<T>::FindCurrentBlock(Symbol name) const {
+  return layers_[depth_ - 1].names.Find(name);
 }
 
 template <class T>
-T* Scope<T>::Put(const std::string& name, T* v) {
-  auto& l = layers_.back();
-  auto [ old_it, inserted ] = l.insert({name, v});
-  if (inserted) {
-    put_order_.back().push_back(v);
-    return nullptr;
+T* Scope<T>::Put(Symbol name, T* v) {
+  auto& l = layers_[depth_ - 1];
+  if (auto old = l.names.Insert(name, v)) {
+    return old;
   }
-  return old_it->second;
+  l.put_order.push_back(v);
+  return nullptr;
 }
 
 template <class T>
-std::vector<T*> Scope<T>::GetGlobals() const {
-  return put_order_.front();
+const std::vector<T*>& Scope<T>::GetGlobals() const {
+  return layers_.front().put_order;
 }
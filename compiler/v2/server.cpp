@@ -0,0 +1,201 @@
+#include "server.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "arena.hpp"
+#include "trace.hpp"
+
+using namespace std;
+
+namespace {
+
+// ファイルディスクリプタから行とバイト列を読む
+class FdReader {
+ public:
+  explicit FdReader(int fd) : fd_{fd} {}
+
+  // 改行までを line に読む（改行は含めない）。改行の前に終わったら false
+  bool ReadLine(string& line) {
+    for (size_t scanned = 0;;) { // pos_ から scanned バイトには改行が無い
+      if (auto nl = buf_.find('\n', pos_ + scanned); nl != string::npos) {
+        line.assign(buf_, pos_, nl - pos_);
+        pos_ = nl + 1;
+        return true;
+      }
+      scanned = buf_.size() - pos_;
+      if (!Fill()) {
+        return false;
+      }
+    }
+  }
+
+  // size バイトを data に読む
+  bool Read(size_t size, string& data) {
+    while (buf_.size() - pos_ < size) {
+      if (!Fill()) {
+        return false;
+      }
+    }
+    data.assign(buf_, pos_, size);
+    pos_ += size;
+    return true;
+  }
+
+ private:
+  bool Fill() {
+    buf_.erase(0, pos_); // 読み終えた部分を捨てる
+    pos_ = 0;
+    char chunk[65536];
+    ssize_t n;
+    do {
+      n = read(fd_, chunk, sizeof(chunk));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      return false;
+    }
+    buf_.append(chunk, n);
+    return true;
+  }
+
+  int fd_;
+  string buf_;
+  size_t pos_ = 0;
+};
+
+bool WriteAll(int fd, string_view data) {
+  while (!data.empty()) {
+    ssize_t n = write(fd, data.data(), data.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return false;
+    }
+    data.remove_prefix(n);
+  }
+  return true;
+}
+
+bool WriteResponse(int fd, bool ok, string_view output,
+                   string_view diagnostics) {
+  ostringstream header;
+  header << (ok ? "ok " : "error ") << output.size() << ' '
+         << diagnostics.size() << '\n';
+  return WriteAll(fd, header.view()) && WriteAll(fd, output) &&
+         WriteAll(fd, diagnostics);
+}
+
+} // namespace
+
+int ServeFd(int in_fd, int out_fd, const opela::CompileOptions& opts) {
+  FdReader reader{in_fd};
+  string header, source;
+  while (reader.ReadLine(header)) {
+    // compile <ソースのバイト数> <ファイル名>
+    istringstream words{header};
+    string command;
+    size_t size;
+    if (!(words >> command >> size) || command != "compile") {
+      WriteResponse(out_fd, false, {}, "invalid request: " + header + '\n');
+      return 1;
+    }
+    words.get(); // 区切りの空白
+    string name;
+    getline(words, name);
+    if (!reader.Read(size, source)) {
+      WriteResponse(out_fd, false, {}, "incomplete source: " + name + '\n');
+      return 1;
+    }
+
+    TraceSpan span{"ServeRequest", name};
+    auto result = opela::Compile(opts, name, source);
+    if (!WriteResponse(out_fd, result.ok, result.output,
+                       result.diagnostics)) {
+      return 1; // 相手が接続を閉じた
+    }
+  }
+  return 0;
+}
+
+int ServeSocket(const string& path, const opela::CompileOptions& opts) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    cerr << "socket path is too long: " << path << endl;
+    return 1;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    cerr << "failed to create a socket: " << strerror(errno) << endl;
+    return 1;
+  }
+  unlink(path.c_str()); // 前回のサーバが残したソケットファイル
+  if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(listen_fd, SOMAXCONN) < 0) {
+    cerr << "failed to listen on " << path << ": " << strerror(errno) << endl;
+    close(listen_fd);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN); // 応答の前に切断されても終了しない
+
+  /* 接続は決まった数のスレッドで処理する
+   *
+   * 接続ごとのコンパイルは -j のスレッドを使うので、全体でノードのプールを持てる
+   * スレッドの数（kMaxPoolThreads）に収まるよう、同時に処理する接続の数を決める。
+   * 受け付けた接続は、手の空いたスレッドが順に処理する。
+   */
+  const size_t num_handlers =
+    max<size_t>(1, kMaxPoolThreads / max(1, opts.num_jobs));
+  mutex mtx;
+  condition_variable cv;
+  queue<int> pending_fds;
+  vector<jthread> handlers;
+  for (size_t i = 0; i < num_handlers; ++i) {
+    handlers.emplace_back([&]{
+      for (;;) {
+        int fd;
+        {
+          unique_lock lock{mtx};
+          cv.wait(lock, [&]{ return !pending_fds.empty(); });
+          fd = pending_fds.front();
+          pending_fds.pop();
+        }
+        ServeFd(fd, fd, opts);
+        close(fd);
+      }
+    });
+  }
+
+  for (;;) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      cerr << "failed to accept: " << strerror(errno) << endl;
+      close(listen_fd);
+      exit(1); // 処理中の接続を待たずに終了する
+    }
+    {
+      lock_guard lock{mtx};
+      pending_fds.push(fd);
+    }
+    cv.notify_one();
+  }
+}
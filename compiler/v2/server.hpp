@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+#include "compile.hpp"
+
+/* -server: コンパイル要求を 1 つのプロセスで繰り返し受け付ける
+ *
+ * 要求と応答はどちらも 1 行のヘッダと、ヘッダで長さを示したバイト列からなる。
+ *
+ *   要求: compile <ソースのバイト数> <ファイル名>\n<ソース>
+ *   応答: ok|error <出力のバイト数> <エラーメッセージのバイト数>\n<出力><エラーメッセージ>
+ *
+ * ファイル名はエラー表示とキャッシュの区別に使う（空でもよい）。
+ * 出力はアセンブリ言語（-emit-obj なら ELF）。ヘッダが読めなければ error を返して接続を閉じる。
+ */
+
+// in_fd から要求を読み、out_fd へ応答を書く。in_fd が終わるまで続ける
+int ServeFd(int in_fd, int out_fd, const opela::CompileOptions& opts);
+
+// Unix ソケット path で接続を待ち受け、決まった数のスレッドで接続を ServeFd する
+int ServeSocket(const std::string& path, const opela::CompileOptions& opts);
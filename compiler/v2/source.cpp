@@ -1,5 +1,6 @@
 #include "source.hpp"
 
+#include <algorithm>
 #include <array>
 #include <cstdlib>
 #include <execinfo.h>
@@ -9,35 +10,76 @@
 
 using namespace std;
 
+namespace {
+
+thread_local ostream* error_out = &cerr;
+
+} // namespace
+
+ostream& ErrorOut() {
+  return *error_out;
+}
+
+ErrorOutScope::ErrorOutScope(ostream& os) : prev_{error_out} {
+  error_out = &os;
+}
+
+ErrorOutScope::~ErrorOutScope() {
+  error_out = prev_;
+}
+
 void Source::ReadAll(istream& is) {
   array<char, 1024> buf;
   while (auto n = is.read(buf.begin(), buf.size()).gcount()) {
     src_.append(buf.begin(), n);
   }
   src_.append(1, '\0');
+  text_ = src_;
 }
 
 std::string_view Source::GetLine(const char* loc) {
   auto line = loc;
-  while (&*src_.begin() < line && line[-1] != '\n') {
+  while (Begin() < line && line[-1] != '\n') {
     --line;
   }
   auto line_end = loc;
-  while (*line_end != '\n' && line_end < &*src_.end()) {
+  while (*line_end != '\n' && line_end < End()) {
     ++line_end;
   }
   return {line, static_cast<size_t>(line_end - line)};
 }
 
-void ErrorAt(Source& src, const char* loc) {
-  auto line = src.GetLine(loc);
+Source* Source::Find(const char* loc) {
+  if (Contains(loc)) {
+    return this;
+  }
+  for (auto iface : imports_) {
+    if (auto found = iface->Find(loc)) {
+      return found;
+    }
+  }
+  return nullptr;
+}
 
-  cerr << line << endl;
-  cerr << string(&*loc - line.begin(), ' ') << '^' << endl;
+void ErrorAt(Source& src, const char* loc) {
+  // import したモジュールの宣言を指すこともあるので、loc を含むソースを探して表示する
+  if (auto loc_src = src.Find(loc)) {
+    auto line = loc_src->GetLine(loc);
+    if (!loc_src->Name().empty()) {
+      const auto line_no = count(loc_src->Begin(), line.data(), '\n') + 1;
+      ErrorOut() << "at " << loc_src->Name() << ':' << line_no << ':'
+                 << loc - line.data() + 1 << endl;
+    }
+    ErrorOut() << line << endl;
+    ErrorOut() << string(&*loc - line.begin(), ' ') << '^' << endl;
+  }
 
-  array<void*, 128> trace{};
-  int n = backtrace(trace.begin(), trace.size());
-  backtrace_symbols_fd(trace.begin(), n, STDERR_FILENO);
+  // コンパイラのどこで見つけたエラーかを示す（出力先を切り替えているときは省く）
+  if (&ErrorOut() == &cerr) {
+    array<void*, 128> trace{};
+    int n = backtrace(trace.begin(), trace.size());
+    backtrace_symbols_fd(trace.begin(), n, STDERR_FILENO);
+  }
 
-  exit(1);
+  throw CompileError{};
 }
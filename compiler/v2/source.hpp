@@ -1,24 +1,70 @@
 #pragma once
 
+#include <exception>
 #include <istream>
+#include <ostream>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 // コンパイル対象のソースコード全体
 class Source {
  public:
+  explicit Source(std::string name = {}) : name_{std::move(name)} {}
+  // text（末尾はヌル文字）を複製せずにソースコードとする。text は Source より長く生きること
+  Source(std::string name, std::string_view text)
+    : name_{std::move(name)}, text_{text} {}
+  Source(const Source&) = delete;
+  Source& operator=(const Source&) = delete;
+
+  // エラー表示に使うファイル名（標準入力から読むときは空）
+  const std::string& Name() const { return name_; }
+
   // src にソースコードを読み込む
   void ReadAll(std::istream& is);
 
   // 指定された箇所を含む行を取得する
   std::string_view GetLine(const char* loc);
 
-  const char* Begin() { return &*src_.begin(); }
-  const char* End() { return &*src_.end() - 1; }
+  const char* Begin() { return text_.data(); }
+  const char* End() { return text_.data() + text_.size() - 1; }
+  bool Contains(const char* loc) {
+    return text_.data() <= loc && loc < text_.data() + text_.size();
+  }
+
+  // import したモジュールのインターフェース（エラー箇所がこのソースになければ、ここから探す）
+  void AddImport(Source* iface) { imports_.push_back(iface); }
+  // loc を含むソースを自身と import したものから探す（見つからなければ nullptr）
+  Source* Find(const char* loc);
+
+ private:
+  std::string name_;
+  std::string src_; // ReadAll で読み込んだファイルの中身
+  std::string_view text_; // ソースコード全体（末尾はヌル文字）
+  std::vector<Source*> imports_;
+};
+
+// コンパイルエラー。エラーの内容は投げる前に ErrorOut() へ表示してある
+class CompileError : public std::exception {
+ public:
+  const char* what() const noexcept override { return "compile error"; }
+};
+
+// エラーメッセージの出力先。既定は標準エラー出力で、スレッドごとに切り替えられる
+std::ostream& ErrorOut();
+
+// 生存期間中、このスレッドのエラーメッセージの出力先を os にする
+class ErrorOutScope {
+ public:
+  explicit ErrorOutScope(std::ostream& os);
+  ~ErrorOutScope();
+  ErrorOutScope(const ErrorOutScope&) = delete;
+  ErrorOutScope& operator=(const ErrorOutScope&) = delete;
 
  private:
-  std::string src_; // ファイルの中身全体（末尾はヌル文字）
+  std::ostream* prev_;
 };
 
-// 指定された箇所をエラー表示し、プログラムを終了する
+// 指定された箇所をエラー表示し、CompileError を投げる
 [[noreturn]] void ErrorAt(Source& src, const char* loc);
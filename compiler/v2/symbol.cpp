@@ -0,0 +1,81 @@
+#include "symbol.hpp"
+
+#include <memory>
+#include <mutex>
+
+#include "arena.hpp"
+
+using namespace std;
+
+namespace {
+
+/* 記号表
+ *
+ * 名前の文字列はプールにコピーして保持する。
+ * 字句解析スレッドと構文解析が同時に登録しうるので、排他制御する。
+ */
+struct SymbolTable {
+  mutex mtx;
+  Arena strings;
+  vector<string_view> names{{}}; // 番号 0 は無効値
+  vector<uint32_t> slots = vector<uint32_t>(1024); // names の添え字（0 は空き）
+
+  static size_t Hash(string_view name) { // FNV-1a
+    uint64_t h = 0xcbf29ce484222325;
+    for (unsigned char c : name) {
+      h = (h ^ c) * 0x100000001b3;
+    }
+    return h;
+  }
+
+  uint32_t& Lookup(string_view name) {
+    const size_t mask = slots.size() - 1;
+    for (size_t i = Hash(name) & mask;; i = (i + 1) & mask) {
+      if (slots[i] == 0 || names[slots[i]] == name) {
+        return slots[i];
+      }
+    }
+  }
+
+  void Grow() {
+    vector<uint32_t> old(slots.size() * 2);
+    old.swap(slots);
+    for (auto id : old) {
+      if (id != 0) {
+        Lookup(names[id]) = id;
+      }
+    }
+  }
+};
+
+SymbolTable& GetSymbolTable() {
+  static SymbolTable table;
+  return table;
+}
+
+} // namespace
+
+Symbol Intern(std::string_view name) {
+  auto& tbl = GetSymbolTable();
+  lock_guard lock{tbl.mtx};
+
+  if (auto id = tbl.Lookup(name)) {
+    return {id};
+  }
+  if (tbl.names.size() * 4 > tbl.slots.size() * 3) {
+    tbl.Grow();
+  }
+
+  auto p = static_cast<char*>(tbl.strings.Allocate(name.size(), 1));
+  copy(name.begin(), name.end(), p);
+  uint32_t id = tbl.names.size();
+  tbl.names.push_back({p, name.size()});
+  tbl.Lookup(name) = id;
+  return {id};
+}
+
+std::string_view SymbolName(Symbol sym) {
+  auto& tbl = GetSymbolTable();
+  lock_guard lock{tbl.mtx};
+  return tbl.names[sym.id];
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// 識別子を一意に表す番号（0 は無効値）
+struct Symbol {
+  std::uint32_t id;
+
+  bool operator==(const Symbol&) const = default;
+};
+
+// 名前を記号表に登録し、その番号を返す（既に登録済みなら同じ番号を返す）
+Symbol Intern(std::string_view name);
+
+// 番号に対応する名前を返す
+std::string_view SymbolName(Symbol sym);
+
+/* Symbol をキーとするハッシュ表（オープンアドレス法）
+ *
+ * 要素の個別削除はできない。Clear() は確保済みの領域を再利用する。
+ * 使用中のスロットの位置を覚えておき、Clear() は要素の数に比例する時間で済ませる。
+ */
+template <class T>
+class SymbolMap {
+ public:
+  T* Find(Symbol sym) const {
+    if (size_ == 0) {
+      return nullptr;
+    }
+    for (auto i = Hash(sym);; i = (i + 1) & mask_) {
+      if (slots_[i].first == sym) {
+        return slots_[i].second;
+      } else if (slots_[i].first.id == 0) {
+        return nullptr;
+      }
+    }
+  }
+
+  // 登録済みなら上書きせず、登録済みの値を返す
+  T* Insert(Symbol sym, T* v) {
+    if ((size_ + 1) * 4 > slots_.size() * 3) {
+      Grow();
+    }
+    auto i = Hash(sym);
+    for (; slots_[i].first.id != 0; i = (i + 1) & mask_) {
+      if (slots_[i].first == sym) {
+        return slots_[i].second;
+      }
+    }
+    slots_[i] = {sym, v};
+    used_.push_back(static_cast<std::uint32_t>(i));
+    ++size_;
+    return nullptr;
+  }
+
+  void Clear() {
+    for (auto i : used_) {
+      slots_[i] = Slot{};
+    }
+    used_.clear();
+    size_ = 0;
+  }
+
+ private:
+  using Slot = std::pair<Symbol, T*>;
+
+  std::size_t Hash(Symbol sym) const {
+    return (sym.id * 0x9e3779b9u) & mask_;
+  }
+
+  void Grow() {
+    std::vector<Slot> old(std::max<std::size_t>(8, slots_.size() * 2));
+    old.swap(slots_);
+    mask_ = slots_.size() - 1;
+    size_ = 0;
+    used_.clear();
+    for (auto& [ sym, v ] : old) {
+      if (sym.id != 0) {
+        Insert(sym, v);
+      }
+    }
+  }
+
+  std::vector<Slot> slots_;
+  std::vector<std::uint32_t> used_; // 使用中のスロットの位置
+  std::size_t mask_ = 0;
+  std::size_t size_ = 0;
+};
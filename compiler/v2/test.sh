@@ -11,64 +11,306 @@ passed=0
 failed=0
 opelac="./opelac -target-arch $target_arch"
 
+# x86-64 のマシンでは -run でアセンブル・リンクを省いてその場で実行する
+use_jit=0
+if [ "$target_arch" = "x86_64" -a "$(uname -m)" = "x86_64" ]
+then
+  use_jit=1
+  make cfunc.so || exit 1
+fi
+
 function build_tmp() {
   echo "$1" | $opelac > tmp.s
   cc -o tmp tmp.s cfunc.o
 }
 
-function test_exit() {
-  want="$1"
-  input="$2"
-
+# 入力をコンパイルして実行する。残りの引数はプログラムに渡す
+function run_input() {
+  input="$1"
+  shift
+  if [ $use_jit -eq 1 ]
+  then
+    echo "$input" | $opelac -load ./cfunc.so -run "$@"
+    return $?
+  fi
   build_tmp "$input"
-  ./tmp
-  got=$?
+  ./tmp "$@"
+  ret=$?
   rm tmp tmp.s
+  return $ret
+}
 
-  if [ "$want" = "$got" ]
+# AST のダンプに含まれるノードのアドレスは実行ごとに変わるので、比べる前に消す
+function strip_addrs() {
+  sed -E 's/0x[0-9a-f]+/0x/g'
+}
+
+# グローバル変数 n 個と、n 文からなる関数・ジェネリック関数を持つソースを出力する
+function gen_long_source() {
+  n=$1
+  for ((i = 0; i < n; i++)); do echo "var g$i int;"; done
+  echo "func gsum<T>(a T) T {"
+  for ((i = 0; i < n; i++)); do echo "  a = a + 1;"; done
+  echo "  return a;"
+  echo "}"
+  echo "func main() int {"
+  echo "  s := 0;"
+  for ((i = 0; i < n; i++)); do echo "  s = s + g$i + 1;"; done
+  echo "  return s - gsum@<int>(0) + 42;"
+  echo "}"
+}
+
+# next の長い連鎖を小さなスタックでも処理できることを確かめる
+function test_long_chain() {
+  n=$1
+  stack_kib=$2
+
+  (ulimit -s $stack_kib; run_input "$(gen_long_source $n)")
+  got=$?
+
+  if [ 42 = "$got" ]
   then
-    echo "[  OK  ]: $input -> '$got'"
+    echo "[  OK  ]: $n decls/stmts with ${stack_kib}KiB stack -> '$got'"
     (( ++passed ))
   else
-    echo "[FAILED]: $input -> '$got', want '$want'"
+    echo "[FAILED]: $n decls/stmts with ${stack_kib}KiB stack -> '$got', want '42'"
     (( ++failed ))
   fi
 }
 
-function test_stdout() {
-  want="$1"
-  input="$2"
+# -j で並列にコード生成しても、出力が 1 スレッドのときと一致することを確かめる
+function test_parallel_codegen() {
+  jobs=$1
+  src=$2
 
-  build_tmp "$input"
-  got=$(./tmp)
-  rm tmp tmp.s
+  if cmp -s <($opelac -lean < $src) <($opelac -lean -j $jobs < $src)
+  then
+    echo "[  OK  ]: -j $jobs output of $src matches -j 1"
+    (( ++passed ))
+  else
+    echo "[FAILED]: -j $jobs output of $src differs from -j 1"
+    (( ++failed ))
+  fi
+}
+
+# -c で複数のファイルをまとめてコンパイルした結果が、1 つずつコンパイルした結果と一致することを確かめる
+# AST のダンプの Node_0 などの番号もファイルごとに振られることを確かめるため、-lean は付けない
+function test_compile_files() {
+  jobs=$1
+  shift
+
+  out_dir=$(mktemp -d)
+  ok=1
+  $opelac -j $jobs -c "$@" -o $out_dir 2> /dev/null || ok=0
+  for src in "$@"
+  do
+    cmp -s <($opelac < $src 2> /dev/null | strip_addrs) \
+      <(strip_addrs < $out_dir/$(basename ${src%.*}).s) || ok=0
+  done
+  rm -rf $out_dir
+
+  if [ $ok -eq 1 ]
+  then
+    echo "[  OK  ]: -j $jobs -c $* matches separate compilation"
+    (( ++passed ))
+  else
+    echo "[FAILED]: -j $jobs -c $* differs from separate compilation"
+    (( ++failed ))
+  fi
+}
+
+# import したモジュールと別々にコンパイルしてリンクし、終了コードを確かめる
+# 2 回目はキャッシュした .opli を読み込む
+function test_import() {
+  want=$1
+  module="$2"
+  input="$3"
+
+  dir=$(mktemp -d)
+  echo "$module" > $dir/mod.opl
+  echo "$input" > $dir/main.opl
+  ok=1
+  for pass in build cached
+  do
+    $opelac -c $dir/mod.opl $dir/main.opl -o $dir 2> /dev/null || ok=0
+    cc -o $dir/main $dir/mod.s $dir/main.s 2> /dev/null || ok=0
+    $dir/main
+    got=$?
+    [ "$want" = "$got" -a -f $dir/mod.opli ] || ok=0
+  done
+  rm -rf $dir
+
+  if [ $ok -eq 1 ]
+  then
+    echo "[  OK  ]: import '$module' -> $want"
+    (( ++passed ))
+  else
+    echo "[FAILED]: import '$module' -> $got, want $want"
+    (( ++failed ))
+  fi
+}
+
+# import できないモジュールで、モジュールのソースの位置を指すエラーになることを確かめる
+function test_import_error() {
+  want_msg="$1"
+  module="$2"
+  input="$3"
+
+  dir=$(mktemp -d)
+  echo "$module" > $dir/mod.opl
+  echo "$input" > $dir/main.opl
+  ok=1
+  $opelac -c $dir/main.opl -o $dir 2> $dir/diag && ok=0
+  grep -q "$want_msg" $dir/diag || ok=0
+  grep -q "^at $dir/mod.opl:" $dir/diag || ok=0
+  rm -rf $dir
 
-  if [ "$want" = "$got" ]
+  if [ $ok -eq 1 ]
   then
-    echo "[  OK  ]: $input -> '$got'"
+    echo "[  OK  ]: import '$module' reports $want_msg"
     (( ++passed ))
   else
-    echo "[FAILED]: $input -> '$got', want '$want'"
+    echo "[FAILED]: import '$module' does not report $want_msg in mod.opl"
     (( ++failed ))
   fi
 }
 
-function test_argv() {
-  want="$1"
-  input_arg="$2"
-  input_src="$3"
+# -cache-dir でキャッシュしたコードを再利用しても、出力がキャッシュなしと一致することを確かめる
+# 2 回目は関数を先頭に足して、ラベルの関数番号がずれる場合を試す
+function test_code_cache() {
+  src=$1
 
-  build_tmp "$input_src"
-  ./tmp $input_arg
+  dir=$(mktemp -d)
+  ok=1
+  cmp -s <($opelac -lean < $src) \
+    <($opelac -lean -cache-dir $dir < $src 2> /dev/null) || ok=0
+  (echo 'func cacheTestFirst() int { if 1 { return 2; } return 3; }'; cat $src) \
+    > $dir/shifted.opl
+  cmp -s <($opelac -lean < $dir/shifted.opl) \
+    <($opelac -lean -cache-dir $dir < $dir/shifted.opl 2> $dir/stats) || ok=0
+  grep -q "functions reused" $dir/stats || ok=0
+  rm -rf $dir
+
+  if [ $ok -eq 1 ]
+  then
+    echo "[  OK  ]: -cache-dir output of $src matches uncached output"
+    (( ++passed ))
+  else
+    echo "[FAILED]: -cache-dir output of $src differs from uncached output"
+    (( ++failed ))
+  fi
+}
+
+# -server に複数の要求を続けて送り、エラーの後も同じ結果を返し続けることを確かめる
+function test_server() {
+  src=$1
+
+  dir=$(mktemp -d)
+  bad='func main() int { return undeclaredVar; }'
+  {
+    printf 'compile %d %s\n' $(wc -c < $src) $src; cat $src
+    printf 'compile %d bad.opl\n' ${#bad}; printf '%s' "$bad"
+    printf 'compile %d %s\n' $(wc -c < $src) $src; cat $src
+  } | $opelac -server > $dir/resp
+  $opelac < $src | strip_addrs > $dir/want
+
+  ok=1
+  offset=0
+  for want_status in ok error ok
+  do
+    header=$(tail -c +$((offset + 1)) $dir/resp | head -n 1)
+    read -r status out_size diag_size <<< "$header"
+    offset=$((offset + ${#header} + 1))
+    tail -c +$((offset + 1)) $dir/resp | head -c $out_size > $dir/out
+    offset=$((offset + out_size))
+    tail -c +$((offset + 1)) $dir/resp | head -c $diag_size > $dir/diag
+    offset=$((offset + diag_size))
+
+    [ "$status" = "$want_status" ] || ok=0
+    if [ "$want_status" = ok ]
+    then
+      strip_addrs < $dir/out | cmp -s - $dir/want || ok=0
+    else
+      grep -q "undeclared id" $dir/diag || ok=0
+    fi
+  done
+  rm -rf $dir
+
+  if [ $ok -eq 1 ]
+  then
+    echo "[  OK  ]: -server compiles $src repeatedly and reports errors"
+    (( ++passed ))
+  else
+    echo "[FAILED]: -server output of $src differs from opelac"
+    (( ++failed ))
+  fi
+}
+
+# -prune-unused で main から到達できない関数とジェネリック関数の具体化を生成しないことを確かめる
+# 関数ポインタやグローバル変数の初期化式から参照する関数は残す
+function test_prune() {
+  want=$1
+  input="$2"
+  shift 2
+
+  ok=1
+  asm=$(echo "$input" | $opelac -lean -prune-unused 2> /dev/null)
+  for sym in "$@"
+  do
+    echo "$asm" | grep -q "^$sym:" && ok=0
+    echo "$input" | $opelac -lean 2> /dev/null | grep -q "^$sym:" || ok=0
+  done
+  opelac="$opelac -prune-unused" run_input "$input" 2> /dev/null
   got=$?
-  rm tmp tmp.s
+  [ "$want" = "$got" ] || ok=0
 
-  if [ $want -eq $got ]
+  if [ $ok -eq 1 ]
   then
-    echo "[  OK  ]: '$input_arg' -> $got"
+    echo "[  OK  ]: unreachable $* pruned -> $got"
     (( ++passed ))
   else
-    echo "[FAILED]: '$input_arg' -> $got, want $want"
+    echo "[FAILED]: unreachable $* not pruned or -> $got, want $want"
+    (( ++failed ))
+  fi
+}
+
+# main から到達できない関数の中のエラーも報告することを確かめる
+function test_prune_error() {
+  input="$1"
+  want_msg="$2"
+
+  if echo "$input" | $opelac -lean -prune-unused 2>&1 > /dev/null | grep -q "$want_msg"
+  then
+    echo "[  OK  ]: unreachable function reports $want_msg"
+    (( ++passed ))
+  else
+    echo "[FAILED]: unreachable function does not report $want_msg"
+    (( ++failed ))
+  fi
+}
+
+# -stream で関数を 1 つずつ生成したプログラムが、まとめて生成したものと同じ出力・終了コードになることを確かめる
+function test_stream() {
+  src=$1
+
+  dir=$(mktemp -d)
+  ok=1
+  for mode in lean stream
+  do
+    $opelac -$mode < $src > $dir/$mode.s 2> /dev/null || ok=0
+    cc -o $dir/$mode $dir/$mode.s cfunc.o 2> /dev/null || ok=0
+    $dir/$mode > $dir/$mode.out
+    echo "exit $?" >> $dir/$mode.out
+  done
+  cmp -s $dir/lean.out $dir/stream.out || ok=0
+  rm -rf $dir
+
+  if [ $ok -eq 1 ]
+  then
+    echo "[  OK  ]: -stream build of $src behaves the same"
+    (( ++passed ))
+  else
+    echo "[FAILED]: -stream build of $src behaves differently"
     (( ++failed ))
   fi
 }
@@ -77,41 +319,48 @@ make test.exe || exit 1
 
 echo "Running standard testcases..."
 ./test.exe
-#test_exit 42 'func main() int { return 42; }'
-#test_exit 30 'func main() int { return (1+2) / 2+ (( 3 -4) +5 *  6 ); }'
-#test_exit 5  'func main() int { return -3 + (+8); }'
-#test_exit 2  'func main() int { return -2 * -1; }'
-#test_exit 0  'func main() int { return 3 < (1 + 1); }'
-#test_exit 1  'func main() int { return 3 > (1 + 1); }'
-#test_exit 1  'func main() int { return 2*3 >= 13/2; }'
-#test_exit 1  'func main() int { return 2>2 == 4<=3; }'
-#test_exit 15 'func main() int { foo:=5; bar:=3; return foo*bar; }'
-#test_exit 6  'func main() int { foo:=2; { foo:=3; } return foo+4; }'
-#test_exit 42 'func main() int { return 41+1; 3; }'
-#test_exit 2  'func main() int { if 42 > 10 { return 2; } }'
-#test_exit 0  'func main() int { if 42 < 10 { return 2; } }'
-#test_exit 2  'func main() int { cond := 10 < 200; if cond { return 2; } }'
-#test_exit 4  'func main() int { if 0 { return 3; } else { return 4; } }'
-#test_exit 5  'func main() int { if 0 { return 3; } else if 1 { return 5; } else { return 4; } }'
-#test_exit 8  'func main() int { foo := 3; foo = 4; return foo * 2; }'
-#test_exit 38 'func main() int { foo:=5; bar:=7; foo=(bar=1)=42; return foo-4; }'
-#test_exit 42 'func main() int { foo:=5; bar:=7; return foo=bar=42; }'
-#test_exit 9  'func main() int { a:=5; a=b:=3; return a*b; }'
-#test_exit 55 'func main() int { i:=0; s:=0; for i <= 10 { s=s+i; i=i+1; } return s; }'
-#test_exit 55 'func main() int { s:=0; for i:=0; i<=10; i=i+1 { s=s+i; } return s; }'
-#test_exit 9  'func main() int { s:=0; for i:=1;i<3;i=i+1{ for j:=1;j<3;j=j+1{ s=s+i*j; } } return s; }'
-#test_exit 39 'func main() int { return func42() - 3; } extern "C" func42 func()int;'
-#test_exit 42 'func main() int { return funcfunc42()(); } extern "C" funcfunc42 func() *func()int;'
-#test_exit 43 'func main() int { return add((1+2)*(3+4), add(func42(), 1)) - 21; } extern "C" func42 func()int; extern "C" add func(a, b int) int;'
-#test_exit 4  'func main() int { return sizeof(myInt); } type myInt int32;'
-#test_exit 6  'func main() int { return (3@myInt2 + 2@int2) + 5; } type myInt2 int2;'
-#test_exit 57 'func main() int {return add(sum10(), 2);} extern "C" add func(a,b int)int; func sum10()int{s:=0; for i:=1;i<=10;i=i+1 {s=s+i;} return s;}'
-#test_exit 5  'func main() int {return myAdd(-3,8);} func myAdd(a,b int)int{return a+b;}'
+
+if [ "$target_arch" = "x86_64" ]
+then
+  echo "Running standard testcases with -emit-obj..."
+  make test-obj.exe || exit 1
+  ./test-obj.exe
+fi
+
+if [ $use_jit -eq 1 ]
+then
+  echo "Running standard testcases with -run..."
+  ./opelac -load ./cfunc.so -run < test.opl.tmp
+fi
 
 echo "============================="
 echo "Running extra testcases..."
-test_stdout 'foo' 'func main() { write(1, "foo", 3); }
-  extern "C" write func(int, *byte, int);'
+test_long_chain 20000 1024
+test_parallel_codegen 4 test.opl.tmp
+test_compile_files 3 test.opl.tmp example/*.opl
+test_code_cache test.opl.tmp
+test_server test.opl.tmp
+test_stream test.opl.tmp
+test_prune 6 'func Twice<T>(a T) T { return a + a; }
+  func Thrice<T>(a T) T { return a + Twice@<T>(a); }
+  func unused1() int { return Thrice@<int>(1) + Twice@<int8>(2); }
+  func unused2() int { return unused1(); }
+  func viaPtr() int { return 7; } func viaGlobal() int { return Thrice@<int>(5); }
+  var gp *func() int = &viaGlobal; func call(f *func() int) int { return f(); }
+  func main() int { return call(&viaPtr) + gp() + Twice@<int>(3) - 22; }' \
+  unused1 unused2 Twice__int8
+test_prune_error 'func unused() int { return undeclaredVar; } func main() int { return 0; }' \
+  "undeclared id"
+test_prune_error 'func unused() int { var p *int; return p + "x" * 3; } func main() int { return 0; }' \
+  "not supported"
+test_import 42 'type P struct{a int; b int;};
+  func Sum(p *P) int { return p->a + p->b; } func Sum(a, b, c int) int { return Twice@<int>(a)/2+b+c; }
+  func Twice<T>(a T) T { return a + a; } var hidden int;' 'import "mod";
+  func main() int { var p P={1,5}; return Sum(&p) + Sum(3, 4, 5) + Twice@<int>(12) + 0*Twice@<int>(0); }'
+test_import_error "cannot use a global variable of the module: counter" \
+  'var counter int; func Get<T>() T { return counter; }
+  type P struct{counter int;}; func Field<T>(counter T, p *P) T { return counter + p->counter; }' \
+  'import "mod"; func main() int { return Get@<int>(); }'
 
 echo "$passed passed, $failed failed"
 if [ $failed -ne 0 ]
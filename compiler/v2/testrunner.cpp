@@ -0,0 +1,365 @@
+// テストケースを並列に実行するテストランナー
+//
+// 使い方: testrunner [-target-arch ARCH] [-emit-obj] [-j N] [-keep] [case file...]
+// ケースの一覧（省略時は testcases.txt。書式はそのファイルの先頭を参照）を読み込み、
+// ケースごとに一時ディレクトリを作って、プロセス内でコンパイル（opela::Compile）し、
+// cc で cfunc.o とリンクして実行する。ケースは -j 個（省略時は CPU の数）ずつ並行して進め、
+// ケースごとにコンパイル・リンク・実行の時間を表示する。最後に時間のかかったケースを並べる。
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <spawn.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "arena.hpp"
+#include "compile.hpp"
+#include "jobs.hpp"
+
+extern char** environ;
+
+using namespace std;
+
+namespace {
+
+enum class CaseKind {
+  kExit,   // 終了コードを確かめる
+  kStdout, // 標準出力を確かめる
+  kArgv,   // 引数を渡して終了コードを確かめる
+};
+
+struct TestCase {
+  string location; // ケースファイル名:行番号
+  CaseKind kind;
+  int want_exit = 0;
+  string want_stdout;
+  vector<string> args;
+  string source;
+};
+
+struct CaseResult {
+  bool ok = false;
+  string message; // 失敗の理由
+  chrono::duration<double, milli> compile_ms{}, link_ms{}, run_ms{};
+
+  double TotalMs() const {
+    return (compile_ms + link_ms + run_ms).count();
+  }
+};
+
+opela::CompileOptions opts;
+string target_arch = "x86_64";
+int num_jobs = 0; // 0 なら CPU の数
+bool keep_dirs = false; // 一時ディレクトリを消さずに残す
+vector<string> case_files;
+string cfunc_path; // テストのプログラムとリンクする cfunc.o（絶対パス）
+
+// 書式の誤りを表示して false を返す
+bool CaseFileError(const string& path, int line, string_view msg) {
+  cerr << path << ':' << line << ": " << msg << endl;
+  return false;
+}
+
+// path からケースを読み込んで cases へ追加する
+bool LoadCases(const string& path, vector<TestCase>& cases) {
+  ifstream in{path};
+  if (!in) {
+    cerr << "failed to open " << path << endl;
+    return false;
+  }
+
+  string line;
+  int line_no = 0;
+  TestCase* current = nullptr; // ソースを読み込み中のケース
+  while (getline(in, line)) {
+    ++line_no;
+    if (current) {
+      if (line.empty()) {
+        current = nullptr;
+      } else {
+        current->source += line + '\n';
+      }
+      continue;
+    }
+    if (line.empty() || line.starts_with('#')) {
+      continue;
+    }
+
+    istringstream words{line};
+    string kind;
+    words >> kind;
+    TestCase c;
+    c.location = path + ':' + to_string(line_no);
+    if (kind == "exit" || kind == "argv") {
+      c.kind = kind == "exit" ? CaseKind::kExit : CaseKind::kArgv;
+      if (!(words >> c.want_exit)) {
+        return CaseFileError(path, line_no, "exit code is missing");
+      }
+      for (string arg; words >> arg;) {
+        c.args.push_back(arg);
+      }
+      if (c.kind == CaseKind::kExit && !c.args.empty()) {
+        return CaseFileError(path, line_no, "exit case takes no arguments");
+      }
+    } else if (kind == "stdout") {
+      c.kind = CaseKind::kStdout;
+      words.get(); // 区切りの空白
+      getline(words, c.want_stdout);
+    } else {
+      return CaseFileError(path, line_no, "unknown case kind: " + kind);
+    }
+    current = &cases.emplace_back(move(c));
+  }
+
+  for (auto& c : cases) {
+    if (c.source.empty()) {
+      cerr << c.location << ": source is missing" << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/* argv を実行して終了を待ち、終了ステータス（waitpid の形式）を返す
+ *
+ * 標準出力と標準エラー出力は out_path へ書き出す。起動できなければ -1 を返す。
+ */
+int Spawn(const vector<string>& argv, const filesystem::path& out_path) {
+  vector<char*> c_argv;
+  for (auto& arg : argv) {
+    c_argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  c_argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out_path.c_str(),
+                                   O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+  pid_t pid;
+  int err = posix_spawnp(&pid, c_argv[0], &actions, nullptr, c_argv.data(),
+                         environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0) {
+    return -1;
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return status;
+}
+
+string ReadFile(const filesystem::path& path) {
+  ifstream in{path, ios::binary};
+  ostringstream oss;
+  oss << in.rdbuf();
+  return oss.str();
+}
+
+// ケースを 1 つ dir の中でコンパイル・リンク・実行する
+CaseResult RunCase(const TestCase& c, const filesystem::path& dir) {
+  using Clock = chrono::steady_clock;
+  CaseResult r;
+
+  auto t0 = Clock::now();
+  auto compiled = opela::Compile(opts, c.location, c.source);
+  r.compile_ms = Clock::now() - t0;
+  if (!compiled.ok) {
+    r.message = "compile error\n" + compiled.diagnostics;
+    return r;
+  }
+
+  const auto input_path = dir / (opts.emit_obj ? "tmp.o" : "tmp.s");
+  ofstream{input_path, ios::binary} << compiled.output;
+  const auto exe_path = dir / "tmp";
+  const auto link_log = dir / "link.log";
+  t0 = Clock::now();
+  int status = Spawn({"cc", "-o", exe_path, input_path, cfunc_path}, link_log);
+  r.link_ms = Clock::now() - t0;
+  if (status < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    r.message = "link error\n" + ReadFile(link_log);
+    return r;
+  }
+
+  vector<string> argv{exe_path};
+  argv.insert(argv.end(), c.args.begin(), c.args.end());
+  const auto stdout_path = dir / "stdout";
+  t0 = Clock::now();
+  status = Spawn(argv, stdout_path);
+  r.run_ms = Clock::now() - t0;
+  if (status < 0 || !WIFEXITED(status)) {
+    r.message = status < 0 ? "failed to run" :
+      "killed by signal " + to_string(WTERMSIG(status));
+    return r;
+  }
+
+  ostringstream msg;
+  if (c.kind == CaseKind::kStdout) {
+    string got = ReadFile(stdout_path);
+    r.ok = got == c.want_stdout;
+    msg << "'" << got << "', want '" << c.want_stdout << "'";
+  } else {
+    const int got = WEXITSTATUS(status);
+    r.ok = got == c.want_exit;
+    msg << "exit " << got << ", want " << c.want_exit;
+  }
+  r.message = msg.str();
+  return r;
+}
+
+// ケースの 1 行目を表示用に切り出す
+string_view Summary(const TestCase& c) {
+  string_view s = c.source;
+  s = s.substr(0, s.find('\n'));
+  return s.size() > 60 ? s.substr(0, 60) : s;
+}
+
+void PrintTimes(ostream& os, const CaseResult& r) {
+  os << fixed << setprecision(1)
+     << setw(6) << r.compile_ms.count() << "ms compile "
+     << setw(6) << r.link_ms.count() << "ms link "
+     << setw(6) << r.run_ms.count() << "ms run";
+}
+
+int ParseArgs(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    string_view opt = argv[i];
+    if ((opt == "-target-arch" || opt == "-j") && i == argc - 1) {
+      cerr << opt << " needs one argument" << endl;
+      return 1;
+    }
+    if (opt == "-target-arch") {
+      target_arch = argv[++i];
+    } else if (opt == "-emit-obj") {
+      opts.emit_obj = true;
+    } else if (opt == "-j") {
+      num_jobs = atoi(argv[++i]);
+    } else if (opt == "-keep") {
+      keep_dirs = true;
+    } else if (!opt.starts_with('-')) {
+      case_files.push_back(argv[i]);
+    } else {
+      cerr << "unknown argument: " << opt << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  if (int err = ParseArgs(argc, argv)) {
+    return err;
+  }
+  if (target_arch == "x86_64") {
+    opts.arch = AsmArch::kX86_64;
+  } else if (target_arch == "aarch64") {
+    opts.arch = AsmArch::kAArch64;
+  } else {
+    cerr << "current version doesn't support " << target_arch << endl;
+    return 1;
+  }
+  if (opts.emit_obj && opts.arch != AsmArch::kX86_64) {
+    cerr << "-emit-obj supports only x86_64" << endl;
+    return 1;
+  }
+  opts.lean_asm = true;
+  if (case_files.empty()) {
+    case_files.push_back("testcases.txt");
+  }
+  if (num_jobs <= 0) {
+    num_jobs = max(1u, thread::hardware_concurrency());
+  }
+  // ケースごとにコンパイルするスレッドは、ノードのプールを持てる数までにする
+  num_jobs = min(num_jobs, static_cast<int>(kMaxPoolThreads));
+  cfunc_path = filesystem::absolute("cfunc.o");
+
+  vector<TestCase> cases;
+  for (auto& path : case_files) {
+    if (!LoadCases(path, cases)) {
+      return 1;
+    }
+  }
+
+  // ケースごとの一時ディレクトリは 1 つのディレクトリの下にまとめる
+  string root_template =
+    (filesystem::temp_directory_path() / "opela-test-XXXXXX").native();
+  if (!mkdtemp(root_template.data())) {
+    cerr << "failed to create a temporary directory: " << strerror(errno)
+         << endl;
+    return 1;
+  }
+  const filesystem::path root = root_template;
+
+  const auto start = chrono::steady_clock::now();
+  vector<CaseResult> results(cases.size());
+  {
+    JobPool pool{num_jobs - 1};
+    JobGroup group{pool};
+    for (size_t i = 0; i < cases.size(); ++i) {
+      group.Run([&, i]{
+        const auto dir = root / to_string(i);
+        filesystem::create_directory(dir);
+        results[i] = RunCase(cases[i], dir);
+      });
+    }
+    group.Wait();
+  }
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+  size_t passed = 0, failed = 0;
+  for (size_t i = 0; i < cases.size(); ++i) {
+    auto& r = results[i];
+    cout << (r.ok ? "[  OK  ] " : "[FAILED] ");
+    PrintTimes(cout, r);
+    cout << "  " << Summary(cases[i]) << endl;
+    if (!r.ok) {
+      cout << "    " << cases[i].location << ": " << r.message << endl;
+    }
+    ++(r.ok ? passed : failed);
+  }
+
+  // 時間のかかったケースを目立たせる
+  vector<size_t> order(cases.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return results[a].TotalMs() > results[b].TotalMs();
+  });
+  order.resize(min<size_t>(order.size(), 5));
+  cout << "slowest cases:" << endl;
+  for (size_t i : order) {
+    cout << "  ";
+    PrintTimes(cout, results[i]);
+    cout << "  " << cases[i].location << endl;
+  }
+
+  if (keep_dirs) {
+    cout << "case directories are kept in " << root.native() << endl;
+  } else {
+    filesystem::remove_all(root);
+  }
+  cout << passed << " passed, " << failed << " failed (" << fixed
+       << setprecision(2) << elapsed.count() << "s with " << num_jobs
+       << " jobs)" << endl;
+  return failed == 0 ? 0 : 1;
+}
@@ -1,11 +1,17 @@
 #include "token.hpp"
 
-#include <cctype>
-#include <cstdlib>
-#include <cstring>
+#include <array>
+#include <bit>
+#include <cstdint>
 #include <iostream>
-#include <map>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "arena.hpp"
 #include "magic_enum.hpp"
 #include "source.hpp"
 
@@ -13,66 +19,236 @@ using namespace std;
 
 namespace {
 
-const map<Token::Kind, string> kKeywords{
-  {Token::kRet,    "return"},
-  {Token::kIf,     "if"},
-  {Token::kElse,   "else"},
-  {Token::kFor,    "for"},
-  {Token::kFunc,   "func"},
-  {Token::kExtern, "extern"},
-  {Token::kSizeof, "sizeof"},
-  {Token::kType,   "type"},
-  {Token::kVar,    "var"},
-  {Token::kBreak,  "break"},
-  {Token::kCont,   "continue"},
-  {Token::kStruct, "struct"},
+// 文字種のビット（1 つの文字が複数の種別を持ちうる）
+enum CharClass : uint8_t {
+  kCSpace      = 1 << 0, // 空白文字（' ', \t, \n, \v, \f, \r）
+  kCDigit      = 1 << 1, // 10 進数字
+  kCIdentHead  = 1 << 2, // 識別子の先頭になれる文字（英字と _）
+  kCIdentBody  = 1 << 3, // 識別子の 2 文字目以降になれる文字（英数字と _）
+  kCPunct      = 1 << 4, // 1 文字で演算子・区切り記号になる文字
+  kCAssignHead = 1 << 5, // 直後に '=' が来ると 2 文字の演算子になる文字
 };
 
-const char* FindStr(const char* p) {
-  if (*p != '"') {
-    return nullptr;
+constexpr std::array<uint8_t, 256> kCharClass = []{
+  std::array<uint8_t, 256> table{};
+  for (int c = 0; c < 256; ++c) {
+    uint8_t cls = 0;
+    if (c == ' ' || ('\t' <= c && c <= '\r')) {
+      cls |= kCSpace;
+    }
+    if ('0' <= c && c <= '9') {
+      cls |= kCDigit | kCIdentBody;
+    }
+    if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_') {
+      cls |= kCIdentHead | kCIdentBody;
+    }
+    table[c] = cls;
   }
+  for (unsigned char c : std::string_view{"+-*/()<>;{}=,@&[]."}) {
+    table[c] |= kCPunct;
+  }
+  for (unsigned char c : std::string_view{"=!<>:+-*/"}) {
+    table[c] |= kCAssignHead;
+  }
+  return table;
+}();
 
-  ++p;
-  while (*p && *p != '"') {
-    if (*p == '\\') {
-      p += 2;
-    } else {
-      ++p;
+inline bool Is(char c, uint8_t cls) {
+  return kCharClass[static_cast<unsigned char>(c)] & cls;
+}
+
+// 数字の値（数字でなければ 0xff）
+constexpr std::array<uint8_t, 256> kDigitValue = []{
+  std::array<uint8_t, 256> table{};
+  for (auto& v : table) {
+    v = 0xff;
+  }
+  for (int c = '0'; c <= '9'; ++c) {
+    table[c] = c - '0';
+  }
+  for (int c = 'a'; c <= 'f'; ++c) {
+    table[c] = table[c - 'a' + 'A'] = c - 'a' + 10;
+  }
+  return table;
+}();
+
+/* 16 バイト単位の文字走査
+ *
+ * ScanUntil(p, end, stop) は [p, end) を 16 バイトずつ調べ、
+ * stop(v) が真となるバイトの位置を返す。
+ * 16 バイトに満たない末尾は調べずにその先頭を返すので、残りは呼び出し側が 1 文字ずつ調べる。
+ */
+#if defined(__SSE2__)
+using Vec = __m128i;
+constexpr int kMaskBitsPerByte = 1;
+inline Vec Load(const char* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+inline Vec Eq(Vec v, char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); }
+inline Vec InRange(Vec v, char lo, char hi) {
+  auto d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(hi - lo)), d);
+}
+inline Vec Or(Vec a, Vec b) { return _mm_or_si128(a, b); }
+inline Vec Not(Vec v) { return _mm_xor_si128(v, _mm_set1_epi8(-1)); }
+inline uint64_t ToMask(Vec v) { return _mm_movemask_epi8(v); }
+#elif defined(__ARM_NEON)
+using Vec = uint8x16_t;
+constexpr int kMaskBitsPerByte = 4;
+inline Vec Load(const char* p) {
+  return vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+}
+inline Vec Eq(Vec v, char c) { return vceqq_u8(v, vdupq_n_u8(c)); }
+inline Vec InRange(Vec v, char lo, char hi) {
+  return vcleq_u8(vsubq_u8(v, vdupq_n_u8(lo)), vdupq_n_u8(hi - lo));
+}
+inline Vec Or(Vec a, Vec b) { return vorrq_u8(a, b); }
+inline Vec Not(Vec v) { return vmvnq_u8(v); }
+inline uint64_t ToMask(Vec v) { // 1 バイトあたり 4 ビットのマスク
+  auto nibbles = vshrn_n_u16(vreinterpretq_u16_u8(v), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+#endif
+
+template <class Stop>
+const char* ScanUntil(const char* p, const char* end, [[maybe_unused]] Stop stop) {
+#if defined(__SSE2__) || defined(__ARM_NEON)
+  for (; end - p >= 16; p += 16) {
+    if (uint64_t mask = ToMask(stop(Load(p)))) {
+      return p + countr_zero(mask) / kMaskBitsPerByte;
     }
   }
+#endif
+  return p;
+}
+
+const char* SkipSpaces(const char* p, const char* end) {
+  p = ScanUntil(p, end, [](auto v){
+    return Not(Or(Eq(v, ' '), InRange(v, '\t', '\r')));
+  });
+  while (p < end && Is(*p, kCSpace)) {
+    ++p;
+  }
+  return p;
+}
 
-  if (*p == '"') {
+const char* SkipIdentBody(const char* p, const char* end) {
+  p = ScanUntil(p, end, [](auto v){
+    return Not(Or(Or(InRange(v, 'a', 'z'), InRange(v, 'A', 'Z')),
+                  Or(InRange(v, '0', '9'), Eq(v, '_'))));
+  });
+  while (p < end && Is(*p, kCIdentBody)) {
     ++p;
   }
   return p;
 }
 
-Token* NextToken(Source& src, const char* p) {
-  while (p < src.End()) {
-    if (isspace(*p)) {
+// c が現れる位置を返す。見つからなければ end を返す。
+const char* FindChar(const char* p, const char* end, char c) {
+  p = ScanUntil(p, end, [c](auto v){ return Eq(v, c); });
+  while (p < end && *p != c) {
+    ++p;
+  }
+  return p;
+}
+
+// 文字列リテラルの終わりの '"' を探す。見つからなければ end を返す。
+const char* FindStrEnd(const char* p, const char* end) {
+  for (;;) {
+    p = ScanUntil(p, end, [](auto v){ return Or(Eq(v, '"'), Eq(v, '\\')); });
+    while (p < end && *p != '"' && *p != '\\') {
       ++p;
-      continue;
     }
+    if (p >= end || *p == '"') {
+      return p;
+    }
+    p += 2; // エスケープされた文字を読み飛ばす
+  }
+}
 
-    if (string_view comment{p, 2}; comment == "//") {
-      if (auto end_comment = strchr(p + 2, '\n')) {
-        p = end_comment + 1;
-        continue;
-      }
-      p = src.End();
+// 識別子がキーワードならその種別を、そうでなければ kId を返す
+Token::Kind KeywordKind(std::string_view id) {
+  auto is = [id](std::string_view kw){ return id == kw; };
+  switch (id.length()) {
+  case 2:
+    if (is("if")) return Token::kIf;
+    break;
+  case 3:
+    if (is("for")) return Token::kFor;
+    if (is("var")) return Token::kVar;
+    break;
+  case 4:
+    switch (id[0]) {
+    case 'e': if (is("else")) return Token::kElse; break;
+    case 'f': if (is("func")) return Token::kFunc; break;
+    case 't': if (is("type")) return Token::kType; break;
+    }
+    break;
+  case 5:
+    if (is("break")) return Token::kBreak;
+    break;
+  case 6:
+    switch (id[0]) {
+    case 'r': if (is("return")) return Token::kRet; break;
+    case 'e': if (is("extern")) return Token::kExtern; break;
+    case 'i': if (is("import")) return Token::kImport; break;
+    case 's':
+      if (is("sizeof")) return Token::kSizeof;
+      if (is("struct")) return Token::kStruct;
       break;
-    } else if (comment == "/*") {
-      if (auto end_comment = strstr(p + 2, "*/")) {
-        p = end_comment + 2;
-        continue;
+    }
+    break;
+  case 8:
+    if (is("continue")) return Token::kCont;
+    break;
+  }
+  return Token::kId;
+}
+
+// 演算子・区切り記号の長さを返す（該当しなければ 0）
+size_t PunctLength(const char* p) {
+  if (p[0] == '.' && p[1] == '.' && p[2] == '.') {
+    return 3;
+  }
+  if (p[1] == '=' && Is(p[0], kCAssignHead)) {
+    return 2;
+  }
+  switch (p[0]) {
+  case '|': return p[1] == '|' ? 2 : 0;
+  case '&': return p[1] == '&' ? 2 : 1;
+  case '+': return p[1] == '+' ? 2 : 1;
+  case '-': return p[1] == '-' || p[1] == '>' ? 2 : 1;
+  }
+  return Is(p[0], kCPunct) ? 1 : 0;
+}
+
+Token NextToken(Source& src, const char* p) {
+  const char* end = src.End();
+  while (p < end) {
+    if (Is(*p, kCSpace)) {
+      p = SkipSpaces(p + 1, end);
+      continue;
+    }
+
+    if (p[0] == '/' && p[1] == '/') {
+      p = FindChar(p + 2, end, '\n');
+      p += p < end;
+      continue;
+    } else if (p[0] == '/' && p[1] == '*') {
+      auto q = p + 2;
+      for (;;) {
+        q = FindChar(q, end, '*');
+        if (q >= end || q[1] == '/') {
+          break;
+        }
+        ++q;
       }
-      p = src.End();
-      break;
+      p = q < end ? q + 2 : end;
+      continue;
     }
 
-    if (isdigit(*p)) {
-      int base = 10;
+    if (Is(*p, kCDigit)) {
+      unsigned base = 10;
       auto literal = p;
 
       if (*p == '0') {
@@ -88,74 +264,165 @@ Token* NextToken(Source& src, const char* p) {
         }
       }
 
-      char* non_digit;
-      opela_type::Int v = strtol(literal, &non_digit, base);
-      return new Token{Token::kInt, {p, static_cast<size_t>(non_digit - p)}, v};
-    }
-
-    if (string_view op{p, 3}; op == "...") {
-      return new Token{Token::kReserved, {p, 3}, {}};
-    }
-
-    if (p[1] == '=' && strchr("=!<>:+-*/", p[0])) {
-      return new Token{Token::kReserved, {p, 2}, {}};
-    }
-
-    if (string_view op{p, 2};
-        op == "||" || op == "&&" || op == "++" || op == "--" || op == "->") {
-      return new Token{Token::kReserved, {p, 2}, {}};
-    }
-
-    if (strchr("+-*/()<>;{}=,@&[].", *p)) {
-      return new Token{Token::kReserved, {p, 1}, {}};
+      opela_type::UInt v = 0;
+      auto q = literal;
+      for (unsigned d; (d = kDigitValue[static_cast<unsigned char>(*q)]) < base; ++q) {
+        v = v * base + d;
+      }
+      return Token{Token::kInt, Punct::kNone, {p, static_cast<size_t>(q - p)},
+                   static_cast<opela_type::Int>(v)};
     }
 
-    for (auto& [ kind, name ] : kKeywords) {
-      if (string_view raw{p, name.size()};
-          raw == name && !isalnum(p[name.size()]) && p[name.size()] != '_') {
-        return new Token{kind, raw, {}};
-      }
+    if (auto len = PunctLength(p)) {
+      return Token{Token::kReserved, PunctOf({p, len}), {p, len}, {}};
     }
 
-    if (isalpha(*p) || *p == '_') {
-      auto id = p++;
-      while (p < src.End() && (isalnum(*p) || *p == '_')) {
-        ++p;
+    if (Is(*p, kCIdentHead)) {
+      auto id_end = SkipIdentBody(p + 1, end);
+      string_view id{p, static_cast<size_t>(id_end - p)};
+      if (auto kind = KeywordKind(id); kind != Token::kId) {
+        return Token{kind, Punct::kNone, id, {}};
       }
-      return new Token{Token::kId, {id, static_cast<size_t>(p - id)}, {}};
+      return Token{Token::kId, Punct::kNone, id, Intern(id)};
     }
 
     if (*p == '"') {
-      auto str_end = FindStr(p);
-      if (*str_end == '\0') {
-        cerr << "incomplete string literal" << endl;
+      auto str_end = FindStrEnd(p + 1, end);
+      if (str_end >= end) {
+        ErrorOut() << "incomplete string literal" << endl;
         ErrorAt(src, p);
       }
-      return new Token{Token::kStr, {p, static_cast<size_t>(str_end - p)}, {}};
+      return Token{Token::kStr, Punct::kNone, {p, static_cast<size_t>(str_end + 1 - p)}, {}};
     }
 
     if (*p == '\'') {
       if (p[1] != '\\' && p[2] == '\'') {
-        return new Token{Token::kChar, {p, 3}, opela_type::Byte(p[1])};
+        return Token{Token::kChar, Punct::kNone, {p, 3}, opela_type::Byte(p[1])};
       } else if (p[1] == '\\' && p[3] == '\'') {
         char v = GetEscapeValue(p[2]);
-        return new Token{Token::kChar, {p, 4}, opela_type::Byte(v)};
+        return Token{Token::kChar, Punct::kNone, {p, 4}, opela_type::Byte(v)};
       }
-      cerr << "invalid char literal" << endl;
+      ErrorOut() << "invalid char literal" << endl;
       ErrorAt(src, p);
     }
 
-    cerr << "failed to tokenize" << endl;
+    ErrorOut() << "failed to tokenize" << endl;
     ErrorAt(src, p);
   }
 
-  return new Token{Token::kEOF, {p, 0}, {}};
+  return Token{Token::kEOF, Punct::kNone, {end, 0}, {}};
 }
 
 } // namespace
 
+Punct PunctOf(std::string_view raw) {
+  const char c0 = raw.empty() ? '\0' : raw[0];
+  if (raw.size() == 1) {
+    switch (c0) {
+    case '+': return Punct::kPlus;
+    case '-': return Punct::kMinus;
+    case '*': return Punct::kStar;
+    case '/': return Punct::kSlash;
+    case '(': return Punct::kLParen;
+    case ')': return Punct::kRParen;
+    case '<': return Punct::kLT;
+    case '>': return Punct::kGT;
+    case ';': return Punct::kSemicolon;
+    case '{': return Punct::kLBrace;
+    case '}': return Punct::kRBrace;
+    case '=': return Punct::kAssign;
+    case ',': return Punct::kComma;
+    case '@': return Punct::kAt;
+    case '&': return Punct::kAmp;
+    case '[': return Punct::kLBracket;
+    case ']': return Punct::kRBracket;
+    case '.': return Punct::kDot;
+    }
+  } else if (raw.size() == 2 && raw[1] == '=') {
+    switch (c0) {
+    case '=': return Punct::kEqu;
+    case '!': return Punct::kNEqu;
+    case '<': return Punct::kLE;
+    case '>': return Punct::kGE;
+    case ':': return Punct::kDefine;
+    case '+': return Punct::kPlusAssign;
+    case '-': return Punct::kMinusAssign;
+    case '*': return Punct::kStarAssign;
+    case '/': return Punct::kSlashAssign;
+    }
+  } else if (raw.size() == 2) {
+    switch (c0) {
+    case '|': if (raw[1] == '|') return Punct::kLOr; break;
+    case '&': if (raw[1] == '&') return Punct::kLAnd; break;
+    case '+': if (raw[1] == '+') return Punct::kInc; break;
+    case '-':
+      if (raw[1] == '-') return Punct::kDec;
+      if (raw[1] == '>') return Punct::kArrow;
+      break;
+    }
+  } else if (raw == "...") {
+    return Punct::kEllipsis;
+  }
+  return Punct::kNone;
+}
+
+TokenStream::TokenStream(Source& src) : src_{src} {
+  // トークンは少なくとも 1 文字を消費するので、チャンク表の大きさは事前に決まる。
+  // 字句解析中にチャンク表が再配置されないため、At() はロックなしで読める。
+  const size_t max_tokens = src_.End() - src_.Begin() + 1;
+  chunks_.resize((max_tokens + kChunkSize - 1) >> kChunkBits);
+}
+
+void TokenStream::LexAll() {
+  const char* p = src_.Begin();
+  for (size_t i = 0;; ++i) {
+    auto& chunk = chunks_[i >> kChunkBits];
+    if (!chunk) {
+      chunk = make_unique<Token[]>(kChunkSize);
+    }
+    auto& token = chunk[i & (kChunkSize - 1)];
+    try {
+      token = NextToken(src_, p);
+    } catch (const CompileError&) {
+      num_tokens_.store(i | kLexFailed, memory_order_release);
+      num_tokens_.notify_all();
+      throw;
+    }
+    p = token.raw.end();
+
+    if (token.kind == Token::kEOF || (i + 1) % kPublishInterval == 0) {
+      num_tokens_.store(i + 1, memory_order_release);
+      num_tokens_.notify_all();
+    }
+    if (token.kind == Token::kEOF) {
+      return;
+    }
+  }
+}
+
+Token* TokenStream::At(std::size_t i) {
+  for (auto n = num_tokens_.load(memory_order_acquire); i >= (n & ~kLexFailed);
+       n = num_tokens_.load(memory_order_acquire)) {
+    if (n & kLexFailed) {
+      throw CompileError{}; // エラーの内容は字句解析したスレッドが表示した
+    }
+    num_tokens_.wait(n, memory_order_acquire);
+  }
+  return &chunks_[i >> kChunkBits][i & (kChunkSize - 1)];
+}
+
 Tokenizer::Tokenizer(Source& src)
-  : src_{src}, cur_token_{NextToken(src_, src_.Begin())} {
+  : src_{src}, cur_token_{GetPool(Pool::kToken).New<Token>(
+                            NextToken(src_, src_.Begin()))} {
+}
+
+Tokenizer::Tokenizer(Source& src, TokenStream& stream)
+  : src_{src}, stream_{&stream}, cur_token_{stream.At(0)} {
+}
+
+Tokenizer::Tokenizer(Source& src, const char* begin)
+  : src_{src}, cur_token_{GetPool(Pool::kToken).New<Token>(
+                            NextToken(src_, begin))} {
 }
 
 Token* Tokenizer::Peek() {
@@ -176,13 +443,20 @@ Token* Tokenizer::Peek(std::string_view raw) {
   return nullptr;
 }
 
+Token* Tokenizer::Peek(Punct punct) {
+  if (cur_token_->punct == punct) {
+    return cur_token_;
+  }
+  return nullptr;
+}
+
 Token* Tokenizer::Consume() {
   if (cur_token_->kind == Token::kEOF) {
     return cur_token_;
   }
 
   auto token = cur_token_;
-  cur_token_ = NextToken(src_, cur_token_->raw.end());
+  cur_token_ = Next();
   return token;
 }
 
@@ -200,6 +474,13 @@ Token* Tokenizer::Consume(string_view raw) {
   return nullptr;
 }
 
+Token* Tokenizer::Consume(Punct punct) {
+  if (Peek(punct)) {
+    return Consume();
+  }
+  return nullptr;
+}
+
 Token* Tokenizer::Expect(Token::Kind kind) {
   if (auto token = Consume(kind)) {
     return token;
@@ -221,7 +502,9 @@ void Tokenizer::Unexpected(Token& token) {
 Token* Tokenizer::SubToken(Token::Kind kind, std::size_t len) {
   auto sub_token = cur_token_->raw.substr(0, len);
   cur_token_->raw = cur_token_->raw.substr(len);
-  return new Token{kind, sub_token, {}};
+  cur_token_->punct = PunctOf(cur_token_->raw);
+  return GetPool(Pool::kToken).New<Token>(
+      Token{kind, PunctOf(sub_token), sub_token, {}});
 }
 
 Token* Tokenizer::ConsumeOrSub(std::string_view raw) {
@@ -234,12 +517,51 @@ Token* Tokenizer::ConsumeOrSub(std::string_view raw) {
   return nullptr;
 }
 
+const char* Tokenizer::SkipBlock() {
+  auto begin = Expect("{")->raw.begin();
+  int depth = 1;
+  if (stream_) {
+    for (; depth > 0; Consume()) {
+      if (cur_token_->kind == Token::kEOF) {
+        ::Unexpected(src_, *cur_token_);
+      }
+      depth += cur_token_->punct == Punct::kLBrace;
+      depth -= cur_token_->punct == Punct::kRBrace;
+    }
+    return begin;
+  }
+
+  Token token = *cur_token_;
+  for (;;) {
+    if (token.kind == Token::kEOF) {
+      ::Unexpected(src_, token);
+    }
+    depth += token.punct == Punct::kLBrace;
+    depth -= token.punct == Punct::kRBrace;
+    if (depth == 0) {
+      break;
+    }
+    token = NextToken(src_, token.raw.end());
+  }
+  cur_token_ = GetPool(Pool::kToken).New<Token>(
+      NextToken(src_, token.raw.end()));
+  return begin;
+}
+
+Token* Tokenizer::Next() {
+  if (stream_) {
+    return stream_->At(++pos_);
+  }
+  return GetPool(Pool::kToken).New<Token>(
+      NextToken(src_, cur_token_->raw.end()));
+}
+
 void ErrorAt(Source& src, Token& token) {
   ErrorAt(src, token.raw.begin());
 }
 
 void Unexpected(Source& src, Token& token) {
-  cerr << "unexpected token "
+  ErrorOut() << "unexpected token "
     << magic_enum::enum_name(token.kind)
     << " '" << token.raw << "'\n";
   ErrorAt(src, token);
@@ -1,14 +1,61 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string_view>
 #include <variant>
 #include <vector>
 
 #include "types.hpp"
 #include "source.hpp"
+#include "symbol.hpp"
+
+// 演算子・区切り記号の種類（kReserved トークンの raw を文字列比較せずに判別する）
+enum class Punct : std::uint8_t {
+  kNone,         // 演算子・区切り記号ではない
+  kPlus,         // +
+  kMinus,        // -
+  kStar,         // *
+  kSlash,        // /
+  kLParen,       // (
+  kRParen,       // )
+  kLT,           // <
+  kGT,           // >
+  kSemicolon,    // ;
+  kLBrace,       // {
+  kRBrace,       // }
+  kAssign,       // =
+  kComma,        // ,
+  kAt,           // @
+  kAmp,          // &
+  kLBracket,     // [
+  kRBracket,     // ]
+  kDot,          // .
+  kEqu,          // ==
+  kNEqu,         // !=
+  kLE,           // <=
+  kGE,           // >=
+  kDefine,       // :=
+  kPlusAssign,   // +=
+  kMinusAssign,  // -=
+  kStarAssign,   // *=
+  kSlashAssign,  // /=
+  kLOr,          // ||
+  kLAnd,         // &&
+  kInc,          // ++
+  kDec,          // --
+  kArrow,        // ->
+  kEllipsis,     // ...
+  kNum,          // 列挙子の数
+};
+
+// 演算子・区切り記号の文字列から種類を求める
+Punct PunctOf(std::string_view raw);
 
 struct Token {
-  enum Kind {
+  enum Kind : std::uint8_t {
     kEOF,
     kReserved,
     kInt,  // 整数リテラル
@@ -29,23 +76,68 @@ struct Token {
     kBreak,
     kCont,
     kStruct,
+    kImport,
   } kind;
 
+  Punct punct; // kReserved のときの演算子・区切り記号の種類
+
   std::string_view raw;
 
-  std::variant<opela_type::Int, opela_type::Byte> value;
+  // kInt: Int, kChar: Byte, kId: Symbol
+  std::variant<opela_type::Int, opela_type::Byte, Symbol> value;
+};
+
+// 識別子トークンの記号番号を返す（識別子以外なら raw を登録して返す）
+inline Symbol GetSymbol(Token& token) {
+  if (auto sym = std::get_if<Symbol>(&token.value)) {
+    return *sym;
+  }
+  return Intern(token.raw);
+}
+
+/* ソース全体を字句解析したトークン列
+ *
+ * トークンは固定長のチャンクに連続して格納され、追加されても移動しない。
+ * LexAll() を別スレッドで実行すれば、字句解析と構文解析を並行して進められる。
+ * At() はまだ字句解析が済んでいないトークンを要求されると、それが揃うまで待つ。
+ */
+class TokenStream {
+ public:
+  TokenStream(Source& src);
+
+  // ソースの末尾（kEOF）まで字句解析する。
+  // エラーなら CompileError を投げ、At() で待っている側にも CompileError を投げさせる
+  void LexAll();
+
+  // i 番目のトークンを返す（kEOF より後ろを指定してはいけない）
+  Token* At(std::size_t i);
+
+ private:
+  static constexpr std::size_t kChunkBits = 12;
+  static constexpr std::size_t kChunkSize = std::size_t(1) << kChunkBits;
+  static constexpr std::size_t kPublishInterval = 256;
+  // num_tokens_ に立てて字句解析の失敗を知らせるビット
+  static constexpr std::size_t kLexFailed = ~(~std::size_t(0) >> 1);
+
+  Source& src_;
+  std::vector<std::unique_ptr<Token[]>> chunks_;
+  std::atomic<std::size_t> num_tokens_{0}; // 読み出し可能なトークン数
 };
 
 class Tokenizer {
  public:
   Tokenizer(Source& src);
+  Tokenizer(Source& src, TokenStream& stream); // 先読み済みのトークン列を辿る
+  Tokenizer(Source& src, const char* begin); // ソースの途中 begin から字句解析する
 
   Token* Peek();
   Token* Peek(Token::Kind kind);
   Token* Peek(std::string_view raw);
+  Token* Peek(Punct punct);
   Token* Consume();
   Token* Consume(Token::Kind kind);
   Token* Consume(std::string_view raw);
+  Token* Consume(Punct punct);
   Token* Expect(Token::Kind kind);
   Token* Expect(std::string_view raw);
 
@@ -54,8 +146,16 @@ class Tokenizer {
   Token* SubToken(Token::Kind kind, std::size_t len);
   Token* ConsumeOrSub(std::string_view raw);
 
+  // 現在の '{' から対応する '}' までを読み飛ばし、'{' の位置を返す。
+  // 読み飛ばすトークンはプールに確保しない（先読み済みのトークン列を辿るときを除く）
+  const char* SkipBlock();
+
  private:
+  Token* Next();
+
   Source& src_;
+  TokenStream* stream_ = nullptr;
+  std::size_t pos_ = 0; // stream_ 上の現在位置
   Token* cur_token_;
 };
 
@@ -0,0 +1,188 @@
+#include "trace.hpp"
+
+#include <sys/resource.h>
+
+#include <atomic>
+#include <ctime>
+#include <iomanip>
+#include <mutex>
+
+#include "magic_enum.hpp"
+
+using namespace std;
+
+namespace {
+
+using Clock = chrono::steady_clock;
+
+double CPUTimeMs() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+long MaxRSSKiB() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+struct TraceEvent {
+  string name, detail;
+  Clock::time_point start, end;
+  int tid;
+};
+
+atomic<bool> trace_enabled = false;
+mutex trace_mutex;
+vector<TraceEvent> trace_events;
+const Clock::time_point trace_origin = Clock::now();
+
+int TraceThreadID() {
+  static atomic<int> next_tid = 0;
+  thread_local int tid = next_tid++;
+  return tid;
+}
+
+void AddTraceEvent(string name, string detail,
+                   Clock::time_point start, Clock::time_point end) {
+  lock_guard lock{trace_mutex};
+  trace_events.push_back({move(name), move(detail), start, end,
+                          TraceThreadID()});
+}
+
+void PrintJSONString(ostream& os, string_view s) {
+  os << '"';
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      os << "\\u" << hex << setw(4) << setfill('0') << int{c}
+         << dec << setfill(' ');
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+long long MicrosecondsSinceOrigin(Clock::time_point t) {
+  return chrono::duration_cast<chrono::microseconds>(t - trace_origin).count();
+}
+
+} // namespace
+
+void PhaseRecorder::Begin(std::string_view name) {
+  End();
+  cur_name_ = name;
+  wall_start_ = Clock::now();
+  cpu_start_ms_ = CPUTimeMs();
+  running_ = true;
+}
+
+void PhaseRecorder::End() {
+  if (!running_) {
+    return;
+  }
+  running_ = false;
+
+  const auto wall_end = Clock::now();
+  Phase phase{cur_name_,
+              chrono::duration<double, milli>(wall_end - wall_start_).count(),
+              CPUTimeMs() - cpu_start_ms_, MaxRSSKiB(), {}, 0};
+  for (size_t i = 0; i < phase.objects.size(); ++i) {
+    auto& arena = GetPool(static_cast<Pool>(i));
+    phase.objects[i] = arena.NumObjects();
+    phase.arena_bytes += arena.BytesAllocated();
+  }
+  phases_.push_back(move(phase));
+
+  if (TimeTraceEnabled()) {
+    AddTraceEvent(cur_name_, "", wall_start_, wall_end);
+  }
+}
+
+void PhaseRecorder::PrintTimeReport(std::ostream& os) const {
+  os << left << setw(12) << "phase" << right
+     << setw(12) << "wall(ms)" << setw(12) << "cpu(ms)"
+     << setw(10) << "wall%" << setw(16) << "peak RSS(KiB)" << '\n';
+
+  double total_wall = 0, total_cpu = 0;
+  for (auto& phase : phases_) {
+    total_wall += phase.wall_ms;
+    total_cpu += phase.cpu_ms;
+  }
+  os << fixed << setprecision(2);
+  for (auto& phase : phases_) {
+    os << left << setw(12) << phase.name << right
+       << setw(12) << phase.wall_ms << setw(12) << phase.cpu_ms
+       << setw(9) << (total_wall > 0 ? phase.wall_ms / total_wall * 100 : 0)
+       << '%' << setw(16) << phase.max_rss_kib << '\n';
+  }
+  os << left << setw(12) << "total" << right
+     << setw(12) << total_wall << setw(12) << total_cpu
+     << setw(10) << "" << setw(16) << MaxRSSKiB() << '\n';
+  os << defaultfloat << setprecision(6);
+}
+
+void PhaseRecorder::PrintMemReport(std::ostream& os) const {
+  // 各段階の終了時点の累計（プールは途中で解放しないので単調に増える）
+  os << left << setw(12) << "phase" << right;
+  for (size_t i = 0; i < static_cast<size_t>(Pool::kNum); ++i) {
+    os << setw(10) << magic_enum::enum_name(static_cast<Pool>(i)).substr(1);
+  }
+  os << setw(14) << "arena bytes" << setw(16) << "peak RSS(KiB)" << '\n';
+
+  for (auto& phase : phases_) {
+    os << left << setw(12) << phase.name << right;
+    for (auto n : phase.objects) {
+      os << setw(10) << n;
+    }
+    os << setw(14) << phase.arena_bytes
+       << setw(16) << phase.max_rss_kib << '\n';
+  }
+}
+
+void EnableTimeTrace() {
+  trace_enabled = true;
+}
+
+bool TimeTraceEnabled() {
+  return trace_enabled.load(memory_order_relaxed);
+}
+
+void WriteTimeTrace(std::ostream& os) {
+  lock_guard lock{trace_mutex};
+  os << "{\"traceEvents\":[\n";
+  for (size_t i = 0; i < trace_events.size(); ++i) {
+    auto& e = trace_events[i];
+    os << "{\"name\":";
+    PrintJSONString(os, e.name);
+    os << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.tid
+       << ",\"ts\":" << MicrosecondsSinceOrigin(e.start)
+       << ",\"dur\":" << MicrosecondsSinceOrigin(e.end) -
+                         MicrosecondsSinceOrigin(e.start);
+    if (!e.detail.empty()) {
+      os << ",\"args\":{\"detail\":";
+      PrintJSONString(os, e.detail);
+      os << '}';
+    }
+    os << '}' << (i + 1 < trace_events.size() ? ",\n" : "\n");
+  }
+  os << "],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+TraceSpan::TraceSpan(std::string_view name, std::string_view detail)
+    : enabled_{TimeTraceEnabled()} {
+  if (enabled_) {
+    name_ = name;
+    detail_ = detail;
+    start_ = Clock::now();
+  }
+}
+
+TraceSpan::~TraceSpan() {
+  if (enabled_) {
+    AddTraceEvent(move(name_), move(detail_), start_, Clock::now());
+  }
+}
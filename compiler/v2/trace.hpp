@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.hpp"
+
+/* コンパイルの段階（字句解析、構文解析、型付け、コード生成など）ごとの計測
+ *
+ * Begin() で前の段階を終えて次の段階を始める。段階ごとに経過時間、CPU 時間、
+ * ピーク RSS、各プールのオブジェクト数を記録し、-ftime-report と -fmem-report で表示する。
+ */
+class PhaseRecorder {
+ public:
+  void Begin(std::string_view name);
+  void End(); // 計測中の段階を終える（何も計測していなければ何もしない）
+
+  void PrintTimeReport(std::ostream& os) const;
+  void PrintMemReport(std::ostream& os) const;
+
+ private:
+  struct Phase {
+    std::string name;
+    double wall_ms, cpu_ms;
+    long max_rss_kib; // 段階の終了時点のピーク RSS
+    std::array<std::size_t, static_cast<std::size_t>(Pool::kNum)> objects;
+    std::size_t arena_bytes;
+  };
+
+  std::vector<Phase> phases_;
+  std::string cur_name_;
+  std::chrono::steady_clock::time_point wall_start_;
+  double cpu_start_ms_ = 0;
+  bool running_ = false;
+};
+
+/* Chrome のトレース形式（chrome://tracing, Perfetto）で区間を記録する（-ftime-trace）
+ *
+ * 記録を有効にしていなければ TraceSpan は何もしない。
+ * 複数のスレッドから同時に記録してよい。
+ */
+void EnableTimeTrace();
+bool TimeTraceEnabled();
+void WriteTimeTrace(std::ostream& os);
+
+class TraceSpan {
+ public:
+  TraceSpan(std::string_view name, std::string_view detail = {});
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+  ~TraceSpan();
+
+ private:
+  bool enabled_;
+  std::string name_, detail_;
+  std::chrono::steady_clock::time_point start_;
+};
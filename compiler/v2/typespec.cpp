@@ -1,9 +1,12 @@
 #include "typespec.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <execinfo.h>
 #include <iostream>
 #include <unistd.h>
 
+#include "arena.hpp"
 #include "generics.hpp"
 #include "magic_enum.hpp"
 
@@ -16,49 +19,118 @@ namespace {
   int n = backtrace(trace.begin(), trace.size());
   backtrace_symbols_fd(trace.begin(), n, STDERR_FILENO);
 
-  exit(1);
+  throw CompileError{};
 }
 
+Type* AllocType(Type::Kind kind, Type* base, Type* next,
+                std::variant<long, Token*> value) {
+  return GetPool(Pool::kType).New<Type>(kind, base, next, value, 0u);
+}
+
+// 名前のトークンを型のプールへ複製する。
+// -stream では型より先に関数本体のトークンを解放するので、型からは元のトークンを指さない
+Token* PersistName(Token* name) {
+  return name ? GetPool(Pool::kType).New<Token>(*name) : nullptr;
+}
+
+// 正準型の表
+struct InternKey {
+  Type::Kind kind;
+  long value;
+  std::uint32_t base_id;
+
+  auto operator<=>(const InternKey&) const = default;
+};
+thread_local map<InternKey, Type*> interned_types;
+
+Type* Intern(Type::Kind kind, Type* base, long value) {
+  InternKey key{kind, value, base ? base->id : 0};
+  auto [ it, inserted ] = interned_types.insert({key, nullptr});
+  if (inserted) {
+    it->second = AllocType(kind, base, nullptr, value);
+    it->second->id = interned_types.size();
+  }
+  return it->second;
+}
+
+}
+
+void ClearInternedTypes() {
+  interned_types.clear();
 }
 
 Type* NewType(Type::Kind kind) {
-  return new Type{kind, nullptr, nullptr, 0};
+  if (kind == Type::kVoid || kind == Type::kBool) {
+    return Intern(kind, nullptr, 0);
+  }
+  return AllocType(kind, nullptr, nullptr, 0);
 }
 
 Type* NewTypeIntegral(Type::Kind kind, long bits) {
-  return new Type{kind, nullptr, nullptr, bits};
+  return Intern(kind, nullptr, bits);
 }
 
 Type* NewTypePointer(Type* base) {
-  return new Type{Type::kPointer, base, nullptr, 0};
+  if (base->id != 0) {
+    return Intern(Type::kPointer, base, 0);
+  }
+  return AllocType(Type::kPointer, base, nullptr, 0);
 }
 
 Type* NewTypeFunc(Type* ret, Type* param_list) {
-  return new Type{Type::kFunc, ret, param_list, 0};
+  return AllocType(Type::kFunc, ret, param_list, 0);
 }
 
 Type* NewTypeParam(Type* t, Token* name) {
-  return new Type{Type::kParam, t, nullptr, name};
+  return AllocType(Type::kParam, t, nullptr, PersistName(name));
 }
 
 Type* NewTypeUnresolved(Token* name) {
-  return new Type{Type::kUnresolved, nullptr, nullptr, name};
+  return AllocType(Type::kUnresolved, nullptr, nullptr, PersistName(name));
 }
 
 Type* NewTypeUser(Type* base, Token* name) {
-  return new Type{Type::kUser, base, nullptr, name};
+  return AllocType(Type::kUser, base, nullptr, PersistName(name));
 }
 
 Type* NewTypeArray(Type* base, long size) {
-  return new Type{Type::kArray, base, nullptr, size};
+  if (base->id != 0) {
+    return Intern(Type::kArray, base, size);
+  }
+  return AllocType(Type::kArray, base, nullptr, size);
 }
 
 Type* NewTypeGParam(Token* name) {
-  return new Type{Type::kGParam, nullptr, nullptr, name};
+  return AllocType(Type::kGParam, nullptr, nullptr, PersistName(name));
 }
 
 Type* NewTypeGeneric(Type* gtype, Type* param_list) {
-  return new Type{Type::kGeneric, gtype, param_list, 0};
+  return AllocType(Type::kGeneric, gtype, param_list, 0);
+}
+
+Type* InternType(Type* t) {
+  if (t == nullptr || t->id != 0 || t->next) {
+    return t;
+  }
+  switch (t->kind) {
+  case Type::kInt:
+  case Type::kUInt:
+  case Type::kVoid:
+  case Type::kBool:
+    if (t->base == nullptr) {
+      return Intern(t->kind, nullptr, get<long>(t->value));
+    }
+    break;
+  case Type::kPointer:
+  case Type::kArray:
+    if (auto base = InternType(t->base); base && base->id != 0) {
+      return Intern(t->kind, base, get<long>(t->value));
+    }
+    break;
+  default:
+    break;
+  }
+  return t;
 }
 
 std::ostream& PrintType(std::ostream& os, Type* t, int depth) {
@@ -158,7 +230,7 @@ size_t SizeofType(Source& src, Type* t) {
   case Type::kUndefined:
   case Type::kUnresolved:
   case Type::kFunc:
-    cerr << "cannot determine size: type=" << t << endl;
+    ErrorOut() << "cannot determine size: type=" << t << endl;
     Error();
   case Type::kInt:
   case Type::kUInt:
@@ -168,7 +240,7 @@ size_t SizeofType(Source& src, Type* t) {
   case Type::kParam:
     return SizeofType(src, t->base);
   case Type::kVParam:
-    cerr << "sizeof kVParam is not defined" << endl;
+    ErrorOut() << "sizeof kVParam is not defined" << endl;
     Error();
   case Type::kVoid:
     return 0;
@@ -179,29 +251,95 @@ size_t SizeofType(Source& src, Type* t) {
   case Type::kArray:
     return get<long>(t->value) * SizeofType(src, t->base);
   case Type::kInitList:
-    cerr << "sizeof kInitList is not defined" << endl;
+    ErrorOut() << "sizeof kInitList is not defined" << endl;
     Error();
   case Type::kStruct:
-    {
-      size_t s = 0;
-      for (auto field_t = t->next; field_t; field_t = field_t->next) {
-        s += SizeofType(src, field_t);
-      }
-      return s;
-    }
+    return GetTypeLayout(src, t).size;
   case Type::kGParam:
-    cerr << "sizeof kGParam is not defined" << endl;
+    ErrorOut() << "sizeof kGParam is not defined" << endl;
     Error();
   case Type::kGeneric:
-    cerr << "sizeof kGeneric is not defined" << endl;
+    ErrorOut() << "sizeof kGeneric is not defined" << endl;
     Error();
   case Type::kConcrete:
-    return SizeofType(src, ConcretizeType(t));
+    return GetTypeLayout(src, t).size;
   }
-  cerr << "should not come here: type=" << t << endl;
+  ErrorOut() << "should not come here: type=" << t << endl;
   Error();
 }
 
+namespace {
+
+size_t AlignofType(Source& src, Type* t) {
+  switch (t->kind) {
+  case Type::kParam:
+  case Type::kUser:
+  case Type::kArray:
+    return AlignofType(src, t->base);
+  case Type::kStruct:
+  case Type::kConcrete:
+    return GetTypeLayout(src, t).align;
+  default:
+    return max<size_t>(1, SizeofType(src, t));
+  }
+}
+
+const TypeLayout* NewTypeLayout(Source& src, Type* t) {
+  if (t->kind == Type::kConcrete) {
+    // 具体化した構造体と配置を共有する
+    auto conc_t = ConcretizeType(t);
+    if (auto struct_t = GetUserBaseType(conc_t); struct_t->kind == Type::kStruct) {
+      return &GetTypeLayout(src, struct_t);
+    }
+    auto layout = GetPool(Pool::kType).New<TypeLayout>();
+    layout->size = SizeofType(src, conc_t);
+    layout->align = AlignofType(src, conc_t);
+    return layout;
+  }
+
+  auto layout = GetPool(Pool::kType).New<TypeLayout>();
+  size_t num_fields = 0;
+  for (auto ft = t->next; ft; ft = ft->next) {
+    ++num_fields;
+  }
+  // field_by_name が要素を指すので、fields は後から伸ばさない
+  layout->fields.reserve(num_fields);
+  layout->size = 0;
+  layout->align = 1;
+  for (auto ft = t->next; ft; ft = ft->next) {
+    auto& field = layout->fields.emplace_back(FieldLayout{
+        get<Token*>(ft->value), ft->base, layout->fields.size(),
+        layout->size});
+    if (field.name) {
+      layout->field_by_name.Insert(GetSymbol(*field.name), &field);
+    }
+    layout->size += SizeofType(src, ft->base);
+    layout->align = max(layout->align, AlignofType(src, ft->base));
+  }
+  return layout;
+}
+
+} // namespace
+
+const TypeLayout& GetTypeLayout(Source& src, Type* t) {
+  if (t->kind != Type::kStruct && t->kind != Type::kConcrete) {
+    ErrorOut() << "layout is defined only for structs: type=" << t << endl;
+    Error();
+  }
+  atomic_ref<const TypeLayout*> cache{t->layout};
+  if (auto layout = cache.load(memory_order_acquire)) {
+    return *layout;
+  }
+  // 同時に計算したスレッドがあれば、先に記憶した方を使う
+  auto layout = NewTypeLayout(src, t);
+  const TypeLayout* expected = nullptr;
+  if (!cache.compare_exchange_strong(expected, layout,
+                                     memory_order_acq_rel)) {
+    return *expected;
+  }
+  return *layout;
+}
+
 Type* GetUserBaseType(Type* user_type) {
   while (user_type->kind == Type::kUser) {
     user_type = user_type->base;
@@ -222,6 +360,10 @@ bool IsEqual(Type* a, Type* b) {
     return true;
   } else if (a == nullptr || b == nullptr) {
     return false;
+  } else if (a == b) {
+    return true;
+  } else if (a->id != 0 && b->id != 0) { // 正準型どうしなら番号で比較できる
+    return a->id == b->id;
   }
 
   return a->kind == b->kind && a->value == b->value &&
@@ -229,34 +371,34 @@ bool IsEqual(Type* a, Type* b) {
 }
 
 TypeManager::TypeManager(Source& src) : src_{src} {
-  types_.Put("void", new Type{Type::kVoid, nullptr, nullptr, 0});
+  types_.Put("void", NewType(Type::kVoid));
   types_.Put("int", NewTypeIntegral(Type::kInt, 64));
   types_.Put("uint", NewTypeIntegral(Type::kUInt, 64));
-  types_.Put("bool", new Type{Type::kBool, nullptr, nullptr, 0});
+  types_.Put("bool", NewType(Type::kBool));
   types_.Put("byte", NewTypeIntegral(Type::kUInt, 8));
 }
 
 Type* TypeManager::Find(Token& name) {
   bool err;
-  if (auto t = Find(string(name.raw), err); err) {
+  if (auto t = Find(GetSymbol(name), name.raw, err); err) {
     ErrorAt(src_, name);
   } else {
     return t;
   }
 }
 
-Type* TypeManager::Find(const std::string& name) {
+Type* TypeManager::Find(std::string_view name) {
   bool err;
-  if (auto t = Find(name, err); err) {
+  if (auto t = Find(Intern(name), name, err); err) {
     Error();
   } else {
     return t;
   }
 }
 
-Type* TypeManager::Find(const std::string& name, bool& err) {
+Type* TypeManager::Find(Symbol sym, std::string_view name, bool& err) {
   err = false;
-  if (auto t = types_.Find(name)) {
+  if (auto t = types_.Find(sym)) {
     return t;
   }
 
@@ -272,14 +414,14 @@ Type* TypeManager::Find(const std::string& name, bool& err) {
     int bits = 0;
     for (size_t i = integral; i < name.length(); ++i) {
       if (!isdigit(name[i])) {
-        cerr << "bit width must be a 10-base number" << endl;
+        ErrorOut() << "bit width must be a 10-base number" << endl;
         err = true;
         return nullptr;
       }
       bits = 10*bits + name[i] - '0';
     }
     auto t = NewTypeIntegral(unsig ? Type::kUInt : Type::kInt, bits);
-    types_.Put(name, t);
+    types_.Put(sym, t);
     return t;
   }
 
@@ -287,6 +429,5 @@ Type* TypeManager::Find(const std::string& name, bool& err) {
 }
 
 Type* TypeManager::Register(Type* t) {
-  string name(get<Token*>(t->value)->raw);
-  return types_.Put(name, t);
+  return types_.Put(*get<Token*>(t->value), t);
 }
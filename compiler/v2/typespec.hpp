@@ -1,12 +1,16 @@
 #pragma once
 
+#include <cstdint>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "scope.hpp"
 #include "source.hpp"
 #include "token.hpp"
 
+struct TypeLayout;
+
 // 抽象構文木での型表現
 struct Type {
   enum Kind {
@@ -66,6 +70,38 @@ struct Type {
    * kGParam:     [Token*] 型変数名
    */
   std::variant<long, Token*> value;
+
+  // 正準化された型の番号（0 なら正準化されていない）
+  // 構造が同じ正準型は 1 つの Type* を共有するので、番号は型の同値性を表す。
+  std::uint32_t id = 0;
+
+  // kStruct、kConcrete の大きさと配置（GetTypeLayout() が最初に求めたときに記憶する）
+  const TypeLayout* layout = nullptr;
+};
+
+// 構造体のフィールドの配置
+struct FieldLayout {
+  Token* name;        // フィールド名（無名なら nullptr）
+  Type* type;
+  std::size_t index;  // 宣言順の番号
+  std::size_t offset; // 構造体の先頭からのバイト数
+};
+
+/* 型の大きさと構造体のフィールドの配置
+ *
+ * フィールドは隙間を空けずに宣言順に並べる。
+ * align はフィールドのアラインメントの最大値で、配置には影響しない。
+ * 構造体でない型（構造体以外に具体化される kConcrete）は fields が空になる。
+ */
+struct TypeLayout {
+  std::size_t size, align;
+  std::vector<FieldLayout> fields;
+  SymbolMap<const FieldLayout> field_by_name;
+
+  // 名前が name のフィールドを返す。無ければ nullptr
+  const FieldLayout* Find(Token& name) const {
+    return field_by_name.Find(GetSymbol(name));
+  }
 };
 
 Type* NewType(Type::Kind kind);
@@ -79,8 +115,27 @@ Type* NewTypeArray(Type* base, long size);
 Type* NewTypeGParam(Token* name);
 Type* NewTypeGeneric(Type* gtype, Type* param_list);
 
+/* 型を正準化する
+ *
+ * 対象は整数、void、bool と、正準型を base に持つポインタ・配列型。
+ * 構造が同じ型には同じ Type* を返す。対象外の型は t をそのまま返す。
+ * 正準型は共有されるので、書き換えてはならない。
+ */
+Type* InternType(Type* t);
+
+// 正準型の表を空にする（翻訳単位のコンパイルを終え、プールを解放するときに呼ぶ）
+void ClearInternedTypes();
+
 std::ostream& operator<<(std::ostream& os, Type* t);
 size_t SizeofType(Source& src, Type* t);
+
+/* 構造体型（kStruct）か具体化した型（kConcrete）の配置を返す
+ *
+ * 型ごとに 1 回だけ計算して Type::layout に記憶する。
+ * -j のワーカーからも呼ばれるので、記憶するときは他のスレッドと競合しないようにする。
+ */
+const TypeLayout& GetTypeLayout(Source& src, Type* t);
+
 Type* GetUserBaseType(Type* user_type);
 Type* GetPrimaryType(Type* type);
 
@@ -94,14 +149,14 @@ class TypeManager {
   TypeManager(Source& src);
 
   Type* Find(Token& name);
-  Type* Find(const std::string& name);
+  Type* Find(std::string_view name);
   Type* Register(Type* t); // 同じ名前でこれまで登録されていた型を返す
 
   void Enter() { types_.Enter(); }
   void Leave() { types_.Leave(); }
 
  private:
-  Type* Find(const std::string& name, bool& err);
+  Type* Find(Symbol sym, std::string_view name, bool& err);
 
   Source& src_;
   Scope<Type> types_;